@@ -18,24 +18,32 @@ Blob bfp_to_blob(const std::string & bfp, int *)
   return blob;
 }
 
-std::string blob_to_bfp(const Blob & blob, int *rc)
+/*
+** Validate the header of a serialized bfp and return a view of the fingerprint
+** bytes. The view refers to the input buffer and no data is copied.
+*/
+static std::string_view bfp_payload(const uint8_t * data, size_t size, int *rc)
 {
-  if (blob.size() <= sizeof(uint32_t)) {
+  if (size <= sizeof(uint32_t)) {
     *rc = SQLITE_MISMATCH;
-    return "";
+    return std::string_view();
   }
-  const uint8_t * p = blob.data();
-  uint32_t magic = read_uint32(p);
+  uint32_t magic = read_uint32(data);
   if (magic != BFP_MAGIC) {
     *rc = SQLITE_MISMATCH;
     chemicalite_log(SQLITE_MISMATCH, "mismatching blob header found");
-    return "";
+    return std::string_view();
   }
-  p += sizeof(uint32_t);
-  return std::string(reinterpret_cast<const char *>(p), blob.size()-sizeof(uint32_t));
+  return std::string_view(
+    reinterpret_cast<const char *>(data + sizeof(uint32_t)), size - sizeof(uint32_t));
 }
 
-std::string arg_to_bfp(sqlite3_value *arg, int *rc)
+std::string blob_to_bfp(const Blob & blob, int *rc)
+{
+  return std::string(bfp_payload(blob.data(), blob.size(), rc));
+}
+
+std::string_view arg_to_bfp_view(sqlite3_value *arg, int *rc)
 {
   int value_type = sqlite3_value_type(arg);
 
@@ -44,13 +52,17 @@ std::string arg_to_bfp(sqlite3_value *arg, int *rc)
   if (value_type != SQLITE_BLOB) {
     *rc = SQLITE_MISMATCH;
     chemicalite_log(SQLITE_MISMATCH, "input arg must be of type blob or NULL");
-    return "";
+    return std::string_view();
   }
 
-  int size = sqlite3_value_bytes(arg);
   const uint8_t * data = (const uint8_t *)sqlite3_value_blob(arg);
-  Blob blob(data, data+size);
-  return blob_to_bfp(blob, rc);
+  int size = sqlite3_value_bytes(arg);
+  return bfp_payload(data, size, rc);
+}
+
+std::string arg_to_bfp(sqlite3_value *arg, int *rc)
+{
+  return std::string(arg_to_bfp_view(arg, rc));
 }
 
 void free_bfp_auxdata(void * pbfp)
@@ -1,11 +1,14 @@
 #ifndef CHEMICALITE_BFP_INCLUDED
 #define CHEMICALITE_BFP_INCLUDED
 #include <string>
+#include <string_view>
 
 Blob bfp_to_blob(const std::string &, int *);
 std::string blob_to_bfp(const Blob &, int *);
 
 std::string arg_to_bfp(sqlite3_value *, int *);
+/* the returned view is only valid as long as the sqlite3_value is unchanged */
+std::string_view arg_to_bfp_view(sqlite3_value *, int *);
 void free_bfp_auxdata(void *);
 
 #endif
\ No newline at end of file
@@ -8,60 +8,37 @@ extern const sqlite3_api_routines *sqlite3_api;
 #include "bfp.hpp"
 #include "bfp_ops.hpp"
 
-template <double (*F)(const std::string &, const std::string &)>
+/*
+** The fingerprints are compared in place, as views of the argument blobs.
+** This is as cheap as caching a decoded copy of a constant argument, and
+** saves allocating and copying the per-row argument.
+*/
+template <double (*F)(std::string_view, std::string_view)>
 static void bfp_compare(sqlite3_context* ctx, int /*argc*/, sqlite3_value** argv)
 {
-  double similarity = 0.;
   int rc = SQLITE_OK;
 
-  std::string *p1 = 0;
-  std::string *p2 = 0;
-
-  void * aux1 = sqlite3_get_auxdata(ctx, 0);
-  if (aux1) {
-    p1 = (std::string *) aux1;
-  }
-  else {
-    std::string bfp = arg_to_bfp(argv[0], &rc);
-    if (rc != SQLITE_OK) {
-      sqlite3_result_error_code(ctx, rc);
-      return;
-    }
-    else {
-      p1 = new std::string(std::move(bfp));
-      sqlite3_set_auxdata(ctx, 0, (void *) p1, free_bfp_auxdata);
-    }
+  std::string_view bfp1 = arg_to_bfp_view(argv[0], &rc);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error_code(ctx, rc);
+    return;
   }
 
-  void * aux2 = sqlite3_get_auxdata(ctx, 1);
-  if (aux2) {
-    p2 = (std::string *) aux2;
-  }
-  else {
-    std::string bfp = arg_to_bfp(argv[1], &rc);
-    if (rc != SQLITE_OK) {
-      sqlite3_result_error_code(ctx, rc);
-      return;
-    }
-    else {
-      p2 = new std::string(std::move(bfp));
-      sqlite3_set_auxdata(ctx, 1, (void *) p2, free_bfp_auxdata);
-    }
+  std::string_view bfp2 = arg_to_bfp_view(argv[1], &rc);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error_code(ctx, rc);
+    return;
   }
 
-  if (!p1 || !p2) {
-    sqlite3_result_null(ctx);
-  }
-  else if (p1->size() != p2->size()) {
+  if (bfp1.size() != bfp2.size()) {
     sqlite3_result_error_code(ctx, SQLITE_MISMATCH);
   }
   else {
-    similarity = F(*p1, *p2);
-    sqlite3_result_double(ctx, similarity);
+    sqlite3_result_double(ctx, F(bfp1, bfp2));
   }
 }
 
-static double tanimoto_similarity(const std::string & bfp1, const std::string & bfp2)
+static double tanimoto_similarity(std::string_view bfp1, std::string_view bfp2)
 {
   assert(bfp1.size() == bfp2.size());
   return bfp_op_tanimoto(
@@ -70,7 +47,7 @@ static double tanimoto_similarity(const std::string & bfp1, const std::string &
     reinterpret_cast<const uint8_t *>(bfp2.data()));
 }
 
-static double dice_similarity(const std::string & bfp1, const std::string & bfp2)
+static double dice_similarity(std::string_view bfp1, std::string_view bfp2)
 {
   assert(bfp1.size() == bfp2.size());
   return bfp_op_dice(
@@ -15,7 +15,7 @@ static void bfp_descriptor(sqlite3_context* ctx, int /*argc*/, sqlite3_value** a
   sqlite3_value *arg = argv[0];
 
   int rc = SQLITE_OK;
-  std::string bfp = arg_to_bfp(arg, &rc);
+  std::string_view bfp = arg_to_bfp_view(arg, &rc);
 
   if ( rc != SQLITE_OK ) {
     sqlite3_result_error_code(ctx, rc);
@@ -26,9 +26,9 @@ static void bfp_descriptor(sqlite3_context* ctx, int /*argc*/, sqlite3_value** a
   }
 }
 
-static int bfp_length(const std::string & bfp) {return 8*bfp.size();}
+static int bfp_length(std::string_view bfp) {return 8*bfp.size();}
 
-static int bfp_weight(const std::string & bfp)
+static int bfp_weight(std::string_view bfp)
 {
   return bfp_op_weight(bfp.size(), reinterpret_cast<const uint8_t *>(bfp.data()));
 }
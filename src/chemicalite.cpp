@@ -15,8 +15,11 @@ SQLITE_EXTENSION_INIT1
 #include "bfp_descriptors.hpp"
 #include "periodic_table.hpp"
 #include "rdtree.hpp"
+#include "rdtree_stats.hpp"
+#include "map_vtab.hpp"
 #include "sdf_io.hpp"
 #include "smi_io.hpp"
+#include "file_import.hpp"
 #include "versions.hpp"
 
 /*
@@ -47,7 +50,10 @@ extern "C" int sqlite3_chemicalite_init(sqlite3 *db, char ** /*pzErrMsg*/,
   if (rc == SQLITE_OK) rc = chemicalite_init_periodic_table(db);
   if (rc == SQLITE_OK) rc = chemicalite_init_sdf_io(db);
   if (rc == SQLITE_OK) rc = chemicalite_init_smi_io(db);
+  if (rc == SQLITE_OK) rc = chemicalite_init_file_import(db);
   if (rc == SQLITE_OK) rc = chemicalite_init_rdtree(db);
+  if (rc == SQLITE_OK) rc = chemicalite_init_rdtree_stats(db);
+  if (rc == SQLITE_OK) rc = chemicalite_init_map(db);
 
   return rc;
 }
@@ -0,0 +1,506 @@
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <streambuf>
+#include <thread>
+#include <vector>
+
+#include <boost/version.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#if BOOST_VERSION >= 107000
+#include <boost/iostreams/filter/zstd.hpp>
+#endif
+#include <boost/algorithm/string/predicate.hpp>
+
+#include <sqlite3ext.h>
+extern const sqlite3_api_routines *sqlite3_api;
+
+#include "file_compression.hpp"
+#include "logging.hpp"
+
+/*
+** The decompressed data is transferred to the reading thread in blocks of
+** DECOMPRESSED_BLOCK_SIZE bytes, and at most MAX_DECOMPRESSED_BLOCKS blocks
+** are decompressed in advance.
+*/
+static const std::size_t DECOMPRESSED_BLOCK_SIZE = 1 << 20;
+static const std::size_t MAX_DECOMPRESSED_BLOCKS = 4;
+
+/*
+** Similarly, at most MAX_COMPRESSED_BLOCKS blocks of output data are waiting
+** to be compressed.
+*/
+static const std::size_t MAX_COMPRESSED_BLOCKS = 4;
+
+FileCompression detect_compression(const char * data, std::size_t size)
+{
+  static const unsigned char GZIP_MAGIC[] = {0x1f, 0x8b};
+  static const unsigned char ZSTD_MAGIC[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+  if (size >= sizeof(GZIP_MAGIC) && memcmp(data, GZIP_MAGIC, sizeof(GZIP_MAGIC)) == 0) {
+    return FileCompression::GZIP;
+  }
+  if (size >= sizeof(ZSTD_MAGIC) && memcmp(data, ZSTD_MAGIC, sizeof(ZSTD_MAGIC)) == 0) {
+    return FileCompression::ZSTD;
+  }
+  return FileCompression::NONE;
+}
+
+/*
+** A stream buffer returning the data decompressed by a background thread
+*/
+class DecompressingBuf : public std::streambuf {
+public:
+  DecompressingBuf(std::unique_ptr<std::ifstream> file, FileCompression compression)
+    : file(std::move(file)), done(false), stopped(false), failed(false)
+  {
+    if (compression == FileCompression::GZIP) {
+      input.push(boost::iostreams::gzip_decompressor());
+    }
+#if BOOST_VERSION >= 107000
+    else if (compression == FileCompression::ZSTD) {
+      input.push(boost::iostreams::zstd_decompressor());
+    }
+#endif
+    input.push(*this->file);
+    thread = std::thread(&DecompressingBuf::decompress, this);
+  }
+
+  ~DecompressingBuf()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopped = true;
+    }
+    cv.notify_all();
+    thread.join();
+  }
+
+protected:
+  int_type underflow() override
+  {
+    if (gptr() < egptr()) {
+      return traits_type::to_int_type(*gptr());
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this] { return done || !blocks.empty(); });
+    if (blocks.empty()) {
+      if (failed) {
+        // reported to the reader as a badbit on the stream
+        throw std::ios_base::failure("error decompressing the input file");
+      }
+      return traits_type::eof();
+    }
+    current = std::move(blocks.front());
+    blocks.pop_front();
+    lock.unlock();
+    cv.notify_all();
+
+    setg(current.data(), current.data(), current.data() + current.size());
+    return traits_type::to_int_type(*gptr());
+  }
+
+private:
+  void decompress()
+  {
+    try {
+      while (true) {
+        std::vector<char> block(DECOMPRESSED_BLOCK_SIZE);
+        input.read(block.data(), block.size());
+        std::streamsize count = input.gcount();
+        if (count > 0) {
+          block.resize(count);
+          std::unique_lock<std::mutex> lock(mutex);
+          cv.wait(lock, [this] { return stopped || blocks.size() < MAX_DECOMPRESSED_BLOCKS; });
+          if (stopped) {
+            break;
+          }
+          blocks.push_back(std::move(block));
+          lock.unlock();
+          cv.notify_all();
+        }
+        if (input.bad()) {
+          chemicalite_log(SQLITE_IOERR, "error decompressing the input file");
+          failed = true;
+          break;
+        }
+        if (!input) {
+          break;
+        }
+      }
+    }
+    catch (...) {
+      chemicalite_log(SQLITE_IOERR, "error decompressing the input file");
+      failed = true;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      done = true;
+    }
+    cv.notify_all();
+  }
+
+  std::unique_ptr<std::ifstream> file;
+  boost::iostreams::filtering_istream input;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::vector<char>> blocks;
+  bool done;
+  bool stopped;
+  bool failed;
+
+  // the block currently read by the consumer
+  std::vector<char> current;
+
+  std::thread thread;
+};
+
+class DecompressingStream : public std::istream {
+public:
+  DecompressingStream(std::unique_ptr<std::ifstream> file, FileCompression compression)
+    : std::istream(nullptr), buf(std::move(file), compression)
+  {
+    rdbuf(&buf);
+  }
+
+private:
+  DecompressingBuf buf;
+};
+
+std::unique_ptr<std::istream> open_input_file(
+  const std::string & filename, FileCompression * compression, int * rc)
+{
+  std::unique_ptr<std::ifstream> file(new std::ifstream(filename, std::ios::binary));
+
+  if (!file->is_open()) {
+    std::string message = "could not open file '" + filename + "'";
+    *rc = SQLITE_ERROR;
+    chemicalite_log(*rc, message.c_str());
+    return nullptr;
+  }
+
+  char magic[4];
+  file->read(magic, sizeof(magic));
+  *compression = detect_compression(magic, file->gcount());
+  file->clear();
+  file->seekg(0);
+
+#if BOOST_VERSION < 107000
+  if (*compression == FileCompression::ZSTD) {
+    std::string message = "zstd compressed input is not supported (file '" + filename + "')";
+    *rc = SQLITE_ERROR;
+    chemicalite_log(*rc, message.c_str());
+    return nullptr;
+  }
+#endif
+
+  if (*compression == FileCompression::NONE) {
+    // plain text files are read as before, without a background thread
+    std::unique_ptr<std::ifstream> text_file(new std::ifstream(filename));
+    if (!text_file->is_open()) {
+      std::string message = "could not open file '" + filename + "'";
+      *rc = SQLITE_ERROR;
+      chemicalite_log(*rc, message.c_str());
+      return nullptr;
+    }
+    return text_file;
+  }
+
+  return std::unique_ptr<std::istream>(new DecompressingStream(std::move(file), *compression));
+}
+
+FileCompression compression_from_extension(const std::string & filename)
+{
+  if (boost::algorithm::iends_with(filename, ".gz")) {
+    return FileCompression::GZIP;
+  }
+  if (boost::algorithm::iends_with(filename, ".zst") ||
+      boost::algorithm::iends_with(filename, ".zstd")) {
+    return FileCompression::ZSTD;
+  }
+  return FileCompression::NONE;
+}
+
+bool compression_from_name(const std::string & name, FileCompression * compression)
+{
+  if (name == "none") {
+    *compression = FileCompression::NONE;
+  }
+  else if (name == "gzip") {
+    *compression = FileCompression::GZIP;
+  }
+  else if (name == "zstd") {
+    *compression = FileCompression::ZSTD;
+  }
+  else {
+    return false;
+  }
+  return true;
+}
+
+/*
+** The device at the end of the compressing filters. A failed write throws,
+** so that the filters don't retry it.
+*/
+class CompressedFileSink {
+public:
+  typedef char char_type;
+  typedef boost::iostreams::sink_tag category;
+
+  CompressedFileSink(std::ofstream * file) : file(file) {}
+
+  std::streamsize write(const char * data, std::streamsize size)
+  {
+    file->write(data, size);
+    if (!*file) {
+      throw std::ios_base::failure("error writing the compressed output file");
+    }
+    return size;
+  }
+
+private:
+  std::ofstream * file;
+};
+
+/*
+** A stream buffer collecting the output data in blocks, that are compressed
+** and written to the file by a background thread
+*/
+class CompressingBuf : public std::streambuf {
+public:
+  CompressingBuf(std::unique_ptr<std::ofstream> file, FileCompression compression,
+                 std::size_t block_size)
+    : file(std::move(file)), block_size(block_size),
+      done(false), failed(false), closed(false)
+  {
+    if (compression == FileCompression::GZIP) {
+      output.push(boost::iostreams::gzip_compressor());
+    }
+#if BOOST_VERSION >= 107000
+    else if (compression == FileCompression::ZSTD) {
+      output.push(boost::iostreams::zstd_compressor());
+    }
+#endif
+    output.push(CompressedFileSink(this->file.get()));
+    current.resize(block_size);
+    setp(current.data(), current.data() + current.size());
+    thread = std::thread(&CompressingBuf::compress, this);
+  }
+
+  ~CompressingBuf()
+  {
+    close();
+  }
+
+  // write the pending data, and wait for the file to be completed
+  bool close()
+  {
+    if (!closed) {
+      submit();
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+      }
+      cv.notify_all();
+      thread.join();
+      closed = true;
+    }
+    return !failed;
+  }
+
+protected:
+  int_type overflow(int_type ch) override
+  {
+    if (!submit()) {
+      return traits_type::eof();
+    }
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(ch);
+      pbump(1);
+    }
+    return traits_type::not_eof(ch);
+  }
+
+  int sync() override
+  {
+    return submit() ? 0 : -1;
+  }
+
+private:
+  // hand the current block to the compressing thread
+  bool submit()
+  {
+    std::size_t count = pptr() - pbase();
+    if (count > 0) {
+      current.resize(count);
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [this] { return failed || blocks.size() < MAX_COMPRESSED_BLOCKS; });
+      if (failed) {
+        return false;
+      }
+      blocks.push_back(std::move(current));
+      lock.unlock();
+      cv.notify_all();
+      current = std::vector<char>(block_size);
+    }
+    setp(current.data(), current.data() + current.size());
+    return true;
+  }
+
+  void compress()
+  {
+    bool ok = true;
+    try {
+      while (true) {
+        std::vector<char> block;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          cv.wait(lock, [this] { return done || !blocks.empty(); });
+          if (blocks.empty()) {
+            break;
+          }
+          block = std::move(blocks.front());
+          blocks.pop_front();
+        }
+        cv.notify_all();
+        output.write(block.data(), block.size());
+        if (!output) {
+          ok = false;
+          break;
+        }
+      }
+      if (ok) {
+        // write the compressed stream trailer
+        output.reset();
+        file->close();
+        ok = !file->fail();
+      }
+    }
+    catch (...) {
+      ok = false;
+    }
+
+    if (!ok) {
+      chemicalite_log(SQLITE_IOERR, "error writing the compressed output file");
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        failed = true;
+      }
+      cv.notify_all();
+    }
+  }
+
+  std::unique_ptr<std::ofstream> file;
+  boost::iostreams::filtering_ostream output;
+  std::size_t block_size;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::vector<char>> blocks;
+  bool done;
+  bool failed;
+
+  // the block currently written by the producer
+  std::vector<char> current;
+  bool closed;
+
+  std::thread thread;
+};
+
+class CompressingOutputFile : public OutputFileStream {
+public:
+  CompressingOutputFile(std::unique_ptr<std::ofstream> file, FileCompression compression,
+                        std::size_t buffer_size)
+    : buf(std::move(file), compression, buffer_size)
+  {
+    rdbuf(&buf);
+  }
+
+  bool close() override
+  {
+    flush();
+    bool ok = buf.close() && !fail();
+    if (!ok) {
+      setstate(std::ios::badbit);
+    }
+    return ok;
+  }
+
+private:
+  CompressingBuf buf;
+};
+
+class PlainOutputFile : public OutputFileStream {
+public:
+  PlainOutputFile(std::size_t buffer_size)
+    : buffer(buffer_size)
+  {
+    // the buffer must be assigned before the file is opened
+    buf.pubsetbuf(buffer.data(), buffer.size());
+    rdbuf(&buf);
+  }
+
+  bool open(const std::string & filename)
+  {
+    return buf.open(filename, std::ios::out | std::ios::trunc) != nullptr;
+  }
+
+  bool close() override
+  {
+    if (!buf.is_open()) {
+      return !fail();
+    }
+    flush();
+    bool ok = !fail() && buf.close() != nullptr;
+    if (!ok) {
+      setstate(std::ios::badbit);
+    }
+    return ok;
+  }
+
+private:
+  std::vector<char> buffer;
+  std::filebuf buf;
+};
+
+std::unique_ptr<OutputFileStream> open_output_file(
+  const std::string & filename, FileCompression compression, std::size_t buffer_size, int * rc)
+{
+#if BOOST_VERSION < 107000
+  if (compression == FileCompression::ZSTD) {
+    std::string message = "zstd compressed output is not supported (file '" + filename + "')";
+    *rc = SQLITE_ERROR;
+    chemicalite_log(*rc, message.c_str());
+    return nullptr;
+  }
+#endif
+
+  if (compression == FileCompression::NONE) {
+    std::unique_ptr<PlainOutputFile> file(new PlainOutputFile(buffer_size));
+    if (!file->open(filename)) {
+      std::string message = "could not open file '" + filename + "'";
+      *rc = SQLITE_ERROR;
+      chemicalite_log(*rc, message.c_str());
+      return nullptr;
+    }
+    return file;
+  }
+
+  std::unique_ptr<std::ofstream> file(
+    new std::ofstream(filename, std::ios::binary | std::ios::trunc));
+  if (!file->is_open()) {
+    std::string message = "could not open file '" + filename + "'";
+    *rc = SQLITE_ERROR;
+    chemicalite_log(*rc, message.c_str());
+    return nullptr;
+  }
+
+  return std::unique_ptr<OutputFileStream>(
+    new CompressingOutputFile(std::move(file), compression, buffer_size));
+}
@@ -0,0 +1,49 @@
+#ifndef CHEMICALITE_FILE_COMPRESSION_INCLUDED
+#define CHEMICALITE_FILE_COMPRESSION_INCLUDED
+#include <cstddef>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <string>
+
+enum class FileCompression { NONE, GZIP, ZSTD };
+
+/*
+** Detect the compression format from the magic bytes at the start of a file
+*/
+FileCompression detect_compression(const char * data, std::size_t size);
+
+/*
+** Open an input file. Gzip and zstd compressed files are transparently
+** decompressed, on a separate thread that feeds the returned stream.
+** Decompressed streams are not seekable.
+*/
+std::unique_ptr<std::istream> open_input_file(
+  const std::string & filename, FileCompression * compression, int * rc);
+
+/*
+** The compression format of an output file, from the extension of its name
+** (".gz" or ".zst"), or from an explicit name ("none", "gzip" or "zstd").
+** The latter returns false if the name is not recognized.
+*/
+FileCompression compression_from_extension(const std::string & filename);
+bool compression_from_name(const std::string & name, FileCompression * compression);
+
+/*
+** An output file, written through a buffer of a given size. If compressed,
+** the buffered blocks are compressed and written by a separate thread.
+*/
+class OutputFileStream : public std::ostream {
+public:
+  virtual ~OutputFileStream() = default;
+  // flush and close the file, return false if the output could not be written
+  virtual bool close() = 0;
+
+protected:
+  OutputFileStream() : std::ostream(nullptr) {}
+};
+
+std::unique_ptr<OutputFileStream> open_output_file(
+  const std::string & filename, FileCompression compression, std::size_t buffer_size, int * rc);
+
+#endif
@@ -0,0 +1,485 @@
+#include <algorithm>
+#include <initializer_list>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <GraphMol/ROMol.h>
+
+#include <sqlite3ext.h>
+extern const sqlite3_api_routines *sqlite3_api;
+
+#include "utils.hpp"
+#include "file_import.hpp"
+#include "file_compression.hpp"
+#include "file_pipeline.hpp"
+#include "sdf_io.hpp"
+#include "smi_io.hpp"
+#include "mol.hpp"
+#include "mol_to_bfp.hpp"
+#include "map_function.hpp"
+#include "logging.hpp"
+
+/*
+** chemicalite_import(filename, table[, options]) loads the molecules of an SDF
+** or SMILES file into an existing table, in a single pass, e.g.:
+**
+**   SELECT chemicalite_import('library.sdf.gz', 'compounds', '{
+**     "column": "mol",
+**     "properties": {"name": "_Name", "chembl_id": "chembl_id"},
+**     "descriptors": {"mw": "mol_amw", "tpsa": "mol_tpsa"},
+**     "threads": 8}');
+**
+** A reader thread splits the file in chunks of records, and a pool of worker
+** threads parses the molecules, computes the descriptors and serializes each
+** molecule together with its pattern and Morgan fingerprints (as done by
+** mol_with_cached_fps). The rows are inserted in file order by the calling
+** thread, with a single prepared statement and within a savepoint, so that a
+** failed insert leaves the table unchanged.
+**
+** The triggers of the rdtree indexes linked to the molecule column are run for
+** each row as usual. When the bfp constructor of an index and its parameters
+** match the cached fingerprints, the molecule is not decoded again.
+**
+** The options are a JSON object, with the following (optional) members:
+**
+**   format        'sdf' or 'smi' (by default, from the file extension)
+**   column        the molecule column ('molecule')
+**   properties    an object mapping table columns to molecule properties
+**   descriptors   an object mapping table columns to descriptor functions
+**   cached_fps    false, or an object with any of pattern_length,
+**                 morgan_radius and morgan_length (same defaults as
+**                 mol_with_cached_fps)
+**   threads       the number of worker threads (the hardware threads)
+**   delimiter, smiles_column, name_column, title_line
+**                 as the smi_reader arguments, for the SMILES format
+**
+** The records that can't be parsed are skipped, and the number of inserted
+** rows is returned.
+*/
+enum class ImportFormat { UNKNOWN, SDF, SMI };
+
+struct ImportOptions {
+  ImportFormat format = ImportFormat::UNKNOWN;
+  std::string column = "molecule";
+  std::vector<std::pair<std::string, std::string>> properties;
+  std::vector<std::pair<std::string, MolMapResult>> descriptors;
+  bool cached_fps = true;
+  int pattern_length = DEFAULT_CACHED_PATTERN_BFP_LENGTH;
+  int morgan_radius = DEFAULT_CACHED_MORGAN_BFP_RADIUS;
+  int morgan_length = DEFAULT_CACHED_MORGAN_BFP_LENGTH;
+  int threads = 0;
+  std::string delimiter = " \t";
+  int smiles_column = 0;
+  int name_column = 1;
+  bool title_line = true;
+};
+
+/*
+** A maximum of IMPORT_CHUNKS_PER_THREAD chunks per worker thread are read in
+** advance of the inserts
+*/
+static const std::size_t IMPORT_CHUNKS_PER_THREAD = 4;
+
+/*
+** A record converted by the worker threads
+*/
+struct ImportRecord {
+  Blob mol;                     // empty if the record could not be parsed
+  std::vector<MapValue> values; // the property and descriptor columns
+};
+
+using ImportPipeline = FilePipeline<ImportRecord>;
+
+static ImportFormat format_from_extension(const std::string & filename)
+{
+  std::string name = boost::to_lower_copy(filename);
+  // the format is given by the extension that precedes the compression one
+  if (compression_from_extension(name) != FileCompression::NONE) {
+    name.erase(name.rfind('.'));
+  }
+  if (boost::ends_with(name, ".sdf") || boost::ends_with(name, ".sd")) {
+    return ImportFormat::SDF;
+  }
+  if (boost::ends_with(name, ".smi") || boost::ends_with(name, ".smiles")) {
+    return ImportFormat::SMI;
+  }
+  return ImportFormat::UNKNOWN;
+}
+
+/*
+** Assign the value of an option, if present (invalid values are reported
+** with an exception, instead of being replaced by the default)
+*/
+template <typename T>
+static void get_option(const boost::property_tree::ptree & tree, const char * name, T & value)
+{
+  if (auto child = tree.get_child_optional(name)) {
+    value = child->get_value<T>();
+  }
+}
+
+static int parse_import_options(const std::string & json, ImportOptions & options)
+{
+  static const std::initializer_list<const char *> OPTION_NAMES = {
+    "format", "column", "properties", "descriptors", "cached_fps", "threads",
+    "delimiter", "smiles_column", "name_column", "title_line"
+  };
+
+  namespace pt = boost::property_tree;
+  pt::ptree tree;
+
+  try {
+    std::istringstream ins(json);
+    pt::read_json(ins, tree);
+
+    for (const auto & item: tree) {
+      if (std::find(OPTION_NAMES.begin(), OPTION_NAMES.end(), item.first) == OPTION_NAMES.end()) {
+        chemicalite_log(SQLITE_ERROR, "unknown chemicalite_import option: '%s'", item.first.c_str());
+        return SQLITE_ERROR;
+      }
+    }
+
+    if (auto format = tree.get_optional<std::string>("format")) {
+      if (*format == "sdf") {
+        options.format = ImportFormat::SDF;
+      }
+      else if (*format == "smi") {
+        options.format = ImportFormat::SMI;
+      }
+      else {
+        chemicalite_log(SQLITE_ERROR, "unsupported chemicalite_import format: '%s'", format->c_str());
+        return SQLITE_ERROR;
+      }
+    }
+
+    get_option(tree, "column", options.column);
+
+    if (auto properties = tree.get_child_optional("properties")) {
+      for (const auto & item: *properties) {
+        options.properties.emplace_back(item.first, item.second.get_value<std::string>());
+      }
+    }
+
+    if (auto descriptors = tree.get_child_optional("descriptors")) {
+      for (const auto & item: *descriptors) {
+        std::string name = item.second.get_value<std::string>();
+        MolMapResult descriptor = mol_descriptor_map_result(name);
+        if (!descriptor) {
+          chemicalite_log(SQLITE_ERROR, "unsupported chemicalite_import descriptor: '%s'", name.c_str());
+          return SQLITE_ERROR;
+        }
+        options.descriptors.emplace_back(item.first, descriptor);
+      }
+    }
+
+    if (auto cached_fps = tree.get_child_optional("cached_fps")) {
+      if (cached_fps->empty() && !cached_fps->data().empty()) {
+        options.cached_fps = cached_fps->get_value<bool>();
+      }
+      else {
+        get_option(*cached_fps, "pattern_length", options.pattern_length);
+        get_option(*cached_fps, "morgan_radius", options.morgan_radius);
+        get_option(*cached_fps, "morgan_length", options.morgan_length);
+      }
+    }
+
+    get_option(tree, "threads", options.threads);
+    get_option(tree, "delimiter", options.delimiter);
+    get_option(tree, "smiles_column", options.smiles_column);
+    get_option(tree, "name_column", options.name_column);
+    get_option(tree, "title_line", options.title_line);
+  }
+  catch (const pt::ptree_error & e) {
+    chemicalite_log(SQLITE_ERROR, "invalid chemicalite_import options: %s", e.what());
+    return SQLITE_ERROR;
+  }
+
+  for (const auto & item: options.properties) {
+    if (item.first.empty()) {
+      chemicalite_log(SQLITE_ERROR, "the chemicalite_import properties must be a JSON object");
+      return SQLITE_ERROR;
+    }
+  }
+  for (const auto & item: options.descriptors) {
+    if (item.first.empty()) {
+      chemicalite_log(SQLITE_ERROR, "the chemicalite_import descriptors must be a JSON object");
+      return SQLITE_ERROR;
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Serialize the parsed molecules and compute the values of the other columns
+** (called concurrently by the pipeline workers)
+*/
+static void convert_import_mols(const ImportOptions & options,
+                                const std::vector<std::unique_ptr<RDKit::ROMol>> & mols,
+                                std::vector<ImportRecord> & records)
+{
+  records.resize(mols.size());
+  for (std::size_t ii = 0; ii < mols.size(); ++ii) {
+    const auto & mol = mols[ii];
+    if (!mol) {
+      continue;
+    }
+
+    auto & record = records[ii];
+    int rc = SQLITE_OK;
+    if (options.cached_fps) {
+      record.mol = mol_to_blob_with_cached_fps(
+        *mol, options.pattern_length, options.morgan_radius, options.morgan_length, &rc);
+    }
+    else {
+      record.mol = mol_to_blob(*mol, &rc);
+    }
+    if (rc != SQLITE_OK) {
+      record.mol.clear();
+      continue;
+    }
+
+    record.values.resize(options.properties.size() + options.descriptors.size());
+    auto value = record.values.begin();
+    for (const auto & property: options.properties) {
+      try {
+        if (mol->hasProp(property.second)) {
+          map_result(*value, mol->getProp<std::string>(property.second));
+        }
+      }
+      catch (...) {
+        chemicalite_log(SQLITE_MISMATCH, "could not convert the mol property to text");
+        *value = MapValue();
+      }
+      ++value;
+    }
+    for (const auto & descriptor: options.descriptors) {
+      try {
+        descriptor.second(*value, *mol);
+      }
+      catch (...) {
+        chemicalite_log(SQLITE_ERROR, "descriptor computation failed with an exception");
+        *value = MapValue();
+      }
+      ++value;
+    }
+  }
+}
+
+static std::string quote_identifier(const std::string & name)
+{
+  char * quoted = sqlite3_mprintf("\"%w\"", name.c_str());
+  std::string result = quoted ? quoted : "";
+  sqlite3_free(quoted);
+  return result;
+}
+
+static int prepare_import_stmt(sqlite3 *db, const std::string & table,
+                               const ImportOptions & options, sqlite3_stmt **pstmt)
+{
+  std::string columns = quote_identifier(options.column);
+  std::string params = "?";
+  for (const auto & property: options.properties) {
+    columns += ", " + quote_identifier(property.first);
+    params += ", ?";
+  }
+  for (const auto & descriptor: options.descriptors) {
+    columns += ", " + quote_identifier(descriptor.first);
+    params += ", ?";
+  }
+
+  std::string sql =
+    "INSERT INTO " + quote_identifier(table) + "(" + columns + ") VALUES (" + params + ")";
+
+  int rc = sqlite3_prepare_v2(db, sql.c_str(), -1, pstmt, 0);
+  if (rc != SQLITE_OK) {
+    chemicalite_log(rc, "could not prepare the chemicalite_import statement: %s", sqlite3_errmsg(db));
+  }
+  return rc;
+}
+
+static void bind_map_value(sqlite3_stmt *stmt, int param, const MapValue & value)
+{
+  switch (value.type) {
+    case SQLITE_INTEGER:
+      sqlite3_bind_int64(stmt, param, value.int_value);
+      break;
+    case SQLITE_FLOAT:
+      sqlite3_bind_double(stmt, param, value.float_value);
+      break;
+    case SQLITE_TEXT:
+      sqlite3_bind_text(stmt, param, (const char *) value.bytes.data(), value.bytes.size(), SQLITE_STATIC);
+      break;
+    case SQLITE_BLOB:
+      sqlite3_bind_blob(stmt, param, value.bytes.data(), value.bytes.size(), SQLITE_STATIC);
+      break;
+    default:
+      sqlite3_bind_null(stmt, param);
+  }
+}
+
+/*
+** Insert the records returned by the pipeline, return a status code
+*/
+static int insert_import_records(ImportPipeline & pipeline, sqlite3_stmt *stmt,
+                                 sqlite3_int64 & num_rows, int & num_skipped)
+{
+  int rc = SQLITE_OK;
+  ImportRecord record;
+  while (rc == SQLITE_OK && pipeline.next(record)) {
+    if (record.mol.empty()) {
+      ++num_skipped;
+      continue;
+    }
+    sqlite3_bind_blob(stmt, 1, record.mol.data(), record.mol.size(), SQLITE_STATIC);
+    for (std::size_t ii = 0; ii < record.values.size(); ++ii) {
+      bind_map_value(stmt, ii + 2, record.values[ii]);
+    }
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_DONE) {
+      rc = SQLITE_OK;
+      ++num_rows;
+    }
+    else {
+      chemicalite_log(rc, "chemicalite_import insert failed: %s",
+                      sqlite3_errmsg(sqlite3_db_handle(stmt)));
+    }
+    sqlite3_reset(stmt);
+  }
+  sqlite3_clear_bindings(stmt);
+  if (rc == SQLITE_OK && pipeline.failed()) {
+    // the input ended early (e.g. corrupt compressed data)
+    rc = SQLITE_IOERR;
+    chemicalite_log(rc, "chemicalite_import could not read the whole input file");
+  }
+  return rc;
+}
+
+static void chemicalite_import(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+{
+  if (sqlite3_value_type(argv[0]) != SQLITE_TEXT || // filename
+      sqlite3_value_type(argv[1]) != SQLITE_TEXT || // table
+      (argc > 2 && sqlite3_value_type(argv[2]) != SQLITE_TEXT &&
+       sqlite3_value_type(argv[2]) != SQLITE_NULL)) { // options
+    chemicalite_log(
+      SQLITE_MISMATCH, "chemicalite_import expects filename, table and options arguments of type TEXT");
+    sqlite3_result_error_code(ctx, SQLITE_MISMATCH);
+    return;
+  }
+
+  std::string filename = (const char *) sqlite3_value_text(argv[0]);
+  std::string table = (const char *) sqlite3_value_text(argv[1]);
+
+  ImportOptions options;
+  int rc = SQLITE_OK;
+  if (argc > 2 && sqlite3_value_type(argv[2]) == SQLITE_TEXT) {
+    rc = parse_import_options((const char *) sqlite3_value_text(argv[2]), options);
+  }
+  if (rc == SQLITE_OK && options.format == ImportFormat::UNKNOWN) {
+    options.format = format_from_extension(filename);
+    if (options.format == ImportFormat::UNKNOWN) {
+      rc = SQLITE_ERROR;
+      chemicalite_log(rc, "could not detect the format of '%s', use the format option", filename.c_str());
+    }
+  }
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error_code(ctx, rc);
+    return;
+  }
+
+  int threads = options.threads;
+  if (threads < 1) {
+    threads = std::max<int>(std::thread::hardware_concurrency(), 1);
+  }
+
+  sqlite3 *db = sqlite3_context_db_handle(ctx);
+  sqlite3_stmt *stmt = nullptr;
+  rc = prepare_import_stmt(db, table, options, &stmt);
+  if (rc != SQLITE_OK) {
+    sqlite3_finalize(stmt);
+    sqlite3_result_error_code(ctx, rc);
+    return;
+  }
+
+  // compressed files are decompressed by a background thread
+  FileCompression compression = FileCompression::NONE;
+  std::shared_ptr<std::istream> ins(open_input_file(filename, &compression, &rc));
+  if (!ins) {
+    sqlite3_finalize(stmt);
+    sqlite3_result_error_code(ctx, rc);
+    return;
+  }
+
+  ImportPipeline::ChunkReader read_chunk;
+  if (options.format == ImportFormat::SDF) {
+    read_chunk = [ins](FileChunk & chunk) { return read_sdf_chunk(*ins, chunk); };
+  }
+  else {
+    std::size_t line_count = 0;
+    std::string title = options.title_line ? read_smi_title(*ins, &line_count) : std::string();
+    read_chunk = [ins, title, line_count](FileChunk & chunk) mutable {
+      return read_smi_chunk(*ins, title, &line_count, chunk);
+    };
+  }
+
+  auto parse_chunk = [&options](const FileChunk & chunk, std::vector<ImportRecord> & records) {
+    std::vector<std::unique_ptr<RDKit::ROMol>> mols;
+    if (options.format == ImportFormat::SDF) {
+      parse_sdf_chunk_mols(chunk, mols);
+    }
+    else {
+      parse_smi_chunk_mols(
+        chunk, options.delimiter, options.smiles_column, options.name_column,
+        options.title_line, mols);
+    }
+    convert_import_mols(options, mols, records);
+  };
+
+  sqlite3_int64 num_rows = 0;
+  int num_skipped = 0;
+
+  rc = sqlite3_exec(db, "SAVEPOINT chemicalite_import", 0, 0, 0);
+  if (rc == SQLITE_OK) {
+    {
+      ImportPipeline pipeline(read_chunk, parse_chunk, threads, IMPORT_CHUNKS_PER_THREAD*threads);
+      rc = insert_import_records(pipeline, stmt, num_rows, num_skipped);
+    }
+    if (rc != SQLITE_OK) {
+      // undo the inserts, and keep the error code of the failed insert or read
+      sqlite3_exec(db, "ROLLBACK TO chemicalite_import", 0, 0, 0);
+      sqlite3_exec(db, "RELEASE chemicalite_import", 0, 0, 0);
+    }
+    else {
+      rc = sqlite3_exec(db, "RELEASE chemicalite_import", 0, 0, 0);
+    }
+  }
+
+  sqlite3_finalize(stmt);
+
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error_code(ctx, rc);
+    return;
+  }
+
+  if (num_skipped > 0) {
+    chemicalite_log(SQLITE_WARNING, "chemicalite_import skipped %d records that could not be parsed", num_skipped);
+  }
+
+  sqlite3_result_int64(ctx, num_rows);
+}
+
+int chemicalite_init_file_import(sqlite3 *db)
+{
+  int rc = SQLITE_OK;
+  if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "chemicalite_import", 2, SQLITE_UTF8, 0, chemicalite_import, 0, 0);
+  if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "chemicalite_import", 3, SQLITE_UTF8, 0, chemicalite_import, 0, 0);
+  return rc;
+}
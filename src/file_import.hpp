@@ -0,0 +1,6 @@
+#ifndef CHEMICALITE_FILE_IMPORT_INCLUDED
+#define CHEMICALITE_FILE_IMPORT_INCLUDED
+
+int chemicalite_init_file_import(sqlite3 *db);
+
+#endif
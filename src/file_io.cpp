@@ -3,6 +3,7 @@
 #include <sstream>
 
 #include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
 
 #include <sqlite3ext.h>
 extern const sqlite3_api_routines *sqlite3_api;
@@ -133,6 +134,36 @@ void PropColumn::sqlite3_result(const RDKit::ROMol & mol, sqlite3_context * ctx)
   }
 }
 
+void PropColumn::sqlite3_result(const PropValues & values, sqlite3_context * ctx) const
+{
+  auto it = values.find(property);
+  if (it == values.end()) {
+    sqlite3_result_null(ctx);
+    return;
+  }
+  // the values are converted like the string properties of an RDKit mol
+  const std::string & value = it->second;
+  try {
+    switch (type) {
+      case Type::TEXT:
+        sqlite3_result_text(ctx, value.c_str(), -1, SQLITE_TRANSIENT);
+        break;
+      case Type::REAL:
+        sqlite3_result_double(ctx, boost::lexical_cast<double>(value));
+        break;
+      case Type::INTEGER:
+        sqlite3_result_int(ctx, boost::lexical_cast<int>(value));
+        break;
+      default:
+        assert(!"Unexpected value for Type enum");
+    }
+  }
+  catch (const boost::bad_lexical_cast & e) {
+    chemicalite_log(SQLITE_MISMATCH, "could not convert the mol property to the requested type");
+    sqlite3_result_error_code(ctx, SQLITE_MISMATCH);
+  }
+}
+
 
 int parse_schema(const std::string & schema, PropColumnPtrs & columns)
 {
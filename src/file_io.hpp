@@ -1,6 +1,7 @@
 #ifndef CHEMICALITE_PROP_IO_INCLUDED
 #define CHEMICALITE_PROP_IO_INCLUDED
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <memory>
 
@@ -9,6 +10,12 @@ namespace RDKit
   class ROMol;
 } // namespace RDKit
 
+/*
+** The property values of a record, as extracted from the input text without
+** parsing the molecule
+*/
+using PropValues = std::unordered_map<std::string, std::string>;
+
 struct PropColumn {
   enum class Type { TEXT, REAL, INTEGER };
 
@@ -20,6 +27,7 @@ struct PropColumn {
   const char * sql_type() const;
   std::string declare_column() const;
   void sqlite3_result(const RDKit::ROMol & mol, sqlite3_context * ctx) const;
+  void sqlite3_result(const PropValues & values, sqlite3_context * ctx) const;
 };
 
 using PropColumnPtr = std::unique_ptr<PropColumn>;
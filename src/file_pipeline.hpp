@@ -0,0 +1,350 @@
+#ifndef CHEMICALITE_FILE_PIPELINE_INCLUDED
+#define CHEMICALITE_FILE_PIPELINE_INCLUDED
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+** A block of consecutive raw records, as read from an input file
+*/
+struct FileChunk {
+  std::string text;
+  std::size_t num_records = 0;
+  // the number of input lines that precede the chunk (only tracked by the
+  // line-based formats)
+  std::size_t first_line = 0;
+};
+
+/*
+** A parallel pipeline for the file readers.
+**
+** A reader thread splits the input in chunks of records, a pool of worker
+** threads converts each chunk into a sequence of Record values, and next()
+** returns the records in the same order they were read from the file.
+**
+** The number of chunks that were read but not yet consumed is bounded, so
+** that the memory usage doesn't depend on the size of the input file.
+*/
+template <typename Record>
+class FilePipeline {
+public:
+  // fill the chunk with the next records, return false at the end of the input
+  // (an exception stops the reading, and it's reported by failed())
+  using ChunkReader = std::function<bool (FileChunk &)>;
+  // convert the records in a chunk (called concurrently by the workers, must not throw)
+  using ChunkParser = std::function<void (const FileChunk &, std::vector<Record> &)>;
+
+  FilePipeline(ChunkReader reader, ChunkParser parser, int num_threads, std::size_t max_pending)
+    : read_chunk(reader), parse_chunk(parser), max_chunks(max_pending),
+      input_done(false), read_failed(false), stopped(false), current_pos(0)
+  {
+    threads.emplace_back(&FilePipeline::reader_loop, this);
+    for (int ii = 0; ii < num_threads; ++ii) {
+      threads.emplace_back(&FilePipeline::worker_loop, this);
+    }
+  }
+
+  ~FilePipeline()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopped = true;
+    }
+    reader_cv.notify_all();
+    worker_cv.notify_all();
+    for (auto & thread: threads) {
+      thread.join();
+    }
+  }
+
+  FilePipeline(const FilePipeline &) = delete;
+  FilePipeline & operator=(const FilePipeline &) = delete;
+
+  // move the next record into the argument, or return false if no more
+  // records are available
+  bool next(Record & record)
+  {
+    while (!current || current_pos == current->records.size()) {
+      std::unique_lock<std::mutex> lock(mutex);
+      consumer_cv.wait(lock, [this] {
+        return pending.empty() ? input_done : pending.front()->done;
+      });
+      if (pending.empty()) {
+        current.reset();
+        return false;
+      }
+      current = pending.front();
+      pending.pop_front();
+      current_pos = 0;
+      lock.unlock();
+      reader_cv.notify_one();
+    }
+    record = std::move(current->records[current_pos++]);
+    return true;
+  }
+
+  // true if the input could not be read to the end (e.g. because of an I/O
+  // error or corrupt compressed data). The records that were read before the
+  // error are still returned by next().
+  bool failed() const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return read_failed;
+  }
+
+private:
+  struct Chunk {
+    FileChunk input;
+    std::vector<Record> records;
+    bool done = false;
+  };
+  using ChunkPtr = std::shared_ptr<Chunk>;
+
+  void reader_loop()
+  {
+    bool more = true;
+    while (more) {
+      ChunkPtr chunk = std::make_shared<Chunk>();
+      try {
+        more = read_chunk(chunk->input);
+      }
+      catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        read_failed = true;
+        more = false;
+      }
+      std::unique_lock<std::mutex> lock(mutex);
+      reader_cv.wait(lock, [this] { return stopped || pending.size() < max_chunks; });
+      if (stopped) {
+        break;
+      }
+      if (chunk->input.num_records > 0) {
+        pending.push_back(chunk);
+        todo.push_back(chunk);
+        worker_cv.notify_one();
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      input_done = true;
+    }
+    worker_cv.notify_all();
+    consumer_cv.notify_all();
+  }
+
+  void worker_loop()
+  {
+    while (true) {
+      ChunkPtr chunk;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        worker_cv.wait(lock, [this] { return stopped || input_done || !todo.empty(); });
+        if (stopped || todo.empty()) {
+          return;
+        }
+        chunk = todo.front();
+        todo.pop_front();
+      }
+      parse_chunk(chunk->input, chunk->records);
+      chunk->input = FileChunk();
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        chunk->done = true;
+      }
+      consumer_cv.notify_all();
+    }
+  }
+
+  ChunkReader read_chunk;
+  ChunkParser parse_chunk;
+  std::size_t max_chunks;
+
+  mutable std::mutex mutex;
+  std::condition_variable reader_cv;
+  std::condition_variable worker_cv;
+  std::condition_variable consumer_cv;
+  std::deque<ChunkPtr> pending; // in file order, waiting to be consumed
+  std::deque<ChunkPtr> todo;    // waiting to be parsed
+  bool input_done;
+  bool read_failed;
+  bool stopped;
+  std::vector<std::thread> threads;
+
+  // the chunk currently consumed by next() (only accessed by the consumer)
+  ChunkPtr current;
+  std::size_t current_pos;
+};
+
+/*
+** A parallel pipeline for the file writers.
+**
+** The records are submitted by the calling thread, and collected in batches
+** of consecutive records. A pool of worker threads formats the records of
+** each batch into text, and a writer thread appends the text of the batches
+** to the output, in the same order the records were submitted.
+**
+** The number of batches that were submitted but not yet written is bounded,
+** and push() blocks when the limit is reached.
+*/
+template <typename Record>
+class OutputPipeline {
+public:
+  // append the text of a record (called concurrently by the workers, must
+  // not throw), return false if the record could not be formatted
+  using RecordFormatter = std::function<bool (const Record &, std::string &)>;
+  // write the text of a batch (only called by the writer thread, must not throw)
+  using TextWriter = std::function<void (const std::string &)>;
+
+  OutputPipeline(RecordFormatter formatter, TextWriter writer, int num_threads,
+                 std::size_t batch_size, std::size_t max_pending)
+    : format_record(formatter), write_text(writer),
+      max_records(batch_size), max_batches(max_pending),
+      closing(false), num_failed(0), finished(false)
+  {
+    threads.emplace_back(&OutputPipeline::writer_loop, this);
+    for (int ii = 0; ii < num_threads; ++ii) {
+      threads.emplace_back(&OutputPipeline::worker_loop, this);
+    }
+  }
+
+  ~OutputPipeline()
+  {
+    finish();
+  }
+
+  OutputPipeline(const OutputPipeline &) = delete;
+  OutputPipeline & operator=(const OutputPipeline &) = delete;
+
+  void push(Record record)
+  {
+    if (!current) {
+      current = std::make_shared<Batch>();
+      current->records.reserve(max_records);
+    }
+    current->records.push_back(std::move(record));
+    if (current->records.size() == max_records) {
+      submit();
+    }
+  }
+
+  // wait until all the submitted records are written, and return the number
+  // of records that could not be formatted
+  std::size_t finish()
+  {
+    if (!finished) {
+      submit();
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+      }
+      worker_cv.notify_all();
+      writer_cv.notify_all();
+      for (auto & thread: threads) {
+        thread.join();
+      }
+      finished = true;
+    }
+    return num_failed;
+  }
+
+private:
+  struct Batch {
+    std::vector<Record> records;
+    std::string text;
+    std::size_t failed = 0;
+    bool done = false;
+  };
+  using BatchPtr = std::shared_ptr<Batch>;
+
+  void submit()
+  {
+    if (!current) {
+      return;
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      producer_cv.wait(lock, [this] { return pending.size() < max_batches; });
+      pending.push_back(current);
+      todo.push_back(current);
+    }
+    current.reset();
+    worker_cv.notify_one();
+  }
+
+  void worker_loop()
+  {
+    while (true) {
+      BatchPtr batch;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        worker_cv.wait(lock, [this] { return closing || !todo.empty(); });
+        if (todo.empty()) {
+          return;
+        }
+        batch = todo.front();
+        todo.pop_front();
+      }
+      for (const auto & record: batch->records) {
+        if (!format_record(record, batch->text)) {
+          ++batch->failed;
+        }
+      }
+      batch->records.clear();
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        batch->done = true;
+      }
+      writer_cv.notify_one();
+    }
+  }
+
+  void writer_loop()
+  {
+    while (true) {
+      BatchPtr batch;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        writer_cv.wait(lock, [this] {
+          return pending.empty() ? closing : pending.front()->done;
+        });
+        if (pending.empty()) {
+          return;
+        }
+        batch = pending.front();
+        pending.pop_front();
+      }
+      producer_cv.notify_one();
+      write_text(batch->text);
+      num_failed += batch->failed;
+    }
+  }
+
+  RecordFormatter format_record;
+  TextWriter write_text;
+  std::size_t max_records;
+  std::size_t max_batches;
+
+  std::mutex mutex;
+  std::condition_variable producer_cv;
+  std::condition_variable worker_cv;
+  std::condition_variable writer_cv;
+  std::deque<BatchPtr> pending; // in submission order, waiting to be written
+  std::deque<BatchPtr> todo;    // waiting to be formatted
+  bool closing;
+  std::vector<std::thread> threads;
+
+  // only accessed by the writer thread, and read after it's joined
+  std::size_t num_failed;
+
+  // only accessed by the calling thread
+  BatchPtr current;
+  bool finished;
+};
+
+#endif
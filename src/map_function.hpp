@@ -0,0 +1,71 @@
+#ifndef CHEMICALITE_MAP_FUNCTION_INCLUDED
+#define CHEMICALITE_MAP_FUNCTION_INCLUDED
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace RDKit
+{
+  class ROMol;
+} // namespace RDKit
+
+/*
+** A copy of an sqlite3_value, that can be safely accessed from a worker
+** thread. Text and blob values are both stored in bytes.
+*/
+struct MapValue {
+  int type = SQLITE_NULL;
+  sqlite3_int64 int_value = 0;
+  double float_value = 0.;
+  Blob bytes;
+};
+
+/*
+** The thread-safe implementation of a chemicalite function, as evaluated by
+** chemicalite_map. The function is called with the non-NULL arguments of an
+** input row, must only use RDKit and the chemicalite conversion functions
+** (no access to the database connection), and returns a status code.
+*/
+using MapFunction = std::function<int (const std::vector<MapValue> &, MapValue &)>;
+
+inline void map_result(MapValue & result, int value)
+{
+  result.type = SQLITE_INTEGER;
+  result.int_value = value;
+}
+
+inline void map_result(MapValue & result, double value)
+{
+  result.type = SQLITE_FLOAT;
+  result.float_value = value;
+}
+
+inline void map_result(MapValue & result, const std::string & value)
+{
+  result.type = SQLITE_TEXT;
+  result.bytes.assign(value.begin(), value.end());
+}
+
+inline void map_result_blob(MapValue & result, Blob && value)
+{
+  result.type = SQLITE_BLOB;
+  result.bytes = std::move(value);
+}
+
+/*
+** Each module returns the map implementation of the named function, or an
+** empty MapFunction if the function is not supported.
+*/
+MapFunction mol_descriptors_map_function(const std::string & name);
+MapFunction mol_standardize_map_function(const std::string & name);
+MapFunction mol_to_bfp_map_function(const std::string & name);
+
+/*
+** The named descriptor (e.g. 'mol_tpsa'), evaluated on a molecule that was
+** already decoded (as by chemicalite_import), or nullptr if the descriptor is
+** not supported.
+*/
+using MolMapResult = void (*)(MapValue &, const RDKit::ROMol &);
+MolMapResult mol_descriptor_map_result(const std::string & name);
+
+#endif
@@ -0,0 +1,626 @@
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sqlite3ext.h>
+extern const sqlite3_api_routines *sqlite3_api;
+
+#include "utils.hpp"
+#include "map_vtab.hpp"
+#include "map_function.hpp"
+#include "logging.hpp"
+
+/*
+** chemicalite_map('function', 'query', threads) evaluates a chemicalite
+** function over the rows returned by query, using a pool of worker threads.
+** The first column of the query is returned unchanged as the row id, and the
+** other columns are passed as the function arguments, e.g.:
+**
+**   INSERT INTO std(id, mol)
+**     SELECT id, result FROM chemicalite_map(
+**       'mol_super_parent', 'SELECT id, mol FROM compounds', 8);
+**
+**   id        the first column of the query
+**   result    the function return value (NULL if any argument is NULL)
+**
+** The input rows are read in blocks by the calling thread, and the blocks
+** are evaluated by the worker threads while the next input rows are read.
+** The results are returned in the same order as the input rows. If threads
+** is omitted or not positive, the number of hardware threads is used.
+*/
+static const int CHEMICALITE_MAP_FUNCTION_COLUMN = 2;
+static const int CHEMICALITE_MAP_QUERY_COLUMN = 3;
+static const int CHEMICALITE_MAP_THREADS_COLUMN = 4;
+
+static const size_t CHEMICALITE_MAP_BLOCK_ROWS = 64;
+static const size_t CHEMICALITE_MAP_PENDING_BLOCKS_PER_THREAD = 2;
+
+struct ChemicaliteMapRow {
+  MapValue id;
+  std::vector<MapValue> args;
+  MapValue result;
+  int rc;
+};
+
+struct ChemicaliteMapVtab : public sqlite3_vtab {
+  sqlite3 *db;
+};
+
+static int chemicaliteMapConnect(sqlite3 *db, void */*pAux*/,
+                      int /*argc*/, const char * const */*argv*/,
+                      sqlite3_vtab **ppVTab,
+                      char **pzErr)
+{
+  int rc = sqlite3_declare_vtab(db, "CREATE TABLE x("
+    "id, "
+    "result, "
+    "function HIDDEN, "
+    "query HIDDEN, "
+    "threads HIDDEN"
+    ")");
+
+  if (rc == SQLITE_OK) {
+    ChemicaliteMapVtab *vtab = new ChemicaliteMapVtab;
+    memset((sqlite3_vtab *)vtab, 0, sizeof(sqlite3_vtab));
+    vtab->db = db;
+    *ppVTab = vtab;
+  }
+  else {
+    *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+  }
+
+  return rc;
+}
+
+static int chemicaliteMapBestIndex(sqlite3_vtab */*pVTab*/, sqlite3_index_info *pIndexInfo)
+{
+  int function_index = -1;
+  int query_index = -1;
+  int threads_index = -1;
+  for (int index = 0; index < pIndexInfo->nConstraint; ++index) {
+    if (pIndexInfo->aConstraint[index].usable == 0 ||
+        pIndexInfo->aConstraint[index].op != SQLITE_INDEX_CONSTRAINT_EQ) {
+      continue;
+    }
+    switch (pIndexInfo->aConstraint[index].iColumn) {
+      case CHEMICALITE_MAP_FUNCTION_COLUMN:
+        function_index = index;
+        break;
+      case CHEMICALITE_MAP_QUERY_COLUMN:
+        query_index = index;
+        break;
+      case CHEMICALITE_MAP_THREADS_COLUMN:
+        threads_index = index;
+        break;
+      default:
+        break;
+    }
+  }
+  if (function_index < 0 || query_index < 0) {
+    // The function name or the input query are not available, or not usable,
+    // This plan is therefore unusable.
+    return SQLITE_CONSTRAINT;
+  }
+  pIndexInfo->aConstraintUsage[function_index].argvIndex = 1;
+  pIndexInfo->aConstraintUsage[function_index].omit = 1;
+  pIndexInfo->aConstraintUsage[query_index].argvIndex = 2;
+  pIndexInfo->aConstraintUsage[query_index].omit = 1;
+  if (threads_index >= 0) {
+    pIndexInfo->aConstraintUsage[threads_index].argvIndex = 3;
+    pIndexInfo->aConstraintUsage[threads_index].omit = 1;
+  }
+  pIndexInfo->idxNum = 1; // Not really meaningful a this time
+  pIndexInfo->estimatedCost = 10000;
+  return SQLITE_OK;
+}
+
+static int chemicaliteMapDisconnect(sqlite3_vtab *pVTab)
+{
+  delete (ChemicaliteMapVtab *)pVTab;
+  return SQLITE_OK;
+}
+
+/*
+** The worker threads of a chemicalite_map cursor.
+**
+** The blocks of input rows are submitted by the calling thread (the only one
+** that steps the input query), a pool of worker threads evaluates them, and
+** collect() returns the blocks in the same order they were submitted. The
+** caller bounds the number of blocks that were submitted but not collected.
+*/
+class ChemicaliteMapPipeline {
+public:
+  // evaluate the rows of a block (called concurrently by the workers, must not throw)
+  using BlockEvaluator = std::function<void (std::vector<ChemicaliteMapRow> &)>;
+
+  // may throw if the threads can't be started
+  ChemicaliteMapPipeline(BlockEvaluator evaluator, int num_threads)
+    : evaluate_block(evaluator), stopped(false)
+  {
+    try {
+      for (int ii = 0; ii < num_threads; ++ii) {
+        threads.emplace_back(&ChemicaliteMapPipeline::worker_loop, this);
+      }
+    }
+    catch (...) {
+      stop();
+      throw;
+    }
+  }
+
+  ~ChemicaliteMapPipeline()
+  {
+    stop();
+  }
+
+  ChemicaliteMapPipeline(const ChemicaliteMapPipeline &) = delete;
+  ChemicaliteMapPipeline & operator=(const ChemicaliteMapPipeline &) = delete;
+
+  void submit(std::vector<ChemicaliteMapRow> rows)
+  {
+    BlockPtr block = std::make_shared<Block>();
+    block->rows = std::move(rows);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending.push_back(block);
+      todo.push_back(block);
+    }
+    worker_cv.notify_one();
+  }
+
+  // the number of blocks that were submitted and not yet collected
+  size_t size() const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return pending.size();
+  }
+
+  // wait for the evaluation of the oldest block, and move its rows into the
+  // argument. return false if no blocks are pending.
+  bool collect(std::vector<ChemicaliteMapRow> & rows)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (pending.empty()) {
+      return false;
+    }
+    BlockPtr block = pending.front();
+    consumer_cv.wait(lock, [&block] { return block->done; });
+    pending.pop_front();
+    rows = std::move(block->rows);
+    return true;
+  }
+
+private:
+  struct Block {
+    std::vector<ChemicaliteMapRow> rows;
+    bool done = false;
+  };
+  using BlockPtr = std::shared_ptr<Block>;
+
+  void stop()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopped = true;
+    }
+    worker_cv.notify_all();
+    for (auto & thread: threads) {
+      thread.join();
+    }
+    threads.clear();
+  }
+
+  void worker_loop()
+  {
+    while (true) {
+      BlockPtr block;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        worker_cv.wait(lock, [this] { return stopped || !todo.empty(); });
+        if (stopped) {
+          return;
+        }
+        block = todo.front();
+        todo.pop_front();
+      }
+      evaluate_block(block->rows);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        block->done = true;
+      }
+      consumer_cv.notify_all();
+    }
+  }
+
+  BlockEvaluator evaluate_block;
+
+  mutable std::mutex mutex;
+  std::condition_variable worker_cv;
+  std::condition_variable consumer_cv;
+  std::deque<BlockPtr> pending; // in submission order, waiting to be collected
+  std::deque<BlockPtr> todo;    // waiting to be evaluated
+  bool stopped;
+  std::vector<std::thread> threads;
+};
+
+struct ChemicaliteMapCursor : public sqlite3_vtab_cursor {
+  sqlite3_stmt *stmt;
+  MapFunction function;
+  std::string function_name;
+  int threads;
+  std::vector<ChemicaliteMapRow> rows;
+  size_t index;
+  sqlite3_int64 rowid;
+  // declared last, so that the workers are stopped first
+  std::unique_ptr<ChemicaliteMapPipeline> pipeline;
+};
+
+static int chemicaliteMapOpen(sqlite3_vtab */*pVTab*/, sqlite3_vtab_cursor **ppCursor)
+{
+  ChemicaliteMapCursor *p = new ChemicaliteMapCursor;
+  p->stmt = nullptr;
+  p->threads = 1;
+  p->index = 0;
+  p->rowid = 0;
+  *ppCursor = (sqlite3_vtab_cursor *)p;
+  return SQLITE_OK;
+}
+
+static int chemicaliteMapClose(sqlite3_vtab_cursor *pCursor)
+{
+  ChemicaliteMapCursor *p = (ChemicaliteMapCursor *)pCursor;
+  p->pipeline.reset();
+  sqlite3_finalize(p->stmt);
+  delete p;
+  return SQLITE_OK;
+}
+
+static void copy_column_value(sqlite3_stmt *stmt, int col, MapValue & value)
+{
+  value.type = sqlite3_column_type(stmt, col);
+  switch (value.type) {
+    case SQLITE_INTEGER:
+      value.int_value = sqlite3_column_int64(stmt, col);
+      break;
+    case SQLITE_FLOAT:
+      value.float_value = sqlite3_column_double(stmt, col);
+      break;
+    case SQLITE_TEXT: {
+      const uint8_t *text = sqlite3_column_text(stmt, col);
+      value.bytes.assign(text, text + sqlite3_column_bytes(stmt, col));
+      break;
+    }
+    case SQLITE_BLOB: {
+      const uint8_t *blob = (const uint8_t *) sqlite3_column_blob(stmt, col);
+      value.bytes.assign(blob, blob + sqlite3_column_bytes(stmt, col));
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+static void result_map_value(sqlite3_context *ctx, const MapValue & value)
+{
+  switch (value.type) {
+    case SQLITE_INTEGER:
+      sqlite3_result_int64(ctx, value.int_value);
+      break;
+    case SQLITE_FLOAT:
+      sqlite3_result_double(ctx, value.float_value);
+      break;
+    case SQLITE_TEXT:
+      sqlite3_result_text(ctx, (const char *) value.bytes.data(), value.bytes.size(), SQLITE_TRANSIENT);
+      break;
+    case SQLITE_BLOB:
+      sqlite3_result_blob(ctx, value.bytes.data(), value.bytes.size(), SQLITE_TRANSIENT);
+      break;
+    default:
+      sqlite3_result_null(ctx);
+  }
+}
+
+/*
+** Evaluate the function over the rows of a block.
+*/
+static void evaluate_block(
+  const MapFunction & function, const std::string & function_name,
+  std::vector<ChemicaliteMapRow> & rows)
+{
+  for (auto & row: rows) {
+    row.rc = SQLITE_OK;
+    bool has_null = false;
+    for (const auto & arg: row.args) {
+      has_null = has_null || arg.type == SQLITE_NULL;
+    }
+    if (has_null) {
+      /* if any argument is NULL, return NULL */
+      continue;
+    }
+    try {
+      row.rc = function(row.args, row.result);
+    }
+    catch (...) {
+      row.rc = SQLITE_ERROR;
+      chemicalite_log(row.rc, "%s failed with an exception", function_name.c_str());
+    }
+  }
+}
+
+/*
+** Read the next block of input rows. The statement is finalized when the
+** input rows are exhausted, or if the query fails.
+*/
+static int read_block(ChemicaliteMapCursor *p, std::vector<ChemicaliteMapRow> & rows)
+{
+  int ncols = sqlite3_column_count(p->stmt);
+
+  int rc = SQLITE_OK;
+  while (rows.size() < CHEMICALITE_MAP_BLOCK_ROWS) {
+    rc = sqlite3_step(p->stmt);
+    if (rc != SQLITE_ROW) {
+      break;
+    }
+    rows.emplace_back();
+    ChemicaliteMapRow & row = rows.back();
+    copy_column_value(p->stmt, 0, row.id);
+    row.args.resize(ncols - 1);
+    for (int col = 1; col < ncols; ++col) {
+      copy_column_value(p->stmt, col, row.args[col - 1]);
+    }
+  }
+
+  if (rc == SQLITE_ROW) {
+    rc = SQLITE_OK;
+  }
+  else {
+    /* the input rows are exhausted, or the query failed */
+    if (rc == SQLITE_DONE) {
+      rc = SQLITE_OK;
+    }
+    else {
+      sqlite3_free(p->pVtab->zErrMsg);
+      p->pVtab->zErrMsg = sqlite3_mprintf(
+        "%s", sqlite3_errmsg(((ChemicaliteMapVtab *)p->pVtab)->db));
+    }
+    sqlite3_finalize(p->stmt);
+    p->stmt = nullptr;
+  }
+
+  return rc;
+}
+
+/*
+** Return the results of the next block. The input rows are read ahead, so
+** that the workers evaluate the following blocks while the results of the
+** current one are returned.
+*/
+static int next_block(ChemicaliteMapCursor *p)
+{
+  p->rows.clear();
+  p->index = 0;
+
+  if (!p->pipeline) {
+    return SQLITE_OK;
+  }
+
+  size_t max_pending = (size_t) p->threads * CHEMICALITE_MAP_PENDING_BLOCKS_PER_THREAD;
+
+  int rc = SQLITE_OK;
+  while (p->stmt && p->pipeline->size() < max_pending) {
+    std::vector<ChemicaliteMapRow> rows;
+    rows.reserve(CHEMICALITE_MAP_BLOCK_ROWS);
+    rc = read_block(p, rows);
+    if (rc != SQLITE_OK) {
+      break;
+    }
+    if (!rows.empty()) {
+      p->pipeline->submit(std::move(rows));
+    }
+  }
+
+  if (rc == SQLITE_OK && p->pipeline->collect(p->rows)) {
+    for (const auto & row: p->rows) {
+      if (row.rc != SQLITE_OK) {
+        sqlite3_free(p->pVtab->zErrMsg);
+        p->pVtab->zErrMsg = sqlite3_mprintf(
+          "%s failed with error code %d", p->function_name.c_str(), row.rc);
+        rc = row.rc;
+        break;
+      }
+    }
+  }
+
+  if (rc != SQLITE_OK) {
+    p->rows.clear();
+    p->pipeline.reset();
+  }
+
+  return rc;
+}
+
+static MapFunction lookup_map_function(const std::string & name)
+{
+  MapFunction function = mol_descriptors_map_function(name);
+  if (!function) function = mol_standardize_map_function(name);
+  if (!function) function = mol_to_bfp_map_function(name);
+  return function;
+}
+
+static int chemicaliteMapFilter(sqlite3_vtab_cursor *pCursor, int /*idxNum*/, const char */*idxStr*/,
+                     int argc, sqlite3_value **argv)
+{
+  ChemicaliteMapCursor *p = (ChemicaliteMapCursor *)pCursor;
+  sqlite3 *db = ((ChemicaliteMapVtab *)pCursor->pVtab)->db;
+
+  // stop the evaluation of a previous scan
+  p->pipeline.reset();
+  sqlite3_finalize(p->stmt);
+  p->stmt = nullptr;
+  p->rows.clear();
+  p->index = 0;
+  p->rowid = 0;
+
+  if (argc < 2) {
+    return SQLITE_ERROR;
+  }
+
+  if (sqlite3_value_type(argv[0]) != SQLITE_TEXT || sqlite3_value_type(argv[1]) != SQLITE_TEXT) {
+    return SQLITE_MISMATCH;
+  }
+
+  p->function_name = (const char *)sqlite3_value_text(argv[0]);
+  p->function = lookup_map_function(p->function_name);
+  if (!p->function) {
+    sqlite3_free(pCursor->pVtab->zErrMsg);
+    pCursor->pVtab->zErrMsg = sqlite3_mprintf(
+      "function %s is not supported by chemicalite_map", p->function_name.c_str());
+    return SQLITE_ERROR;
+  }
+
+  p->threads = 0;
+  if (argc > 2) {
+    if (sqlite3_value_type(argv[2]) != SQLITE_INTEGER) {
+      return SQLITE_MISMATCH;
+    }
+    p->threads = sqlite3_value_int(argv[2]);
+  }
+  if (p->threads <= 0) {
+    p->threads = std::max<int>(std::thread::hardware_concurrency(), 1);
+  }
+
+  const char *query = (const char *)sqlite3_value_text(argv[1]);
+  int rc = sqlite3_prepare_v2(db, query, -1, &p->stmt, 0);
+  if (rc == SQLITE_OK && sqlite3_column_count(p->stmt) < 2) {
+    sqlite3_free(pCursor->pVtab->zErrMsg);
+    pCursor->pVtab->zErrMsg = sqlite3_mprintf(
+      "the chemicalite_map query must return an id and at least one argument");
+    return SQLITE_ERROR;
+  }
+  else if (rc != SQLITE_OK) {
+    sqlite3_free(pCursor->pVtab->zErrMsg);
+    pCursor->pVtab->zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  MapFunction function = p->function;
+  std::string function_name = p->function_name;
+  try {
+    p->pipeline.reset(new ChemicaliteMapPipeline(
+      [function, function_name](std::vector<ChemicaliteMapRow> & rows) {
+        evaluate_block(function, function_name, rows);
+      },
+      p->threads));
+  }
+  catch (...) {
+    sqlite3_free(pCursor->pVtab->zErrMsg);
+    pCursor->pVtab->zErrMsg = sqlite3_mprintf(
+      "chemicalite_map could not start %d worker threads", p->threads);
+    return SQLITE_ERROR;
+  }
+
+  return next_block(p);
+}
+
+static int chemicaliteMapNext(sqlite3_vtab_cursor *pCursor)
+{
+  ChemicaliteMapCursor *p = (ChemicaliteMapCursor *)pCursor;
+  ++p->index;
+  ++p->rowid;
+  if (p->index < p->rows.size()) {
+    return SQLITE_OK;
+  }
+  return next_block(p);
+}
+
+static int chemicaliteMapEof(sqlite3_vtab_cursor *pCursor)
+{
+  ChemicaliteMapCursor *p = (ChemicaliteMapCursor *)pCursor;
+  return p->index >= p->rows.size() ? 1 : 0;
+}
+
+static int chemicaliteMapColumn(sqlite3_vtab_cursor *pCursor, sqlite3_context *ctx, int N)
+{
+  ChemicaliteMapCursor *p = (ChemicaliteMapCursor *)pCursor;
+  assert(p->index < p->rows.size());
+  const ChemicaliteMapRow & row = p->rows[p->index];
+
+  switch (N) {
+    case 0:
+      result_map_value(ctx, row.id);
+      break;
+    case 1:
+      result_map_value(ctx, row.result);
+      break;
+    default:
+      sqlite3_result_null(ctx);
+  }
+  return SQLITE_OK;
+}
+
+static int chemicaliteMapRowid(sqlite3_vtab_cursor *pCursor, sqlite_int64 *pRowid)
+{
+  ChemicaliteMapCursor *p = (ChemicaliteMapCursor *)pCursor;
+  *pRowid = p->rowid;
+  return SQLITE_OK;
+}
+
+/*
+** The chemicalite_map module, implemented as an eponymous virtual table
+*/
+static sqlite3_module chemicaliteMapModule = {
+#if SQLITE_VERSION_NUMBER >= 3044000
+  4,                           /* iVersion */
+#else
+  3,                           /* iVersion */
+#endif
+  0,                           /* xCreate - create a table */ /* null because eponymous-only */
+  chemicaliteMapConnect,       /* xConnect - connect to an existing table */
+  chemicaliteMapBestIndex,     /* xBestIndex - Determine search strategy */
+  chemicaliteMapDisconnect,    /* xDisconnect - Disconnect from a table */
+  0,                           /* xDestroy - Drop a table */
+  chemicaliteMapOpen,          /* xOpen - open a cursor */
+  chemicaliteMapClose,         /* xClose - close a cursor */
+  chemicaliteMapFilter,        /* xFilter - configure scan constraints */
+  chemicaliteMapNext,          /* xNext - advance a cursor */
+  chemicaliteMapEof,           /* xEof */
+  chemicaliteMapColumn,        /* xColumn - read data */
+  chemicaliteMapRowid,         /* xRowid - read data */
+  0,                           /* xUpdate - write data */
+  0,                           /* xBegin - begin transaction */
+  0,                           /* xSync - sync transaction */
+  0,                           /* xCommit - commit transaction */
+  0,                           /* xRollback - rollback transaction */
+  0,                           /* xFindFunction - function overloading */
+  0,                           /* xRename - rename the table */
+  0,                           /* xSavepoint */
+  0,                           /* xRelease */
+  0,                           /* xRollbackTo */
+  0                            /* xShadowName */
+#if SQLITE_VERSION_NUMBER >= 3044000
+  ,
+  0                            /* xIntegrity */
+#endif
+};
+
+int chemicalite_init_map(sqlite3 *db)
+{
+  int rc = SQLITE_OK;
+
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_create_module_v2(db, "chemicalite_map", &chemicaliteMapModule,
+				  0,  /* Client data for xCreate/xConnect */
+				  0   /* Module destructor function */
+				  );
+  }
+
+  return rc;
+}
@@ -0,0 +1,6 @@
+#ifndef CHEMICALITE_MAP_VTAB_INCLUDED
+#define CHEMICALITE_MAP_VTAB_INCLUDED
+
+int chemicalite_init_map(sqlite3 *db);
+
+#endif
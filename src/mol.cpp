@@ -1,15 +1,62 @@
 #include <cstring>
+#include <functional>
+#include <istream>
+#include <sstream>
+#include <string_view>
 
 #include <sqlite3ext.h>
 extern const sqlite3_api_routines *sqlite3_api;
 
 #include <GraphMol/MolPickler.h>
+#include <RDGeneral/StreamOps.h>
 
 #include "utils.hpp"
 #include "mol.hpp"
+#include "map_function.hpp"
 #include "logging.hpp"
+#include "settings.hpp"
 
+/*
+** Two blob formats are supported for the mol data type:
+**
+** MOL_MAGIC     the magic number followed by an RDKit pickle of the molecule,
+**               including its properties. This format is still read, and it's
+**               written by mol_from_binary_mol, which stores the input pickle
+**               as is.
+**
+** MOL_MAGIC_V2  the magic number followed by a sequence of tagged sections,
+**               each stored as a 4-byte tag, a 4-byte size and the section
+**               data:
+**
+**                 MOL_SECTION_GRAPH  the RDKit pickle of the molecule without
+**                                    the molecule-level properties (required,
+**                                    always the first section)
+**                 MOL_SECTION_PROPS  the molecule-level properties (optional)
+**
+**               and optionally some precomputed values, added on request by
+**               mol_with_cached_fps:
+**
+**                 MOL_SECTION_HEAVY_ATOMS  the number of heavy atoms (4 bytes)
+**                 MOL_SECTION_PATTERN_BFP  the pattern fingerprint
+**                 MOL_SECTION_MORGAN_BFP   the Morgan fingerprint radius
+**                                          (4 bytes) and the fingerprint
+**
+**               Unknown sections are skipped by the readers.
+**
+** Keeping the properties in a separate section, the functions that only need
+** the molecular graph don't decode the properties, and the functions that only
+** need the properties don't decode the graph.
+*/
 static constexpr const uint32_t MOL_MAGIC = 0x4D4F4C00;
+static constexpr const uint32_t MOL_MAGIC_V2 = 0x4D4F4C02;
+
+static constexpr const uint32_t MOL_SECTION_GRAPH = 0x47524150; /* GRAP */
+static constexpr const uint32_t MOL_SECTION_PROPS = 0x50524F50; /* PROP */
+static constexpr const uint32_t MOL_SECTION_HEAVY_ATOMS = 0x48565941; /* HVYA */
+static constexpr const uint32_t MOL_SECTION_PATTERN_BFP = 0x50415446; /* PATF */
+static constexpr const uint32_t MOL_SECTION_MORGAN_BFP = 0x4D4F5246; /* MORF */
+
+static constexpr const size_t MOL_SECTION_HEADER_SIZE = 2*sizeof(uint32_t);
 
 std::string mol_to_binary_mol(const RDKit::ROMol & mol, int * rc)
 {
@@ -33,38 +80,185 @@ Blob binary_mol_to_blob(const std::string & bmol, int *)
   return blob;
 }
 
+static uint8_t * write_mol_section(uint8_t * p, uint32_t tag, std::string_view data)
+{
+  p += write_uint32(p, tag);
+  p += write_uint32(p, data.size());
+  memcpy(p, data.data(), data.size());
+  return p + data.size();
+}
+
 Blob mol_to_blob(const RDKit::ROMol & mol, int * rc)
 {
-  std::string bmol = mol_to_binary_mol(mol, rc);
-  if (*rc == SQLITE_OK) {
-    return binary_mol_to_blob(bmol, rc);
+  return mol_to_blob(mol, MolCachedFps(), rc);
+}
+
+Blob mol_to_blob(const RDKit::ROMol & mol, const MolCachedFps & fps, int * rc)
+{
+  std::string graph;
+  std::string props;
+  try {
+    unsigned int flags = 
+      (unsigned int) RDKit::PicklerOps::AllProps & ~(unsigned int) RDKit::PicklerOps::MolProps;
+    RDKit::MolPickler::pickleMol(mol, graph, flags);
+    // the private properties (e.g. _Name) are retained, as they were by
+    // the mol pickle, but the computed ones are not
+    if (!mol.getPropList(true, false).empty()) {
+      std::ostringstream ss;
+      RDKit::streamWriteProps(
+        ss, mol, true, false, RDKit::MolPickler::getCustomPropHandlers());
+      props = ss.str();
+    }
+  }
+  catch (...) {
+    *rc = SQLITE_ERROR;
+    chemicalite_log(*rc, "Could not serialize mol to binary");
+    return Blob();
+  }
+
+  uint8_t heavy_atoms[sizeof(uint32_t)];
+  write_uint32(heavy_atoms, fps.heavy_atoms);
+
+  std::string morgan_bfp;
+  if (!fps.morgan_bfp.empty()) {
+    morgan_bfp.resize(sizeof(uint32_t));
+    write_uint32((uint8_t *) morgan_bfp.data(), fps.morgan_radius);
+    morgan_bfp += fps.morgan_bfp;
+  }
+
+  size_t size = sizeof(uint32_t) + MOL_SECTION_HEADER_SIZE + graph.size();
+  if (!props.empty()) {
+    size += MOL_SECTION_HEADER_SIZE + props.size();
+  }
+  if (fps.heavy_atoms >= 0) {
+    size += MOL_SECTION_HEADER_SIZE + sizeof(uint32_t);
+  }
+  if (!fps.pattern_bfp.empty()) {
+    size += MOL_SECTION_HEADER_SIZE + fps.pattern_bfp.size();
+  }
+  if (!morgan_bfp.empty()) {
+    size += MOL_SECTION_HEADER_SIZE + morgan_bfp.size();
+  }
+
+  Blob blob(size);
+  uint8_t * p = blob.data();
+  p += write_uint32(p, MOL_MAGIC_V2);
+  p = write_mol_section(p, MOL_SECTION_GRAPH, graph);
+  if (!props.empty()) {
+    p = write_mol_section(p, MOL_SECTION_PROPS, props);
+  }
+  if (fps.heavy_atoms >= 0) {
+    p = write_mol_section(
+      p, MOL_SECTION_HEAVY_ATOMS, 
+      std::string_view((const char *) heavy_atoms, sizeof(uint32_t)));
+  }
+  if (!fps.pattern_bfp.empty()) {
+    p = write_mol_section(p, MOL_SECTION_PATTERN_BFP, fps.pattern_bfp);
   }
-  return Blob();
+  if (!morgan_bfp.empty()) {
+    p = write_mol_section(p, MOL_SECTION_MORGAN_BFP, morgan_bfp);
+  }
+
+  return blob;
 }
 
-std::string blob_to_binary_mol(const Blob &blob, int *rc)
+/*
+** The sections of a serialized mol, referring to the input buffer (no data
+** is copied). For the legacy format, the graph is a full pickle (properties
+** included) and the props section is empty.
+*/
+struct MolBlobSections {
+  bool legacy = false;
+  std::string_view graph;
+  std::string_view props;
+  MolCachedFps fps;
+};
+
+static int parse_mol_blob(const uint8_t * data, size_t size, MolBlobSections & sections)
 {
-  if (blob.size() <= sizeof(uint32_t)) {
-    *rc = SQLITE_MISMATCH;
-    return "";
+  if (size <= sizeof(uint32_t)) {
+    return SQLITE_MISMATCH;
   }
-  const uint8_t * p = blob.data();
-  uint32_t magic = read_uint32(p);
-  if (magic != MOL_MAGIC) {
-    *rc = SQLITE_MISMATCH;
-    chemicalite_log(*rc, "mismatching blob header found");
-    return "";
+
+  uint32_t magic = read_uint32(data);
+  data += sizeof(uint32_t);
+  size -= sizeof(uint32_t);
+
+  if (magic == MOL_MAGIC) {
+    sections.legacy = true;
+    sections.graph = std::string_view(reinterpret_cast<const char *>(data), size);
+    return SQLITE_OK;
   }
-  p += sizeof(uint32_t);
-  return std::string(reinterpret_cast<const char *>(p), blob.size()-sizeof(uint32_t));
+
+  if (magic != MOL_MAGIC_V2) {
+    chemicalite_log(SQLITE_MISMATCH, "mismatching blob header found");
+    return SQLITE_MISMATCH;
+  }
+
+  while (size > 0) {
+    if (size < MOL_SECTION_HEADER_SIZE) {
+      chemicalite_log(SQLITE_MISMATCH, "truncated mol blob");
+      return SQLITE_MISMATCH;
+    }
+    uint32_t tag = read_uint32(data);
+    uint32_t section_size = read_uint32(data + sizeof(uint32_t));
+    data += MOL_SECTION_HEADER_SIZE;
+    size -= MOL_SECTION_HEADER_SIZE;
+    if (section_size > size) {
+      chemicalite_log(SQLITE_MISMATCH, "truncated mol blob");
+      return SQLITE_MISMATCH;
+    }
+    std::string_view section(reinterpret_cast<const char *>(data), section_size);
+    if (tag == MOL_SECTION_GRAPH) {
+      sections.graph = section;
+    }
+    else if (tag == MOL_SECTION_PROPS) {
+      sections.props = section;
+    }
+    else if (tag == MOL_SECTION_HEAVY_ATOMS && section_size == sizeof(uint32_t)) {
+      sections.fps.heavy_atoms = read_uint32(data);
+    }
+    else if (tag == MOL_SECTION_PATTERN_BFP) {
+      sections.fps.pattern_bfp = section;
+    }
+    else if (tag == MOL_SECTION_MORGAN_BFP && section_size > sizeof(uint32_t)) {
+      sections.fps.morgan_radius = read_uint32(data);
+      sections.fps.morgan_bfp = section.substr(sizeof(uint32_t));
+    }
+    data += section_size;
+    size -= section_size;
+  }
+
+  if (sections.graph.empty()) {
+    chemicalite_log(SQLITE_MISMATCH, "mol blob without graph section");
+    return SQLITE_MISMATCH;
+  }
+
+  return SQLITE_OK;
+}
+
+static int read_mol_props(std::string_view props, RDKit::RDProps & dest)
+{
+  try {
+    MemoryStreamBuf buf(props.data(), props.size());
+    std::istream ss(&buf);
+    RDKit::streamReadProps(ss, dest, RDKit::MolPickler::getCustomPropHandlers());
+  }
+  catch (...) {
+    chemicalite_log(SQLITE_ERROR, "Could not deserialize mol properties");
+    return SQLITE_ERROR;
+  }
+  return SQLITE_OK;
 }
 
 template <typename MolT>
-MolT * binary_mol_to_mol(const std::string & bmol, int * rc)
+MolT * binary_mol_to_mol(std::string_view bmol, int * rc)
 {
   try {
+    MemoryStreamBuf buf(bmol.data(), bmol.size());
+    std::istream ss(&buf);
     std::unique_ptr<MolT> mol(new MolT());
-    RDKit::MolPickler::molFromPickle(bmol, *mol);
+    RDKit::MolPickler::molFromPickle(ss, mol.get());
     return mol.release();
   }
   catch (...) {
@@ -86,12 +280,28 @@ RDKit::RWMol * binary_mol_to_rwmol(const std::string & bmol, int * rc)
   return binary_mol_to_mol<RDKit::RWMol>(bmol, rc);
 }
 
+/*
+** Build a molecule from the parsed blob sections. If with_props is false, the
+** molecule-level properties are not decoded (unless the blob uses the legacy
+** format, where they are part of the same pickle).
+*/
+template <typename MolT>
+MolT * sections_to_mol(const MolBlobSections & sections, bool with_props, int * rc)
+{
+  std::unique_ptr<MolT> mol(binary_mol_to_mol<MolT>(sections.graph, rc));
+  if (*rc == SQLITE_OK && with_props && !sections.props.empty()) {
+    *rc = read_mol_props(sections.props, *mol);
+  }
+  return (*rc == SQLITE_OK) ? mol.release() : nullptr;
+}
+
 template <typename MolT>
-MolT * blob_to_mol(const Blob &blob, int * rc)
+MolT * blob_to_mol(const uint8_t * data, size_t size, int * rc)
 {
-  std::string bmol = blob_to_binary_mol(blob, rc);
+  MolBlobSections sections;
+  *rc = parse_mol_blob(data, size, sections);
   if (*rc == SQLITE_OK) {
-    return binary_mol_to_mol<MolT>(bmol, rc);
+    return sections_to_mol<MolT>(sections, true, rc);
   }
   return nullptr;
 }
@@ -99,51 +309,72 @@ MolT * blob_to_mol(const Blob &blob, int * rc)
 // cppcheck-suppress unusedFunction
 RDKit::ROMol * blob_to_romol(const Blob &blob, int * rc)
 {
-  return blob_to_mol<RDKit::ROMol>(blob, rc);
+  return blob_to_mol<RDKit::ROMol>(blob.data(), blob.size(), rc);
 }
 
 // cppcheck-suppress unusedFunction
 RDKit::RWMol * blob_to_rwmol(const Blob &blob, int * rc)
 {
-  return blob_to_mol<RDKit::RWMol>(blob, rc);
+  return blob_to_mol<RDKit::RWMol>(blob.data(), blob.size(), rc);
 }
 
-std::string arg_to_binary_mol(sqlite3_value *arg, int *rc)
+static std::string sections_to_binary_mol(const MolBlobSections & sections, int *rc)
 {
-  int value_type = sqlite3_value_type(arg);
-
-  *rc = SQLITE_OK;
-
-  if (value_type != SQLITE_BLOB) {
-    *rc = SQLITE_MISMATCH;
-    chemicalite_log(SQLITE_MISMATCH, "input arg must be of type blob or NULL");
+  if (sections.legacy) {
+    return std::string(sections.graph);
   }
-  else {
-    uint8_t * data = (uint8_t *) sqlite3_value_blob(arg);
-    Blob blob(data, data + sqlite3_value_bytes(arg));
-    return blob_to_binary_mol(blob, rc);
+  std::unique_ptr<RDKit::ROMol> mol(sections_to_mol<RDKit::ROMol>(sections, true, rc));
+  if (*rc == SQLITE_OK) {
+    return mol_to_binary_mol(*mol, rc);
   }
+  return "";
+}
 
+std::string blob_to_binary_mol(const Blob &blob, int *rc)
+{
+  MolBlobSections sections;
+  *rc = parse_mol_blob(blob.data(), blob.size(), sections);
+  if (*rc == SQLITE_OK) {
+    return sections_to_binary_mol(sections, rc);
+  }
   return "";
 }
 
-template <typename MolT>
-MolT * arg_to_mol(sqlite3_value *arg, int *rc)
+/*
+** Validate a mol argument and parse the sections of its blob
+*/
+static int arg_to_mol_sections(sqlite3_value *arg, MolBlobSections & sections)
 {
   int value_type = sqlite3_value_type(arg);
 
-  *rc = SQLITE_OK;
-
   if (value_type != SQLITE_BLOB) {
-    *rc = SQLITE_MISMATCH;
     chemicalite_log(SQLITE_MISMATCH, "input arg must be of type blob or NULL");
+    return SQLITE_MISMATCH;
   }
-  else {
-    uint8_t * data = (uint8_t *) sqlite3_value_blob(arg);
-    Blob blob(data, data + sqlite3_value_bytes(arg));
-    return blob_to_mol<MolT>(blob, rc);
+
+  const uint8_t * data = (const uint8_t *) sqlite3_value_blob(arg);
+  int size = sqlite3_value_bytes(arg);
+  return parse_mol_blob(data, size, sections);
+}
+
+std::string arg_to_binary_mol(sqlite3_value *arg, int *rc)
+{
+  MolBlobSections sections;
+  *rc = arg_to_mol_sections(arg, sections);
+  if (*rc == SQLITE_OK) {
+    return sections_to_binary_mol(sections, rc);
   }
+  return "";
+}
 
+template <typename MolT>
+MolT * arg_to_mol(sqlite3_value *arg, int *rc)
+{
+  MolBlobSections sections;
+  *rc = arg_to_mol_sections(arg, sections);
+  if (*rc == SQLITE_OK) {
+    return sections_to_mol<MolT>(sections, true, rc);
+  }
   return nullptr;
 }
 
@@ -157,8 +388,155 @@ RDKit::RWMol * arg_to_rwmol(sqlite3_value *arg, int *rc)
   return arg_to_mol<RDKit::RWMol>(arg, rc);
 }
 
+template <typename MolT>
+static MolT * map_arg_to_mol(const MapValue &arg, int *rc)
+{
+  if (arg.type != SQLITE_BLOB) {
+    chemicalite_log(SQLITE_MISMATCH, "input arg must be of type blob or NULL");
+    *rc = SQLITE_MISMATCH;
+    return nullptr;
+  }
+
+  MolBlobSections sections;
+  *rc = parse_mol_blob(arg.bytes.data(), arg.bytes.size(), sections);
+  if (*rc == SQLITE_OK) {
+    return sections_to_mol<MolT>(sections, true, rc);
+  }
+  return nullptr;
+}
+
+RDKit::ROMol * map_arg_to_romol(const MapValue &arg, int *rc)
+{
+  return map_arg_to_mol<RDKit::ROMol>(arg, rc);
+}
+
+RDKit::RWMol * map_arg_to_rwmol(const MapValue &arg, int *rc)
+{
+  return map_arg_to_mol<RDKit::RWMol>(arg, rc);
+}
+
+RDKit::RDProps * arg_to_mol_props(sqlite3_value *arg, int *rc)
+{
+  MolBlobSections sections;
+  *rc = arg_to_mol_sections(arg, sections);
+  if (*rc != SQLITE_OK) {
+    return nullptr;
+  }
+
+  if (sections.legacy) {
+    // the properties are only available from the full pickle
+    std::unique_ptr<RDKit::ROMol> mol(binary_mol_to_mol<RDKit::ROMol>(sections.graph, rc));
+    return (*rc == SQLITE_OK) ? new RDKit::RDProps(*mol) : nullptr;
+  }
+
+  std::unique_ptr<RDKit::RDProps> props(new RDKit::RDProps);
+  if (!sections.props.empty()) {
+    *rc = read_mol_props(sections.props, *props);
+  }
+  return (*rc == SQLITE_OK) ? props.release() : nullptr;
+}
+
+int arg_to_mol_cached_fps(sqlite3_value *arg, MolCachedFps & fps)
+{
+  MolBlobSections sections;
+  int rc = arg_to_mol_sections(arg, sections);
+  if (rc == SQLITE_OK) {
+    fps = sections.fps;
+  }
+  return rc;
+}
+
+/*
+** A small cache of the recently decoded molecules, so that a molecule passed
+** to several functions in the same statement (e.g. the same column used as
+** argument to multiple descriptors) is only unpickled once.
+**
+** The entries are matched by connection and by the blob content, because
+** sqlite may pass the same value at different addresses, and a buffer address
+** may be reused for a different molecule. The hash of the content is only
+** used to skip most of the non-matching entries, and a copy of the blob is
+** retained to confirm a match. Molecules decoded with and without their
+** properties are cached separately.
+** The cache is thread local, so that the shared molecules are never accessed
+** concurrently, and its size is controlled by the mol_cache_size setting.
+*/
+struct MolCacheEntry {
+  sqlite3 * db;
+  size_t hash;
+  Blob blob;
+  bool with_props;
+  std::shared_ptr<const RDKit::ROMol> mol;
+};
+
+struct MolCache {
+  std::vector<MolCacheEntry> entries;
+  size_t next = 0;  /* the next entry to be replaced */
+};
+
+static thread_local MolCache mol_cache;
+
+static std::shared_ptr<const RDKit::ROMol> arg_to_cached_mol(
+  sqlite3 * db, sqlite3_value *arg, bool with_props, int *rc)
+{
+  MolBlobSections sections;
+  *rc = arg_to_mol_sections(arg, sections);
+  if (*rc != SQLITE_OK) {
+    return nullptr;
+  }
+
+  int cache_size = 0;
+  chemicalite_get(MOL_CACHE_SIZE, &cache_size);
+  if (cache_size <= 0) {
+    mol_cache.entries.clear();
+    return std::shared_ptr<const RDKit::ROMol>(
+      sections_to_mol<RDKit::ROMol>(sections, with_props, rc));
+  }
+
+  std::string_view blob(
+    (const char *) sqlite3_value_blob(arg), sqlite3_value_bytes(arg));
+  size_t hash = std::hash<std::string_view>()(blob);
+  for (const auto & entry: mol_cache.entries) {
+    if (entry.db == db && entry.hash == hash &&
+        entry.with_props == with_props && entry.blob.size() == blob.size() &&
+        memcmp(entry.blob.data(), blob.data(), blob.size()) == 0) {
+      return entry.mol;
+    }
+  }
+
+  std::shared_ptr<const RDKit::ROMol> mol(
+    sections_to_mol<RDKit::ROMol>(sections, with_props, rc));
+  if (*rc != SQLITE_OK) {
+    return nullptr;
+  }
+
+  auto & entries = mol_cache.entries;
+  if (entries.size() > (size_t) cache_size) {
+    entries.resize(cache_size);
+  }
+  if (entries.size() < (size_t) cache_size) {
+    entries.push_back({db, hash, Blob(blob.begin(), blob.end()), with_props, mol});
+  }
+  else {
+    mol_cache.next %= entries.size();
+    entries[mol_cache.next++] = {db, hash, Blob(blob.begin(), blob.end()), with_props, mol};
+  }
+
+  return mol;
+}
+
+std::shared_ptr<const RDKit::ROMol> arg_to_cached_romol(
+  sqlite3 * db, sqlite3_value *arg, int *rc)
+{
+  return arg_to_cached_mol(db, arg, true, rc);
+}
+
+std::shared_ptr<const RDKit::ROMol> arg_to_cached_mol_graph(
+  sqlite3 * db, sqlite3_value *arg, int *rc)
+{
+  return arg_to_cached_mol(db, arg, false, rc);
+}
+
 void free_romol_auxdata(void * aux)
 {
   delete (RDKit::ROMol *) aux;
 }
-
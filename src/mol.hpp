@@ -1,16 +1,35 @@
 #ifndef CHEMICALITE_MOLECULE_INCLUDED
 #define CHEMICALITE_MOLECULE_INCLUDED
+#include <memory>
 #include <string>
+#include <string_view>
 
 namespace RDKit
 {
   class ROMol;
   class RWMol;
+  class RDProps;
 } // namespace RDKit
 
+struct MapValue;
+
+/*
+** Values that may be precomputed and stored alongside a serialized molecule
+** (see mol_with_cached_fps). The fingerprints are in binary text format, and
+** empty when not available. Read from a blob argument, the views refer to the
+** argument value.
+*/
+struct MolCachedFps {
+  int heavy_atoms = -1;
+  std::string_view pattern_bfp;
+  int morgan_radius = 0;
+  std::string_view morgan_bfp;
+};
+
 std::string mol_to_binary_mol(const RDKit::ROMol &, int *);
 Blob binary_mol_to_blob(const std::string &, int *);
 Blob mol_to_blob(const RDKit::ROMol &, int *);
+Blob mol_to_blob(const RDKit::ROMol &, const MolCachedFps &, int *);
 
 std::string blob_to_binary_mol(const Blob &, int *);
 RDKit::ROMol * binary_mol_to_romol(const std::string &, int *);
@@ -21,6 +40,18 @@ RDKit::RWMol * blob_to_rwmol(const Blob &, int *);
 std::string arg_to_binary_mol(sqlite3_value *, int *);
 RDKit::ROMol * arg_to_romol(sqlite3_value *, int *);
 RDKit::RWMol * arg_to_rwmol(sqlite3_value *, int *);
+/* the returned molecule may be shared with other function calls and must not be modified */
+std::shared_ptr<const RDKit::ROMol> arg_to_cached_romol(sqlite3 *, sqlite3_value *, int *);
+/* as above, but the molecule-level properties may not be decoded */
+std::shared_ptr<const RDKit::ROMol> arg_to_cached_mol_graph(sqlite3 *, sqlite3_value *, int *);
+/* only decode the molecule-level properties */
+RDKit::RDProps * arg_to_mol_props(sqlite3_value *, int *);
+/* only read the precomputed values, if any */
+int arg_to_mol_cached_fps(sqlite3_value *, MolCachedFps &);
+
+/* the thread-safe equivalents, used by chemicalite_map */
+RDKit::ROMol * map_arg_to_romol(const MapValue &, int *);
+RDKit::RWMol * map_arg_to_rwmol(const MapValue &, int *);
 
 void free_romol_auxdata(void *);
 
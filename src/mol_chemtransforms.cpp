@@ -17,7 +17,7 @@ static void mol_delete_substructs(sqlite3_context* ctx, int /*argc*/, sqlite3_va
   
   // the input molecule
   arg = argv[0];
-  std::unique_ptr<RDKit::ROMol> mol(arg_to_romol(arg, &rc));
+  std::shared_ptr<const RDKit::ROMol> mol = arg_to_cached_romol(sqlite3_context_db_handle(ctx), arg, &rc);
   if ( rc != SQLITE_OK ) {
     sqlite3_result_error_code(ctx, rc);
     return;
@@ -25,7 +25,7 @@ static void mol_delete_substructs(sqlite3_context* ctx, int /*argc*/, sqlite3_va
 
   // the input pattern
   arg = argv[1];
-  std::unique_ptr<RDKit::ROMol> query(arg_to_romol(arg, &rc));
+  std::shared_ptr<const RDKit::ROMol> query = arg_to_cached_romol(sqlite3_context_db_handle(ctx), arg, &rc);
   if ( rc != SQLITE_OK ) {
     sqlite3_result_error_code(ctx, rc);
     return;
@@ -230,7 +230,7 @@ static void mol_replace_sidechains(sqlite3_context* ctx, int /*argc*/, sqlite3_v
   
   // the input molecule
   arg = argv[0];
-  std::unique_ptr<RDKit::ROMol> mol(arg_to_romol(arg, &rc));
+  std::shared_ptr<const RDKit::ROMol> mol = arg_to_cached_romol(sqlite3_context_db_handle(ctx), arg, &rc);
   if ( rc != SQLITE_OK ) {
     sqlite3_result_error_code(ctx, rc);
     return;
@@ -238,7 +238,7 @@ static void mol_replace_sidechains(sqlite3_context* ctx, int /*argc*/, sqlite3_v
 
   // the input pattern
   arg = argv[1];
-  std::unique_ptr<RDKit::ROMol> query(arg_to_romol(arg, &rc));
+  std::shared_ptr<const RDKit::ROMol> query = arg_to_cached_romol(sqlite3_context_db_handle(ctx), arg, &rc);
   if ( rc != SQLITE_OK ) {
     sqlite3_result_error_code(ctx, rc);
     return;
@@ -262,7 +262,7 @@ static void mol_replace_core(sqlite3_context* ctx, int /*argc*/, sqlite3_value**
   
   // the input molecule
   arg = argv[0];
-  std::unique_ptr<RDKit::ROMol> mol(arg_to_romol(arg, &rc));
+  std::shared_ptr<const RDKit::ROMol> mol = arg_to_cached_romol(sqlite3_context_db_handle(ctx), arg, &rc);
   if ( rc != SQLITE_OK ) {
     sqlite3_result_error_code(ctx, rc);
     return;
@@ -270,7 +270,7 @@ static void mol_replace_core(sqlite3_context* ctx, int /*argc*/, sqlite3_value**
 
   // the input pattern
   arg = argv[1];
-  std::unique_ptr<RDKit::ROMol> query(arg_to_romol(arg, &rc));
+  std::shared_ptr<const RDKit::ROMol> query = arg_to_cached_romol(sqlite3_context_db_handle(ctx), arg, &rc);
   if ( rc != SQLITE_OK ) {
     sqlite3_result_error_code(ctx, rc);
     return;
@@ -294,7 +294,7 @@ static void mol_murcko_decompose(sqlite3_context* ctx, int /*argc*/, sqlite3_val
   
   // the input molecule
   arg = argv[0];
-  std::unique_ptr<RDKit::ROMol> mol(arg_to_romol(arg, &rc));
+  std::shared_ptr<const RDKit::ROMol> mol = arg_to_cached_romol(sqlite3_context_db_handle(ctx), arg, &rc);
   if ( rc != SQLITE_OK ) {
     sqlite3_result_error_code(ctx, rc);
     return;
@@ -1,3 +1,5 @@
+#include <cstring>
+
 #include <sqlite3ext.h>
 extern const sqlite3_api_routines *sqlite3_api;
 
@@ -5,10 +7,14 @@ extern const sqlite3_api_routines *sqlite3_api;
 #include <GraphMol/Descriptors/MolDescriptors.h>
 #include <GraphMol/Substruct/SubstructMatch.h>
 #include <GraphMol/SmilesParse/SmilesWrite.h>
+#include <GraphMol/Fingerprints/Fingerprints.h>
+#include <DataStructs/ExplicitBitVect.h>
 
 #include "utils.hpp"
 #include "mol_compare.hpp"
 #include "mol.hpp"
+#include "bfp_ops.hpp"
+#include "logging.hpp"
 
 int mol_is_substruct(const RDKit::ROMol & m1, const RDKit::ROMol & m2)
 {
@@ -57,6 +63,52 @@ int mol_cmp(const RDKit::ROMol & m1, const RDKit::ROMol & m2)
   return smi1 == smi2 ? 0 : (smi1 < smi2 ? -1 : 1);
 }
 
+/*
+** A comparison key for a molecule, such that comparing two keys with memcmp
+** orders the molecules on the same counts that are compared by mol_cmp, and
+** then on their (non-isomeric) canonical SMILES. Two keys are equal when the
+** molecules have the same canonical SMILES, which is also when mol_cmp
+** returns 0, and the keys can therefore be stored and indexed for GROUP BY
+** or equality lookups.
+**
+** The ordering of the keys is not exactly the ordering of mol_cmp. The key
+** stores each molecular weight rounded to the nearest integer, while mol_cmp
+** rounds the difference of the two weights with int(diff + .5), which is
+** not symmetric. Molecules with the same atom and bond counts and weights
+** less than 1.5 apart may therefore be sorted differently. The key layout is:
+**
+**   uint32  number of atoms
+**   uint32  number of bonds
+**   uint32  average molecular weight, rounded to the nearest integer
+**   uint32  number of rings
+**   bytes   canonical SMILES
+**
+** The integers are big-endian.
+*/
+static void mol_cmp_key(sqlite3_context* ctx, int /*argc*/, sqlite3_value** argv)
+{
+  int rc = SQLITE_OK;
+  std::shared_ptr<const RDKit::ROMol> mol = arg_to_cached_mol_graph(
+    sqlite3_context_db_handle(ctx), argv[0], &rc);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error_code(ctx, rc);
+    return;
+  }
+
+  bool do_chiral_match = false; /* consistent with mol_cmp */
+  std::string smiles = MolToSmiles(*mol, do_chiral_match);
+
+  Blob key(4*sizeof(uint32_t) + smiles.size());
+  uint8_t *p = key.data();
+  p += write_uint32(p, mol->getNumAtoms());
+  p += write_uint32(p, mol->getNumBonds());
+  p += write_uint32(p, (uint32_t) (RDKit::Descriptors::calcAMW(*mol, false) + .5));
+  p += write_uint32(p, mol->getRingInfo()->numRings());
+  memcpy(p, smiles.data(), smiles.size());
+
+  sqlite3_result_blob(ctx, key.data(), key.size(), SQLITE_TRANSIENT);
+}
+
 template <int (*F)(const RDKit::ROMol &, const RDKit::ROMol &)>
 static void mol_compare(sqlite3_context* ctx, int /*argc*/, sqlite3_value** argv)
 {
@@ -104,12 +156,142 @@ static void mol_compare(sqlite3_context* ctx, int /*argc*/, sqlite3_value** argv
   }
 }
 
+/*
+** A substructure query, compiled once per statement and retained as auxdata.
+** Targets that have fewer atoms or bonds than the query, or whose pattern
+** fingerprint (if precomputed by mol_with_cached_fps) doesn't contain the
+** query fingerprint, are rejected before running the full match.
+*/
+static constexpr const int SCREENED_SSS_BFP_LENGTH = 2048;
+
+struct SubstructQuery {
+  std::unique_ptr<RDKit::ROMol> mol;
+  std::string pattern_bfp;
+  unsigned int num_atoms;
+  unsigned int num_bonds;
+  RDKit::SubstructMatchParameters params;
+};
+
+static void free_substruct_query_auxdata(void * aux)
+{
+  delete (SubstructQuery *) aux;
+}
+
+static SubstructQuery * arg_to_substruct_query(sqlite3_value *arg, bool use_chirality, int *rc)
+{
+  std::unique_ptr<SubstructQuery> query(new SubstructQuery);
+
+  query->mol.reset(arg_to_romol(arg, rc));
+  if (*rc != SQLITE_OK) {
+    return nullptr;
+  }
+
+  query->num_atoms = query->mol->getNumAtoms();
+  query->num_bonds = query->mol->getNumBonds();
+
+  query->params.recursionPossible = true;
+  query->params.useChirality = use_chirality;
+  query->params.maxMatches = 1;
+
+  try {
+    std::unique_ptr<ExplicitBitVect> bv(
+      RDKit::PatternFingerprintMol(*query->mol, SCREENED_SSS_BFP_LENGTH));
+    if (bv) {
+      query->pattern_bfp = BitVectToBinaryText(*bv);
+    }
+  }
+  catch (...) {
+    /* not fatal, the fingerprint screen is just skipped */
+    chemicalite_log(SQLITE_WARNING, "query pattern bfp computation failed with an exception");
+  }
+
+  return query.release();
+}
+
+static int mol_substruct_screened_match(
+  sqlite3 *db, sqlite3_value *arg, const SubstructQuery & query, int *rc)
+{
+  MolCachedFps fps;
+  if (arg_to_mol_cached_fps(arg, fps) == SQLITE_OK) {
+    if (fps.heavy_atoms >= 0 && (unsigned int) fps.heavy_atoms < query.num_atoms) {
+      return 0;
+    }
+    if (!query.pattern_bfp.empty() && fps.pattern_bfp.size() == query.pattern_bfp.size() &&
+        !bfp_op_contains(query.pattern_bfp.size(),
+                         (const uint8_t *) fps.pattern_bfp.data(),
+                         (const uint8_t *) query.pattern_bfp.data())) {
+      return 0;
+    }
+  }
+
+  std::shared_ptr<const RDKit::ROMol> target = arg_to_cached_mol_graph(db, arg, rc);
+  if (*rc != SQLITE_OK) {
+    return 0;
+  }
+
+  if (target->getNumAtoms() < query.num_atoms || target->getNumBonds() < query.num_bonds) {
+    return 0;
+  }
+
+  return RDKit::SubstructMatch(*target, *query.mol, query.params).empty() ? 0 : 1;
+}
+
+static void mol_substruct_screened(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+{
+  int rc = SQLITE_OK;
+
+  bool use_chirality = false;
+  if (argc > 2) {
+    if (sqlite3_value_type(argv[2]) != SQLITE_INTEGER) {
+      sqlite3_result_error_code(ctx, SQLITE_MISMATCH);
+      return;
+    }
+    use_chirality = sqlite3_value_int(argv[2]) != 0;
+  }
+
+  SubstructQuery *query = (SubstructQuery *) sqlite3_get_auxdata(ctx, 1);
+  if (!query) {
+    query = arg_to_substruct_query(argv[1], use_chirality, &rc);
+    if (rc != SQLITE_OK) {
+      sqlite3_result_error_code(ctx, rc);
+      return;
+    }
+    sqlite3_set_auxdata(ctx, 1, (void *) query, free_substruct_query_auxdata);
+  }
+  else if (query->params.useChirality != use_chirality) {
+    /* the auxdata is only bound to the query argument, while the chirality
+    ** flag may change from one row to the next. the compiled query and its
+    ** fingerprint don't depend on it, and only the match parameters are
+    ** updated */
+    query->params.useChirality = use_chirality;
+  }
+
+  int result = 0;
+  try {
+    result = mol_substruct_screened_match(sqlite3_context_db_handle(ctx), argv[0], *query, &rc);
+  }
+  catch (...) {
+    rc = SQLITE_ERROR;
+    chemicalite_log(rc, "substructure match failed with an exception");
+  }
+
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error_code(ctx, rc);
+  }
+  else {
+    sqlite3_result_int(ctx, result);
+  }
+}
+
 int chemicalite_init_mol_compare(sqlite3 *db)
 {
   int rc = SQLITE_OK;
   if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_is_substruct", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<mol_compare<mol_is_substruct>>, 0, 0);
   if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_is_superstruct", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<mol_compare<mol_is_superstruct>>, 0, 0);
   if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_cmp", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<mol_compare<mol_cmp>>, 0, 0);
+  if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_cmp_key", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<mol_cmp_key>, 0, 0);
+  if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_substruct_screened", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<mol_substruct_screened>, 0, 0);
+  if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_substruct_screened", 3, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<mol_substruct_screened>, 0, 0);
   return rc;
 }
 
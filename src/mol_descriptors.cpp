@@ -1,3 +1,7 @@
+#include <cassert>
+#include <cstring>
+#include <memory>
+#include <string>
 #include <utility>
 
 #include <sqlite3ext.h>
@@ -9,6 +13,8 @@ extern const sqlite3_api_routines *sqlite3_api;
 #include "utils.hpp"
 #include "mol_descriptors.hpp"
 #include "mol.hpp"
+#include "map_function.hpp"
+#include "logging.hpp"
 
 
 template <typename F, F f>
@@ -17,7 +23,7 @@ static void mol_descriptor(sqlite3_context* ctx, int /*argc*/, sqlite3_value** a
   sqlite3_value *arg = argv[0];
 
   int rc = SQLITE_OK;
-  std::unique_ptr<RDKit::ROMol> mol(arg_to_romol(arg, &rc));
+  std::shared_ptr<const RDKit::ROMol> mol = arg_to_cached_mol_graph(sqlite3_context_db_handle(ctx), arg, &rc);
 
   if ( rc != SQLITE_OK ) {
     sqlite3_result_error_code(ctx, rc);
@@ -68,11 +74,327 @@ static double mol_logp(const RDKit::ROMol & mol)
 static int mol_num_atms(const RDKit::ROMol & mol) {return mol.getNumAtoms(false);}
 static int mol_num_hvyatms(const RDKit::ROMol & mol) {return mol.getNumAtoms(true);}
 
+/*
+** The number of heavy atoms may be precomputed by mol_with_cached_fps
+*/
+static void mol_num_hvyatms_cached(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+{
+  MolCachedFps fps;
+  if (arg_to_mol_cached_fps(argv[0], fps) == SQLITE_OK && fps.heavy_atoms >= 0) {
+    sqlite3_result_int(ctx, fps.heavy_atoms);
+  }
+  else {
+    mol_descriptor<decltype(&mol_num_hvyatms), &mol_num_hvyatms>(ctx, argc, argv);
+  }
+}
+
 static std::string mol_formula(const RDKit::ROMol & mol) {return RDKit::Descriptors::calcMolFormula(mol);}
 
 
 #define MOL_DESCRIPTOR(func) mol_descriptor<decltype(&func), &func>
 
+/*
+** mol_descriptor_table(mol) returns a single row, with a column for each of the
+** descriptors above. The molecule is decoded once, and each descriptor is only
+** computed if the corresponding column is read, e.g.:
+**
+**   SELECT t.id, d.amw, d.tpsa, d.logp FROM t, mol_descriptor_table(t.mol) d;
+**
+** All the descriptors are computed on the same molecule instance, so that the
+** intermediate results that RDKit retains on the molecule (e.g. the ring info,
+** or the Crippen and TPSA atom contributions) are shared.
+*/
+template <typename F, F f>
+static void descriptor_result(sqlite3_context* ctx, const RDKit::ROMol & mol)
+{
+  auto descriptor = f(mol);
+  sqlite3_result(ctx, descriptor);
+}
+
+#define DESCRIPTOR_RESULT(func) descriptor_result<decltype(&func), &func>
+
+template <typename F, F f>
+static void descriptor_map_result(MapValue & result, const RDKit::ROMol & mol)
+{
+  auto descriptor = f(mol);
+  map_result(result, descriptor);
+}
+
+#define DESCRIPTOR_MAP_RESULT(func) descriptor_map_result<decltype(&func), &func>
+
+struct MolDescriptorColumn {
+  const char * name;
+  void (*result)(sqlite3_context*, const RDKit::ROMol &);
+  void (*map_result)(MapValue &, const RDKit::ROMol &);
+};
+
+static const MolDescriptorColumn mol_descriptor_columns[] = {
+  {"amw", DESCRIPTOR_RESULT(mol_amw), DESCRIPTOR_MAP_RESULT(mol_amw)},
+  {"tpsa", DESCRIPTOR_RESULT(mol_tpsa), DESCRIPTOR_MAP_RESULT(mol_tpsa)},
+  {"fraction_csp3", DESCRIPTOR_RESULT(mol_fraction_csp3), DESCRIPTOR_MAP_RESULT(mol_fraction_csp3)},
+  {"hba", DESCRIPTOR_RESULT(mol_hba), DESCRIPTOR_MAP_RESULT(mol_hba)},
+  {"hbd", DESCRIPTOR_RESULT(mol_hbd), DESCRIPTOR_MAP_RESULT(mol_hbd)},
+  {"num_rotatable_bonds", DESCRIPTOR_RESULT(mol_num_rotatable_bonds), DESCRIPTOR_MAP_RESULT(mol_num_rotatable_bonds)},
+  {"num_hetatms", DESCRIPTOR_RESULT(mol_num_hetatms), DESCRIPTOR_MAP_RESULT(mol_num_hetatms)},
+  {"num_rings", DESCRIPTOR_RESULT(mol_num_rings), DESCRIPTOR_MAP_RESULT(mol_num_rings)},
+  {"num_aromatic_rings", DESCRIPTOR_RESULT(mol_num_aromatic_rings), DESCRIPTOR_MAP_RESULT(mol_num_aromatic_rings)},
+  {"num_aliphatic_rings", DESCRIPTOR_RESULT(mol_num_aliphatic_rings), DESCRIPTOR_MAP_RESULT(mol_num_aliphatic_rings)},
+  {"num_saturated_rings", DESCRIPTOR_RESULT(mol_num_saturated_rings), DESCRIPTOR_MAP_RESULT(mol_num_saturated_rings)},
+  {"chi0v", DESCRIPTOR_RESULT(mol_chi0v), DESCRIPTOR_MAP_RESULT(mol_chi0v)},
+  {"chi1v", DESCRIPTOR_RESULT(mol_chi1v), DESCRIPTOR_MAP_RESULT(mol_chi1v)},
+  {"chi2v", DESCRIPTOR_RESULT(mol_chi2v), DESCRIPTOR_MAP_RESULT(mol_chi2v)},
+  {"chi3v", DESCRIPTOR_RESULT(mol_chi3v), DESCRIPTOR_MAP_RESULT(mol_chi3v)},
+  {"chi4v", DESCRIPTOR_RESULT(mol_chi4v), DESCRIPTOR_MAP_RESULT(mol_chi4v)},
+  {"chi0n", DESCRIPTOR_RESULT(mol_chi0n), DESCRIPTOR_MAP_RESULT(mol_chi0n)},
+  {"chi1n", DESCRIPTOR_RESULT(mol_chi1n), DESCRIPTOR_MAP_RESULT(mol_chi1n)},
+  {"chi2n", DESCRIPTOR_RESULT(mol_chi2n), DESCRIPTOR_MAP_RESULT(mol_chi2n)},
+  {"chi3n", DESCRIPTOR_RESULT(mol_chi3n), DESCRIPTOR_MAP_RESULT(mol_chi3n)},
+  {"chi4n", DESCRIPTOR_RESULT(mol_chi4n), DESCRIPTOR_MAP_RESULT(mol_chi4n)},
+  {"kappa1", DESCRIPTOR_RESULT(mol_kappa1), DESCRIPTOR_MAP_RESULT(mol_kappa1)},
+  {"kappa2", DESCRIPTOR_RESULT(mol_kappa2), DESCRIPTOR_MAP_RESULT(mol_kappa2)},
+  {"kappa3", DESCRIPTOR_RESULT(mol_kappa3), DESCRIPTOR_MAP_RESULT(mol_kappa3)},
+  {"logp", DESCRIPTOR_RESULT(mol_logp), DESCRIPTOR_MAP_RESULT(mol_logp)},
+  {"num_atms", DESCRIPTOR_RESULT(mol_num_atms), DESCRIPTOR_MAP_RESULT(mol_num_atms)},
+  {"num_hvyatms", DESCRIPTOR_RESULT(mol_num_hvyatms), DESCRIPTOR_MAP_RESULT(mol_num_hvyatms)},
+  {"formula", DESCRIPTOR_RESULT(mol_formula), DESCRIPTOR_MAP_RESULT(mol_formula)},
+};
+
+static const int MOL_DESCRIPTOR_TABLE_MOLECULE_COLUMN = 
+  sizeof(mol_descriptor_columns) / sizeof(mol_descriptor_columns[0]);
+
+struct MolDescriptorTableVtab : public sqlite3_vtab {
+  sqlite3 *db;
+};
+
+static int molDescriptorTableConnect(sqlite3 *db, void */*pAux*/,
+                      int /*argc*/, const char * const */*argv*/,
+                      sqlite3_vtab **ppVTab,
+                      char **pzErr)
+{
+  std::string schema = "CREATE TABLE x(";
+  for (const auto & column: mol_descriptor_columns) {
+    schema += column.name;
+    schema += ", ";
+  }
+  schema += "molecule HIDDEN)";
+
+  int rc = sqlite3_declare_vtab(db, schema.c_str());
+
+  if (rc == SQLITE_OK) {
+    MolDescriptorTableVtab *vtab = new MolDescriptorTableVtab;
+    memset((sqlite3_vtab *)vtab, 0, sizeof(sqlite3_vtab));
+    vtab->db = db;
+    *ppVTab = vtab;
+  }
+  else {
+    *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+  }
+
+  return rc;
+}
+
+static int molDescriptorTableBestIndex(sqlite3_vtab */*pVTab*/, sqlite3_index_info *pIndexInfo)
+{
+  int molecule_index = -1;
+  for (int index = 0; index < pIndexInfo->nConstraint; ++index) {
+    if (pIndexInfo->aConstraint[index].usable == 0) {
+      continue;
+    }
+    if (pIndexInfo->aConstraint[index].iColumn == MOL_DESCRIPTOR_TABLE_MOLECULE_COLUMN &&
+        pIndexInfo->aConstraint[index].op == SQLITE_INDEX_CONSTRAINT_EQ) {
+      molecule_index = index;
+    }
+  }
+  if (molecule_index < 0) {
+    // The input molecule is not available, or it's not usable,
+    // This plan is therefore unusable.
+    return SQLITE_CONSTRAINT;
+  }
+  pIndexInfo->idxNum = 1; // Not really meaningful a this time
+  pIndexInfo->aConstraintUsage[molecule_index].argvIndex = 1; // will be argv[0] for xFilter
+  pIndexInfo->aConstraintUsage[molecule_index].omit = 1; // no need for SQLite to verify
+  pIndexInfo->estimatedCost = 10000;
+  return SQLITE_OK;
+}
+
+static int molDescriptorTableDisconnect(sqlite3_vtab *pVTab)
+{
+  delete (MolDescriptorTableVtab *)pVTab;
+  return SQLITE_OK;
+}
+
+struct MolDescriptorTableCursor : public sqlite3_vtab_cursor {
+  std::shared_ptr<const RDKit::ROMol> mol;
+  sqlite3_value *molecule = nullptr;  /* the input value of the hidden column */
+};
+
+static int molDescriptorTableOpen(sqlite3_vtab */*pVTab*/, sqlite3_vtab_cursor **ppCursor)
+{
+  int rc = SQLITE_OK;
+  MolDescriptorTableCursor *pCsr = new MolDescriptorTableCursor;
+  *ppCursor = (sqlite3_vtab_cursor *)pCsr;
+  return rc;
+}
+
+static int molDescriptorTableClose(sqlite3_vtab_cursor *pCursor)
+{
+  MolDescriptorTableCursor *p = (MolDescriptorTableCursor *)pCursor;
+  sqlite3_value_free(p->molecule);
+  delete p;
+  return SQLITE_OK;
+}
+
+static int molDescriptorTableFilter(sqlite3_vtab_cursor *pCursor, int /*idxNum*/, const char */*idxStr*/,
+                     int argc, sqlite3_value **argv)
+{
+  MolDescriptorTableCursor *p = (MolDescriptorTableCursor *)pCursor;
+  sqlite3 *db = ((MolDescriptorTableVtab *)pCursor->pVtab)->db;
+
+  if (argc != 1) {
+    return SQLITE_ERROR;
+  }
+
+  p->mol.reset();
+  sqlite3_value_free(p->molecule);
+  p->molecule = nullptr;
+
+  // a NULL molecule results in an empty table
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    return SQLITE_OK;
+  }
+
+  int rc = SQLITE_OK;
+  p->mol = arg_to_cached_mol_graph(db, argv[0], &rc);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  p->molecule = sqlite3_value_dup(argv[0]);
+  if (!p->molecule) {
+    p->mol.reset();
+    return SQLITE_NOMEM;
+  }
+
+  return rc;
+}
+
+static int molDescriptorTableNext(sqlite3_vtab_cursor *pCursor)
+{
+  MolDescriptorTableCursor *p = (MolDescriptorTableCursor *)pCursor;
+  p->mol.reset();
+  return SQLITE_OK;
+}
+
+static int molDescriptorTableEof(sqlite3_vtab_cursor *pCursor)
+{
+  MolDescriptorTableCursor *p = (MolDescriptorTableCursor *)pCursor;
+  return p->mol ? 0 : 1;
+}
+
+static int molDescriptorTableColumn(sqlite3_vtab_cursor *pCursor, sqlite3_context *ctx, int N)
+{
+  MolDescriptorTableCursor *p = (MolDescriptorTableCursor *)pCursor;
+
+  if (N == MOL_DESCRIPTOR_TABLE_MOLECULE_COLUMN) {
+    sqlite3_result_value(ctx, p->molecule);
+    return SQLITE_OK;
+  }
+
+  if (N < 0 || N > MOL_DESCRIPTOR_TABLE_MOLECULE_COLUMN) {
+    assert(!"unexpected column number");
+    sqlite3_result_null(ctx);
+    return SQLITE_OK;
+  }
+
+  try {
+    mol_descriptor_columns[N].result(ctx, *p->mol);
+  }
+  catch (...) {
+    chemicalite_log(
+      SQLITE_ERROR, "computation of descriptor %s failed", mol_descriptor_columns[N].name);
+    sqlite3_result_error_code(ctx, SQLITE_ERROR);
+  }
+
+  return SQLITE_OK;
+}
+
+static int molDescriptorTableRowid(sqlite3_vtab_cursor */*pCursor*/, sqlite_int64 *pRowid)
+{
+  *pRowid = 1;
+  return SQLITE_OK;
+}
+
+/*
+** The mol_descriptor_table module, implemented as an eponymous virtual table
+*/
+static sqlite3_module molDescriptorTableModule = {
+#if SQLITE_VERSION_NUMBER >= 3044000
+  4,                           /* iVersion */
+#else
+  3,                           /* iVersion */
+#endif
+  0,                           /* xCreate - create a table */ /* null because eponymous-only */
+  molDescriptorTableConnect,   /* xConnect - connect to an existing table */
+  molDescriptorTableBestIndex, /* xBestIndex - Determine search strategy */
+  molDescriptorTableDisconnect,/* xDisconnect - Disconnect from a table */
+  0,                           /* xDestroy - Drop a table */
+  molDescriptorTableOpen,      /* xOpen - open a cursor */
+  molDescriptorTableClose,     /* xClose - close a cursor */
+  molDescriptorTableFilter,    /* xFilter - configure scan constraints */
+  molDescriptorTableNext,      /* xNext - advance a cursor */
+  molDescriptorTableEof,       /* xEof */
+  molDescriptorTableColumn,    /* xColumn - read data */
+  molDescriptorTableRowid,     /* xRowid - read data */
+  0,                           /* xUpdate - write data */
+  0,                           /* xBegin - begin transaction */
+  0,                           /* xSync - sync transaction */
+  0,                           /* xCommit - commit transaction */
+  0,                           /* xRollback - rollback transaction */
+  0,                           /* xFindFunction - function overloading */
+  0,                           /* xRename - rename the table */
+  0,                           /* xSavepoint */
+  0,                           /* xRelease */
+  0,                           /* xRollbackTo */
+  0                            /* xShadowName */
+#if SQLITE_VERSION_NUMBER >= 3044000
+  ,
+  0                            /* xIntegrity */
+#endif
+};
+
+/*
+** The descriptors are also available to chemicalite_map and chemicalite_import,
+** under the same names as the scalar functions (e.g. 'mol_tpsa').
+*/
+MolMapResult mol_descriptor_map_result(const std::string & name)
+{
+  for (const auto & column: mol_descriptor_columns) {
+    if (name == std::string("mol_") + column.name) {
+      return column.map_result;
+    }
+  }
+  return nullptr;
+}
+
+MapFunction mol_descriptors_map_function(const std::string & name)
+{
+  MolMapResult map_result = mol_descriptor_map_result(name);
+  if (!map_result) {
+    return MapFunction();
+  }
+  return [map_result](const std::vector<MapValue> & args, MapValue & result) {
+    if (args.size() != 1) {
+      return SQLITE_MISMATCH;
+    }
+    int rc = SQLITE_OK;
+    std::unique_ptr<RDKit::ROMol> mol(map_arg_to_romol(args[0], &rc));
+    if (rc == SQLITE_OK) {
+      map_result(result, *mol);
+    }
+    return rc;
+  };
+}
+
 int chemicalite_init_mol_descriptors(sqlite3 *db)
 {
   int rc = SQLITE_OK;
@@ -110,9 +432,16 @@ int chemicalite_init_mol_descriptors(sqlite3 *db)
   if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_logp", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<MOL_DESCRIPTOR(mol_logp)>, 0, 0);
 
   if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_num_atms", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<MOL_DESCRIPTOR(mol_num_atms)>, 0, 0);
-  if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_num_hvyatms", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<MOL_DESCRIPTOR(mol_num_hvyatms)>, 0, 0);
+  if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_num_hvyatms", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<mol_num_hvyatms_cached>, 0, 0);
 
   if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_formula", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<MOL_DESCRIPTOR(mol_formula)>, 0, 0);
 
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_create_module_v2(db, "mol_descriptor_table", &molDescriptorTableModule, 
+				  0,  /* Client data for xCreate/xConnect */
+				  0   /* Module destructor function */
+				  );
+  }
+
   return rc;
 }
@@ -8,8 +8,19 @@ extern const sqlite3_api_routines *sqlite3_api;
 #include "utils.hpp"
 #include "mol_fmcs.hpp"
 #include "mol.hpp"
+#include "logging.hpp"
 
-void mol_fmcs_step(sqlite3_context* ctx, int, sqlite3_value** argv)
+/*
+** The state of the mol_find_mcs aggregate: the input molecules, and the
+** search parameters (as json) if passed as the second argument.
+*/
+struct MolFmcsAggregate {
+  std::vector<RDKit::ROMOL_SPTR> mols;
+  bool has_params = false;
+  std::string params;
+};
+
+void mol_fmcs_step(sqlite3_context* ctx, int argc, sqlite3_value** argv)
 {
   int rc = SQLITE_OK;
   
@@ -24,10 +35,21 @@ void mol_fmcs_step(sqlite3_context* ctx, int, sqlite3_value** argv)
 
   if (agg) {
     if (!*agg) {
-      *agg = (void *) new std::vector<RDKit::ROMOL_SPTR>;
+      MolFmcsAggregate *state = new MolFmcsAggregate;
+      if (argc > 1 && sqlite3_value_type(argv[1]) != SQLITE_NULL) {
+        if (sqlite3_value_type(argv[1]) != SQLITE_TEXT) {
+          delete state;
+          sqlite3_result_error_code(ctx, SQLITE_MISMATCH);
+          chemicalite_log(SQLITE_MISMATCH, "mcs params arg must be of type text");
+          return;
+        }
+        state->has_params = true;
+        state->params = (const char *) sqlite3_value_text(argv[1]);
+      }
+      *agg = (void *) state;
     }
-    std::vector<RDKit::ROMOL_SPTR> *mols = (std::vector<RDKit::ROMOL_SPTR> *) *agg;
-    mols->push_back(mol);
+    MolFmcsAggregate *state = (MolFmcsAggregate *) *agg;
+    state->mols.push_back(mol);
   }  
 }
 
@@ -37,10 +59,41 @@ void mol_fmcs_final(sqlite3_context * ctx)
 
   if (agg) {
     if (!*agg) {
-      *agg = (void *) new std::vector<RDKit::ROMOL_SPTR>;
+      *agg = (void *) new MolFmcsAggregate;
+    }
+    std::unique_ptr<MolFmcsAggregate> state((MolFmcsAggregate *) *agg);
+    *agg = nullptr;
+
+    RDKit::MCSParameters params;
+    if (state->has_params) {
+      try {
+        RDKit::parseMCSParametersJSON(state->params.c_str(), &params);
+      }
+      catch (...) {
+        sqlite3_result_error_code(ctx, SQLITE_ERROR);
+        chemicalite_log(SQLITE_ERROR, "could not parse mcs params arg: '%s'", state->params.c_str());
+        return;
+      }
+    }
+
+    RDKit::MCSResult results;
+    try {
+      results = findMCS(state->mols, &params);
+    }
+    catch (...) {
+      sqlite3_result_error_code(ctx, SQLITE_ERROR);
+      chemicalite_log(SQLITE_ERROR, "mcs search failed with an exception");
+      return;
+    }
+    if (results.Canceled) {
+      /* the search timed out, the result is the largest MCS found so far */
+      chemicalite_log(SQLITE_WARNING, "mcs search reached the timeout (%u seconds)", params.Timeout);
+    }
+
+    if (!results.QueryMol) {
+      sqlite3_result_null(ctx);
+      return;
     }
-    std::vector<RDKit::ROMOL_SPTR> *mols = (std::vector<RDKit::ROMOL_SPTR> *) *agg;
-    RDKit::MCSResult results = findMCS(*mols);
 
 #if 0
     sqlite3_result_text(ctx, results.SmartsString.c_str(), -1, SQLITE_TRANSIENT);
@@ -78,5 +131,10 @@ int chemicalite_init_mol_fmcs(sqlite3 *db)
     0  // void(*xDestroy)(void*)
   );
 
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_create_window_function(
+      db, "mol_find_mcs", 2, SQLITE_UTF8, 0, mol_fmcs_step, mol_fmcs_final, 0, 0, 0);
+  }
+
   return rc;
 }
@@ -88,7 +88,7 @@ static void mol_to_smiles(sqlite3_context* ctx, int /*argc*/, sqlite3_value** ar
   sqlite3_value *arg = argv[0];
 
   int rc = SQLITE_OK;
-  std::unique_ptr<RDKit::ROMol> mol(arg_to_romol(arg, &rc));
+  std::shared_ptr<const RDKit::ROMol> mol = arg_to_cached_mol_graph(sqlite3_context_db_handle(ctx), arg, &rc);
 
   if ( rc != SQLITE_OK ) {
     sqlite3_result_error_code(ctx, rc);
@@ -153,7 +153,7 @@ static void mol_to_smarts(sqlite3_context* ctx, int /*argc*/, sqlite3_value** ar
   sqlite3_value *arg = argv[0];
 
   int rc = SQLITE_OK;
-  std::unique_ptr<RDKit::ROMol> mol(arg_to_romol(arg, &rc));
+  std::shared_ptr<const RDKit::ROMol> mol = arg_to_cached_mol_graph(sqlite3_context_db_handle(ctx), arg, &rc);
 
   if ( rc != SQLITE_OK ) {
     sqlite3_result_error_code(ctx, rc);
@@ -218,7 +218,7 @@ static void mol_to_molblock(sqlite3_context* ctx, int /*argc*/, sqlite3_value**
   sqlite3_value *arg = argv[0];
 
   int rc = SQLITE_OK;
-  std::unique_ptr<RDKit::ROMol> mol(arg_to_romol(arg, &rc));
+  std::shared_ptr<const RDKit::ROMol> mol = arg_to_cached_mol_graph(sqlite3_context_db_handle(ctx), arg, &rc);
 
   if ( rc != SQLITE_OK ) {
     sqlite3_result_error_code(ctx, rc);
@@ -1,3 +1,5 @@
+#include <initializer_list>
+
 #include <sqlite3ext.h>
 extern const sqlite3_api_routines *sqlite3_api;
 
@@ -25,6 +27,127 @@ static void mol_hash(sqlite3_context* ctx, int /*argc*/, sqlite3_value** argv)
   }
 }
 
+static int exec_sql(sqlite3 *db, char *sql)
+{
+  if (!sql) {
+    return SQLITE_NOMEM;
+  }
+  int rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+  sqlite3_free(sql);
+  return rc;
+}
+
+/*
+** Connect an exact-match index to a mol column, e.g.:
+**
+**   SELECT mol_hash_link_index('compounds', 'mol', 'compounds_smiles', 'mol_hash_canonicalsmiles');
+**
+** The index is a plain table (created if needed) mapping the rowid of each
+** molecule to the value of the hash function, with a b-tree index on the hash
+** values. It's populated from the existing rows, and kept up to date by
+** triggers on the mol table. An exact-structure lookup is then a b-tree
+** search:
+**
+**   SELECT id FROM compounds_smiles WHERE hash = mol_hash_canonicalsmiles(?);
+*/
+static void mol_hash_link_index(sqlite3_context* ctx, int /*argc*/, sqlite3_value** argv)
+{
+  /* check arguments type */
+  if (sqlite3_value_type(argv[0]) != SQLITE_TEXT || // table
+      sqlite3_value_type(argv[1]) != SQLITE_TEXT || // column
+      sqlite3_value_type(argv[2]) != SQLITE_TEXT || // index
+      sqlite3_value_type(argv[3]) != SQLITE_TEXT) { // hash function
+    sqlite3_result_error_code(ctx, SQLITE_MISMATCH);
+    return;
+  }
+
+  sqlite3 *db = sqlite3_context_db_handle(ctx);
+  const char *table = (const char *)sqlite3_value_text(argv[0]);
+  const char *column = (const char *)sqlite3_value_text(argv[1]);
+  const char *index = (const char *)sqlite3_value_text(argv[2]);
+  const char *hash_function = (const char *)sqlite3_value_text(argv[3]);
+
+  int rc = exec_sql(db, sqlite3_mprintf(
+    "CREATE TABLE IF NOT EXISTS \"%w\"(id INTEGER PRIMARY KEY, hash TEXT NOT NULL)",
+    index));
+
+  if (rc == SQLITE_OK) rc = exec_sql(db, sqlite3_mprintf(
+    "CREATE INDEX IF NOT EXISTS \"%w_hash\" ON \"%w\"(hash)",
+    index, index));
+
+  if (rc == SQLITE_OK) rc = exec_sql(db, sqlite3_mprintf(
+    "INSERT OR REPLACE INTO \"%w\"(id, hash) "
+    "SELECT ROWID, \"%w\"(\"%w\") FROM \"%w\" WHERE \"%w\" IS NOT NULL",
+    index, hash_function, column, table, column));
+
+  if (rc == SQLITE_OK) rc = exec_sql(db, sqlite3_mprintf(
+    "CREATE TRIGGER '%q_insert_%q_%q' AFTER INSERT ON \"%w\"\n"
+    "FOR EACH ROW WHEN NEW.\"%w\" IS NOT NULL BEGIN\n"
+    "INSERT INTO \"%w\"(id, hash) VALUES (NEW.ROWID, \"%w\"(NEW.\"%w\"));\n"
+    "END;",
+    index, table, column, table,
+    column,
+    index, hash_function, column));
+
+  if (rc == SQLITE_OK) rc = exec_sql(db, sqlite3_mprintf(
+    "CREATE TRIGGER '%q_update_%q_%q' AFTER UPDATE ON \"%w\"\n"
+    "FOR EACH ROW BEGIN\n"
+    "DELETE FROM \"%w\" WHERE id = OLD.ROWID;\n"
+    "INSERT INTO \"%w\"(id, hash) SELECT NEW.ROWID, \"%w\"(NEW.\"%w\") WHERE NEW.\"%w\" IS NOT NULL;\n"
+    "END;",
+    index, table, column, table,
+    index,
+    index, hash_function, column, column));
+
+  if (rc == SQLITE_OK) rc = exec_sql(db, sqlite3_mprintf(
+    "CREATE TRIGGER '%q_delete_%q_%q' AFTER DELETE ON \"%w\"\n"
+    "FOR EACH ROW BEGIN\n"
+    "DELETE FROM \"%w\" WHERE id = OLD.ROWID;\n"
+    "END;",
+    index, table, column, table,
+    index));
+
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error_code(ctx, rc);
+  }
+  else {
+    sqlite3_result_int(ctx, 1);
+  }
+}
+
+/*
+** Disconnect an exact-match index from a mol column. The index table is
+** retained.
+*/
+static void mol_hash_unlink_index(sqlite3_context* ctx, int /*argc*/, sqlite3_value** argv)
+{
+  /* check arguments type */
+  if (sqlite3_value_type(argv[0]) != SQLITE_TEXT || // table
+      sqlite3_value_type(argv[1]) != SQLITE_TEXT || // column
+      sqlite3_value_type(argv[2]) != SQLITE_TEXT) { // index
+    sqlite3_result_error_code(ctx, SQLITE_MISMATCH);
+    return;
+  }
+
+  sqlite3 *db = sqlite3_context_db_handle(ctx);
+  const char *table = (const char *)sqlite3_value_text(argv[0]);
+  const char *column = (const char *)sqlite3_value_text(argv[1]);
+  const char *index = (const char *)sqlite3_value_text(argv[2]);
+
+  int rc = SQLITE_OK;
+  for (const char *op : {"insert", "update", "delete"}) {
+    if (rc == SQLITE_OK) rc = exec_sql(db, sqlite3_mprintf(
+      "DROP TRIGGER IF EXISTS '%q_%s_%q_%q'", index, op, table, column));
+  }
+
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error_code(ctx, rc);
+  }
+  else {
+    sqlite3_result_int(ctx, 1);
+  }
+}
+
 int chemicalite_init_mol_hash(sqlite3 *db)
 {
   int rc = SQLITE_OK;
@@ -45,5 +168,7 @@ int chemicalite_init_mol_hash(sqlite3 *db)
   if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_hash_smallworldindexbr", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<mol_hash<RDKit::MolHash::HashFunction::SmallWorldIndexBR>>, 0, 0);
   if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_hash_smallworldindexbrl", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<mol_hash<RDKit::MolHash::HashFunction::SmallWorldIndexBRL>>, 0, 0);
   if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_hash_arthorsubstructureorder", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<mol_hash<RDKit::MolHash::HashFunction::ArthorSubstructureOrder>>, 0, 0);
+  if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_hash_link_index", 4, SQLITE_UTF8, 0, mol_hash_link_index, 0, 0);
+  if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_hash_unlink_index", 3, SQLITE_UTF8, 0, mol_hash_unlink_index, 0, 0);
   return rc;
 }
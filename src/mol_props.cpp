@@ -110,7 +110,7 @@ static int molPropsFilter(sqlite3_vtab_cursor *pCursor, int /*idxNum*/, const ch
   sqlite3_value *arg = argv[0];
 
   int rc = SQLITE_OK;
-  std::unique_ptr<RDKit::ROMol> mol(arg_to_romol(arg, &rc));
+  std::unique_ptr<RDKit::RDProps> mol(arg_to_mol_props(arg, &rc));
 
   if (rc != SQLITE_OK) {
     return rc;
@@ -264,7 +264,7 @@ static void mol_has_prop(sqlite3_context* ctx, int /*argc*/, sqlite3_value** arg
   
   // the input molecule
   arg = argv[0];
-  std::unique_ptr<RDKit::ROMol> mol(arg_to_romol(arg, &rc));
+  std::unique_ptr<RDKit::RDProps> mol(arg_to_mol_props(arg, &rc));
   if ( rc != SQLITE_OK ) {
     sqlite3_result_error_code(ctx, rc);
     return;
@@ -284,7 +284,7 @@ static void mol_has_prop(sqlite3_context* ctx, int /*argc*/, sqlite3_value** arg
   sqlite3_result_int(ctx, it_does ? 1 : 0);
 }
 
-template <void (*F)(sqlite3_context*, const RDKit::ROMol &, const std::string &)>
+template <void (*F)(sqlite3_context*, const RDKit::RDProps &, const std::string &)>
 static void mol_get_prop(sqlite3_context* ctx, int /*argc*/, sqlite3_value** argv)
 {
   int rc = SQLITE_OK;
@@ -292,7 +292,7 @@ static void mol_get_prop(sqlite3_context* ctx, int /*argc*/, sqlite3_value** arg
   
   // the input molecule
   arg = argv[0];
-  std::unique_ptr<RDKit::ROMol> mol(arg_to_romol(arg, &rc));
+  std::unique_ptr<RDKit::RDProps> mol(arg_to_mol_props(arg, &rc));
   if ( rc != SQLITE_OK ) {
     sqlite3_result_error_code(ctx, rc);
     return;
@@ -323,21 +323,21 @@ static void mol_get_prop(sqlite3_context* ctx, int /*argc*/, sqlite3_value** arg
   }
 }
 
-static void mol_get_text_prop(sqlite3_context* ctx, const RDKit::ROMol & mol, const std::string & key)
+static void mol_get_text_prop(sqlite3_context* ctx, const RDKit::RDProps & mol, const std::string & key)
 {
   std::string value;
   mol.getProp(key, value);
   sqlite3_result_text(ctx, value.c_str(), -2, SQLITE_TRANSIENT);
 }
 
-static void mol_get_int_prop(sqlite3_context* ctx, const RDKit::ROMol & mol, const std::string & key)
+static void mol_get_int_prop(sqlite3_context* ctx, const RDKit::RDProps & mol, const std::string & key)
 {
   int value;
   mol.getProp(key, value);
   sqlite3_result_int(ctx, value);
 }
 
-static void mol_get_float_prop(sqlite3_context* ctx, const RDKit::ROMol & mol, const std::string & key)
+static void mol_get_float_prop(sqlite3_context* ctx, const RDKit::RDProps & mol, const std::string & key)
 {
   double value;
   mol.getProp(key, value);
@@ -8,6 +8,7 @@ extern const sqlite3_api_routines *sqlite3_api;
 #include "utils.hpp"
 #include "mol_standardize.hpp"
 #include "mol.hpp"
+#include "map_function.hpp"
 #include "logging.hpp"
 
 static void free_params_auxdata(void * aux)
@@ -158,6 +159,112 @@ void (*mol_charge_parent)(sqlite3_context*, int, sqlite3_value**) = strict<mol_p
 void (*mol_super_parent)(sqlite3_context*, int, sqlite3_value**) = strict<mol_parent<RDKit::MolStandardize::superParent>>;
 
 
+/*
+** The chemicalite_map implementations, with the same arguments as the scalar
+** functions. The update_params json is parsed for each input row.
+*/
+static int map_arg_to_params(
+  const std::vector<MapValue> & args, RDKit::MolStandardize::CleanupParameters & params)
+{
+  if (args.size() < 2) {
+    return SQLITE_OK;
+  }
+  if (args[1].type != SQLITE_TEXT) {
+    chemicalite_log(SQLITE_MISMATCH, "update_params arg must be of type text");
+    return SQLITE_MISMATCH;
+  }
+  std::string json(args[1].bytes.begin(), args[1].bytes.end());
+  try {
+    RDKit::MolStandardize::updateCleanupParamsFromJSON(params, json);
+  }
+  catch (...) {
+    chemicalite_log(SQLITE_ERROR, ("could not parse update_params arg: '" + json + "'").c_str());
+    return SQLITE_ERROR;
+  }
+  return SQLITE_OK;
+}
+
+static int map_mol_result(const RDKit::RWMol & mol, MapValue & result)
+{
+  int rc = SQLITE_OK;
+  Blob blob = mol_to_blob(mol, &rc);
+  if (rc == SQLITE_OK) {
+    map_result_blob(result, std::move(blob));
+  }
+  return rc;
+}
+
+template <MolStandardizerFunc F>
+static int mol_standardize_map(const std::vector<MapValue> & args, MapValue & result)
+{
+  if (args.empty() || args.size() > 2) {
+    return SQLITE_MISMATCH;
+  }
+
+  int rc = SQLITE_OK;
+  std::unique_ptr<RDKit::RWMol> mol_in(map_arg_to_rwmol(args[0], &rc));
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  RDKit::MolStandardize::CleanupParameters params = RDKit::MolStandardize::defaultCleanupParameters;
+  rc = map_arg_to_params(args, params);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  std::unique_ptr<RDKit::RWMol> mol_out(F(mol_in.get(), params));
+  return map_mol_result(*mol_out, result);
+}
+
+template <MolParentFunc F>
+static int mol_parent_map(const std::vector<MapValue> & args, MapValue & result)
+{
+  if (args.empty() || args.size() > 3) {
+    return SQLITE_MISMATCH;
+  }
+
+  int rc = SQLITE_OK;
+  std::unique_ptr<RDKit::RWMol> mol_in(map_arg_to_rwmol(args[0], &rc));
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  RDKit::MolStandardize::CleanupParameters params = RDKit::MolStandardize::defaultCleanupParameters;
+  rc = map_arg_to_params(args, params);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  bool skip_standardize = false;
+  if (args.size() > 2) {
+    if (args[2].type != SQLITE_INTEGER) {
+      chemicalite_log(SQLITE_MISMATCH, "skip_standardize arg must be of type INTEGER (bool)");
+      return SQLITE_MISMATCH;
+    }
+    skip_standardize = args[2].int_value;
+  }
+
+  std::unique_ptr<RDKit::RWMol> mol_out(F(*mol_in, params, skip_standardize));
+  return map_mol_result(*mol_out, result);
+}
+
+MapFunction mol_standardize_map_function(const std::string & name)
+{
+  if (name == "mol_cleanup") return mol_standardize_map<RDKit::MolStandardize::cleanup>;
+  if (name == "mol_normalize") return mol_standardize_map<RDKit::MolStandardize::normalize>;
+  if (name == "mol_reionize") return mol_standardize_map<RDKit::MolStandardize::reionize>;
+  if (name == "mol_remove_fragments") return mol_standardize_map<RDKit::MolStandardize::removeFragments>;
+  if (name == "mol_canonical_tautomer") return mol_standardize_map<RDKit::MolStandardize::canonicalTautomer>;
+  if (name == "mol_tautomer_parent") return mol_parent_map<RDKit::MolStandardize::tautomerParent>;
+  if (name == "mol_fragment_parent") return mol_parent_map<RDKit::MolStandardize::fragmentParent>;
+  if (name == "mol_stereo_parent") return mol_parent_map<RDKit::MolStandardize::stereoParent>;
+  if (name == "mol_isotope_parent") return mol_parent_map<RDKit::MolStandardize::isotopeParent>;
+  if (name == "mol_charge_parent") return mol_parent_map<RDKit::MolStandardize::chargeParent>;
+  if (name == "mol_super_parent") return mol_parent_map<RDKit::MolStandardize::superParent>;
+  return MapFunction();
+}
+
 int chemicalite_init_mol_standardize(sqlite3 *db)
 {
   int rc = SQLITE_OK;
@@ -16,9 +16,46 @@ extern const sqlite3_api_routines *sqlite3_api;
 #include "mol.hpp"
 #include "bfp.hpp"
 #include "mol_to_bfp.hpp"
+#include "map_function.hpp"
 #include "logging.hpp"
 
-template <ExplicitBitVect * (*F)(const RDKit::ROMol &, int), int DEFAULT_LENGTH>
+/*
+** Return a fingerprint precomputed by mol_with_cached_fps, if available
+** for the requested parameters.
+*/
+static void result_cached_bfp(sqlite3_context* ctx, std::string_view bfp)
+{
+  int rc = SQLITE_OK;
+  Blob blob = bfp_to_blob(std::string(bfp), &rc);
+
+  if (rc == SQLITE_OK) {
+    sqlite3_result_blob(ctx, blob.data(), blob.size(), SQLITE_TRANSIENT);
+  }
+  else {
+    sqlite3_result_error_code(ctx, rc);
+  }
+}
+
+static std::string_view cached_pattern_bfp(const MolCachedFps & fps, int length)
+{
+  if (fps.pattern_bfp.size()*8 == (size_t) length) {
+    return fps.pattern_bfp;
+  }
+  return std::string_view();
+}
+
+static std::string_view cached_morgan_bfp(const MolCachedFps & fps, int radius, int length)
+{
+  if (fps.morgan_radius == radius && fps.morgan_bfp.size()*8 == (size_t) length) {
+    return fps.morgan_bfp;
+  }
+  return std::string_view();
+}
+
+typedef std::string_view (*CachedBfp)(const MolCachedFps &, int);
+typedef std::string_view (*CachedMorganBfp)(const MolCachedFps &, int, int);
+
+template <ExplicitBitVect * (*F)(const RDKit::ROMol &, int), int DEFAULT_LENGTH, CachedBfp CACHED = nullptr>
 static void mol_to_bfp(sqlite3_context* ctx, int argc, sqlite3_value** argv)
 {
   int rc = SQLITE_OK;
@@ -30,7 +67,18 @@ static void mol_to_bfp(sqlite3_context* ctx, int argc, sqlite3_value** argv)
     pbfp = (std::string *) aux;
   }
   else {
-    std::unique_ptr<RDKit::ROMol> pmol(arg_to_romol(argv[0], &rc));
+    if (CACHED && argc > 1 && sqlite3_value_type(argv[1]) == SQLITE_INTEGER) {
+      MolCachedFps fps;
+      if (arg_to_mol_cached_fps(argv[0], fps) == SQLITE_OK) {
+        std::string_view cached = CACHED(fps, sqlite3_value_int(argv[1]));
+        if (!cached.empty()) {
+          result_cached_bfp(ctx, cached);
+          return;
+        }
+      }
+    }
+
+    std::shared_ptr<const RDKit::ROMol> pmol = arg_to_cached_mol_graph(sqlite3_context_db_handle(ctx), argv[0], &rc);
 
     if (rc == SQLITE_OK && argc > 1 && sqlite3_value_type(argv[1]) != SQLITE_INTEGER) {
       rc = SQLITE_MISMATCH;
@@ -118,7 +166,7 @@ static ExplicitBitVect * mol_pattern_bfp(const RDKit::ROMol & mol, int length)
   return RDKit::PatternFingerprintMol(mol, length);
 }
 
-template <ExplicitBitVect * (*F)(const RDKit::ROMol &, int, int), int DEFAULT_LENGTH>
+template <ExplicitBitVect * (*F)(const RDKit::ROMol &, int, int), int DEFAULT_LENGTH, CachedMorganBfp CACHED = nullptr>
 static void mol_to_morgan_bfp(sqlite3_context* ctx, int argc, sqlite3_value** argv)
 {
   int rc = SQLITE_OK;
@@ -130,7 +178,19 @@ static void mol_to_morgan_bfp(sqlite3_context* ctx, int argc, sqlite3_value** ar
     pbfp = (std::string *) aux;
   }
   else {
-    std::unique_ptr<RDKit::ROMol> pmol(arg_to_romol(argv[0], &rc));
+    if (CACHED && argc > 2 &&
+        sqlite3_value_type(argv[1]) == SQLITE_INTEGER && sqlite3_value_type(argv[2]) == SQLITE_INTEGER) {
+      MolCachedFps fps;
+      if (arg_to_mol_cached_fps(argv[0], fps) == SQLITE_OK) {
+        std::string_view cached = CACHED(fps, sqlite3_value_int(argv[1]), sqlite3_value_int(argv[2]));
+        if (!cached.empty()) {
+          result_cached_bfp(ctx, cached);
+          return;
+        }
+      }
+    }
+
+    std::shared_ptr<const RDKit::ROMol> pmol = arg_to_cached_mol_graph(sqlite3_context_db_handle(ctx), argv[0], &rc);
 
     if (rc == SQLITE_OK && sqlite3_value_type(argv[1]) != SQLITE_INTEGER) {
       rc = SQLITE_MISMATCH;
@@ -208,6 +268,171 @@ static constexpr const int DEFAULT_MORGAN_BFP_LENGTH = 512;
 static constexpr const int DEFAULT_HASHED_TORSION_BFP_LENGTH = 1024;
 static constexpr const int DEFAULT_HASHED_PAIR_BFP_LENGTH = 2048;
 
+/*
+** Serialize a molecule, together with its pattern and Morgan fingerprints and
+** the number of heavy atoms
+*/
+Blob mol_to_blob_with_cached_fps(const RDKit::ROMol & mol, int pattern_length,
+                                 int morgan_radius, int morgan_length, int * rc)
+{
+  std::string pattern_bfp;
+  std::string morgan_bfp;
+  MolCachedFps fps;
+
+  try {
+    std::unique_ptr<ExplicitBitVect> pattern_bv(mol_pattern_bfp(mol, pattern_length));
+    std::unique_ptr<ExplicitBitVect> morgan_bv(mol_morgan_bfp(mol, morgan_radius, morgan_length));
+    if (pattern_bv && morgan_bv) {
+      pattern_bfp = BitVectToBinaryText(*pattern_bv);
+      morgan_bfp = BitVectToBinaryText(*morgan_bv);
+      fps.heavy_atoms = mol.getNumAtoms(true);
+      fps.pattern_bfp = pattern_bfp;
+      fps.morgan_radius = morgan_radius;
+      fps.morgan_bfp = morgan_bfp;
+    }
+    else {
+      *rc = SQLITE_ERROR;
+      chemicalite_log(*rc, "bfp computation failed");
+    }
+  }
+  catch (...) {
+    *rc = SQLITE_ERROR;
+    chemicalite_log(*rc, "bfp computation failed with an exception");
+  }
+
+  if (*rc != SQLITE_OK) {
+    return Blob();
+  }
+
+  return mol_to_blob(mol, fps, rc);
+}
+
+/*
+** Return a copy of the input molecule that also stores its pattern and Morgan
+** fingerprints and the number of heavy atoms, so that mol_pattern_bfp,
+** mol_morgan_bfp and mol_num_hvyatms don't need to compute them again when
+** called with matching parameters.
+*/
+static void mol_with_cached_fps(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+{
+  int rc = SQLITE_OK;
+
+  for (int argn = 1; argn < argc; ++argn) {
+    if (sqlite3_value_type(argv[argn]) != SQLITE_INTEGER) {
+      sqlite3_result_error_code(ctx, SQLITE_MISMATCH);
+      return;
+    }
+  }
+
+  int pattern_length = (argc > 1) ? sqlite3_value_int(argv[1]) : DEFAULT_CACHED_PATTERN_BFP_LENGTH;
+  int morgan_radius = (argc > 2) ? sqlite3_value_int(argv[2]) : DEFAULT_CACHED_MORGAN_BFP_RADIUS;
+  int morgan_length = (argc > 3) ? sqlite3_value_int(argv[3]) : DEFAULT_CACHED_MORGAN_BFP_LENGTH;
+
+  std::unique_ptr<RDKit::ROMol> mol(arg_to_romol(argv[0], &rc));
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error_code(ctx, rc);
+    return;
+  }
+
+  Blob blob = mol_to_blob_with_cached_fps(*mol, pattern_length, morgan_radius, morgan_length, &rc);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error_code(ctx, rc);
+  }
+  else {
+    sqlite3_result_blob(ctx, blob.data(), blob.size(), SQLITE_TRANSIENT);
+  }
+}
+
+/*
+** The chemicalite_map implementations of the fingerprint functions, with the
+** same arguments as the scalar functions.
+*/
+static int map_bfp_result(ExplicitBitVect * (*compute)(const RDKit::ROMol &, int, int),
+                          const RDKit::ROMol & mol, int param, int length, MapValue & result)
+{
+  int rc = SQLITE_OK;
+  try {
+    std::unique_ptr<ExplicitBitVect> bv(compute(mol, param, length));
+    if (bv) {
+      Blob blob = bfp_to_blob(BitVectToBinaryText(*bv), &rc);
+      if (rc == SQLITE_OK) {
+        map_result_blob(result, std::move(blob));
+      }
+    }
+    else {
+      rc = SQLITE_ERROR;
+      chemicalite_log(rc, "bfp computation failed");
+    }
+  }
+  catch (...) {
+    rc = SQLITE_ERROR;
+    chemicalite_log(rc, "bfp computation failed with an exception");
+  }
+  return rc;
+}
+
+template <ExplicitBitVect * (*F)(const RDKit::ROMol &, int)>
+static ExplicitBitVect * ignore_param(const RDKit::ROMol & mol, int /*param*/, int length)
+{
+  return F(mol, length);
+}
+
+template <ExplicitBitVect * (*F)(const RDKit::ROMol &, int), int DEFAULT_LENGTH>
+static int mol_to_bfp_map(const std::vector<MapValue> & args, MapValue & result)
+{
+  if (args.empty() || args.size() > 2) {
+    return SQLITE_MISMATCH;
+  }
+  if (args.size() > 1 && args[1].type != SQLITE_INTEGER) {
+    return SQLITE_MISMATCH;
+  }
+
+  int rc = SQLITE_OK;
+  std::unique_ptr<RDKit::ROMol> mol(map_arg_to_romol(args[0], &rc));
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  int length = (args.size() > 1) ? (int) args[1].int_value : DEFAULT_LENGTH;
+  return map_bfp_result(ignore_param<F>, *mol, 0, length, result);
+}
+
+template <ExplicitBitVect * (*F)(const RDKit::ROMol &, int, int), int DEFAULT_LENGTH>
+static int mol_to_morgan_bfp_map(const std::vector<MapValue> & args, MapValue & result)
+{
+  if (args.size() < 2 || args.size() > 3) {
+    return SQLITE_MISMATCH;
+  }
+  for (size_t argn = 1; argn < args.size(); ++argn) {
+    if (args[argn].type != SQLITE_INTEGER) {
+      return SQLITE_MISMATCH;
+    }
+  }
+
+  int rc = SQLITE_OK;
+  std::unique_ptr<RDKit::ROMol> mol(map_arg_to_romol(args[0], &rc));
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  int radius = (int) args[1].int_value;
+  int length = (args.size() > 2) ? (int) args[2].int_value : DEFAULT_LENGTH;
+  return map_bfp_result(F, *mol, radius, length, result);
+}
+
+MapFunction mol_to_bfp_map_function(const std::string & name)
+{
+  if (name == "mol_layered_bfp") return mol_to_bfp_map<mol_layered_bfp, DEFAULT_LAYERED_BFP_LENGTH>;
+  if (name == "mol_rdkit_bfp") return mol_to_bfp_map<mol_rdkit_bfp, DEFAULT_LAYERED_BFP_LENGTH>;
+  if (name == "mol_atom_pairs_bfp") return mol_to_bfp_map<mol_atom_pairs_bfp, DEFAULT_HASHED_PAIR_BFP_LENGTH>;
+  if (name == "mol_topological_torsion_bfp") return mol_to_bfp_map<mol_topological_torsion_bfp, DEFAULT_HASHED_TORSION_BFP_LENGTH>;
+  if (name == "mol_maccs_bfp") return mol_to_bfp_map<mol_maccs_bfp, -1>;
+  if (name == "mol_pattern_bfp") return mol_to_bfp_map<mol_pattern_bfp, DEFAULT_SSS_BFP_LENGTH>;
+  if (name == "mol_morgan_bfp") return mol_to_morgan_bfp_map<mol_morgan_bfp, DEFAULT_MORGAN_BFP_LENGTH>;
+  if (name == "mol_feat_morgan_bfp") return mol_to_morgan_bfp_map<mol_feat_morgan_bfp, DEFAULT_MORGAN_BFP_LENGTH>;
+  return MapFunction();
+}
+
 /*
 ** build a simple bitstring (mostly for testing)
 ** [this is not actually a mol -> bfp constructor]
@@ -258,14 +483,17 @@ int chemicalite_init_mol_to_bfp(sqlite3 *db)
   if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_maccs_bfp", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<mol_to_bfp<mol_maccs_bfp, -1>>, 0, 0);
 
   //if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_pattern_bfp", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<mol_to_bfp<mol_pattern_bfp, DEFAULT_SSS_BFP_LENGTH>>, 0, 0);
-  if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_pattern_bfp", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<mol_to_bfp<mol_pattern_bfp, DEFAULT_SSS_BFP_LENGTH>>, 0, 0);
+  if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_pattern_bfp", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<mol_to_bfp<mol_pattern_bfp, DEFAULT_SSS_BFP_LENGTH, cached_pattern_bfp>>, 0, 0);
 
   //if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_morgan_bfp", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<mol_to_morgan_bfp<mol_morgan_bfp, DEFAULT_MORGAN_BFP_LENGTH>>, 0, 0);
-  if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_morgan_bfp", 3, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<mol_to_morgan_bfp<mol_morgan_bfp, DEFAULT_MORGAN_BFP_LENGTH>>, 0, 0);
+  if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_morgan_bfp", 3, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<mol_to_morgan_bfp<mol_morgan_bfp, DEFAULT_MORGAN_BFP_LENGTH, cached_morgan_bfp>>, 0, 0);
 
   //if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_feat_morgan_bfp", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<mol_to_morgan_bfp<mol_feat_morgan_bfp, DEFAULT_MORGAN_BFP_LENGTH>>, 0, 0);
   if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_feat_morgan_bfp", 3, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<mol_to_morgan_bfp<mol_feat_morgan_bfp, DEFAULT_MORGAN_BFP_LENGTH>>, 0, 0);
 
+  if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_with_cached_fps", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<mol_with_cached_fps>, 0, 0);
+  if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "mol_with_cached_fps", 4, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<mol_with_cached_fps>, 0, 0);
+
   if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "bfp_dummy", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, strict<bfp_dummy>, 0, 0);
 
   return rc;
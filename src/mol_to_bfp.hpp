@@ -1,6 +1,26 @@
 #ifndef CHEMICALITE_MOL_TO_BFP_INCLUDED
 #define CHEMICALITE_MOL_TO_BFP_INCLUDED
+#include "utils.hpp"
+
+namespace RDKit
+{
+  class ROMol;
+} // namespace RDKit
 
 int chemicalite_init_mol_to_bfp(sqlite3 *db);
 
+/*
+** The default parameters of the fingerprints stored by mol_with_cached_fps
+*/
+static constexpr const int DEFAULT_CACHED_PATTERN_BFP_LENGTH = 2048;
+static constexpr const int DEFAULT_CACHED_MORGAN_BFP_RADIUS = 2;
+static constexpr const int DEFAULT_CACHED_MORGAN_BFP_LENGTH = 2048;
+
+/*
+** Serialize a molecule with the same precomputed values stored by
+** mol_with_cached_fps. Thread-safe, also used by chemicalite_import.
+*/
+Blob mol_to_blob_with_cached_fps(const RDKit::ROMol & mol, int pattern_length,
+                                 int morgan_radius, int morgan_length, int * rc);
+
 #endif
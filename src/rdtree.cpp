@@ -144,6 +144,69 @@ static int rdtreeRename(sqlite3_vtab *vtab, const char *newname)
   return rdtree->rename(newname);
 }
 
+/* 
+** RDtree virtual table module xBegin method.
+*/
+static int rdtreeBegin(sqlite3_vtab *vtab)
+{
+  RDtreeVtab *rdtree = (RDtreeVtab *)vtab;
+  return rdtree->begin();
+}
+
+/* 
+** RDtree virtual table module xSync method.
+*/
+static int rdtreeSync(sqlite3_vtab *vtab)
+{
+  RDtreeVtab *rdtree = (RDtreeVtab *)vtab;
+  return rdtree->sync();
+}
+
+/* 
+** RDtree virtual table module xCommit method.
+*/
+static int rdtreeCommit(sqlite3_vtab *vtab)
+{
+  RDtreeVtab *rdtree = (RDtreeVtab *)vtab;
+  return rdtree->commit();
+}
+
+/* 
+** RDtree virtual table module xRollback method.
+*/
+static int rdtreeRollback(sqlite3_vtab *vtab)
+{
+  RDtreeVtab *rdtree = (RDtreeVtab *)vtab;
+  return rdtree->rollback();
+}
+
+/* 
+** RDtree virtual table module xSavepoint method.
+*/
+static int rdtreeSavepoint(sqlite3_vtab *vtab, int savepoint)
+{
+  RDtreeVtab *rdtree = (RDtreeVtab *)vtab;
+  return rdtree->savepoint(savepoint);
+}
+
+/* 
+** RDtree virtual table module xRelease method.
+*/
+static int rdtreeRelease(sqlite3_vtab *vtab, int savepoint)
+{
+  RDtreeVtab *rdtree = (RDtreeVtab *)vtab;
+  return rdtree->release(savepoint);
+}
+
+/* 
+** RDtree virtual table module xRollbackTo method.
+*/
+static int rdtreeRollbackTo(sqlite3_vtab *vtab, int savepoint)
+{
+  RDtreeVtab *rdtree = (RDtreeVtab *)vtab;
+  return rdtree->rollback_to(savepoint);
+}
+
 
 static sqlite3_module rdtreeModule = {
 #if SQLITE_VERSION_NUMBER >= 3044000
@@ -164,15 +227,15 @@ static sqlite3_module rdtreeModule = {
   rdtreeColumn,                /* xColumn - read data */
   rdtreeRowid,                 /* xRowid - read data */
   rdtreeUpdate,                /* xUpdate - write data */
-  0,                           /* xBegin - begin transaction */
-  0,                           /* xSync - sync transaction */
-  0,                           /* xCommit - commit transaction */
-  0,                           /* xRollback - rollback transaction */
+  rdtreeBegin,                 /* xBegin - begin transaction */
+  rdtreeSync,                  /* xSync - sync transaction */
+  rdtreeCommit,                /* xCommit - commit transaction */
+  rdtreeRollback,              /* xRollback - rollback transaction */
   0,                           /* xFindFunction - function overloading */
   rdtreeRename,                /* xRename - rename the table */
-  0,                           /* xSavepoint */
-  0,                           /* xRelease */
-  0,                           /* xRollbackTo */
+  rdtreeSavepoint,             /* xSavepoint */
+  rdtreeRelease,               /* xRelease */
+  rdtreeRollbackTo,            /* xRollbackTo */
   0                            /* xShadowName */
 #if SQLITE_VERSION_NUMBER >= 3044000
   ,
@@ -428,7 +491,7 @@ static void rdtree_subset(sqlite3_context* ctx, int /*argc*/, sqlite3_value** ar
 {
   int rc = SQLITE_OK;
   sqlite3_value *arg = argv[0];
-  std::string bfp = arg_to_bfp(arg, &rc);
+  std::string_view bfp = arg_to_bfp_view(arg, &rc);
 
   if (rc != SQLITE_OK) {
     sqlite3_result_error_code(ctx, rc);
@@ -449,7 +512,7 @@ static void rdtree_tanimoto(sqlite3_context* ctx, int /*argc*/, sqlite3_value**
   int rc = SQLITE_OK;
 
   /* The first argument should be a bfp */
-  std::string bfp = arg_to_bfp(argv[0], &rc);
+  std::string_view bfp = arg_to_bfp_view(argv[0], &rc);
 
   if (rc != SQLITE_OK) {
     sqlite3_result_error_code(ctx, rc);
@@ -473,14 +536,82 @@ static void rdtree_tanimoto(sqlite3_context* ctx, int /*argc*/, sqlite3_value**
   sqlite3_result_blob(ctx, blob.data(), blob.size(), SQLITE_TRANSIENT);
 }
 
+/*
+** Remove the tombstoned records from an rdtree table. The schema containing
+** the table can be passed as the first argument.
+*/
+static void rdtree_compact(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+{
+  for (int i = 0; i < argc; ++i) {
+    if (sqlite3_value_type(argv[i]) != SQLITE_TEXT) {
+      sqlite3_result_error_code(ctx, SQLITE_MISMATCH);
+      return;
+    }
+  }
+
+  sqlite3 *db = sqlite3_context_db_handle(ctx);
+  RDtreeRegistry *registry = (RDtreeRegistry *)sqlite3_user_data(ctx);
+  const char *schema = (argc > 1) ? (const char *)sqlite3_value_text(argv[0]) : nullptr;
+  const char *table = (const char *)sqlite3_value_text(argv[argc-1]);
+
+  RDtreeVtab *rdtree = RDtreeVtab::lookup(db, registry, schema, table);
+  if (!rdtree) {
+    sqlite3_result_error(ctx, "no such rdtree table", -1);
+    return;
+  }
+
+  int compacted = 0;
+  int rc = rdtree->compact(&compacted);
+
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error_code(ctx, rc);
+  }
+  else {
+    sqlite3_result_int(ctx, compacted);
+  }
+}
+
+/*
+** Return the traversal counters collected by the last rdtree query as json
+*/
+static void rdtree_last_query_stats(sqlite3_context* ctx, int /*argc*/, sqlite3_value** /*argv*/)
+{
+  RDtreeRegistry *registry = (RDtreeRegistry *)sqlite3_user_data(ctx);
+  const RDtreeQueryStats & stats = registry->last_query_stats;
+
+  char *result = sqlite3_mprintf(
+    "{\"nodes_acquired\": %lld, \"cache_hits\": %lld, "
+    "\"internal_tested\": %lld, \"internal_pruned\": %lld, "
+    "\"leaf_tested\": %lld, \"leaf_accepted\": %lld, "
+    "\"initialize_ms\": %.3f}",
+    stats.nodes_acquired, stats.cache_hits,
+    stats.internal_tested, stats.internal_pruned,
+    stats.leaf_tested, stats.leaf_accepted,
+    stats.initialize_ms);
+
+  if (!result) {
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+
+  sqlite3_result_text(ctx, result, -1, sqlite3_free);
+}
+
+static void rdtree_registry_destroy(void *registry)
+{
+  delete (RDtreeRegistry *)registry;
+}
+
 int chemicalite_init_rdtree(sqlite3 *db)
 {
   int rc = SQLITE_OK;
 
+  RDtreeRegistry *registry = new RDtreeRegistry;
+
   if (rc == SQLITE_OK) {
     rc = sqlite3_create_module_v2(db, "rdtree", &rdtreeModule, 
-				0,  /* Client data for xCreate/xConnect */
-				0   /* Module destructor function */
+				registry,  /* Client data for xCreate/xConnect */
+				rdtree_registry_destroy   /* Module destructor function */
 				);
   }
 
@@ -490,6 +621,9 @@ int chemicalite_init_rdtree(sqlite3 *db)
   if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "rdtree_link_index", 5, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, rdtree_link_index, 0, 0);
   if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "rdtree_link_index", 6, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, rdtree_link_index, 0, 0);
   if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "rdtree_unlink_index", 3, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, rdtree_unlink_index, 0, 0);
+  if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "rdtree_compact", 1, SQLITE_UTF8, registry, rdtree_compact, 0, 0);
+  if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "rdtree_compact", 2, SQLITE_UTF8, registry, rdtree_compact, 0, 0);
+  if (rc == SQLITE_OK) rc = sqlite3_create_function(db, "rdtree_last_query_stats", 0, SQLITE_UTF8, registry, rdtree_last_query_stats, 0, 0);
 
   return rc;
 }
\ No newline at end of file
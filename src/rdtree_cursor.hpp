@@ -9,6 +9,19 @@ extern const sqlite3_api_routines *sqlite3_api;
 class RDtreeNode;
 class RDtreeConstraint;
 
+/*
+** Counters collected while a cursor traverses the rd-tree structure.
+*/
+struct RDtreeQueryStats {
+  sqlite3_int64 nodes_acquired = 0;   /* Nodes loaded while descending the tree */
+  sqlite3_int64 cache_hits = 0;       /* ...of which already available in memory */
+  sqlite3_int64 internal_tested = 0;  /* Internal items tested against the constraints */
+  sqlite3_int64 internal_pruned = 0;  /* ...of which discarded */
+  sqlite3_int64 leaf_tested = 0;      /* Leaf items tested against the constraints */
+  sqlite3_int64 leaf_accepted = 0;    /* ...of which returned */
+  double initialize_ms = 0.;          /* Time spent initializing the constraints */
+};
+
 /* 
 ** Structure to store a deserialized rd-tree record.
 */
@@ -20,6 +33,7 @@ public:
   int item;                         /* Index of current item in pNode */
   int strategy;                     /* Copy of idxNum search parameter */
   Constraints constraints;          /* Search constraints. */
+  RDtreeQueryStats stats;           /* Traversal counters */
 };
 
 #endif
\ No newline at end of file
@@ -26,7 +26,7 @@
 */
 
 RDtreeNode::RDtreeNode(RDtreeVtab *vtab_, RDtreeNode *parent_)
-  : vtab(vtab_), parent(parent_), nodeid(0), n_ref(1), dirty(false),
+  : vtab(vtab_), parent(parent_), nodeid(0), n_ref(1), dirty(false), pinned(false),
     data(vtab_->node_bytes, 0)
 {
 }
@@ -48,6 +48,7 @@ int RDtreeNode::get_size() const
 */
 void RDtreeNode::zero()
 {
+  vtab->node_save(this, false);
   memset(&data.data()[2], 0, vtab->node_bytes-2);
   dirty = true;
 }
@@ -124,11 +125,28 @@ void RDtreeNode::get_item(int idx, RDtreeItem *item) const
   item->max.assign(max, max+vtab->bfp_bytes);
 }
 
+/*
+** Compute the bounds of the node content (i.e. the item that should
+** reference this node in its parent). The node is expected to be non-empty.
+*/
+void RDtreeNode::get_bounds(RDtreeItem *bounds) const
+{
+  int node_size = get_size();
+  get_item(0, bounds);
+  for (int ii = 1; ii < node_size; ii++) {
+    RDtreeItem item(vtab->bfp_bytes);
+    get_item(ii, &item);
+    bounds->extend_bounds(item);
+  }
+  bounds->rowid = nodeid;
+}
+
 /*
 ** Overwrite item idx of node with the contents of item.
 */
 void RDtreeNode::overwrite_item(int idx, RDtreeItem *item)
 {
+  vtab->node_save(this, false);
   uint8_t *p = &data.data()[4 + vtab->item_bytes*idx];
   p += write_uint64(p, item->rowid);
   p += write_uint16(p, item->min_weight);
@@ -144,6 +162,7 @@ void RDtreeNode::overwrite_item(int idx, RDtreeItem *item)
 */
 void RDtreeNode::delete_item(int idx)
 {
+  vtab->node_save(this, false);
   uint8_t *dst = &data.data()[4 + vtab->item_bytes*idx];
   uint8_t *src = dst + vtab->item_bytes;
   int bytes = (get_size() - idx - 1) * vtab->item_bytes;
@@ -164,6 +183,8 @@ int RDtreeNode::insert_item(RDtreeItem *item)
   assert(node_size <= vtab->node_capacity);
 
   if (node_size < vtab->node_capacity) {
+    vtab->node_save(this, false);
+
     // Insert the new item, while preserving the ordering within the
     // node.
 
@@ -24,6 +24,7 @@ public:
   const uint8_t * get_bfp(int item) const;
   const uint8_t * get_max(int item) const;
   void get_item(int idx, RDtreeItem *item) const;
+  void get_bounds(RDtreeItem *bounds) const;
   void overwrite_item(int idx, RDtreeItem *item);
   void delete_item(int idx);
   int insert_item(RDtreeItem *item);
@@ -37,6 +38,7 @@ public:
   sqlite3_int64 nodeid;
   int n_ref;
   bool dirty;
+  bool pinned;
   Blob data;
 };
 
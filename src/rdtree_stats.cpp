@@ -0,0 +1,528 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <sqlite3ext.h>
+extern const sqlite3_api_routines *sqlite3_api;
+
+#include "utils.hpp"
+#include "rowsvecvtab.hpp"
+#include "rdtree_stats.hpp"
+#include "rdtree_vtab.hpp"
+#include "bfp_ops.hpp"
+
+/*
+** rdtree_stats('table') reports, for each level of an rd-tree index, some
+** statistics that are useful to evaluate the quality of the tree structure.
+** The schema containing the table can be passed as the first argument, as
+** in rdtree_stats('schema', 'table').
+** The data is read from the shadow tables, and it therefore doesn't include
+** the changes that were not written yet by an ongoing transaction.
+**
+**   height            0 for the leaf nodes, the tree depth for the root
+**   nodes             number of nodes at this level
+**   items             number of items stored in these nodes, excluding the
+**                     tombstoned records
+**   tombstones        number of tombstoned records (leaf level only)
+**   avg_fill          average ratio between the number of items in a node
+**                     and its capacity
+**   avg_union_weight  average popcount of the union of the node items
+**   pruning_power     estimated fraction of the items at this level that are
+**                     discarded by a substructure (subset) query
+**
+** The pruning power assumes a query of average weight, with bits drawn
+** independently according to the bit frequencies in the %_bitfreq table.
+** The tombstoned records are still stored in the leaf nodes until the table
+** is compacted, and they contribute to the bounds of the parent nodes.
+*/
+static const int RDTREE_STATS_ARG1_COLUMN = 7;
+static const int RDTREE_STATS_ARG2_COLUMN = 8;
+
+struct RDtreeLevelStats {
+  int height;
+  int nodes;
+  sqlite3_int64 items;
+  sqlite3_int64 tombstones;
+  double avg_fill;
+  double avg_union_weight;
+  double pruning_power;
+};
+
+struct RDtreeStatsVtab : public sqlite3_vtab {
+  sqlite3 *db;
+};
+
+static int rdtreeStatsConnect(sqlite3 *db, void */*pAux*/,
+                      int /*argc*/, const char * const */*argv*/,
+                      sqlite3_vtab **ppVTab,
+                      char **pzErr)
+{
+  // the hidden columns are the arguments of the table-valued function,
+  // either (table) or (schema, table)
+  int rc = sqlite3_declare_vtab(db, "CREATE TABLE x("
+    "height INTEGER, "
+    "nodes INTEGER, "
+    "items INTEGER, "
+    "tombstones INTEGER, "
+    "avg_fill REAL, "
+    "avg_union_weight REAL, "
+    "pruning_power REAL, "
+    "arg1 HIDDEN, "
+    "arg2 HIDDEN"
+    ")");
+
+  if (rc == SQLITE_OK) {
+    RDtreeStatsVtab *vtab = new RDtreeStatsVtab;
+    memset((sqlite3_vtab *)vtab, 0, sizeof(sqlite3_vtab));
+    vtab->db = db;
+    *ppVTab = vtab;
+  }
+  else {
+    *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+  }
+
+  return rc;
+}
+
+static int rdtreeStatsBestIndex(sqlite3_vtab */*pVTab*/, sqlite3_index_info *pIndexInfo)
+{
+  int arg1_index = -1;
+  int arg2_index = -1;
+  bool arg2_unusable = false;
+  for (int index = 0; index < pIndexInfo->nConstraint; ++index) {
+    int column = pIndexInfo->aConstraint[index].iColumn;
+    if (column != RDTREE_STATS_ARG1_COLUMN && column != RDTREE_STATS_ARG2_COLUMN) {
+      continue;
+    }
+    if (pIndexInfo->aConstraint[index].usable == 0 ||
+        pIndexInfo->aConstraint[index].op != SQLITE_INDEX_CONSTRAINT_EQ) {
+      arg2_unusable = arg2_unusable || column == RDTREE_STATS_ARG2_COLUMN;
+      continue;
+    }
+    if (column == RDTREE_STATS_ARG1_COLUMN) {
+      arg1_index = index;
+    }
+    else {
+      arg2_index = index;
+    }
+  }
+  if (arg1_index < 0 || arg2_unusable) {
+    // The rdtree table name is not available, or it's not usable,
+    // This plan is therefore unusable.
+    return SQLITE_CONSTRAINT;
+  }
+  pIndexInfo->idxNum = 1; // the number of arguments
+  pIndexInfo->aConstraintUsage[arg1_index].argvIndex = 1; // will be argv[0] for xFilter
+  pIndexInfo->aConstraintUsage[arg1_index].omit = 1; // no need for SQLite to verify
+  if (arg2_index >= 0) {
+    pIndexInfo->idxNum = 2;
+    pIndexInfo->aConstraintUsage[arg2_index].argvIndex = 2;
+    pIndexInfo->aConstraintUsage[arg2_index].omit = 1;
+  }
+  pIndexInfo->estimatedCost = 10000;
+  return SQLITE_OK;
+}
+
+static int rdtreeStatsDisconnect(sqlite3_vtab *pVTab)
+{
+  delete (RDtreeStatsVtab *)pVTab;
+  return SQLITE_OK;
+}
+
+using RDtreeStatsCursor = RowsVecCursor<RDtreeLevelStats>;
+
+/*
+** Read the frequency of each bit position, and the average weight of the
+** stored fingerprints.
+*/
+static int read_frequencies(
+  sqlite3 *db, const char *schema, const char *rdtree,
+  std::vector<double> & bitfreq, double *avg_weight)
+{
+  char *sql = sqlite3_mprintf(
+    "SELECT bitno, freq FROM \"%w\".\"%w_bitfreq\" ORDER BY bitno", schema, rdtree);
+  if (!sql) {
+    return SQLITE_NOMEM;
+  }
+  sqlite3_stmt *stmt = 0;
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  bitfreq.clear();
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    bitfreq.push_back((double) sqlite3_column_int64(stmt, 1));
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    return rc;
+  }
+
+  sql = sqlite3_mprintf(
+    "SELECT SUM(weight*freq), SUM(freq) FROM \"%w\".\"%w_weightfreq\"", schema, rdtree);
+  if (!sql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  *avg_weight = 0.;
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    double count = sqlite3_column_double(stmt, 1);
+    if (count > 0.) {
+      *avg_weight = sqlite3_column_double(stmt, 0) / count;
+    }
+    rc = SQLITE_OK;
+  }
+  sqlite3_finalize(stmt);
+
+  return rc;
+}
+
+/*
+** Read the rowids of the tombstoned records. The %_tombstone table only
+** exists if the rd-tree was created with the OPT_TOMBSTONE_DELETE option.
+*/
+static int read_tombstones(
+  sqlite3 *db, const char *schema, const char *rdtree,
+  std::unordered_set<sqlite3_int64> & tombstones)
+{
+  tombstones.clear();
+
+  char *sql = sqlite3_mprintf(
+    "SELECT 1 FROM \"%w\".sqlite_master "
+    "WHERE type = 'table' AND name = '%q_tombstone' COLLATE NOCASE", schema, rdtree);
+  if (!sql) {
+    return SQLITE_NOMEM;
+  }
+  sqlite3_stmt *stmt = 0;
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if (rc == SQLITE_DONE) {
+    return SQLITE_OK;
+  }
+  else if (rc != SQLITE_ROW) {
+    return rc;
+  }
+
+  sql = sqlite3_mprintf("SELECT rowid FROM \"%w\".\"%w_tombstone\"", schema, rdtree);
+  if (!sql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    tombstones.insert(sqlite3_column_int64(stmt, 0));
+  }
+  sqlite3_finalize(stmt);
+
+  return (rc == SQLITE_DONE) ? SQLITE_OK : rc;
+}
+
+/*
+** Read the content of node nodeid.
+*/
+static int read_node(sqlite3_stmt *stmt, sqlite3_int64 nodeid, Blob & data)
+{
+  sqlite3_bind_int64(stmt, 1, nodeid);
+  int rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    const uint8_t *blob = (const uint8_t *)sqlite3_column_blob(stmt, 0);
+    int bytes = sqlite3_column_bytes(stmt, 0);
+    data.assign(blob, blob + bytes);
+    rc = SQLITE_OK;
+  }
+  else if (rc == SQLITE_DONE) {
+    rc = SQLITE_CORRUPT_VTAB;
+  }
+  sqlite3_reset(stmt);
+  return rc;
+}
+
+/*
+** Visit the tree one level at a time, starting from the root, and collect
+** the statistics of each level.
+*/
+static int read_level_stats(
+  sqlite3 *db, const char *schema, const char *rdtree,
+  std::vector<RDtreeLevelStats> & rows)
+{
+  std::vector<double> bitfreq;
+  double avg_weight = 0.;
+  int rc = read_frequencies(db, schema, rdtree, bitfreq, &avg_weight);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  std::unordered_set<sqlite3_int64> tombstones;
+  rc = read_tombstones(db, schema, rdtree, tombstones);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  int bfp_bytes = bitfreq.size()/8;
+  int item_bytes = 8 /* row id */ + 4 /* min/max weight */ + 2*bfp_bytes /* bfp + max */; 
+
+  double total_freq = 0.;
+  for (auto freq: bitfreq) {
+    total_freq += freq;
+  }
+
+  char *sql = sqlite3_mprintf(
+    "SELECT data FROM \"%w\".\"%w_node\" WHERE nodeno = ?1", schema, rdtree);
+  if (!sql) {
+    return SQLITE_NOMEM;
+  }
+  sqlite3_stmt *stmt = 0;
+  rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  Blob data;
+  rc = read_node(stmt, 1, data);
+
+  int depth = 0;
+  int node_capacity = 0;
+  if (rc == SQLITE_OK) {
+    if (data.size() < 4 || bfp_bytes == 0) {
+      rc = SQLITE_CORRUPT_VTAB;
+    }
+    else {
+      depth = read_uint16(data.data());
+      node_capacity = (data.size() - 4)/item_bytes;
+    }
+  }
+
+  std::vector<sqlite3_int64> level_nodes = {1};
+  Blob node_union(bfp_bytes);
+
+  for (int height = depth; rc == SQLITE_OK && height >= 0; --height) {
+    RDtreeLevelStats stats = {height, 0, 0, 0, 0., 0., 0.};
+    std::vector<sqlite3_int64> child_nodes;
+
+    for (auto nodeid: level_nodes) {
+      rc = read_node(stmt, nodeid, data);
+      if (rc != SQLITE_OK) {
+        break;
+      }
+      int node_size = read_uint16(&data.data()[2]);
+      if (node_size > node_capacity) {
+        rc = SQLITE_CORRUPT_VTAB;
+        break;
+      }
+
+      int node_items = 0;
+      std::fill(node_union.begin(), node_union.end(), 0);
+      for (int ii = 0; ii < node_size; ++ii) {
+        const uint8_t *item = &data.data()[4 + item_bytes*ii];
+        const uint8_t *bfp = item + 12;
+        sqlite3_int64 id = (sqlite3_int64) read_uint64(item);
+        if (height > 0) {
+          child_nodes.push_back(id);
+        }
+        else if (tombstones.count(id) > 0) {
+          ++stats.tombstones;
+          continue;
+        }
+        ++node_items;
+        bfp_op_union(bfp_bytes, node_union.data(), bfp);
+
+        // the probability that a query bit falls within the item's bfp
+        double item_freq = 0.;
+        for (int bitno = 0; bitno < bfp_bytes*8; ++bitno) {
+          if (bfp[bitno/8] & (1 << (bitno%8))) {
+            item_freq += bitfreq[bitno];
+          }
+        }
+        double p_bit = total_freq > 0. ? item_freq/total_freq : 1.;
+        stats.pruning_power += 1. - pow(p_bit, avg_weight);
+      }
+
+      ++stats.nodes;
+      stats.items += node_items;
+      stats.avg_fill += node_capacity > 0 ? (double)node_items/node_capacity : 0.;
+      stats.avg_union_weight += bfp_op_weight(bfp_bytes, node_union.data());
+    }
+
+    if (rc == SQLITE_OK) {
+      if (stats.items > 0) {
+        stats.pruning_power /= stats.items;
+      }
+      if (stats.nodes > 0) {
+        stats.avg_fill /= stats.nodes;
+        stats.avg_union_weight /= stats.nodes;
+      }
+      rows.push_back(stats);
+    }
+
+    level_nodes.swap(child_nodes);
+  }
+
+  sqlite3_finalize(stmt);
+
+  return rc;
+}
+
+static int rdtreeStatsFilter(sqlite3_vtab_cursor *pCursor, int /*idxNum*/, const char */*idxStr*/,
+                     int argc, sqlite3_value **argv)
+{
+  RDtreeStatsCursor *p = (RDtreeStatsCursor *)pCursor;
+  sqlite3_vtab *vtab = pCursor->pVtab;
+  sqlite3 *db = ((RDtreeStatsVtab *)vtab)->db;
+
+  p->index = 0;
+  p->rows.clear();
+
+  if (argc < 1 || argc > 2) {
+    return SQLITE_ERROR;
+  }
+
+  for (int ii = 0; ii < argc; ++ii) {
+    if (sqlite3_value_type(argv[ii]) != SQLITE_TEXT) {
+      sqlite3_free(vtab->zErrMsg);
+      vtab->zErrMsg = sqlite3_mprintf("rdtree_stats expects TEXT arguments");
+      return SQLITE_MISMATCH;
+    }
+  }
+
+  const char *rdtree = (const char *)sqlite3_value_text(argv[argc-1]);
+
+  std::string schema;
+  int rc = SQLITE_OK;
+  if (argc > 1) {
+    schema = (const char *)sqlite3_value_text(argv[0]);
+  }
+  else {
+    rc = RDtreeVtab::find_table_schema(db, rdtree, &schema);
+    if (rc == SQLITE_NOTFOUND) {
+      rc = SQLITE_ERROR;
+      sqlite3_free(vtab->zErrMsg);
+      vtab->zErrMsg = sqlite3_mprintf("no such rdtree table: %s", rdtree);
+      return rc;
+    }
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = read_level_stats(db, schema.c_str(), rdtree, p->rows);
+  }
+
+  if (rc != SQLITE_OK) {
+    p->rows.clear();
+    sqlite3_free(vtab->zErrMsg);
+    if ((rc & 0xff) == SQLITE_CORRUPT) {
+      vtab->zErrMsg = sqlite3_mprintf("the rdtree table %s is corrupt", rdtree);
+    }
+    else {
+      vtab->zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    }
+  }
+
+  return rc;
+}
+
+static int rdtreeStatsColumn(sqlite3_vtab_cursor *pCursor, sqlite3_context *ctx, int N)
+{
+  RDtreeStatsCursor * p = (RDtreeStatsCursor *)pCursor;
+  assert(p->index < p->rows.size());
+  const RDtreeLevelStats & stats = p->rows[p->index];
+
+  switch (N) {
+    case 0:
+      sqlite3_result_int(ctx, stats.height);
+      break;
+    case 1:
+      sqlite3_result_int(ctx, stats.nodes);
+      break;
+    case 2:
+      sqlite3_result_int64(ctx, stats.items);
+      break;
+    case 3:
+      sqlite3_result_int64(ctx, stats.tombstones);
+      break;
+    case 4:
+      sqlite3_result_double(ctx, stats.avg_fill);
+      break;
+    case 5:
+      sqlite3_result_double(ctx, stats.avg_union_weight);
+      break;
+    case 6:
+      sqlite3_result_double(ctx, stats.pruning_power);
+      break;
+    default:
+      assert(!"unexpected column number");
+      sqlite3_result_null(ctx);
+  }
+  return SQLITE_OK;
+}
+
+/*
+** The rdtree stats module, implementing rdtree_stats as an eponymous virtual table
+*/
+static sqlite3_module rdtreeStatsModule = {
+#if SQLITE_VERSION_NUMBER >= 3044000
+  4,                           /* iVersion */
+#else
+  3,                           /* iVersion */
+#endif
+  0,                           /* xCreate - create a table */ /* null because eponymous-only */
+  rdtreeStatsConnect,          /* xConnect - connect to an existing table */
+  rdtreeStatsBestIndex,        /* xBestIndex - Determine search strategy */
+  rdtreeStatsDisconnect,       /* xDisconnect - Disconnect from a table */
+  0,                           /* xDestroy - Drop a table */
+  rowsVecOpen<RDtreeStatsCursor>,  /* xOpen - open a cursor */
+  rowsVecClose<RDtreeStatsCursor>, /* xClose - close a cursor */
+  rdtreeStatsFilter,           /* xFilter - configure scan constraints */
+  rowsVecNext<RDtreeStatsCursor>,  /* xNext - advance a cursor */
+  rowsVecEof<RDtreeStatsCursor>,   /* xEof */
+  rdtreeStatsColumn,           /* xColumn - read data */
+  rowsVecRowid<RDtreeStatsCursor>, /* xRowid - read data */
+  0,                           /* xUpdate - write data */
+  0,                           /* xBegin - begin transaction */
+  0,                           /* xSync - sync transaction */
+  0,                           /* xCommit - commit transaction */
+  0,                           /* xRollback - rollback transaction */
+  0,                           /* xFindFunction - function overloading */
+  0,                           /* xRename - rename the table */
+  0,                           /* xSavepoint */
+  0,                           /* xRelease */
+  0,                           /* xRollbackTo */
+  0                            /* xShadowName */
+#if SQLITE_VERSION_NUMBER >= 3044000
+  ,
+  0                            /* xIntegrity */
+#endif
+};
+
+int chemicalite_init_rdtree_stats(sqlite3 *db)
+{
+  int rc = SQLITE_OK;
+
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_create_module_v2(db, "rdtree_stats", &rdtreeStatsModule, 
+				  0,  /* Client data for xCreate/xConnect */
+				  0   /* Module destructor function */
+				  );
+  }
+
+  return rc;
+}
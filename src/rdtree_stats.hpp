@@ -0,0 +1,6 @@
+#ifndef CHEMICALITE_RDTREE_STATS_INCLUDED
+#define CHEMICALITE_RDTREE_STATS_INCLUDED
+
+int chemicalite_init_rdtree_stats(sqlite3 *db);
+
+#endif
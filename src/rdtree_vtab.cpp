@@ -1,5 +1,8 @@
+#include <algorithm>
+#include <chrono>
 #include <cassert>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <cmath>
 #include <vector>
@@ -13,6 +16,8 @@
 
 #include "bfp.hpp"
 #include "bfp_ops.hpp"
+#include "settings.hpp"
+#include "logging.hpp"
 
 /*
 ** Database Format of RD-Tree Tables
@@ -33,6 +38,18 @@
 ** And for each row of data in the table, there is an entry in the %_rowid
 ** table that maps from the entries rowid to the id of the node that it
 ** is stored on.
+**
+** If the table is created with the OPT_NO_PARENT_TABLE option, the %_parent
+** table is omitted. The parent of a node is then only tracked in memory, and
+** when it's not known (e.g. when deleting a record from a leaf node located
+** via the %_rowid table), it's determined by a search from the root node,
+** guided by the bounds of the node content.
+**
+** If the table is created with the OPT_TOMBSTONE_DELETE option, deleted
+** records are not immediately removed from the tree. Their rowids are
+** instead stored in the %_tombstone table, and the records are skipped
+** during the table scans. The tombstoned records are finally removed
+** from the tree by the rdtree_compact() SQL function.
 */
 
 const int RDtreeVtab::RDTREE_MAX_BITSTRING_SIZE = 256;
@@ -51,20 +68,33 @@ const int RDtreeVtab::RDTREE_MAX_BITSTRING_SIZE = 256;
 */
 const int RDtreeVtab::RDTREE_MAX_DEPTH = 64;
 
-//static const unsigned int RDTREE_FLAGS_UNASSIGNED = 0; /* not currently used */
+/*
+** Upper bounds to the amount of pending changes that are retained in memory
+** during a write transaction. When either limit is exceeded at the end of
+** an xUpdate call, the pending changes are flushed to the database ahead
+** of xSync. The limits are generous enough to coalesce the writes to the
+** upper levels of the tree over many inserted items, while keeping the
+** memory usage bounded during large bulk loads.
+*/
+const int RDtreeVtab::RDTREE_MAX_PINNED_NODES = 2048;
+const int RDtreeVtab::RDTREE_MAX_PENDING_MAPPINGS = 65536;
+
+const unsigned int RDtreeVtab::RDTREE_FLAGS_UNASSIGNED = 0;
+const unsigned int RDtreeVtab::RDTREE_FLAGS_NO_PARENT_TABLE = 1;
+const unsigned int RDtreeVtab::RDTREE_FLAGS_TOMBSTONE_DELETE = 2;
 
 int RDtreeVtab::create(
-  sqlite3 *db, void */*paux*/, int argc, const char *const*argv, 
+  sqlite3 *db, void *paux, int argc, const char *const*argv, 
   sqlite3_vtab **pvtab, char **err)
 {
-  return init(db, argc, argv, pvtab, err, 1);
+  return init(db, (RDtreeRegistry *)paux, argc, argv, pvtab, err, 1);
 }
 
 int RDtreeVtab::connect(
-  sqlite3 *db, void */*paux*/, int argc, const char *const*argv, 
+  sqlite3 *db, void *paux, int argc, const char *const*argv, 
   sqlite3_vtab **pvtab, char **err)
 {
-  return init(db, argc, argv, pvtab, err, 0);
+  return init(db, (RDtreeRegistry *)paux, argc, argv, pvtab, err, 0);
 }
 
 /* 
@@ -74,10 +104,10 @@ int RDtreeVtab::connect(
 **   argv[0]   -> module name
 **   argv[1]   -> database name
 **   argv[2]   -> table name
-**   argv[...] -> columns spec...
+**   argv[...] -> columns spec, followed by the optional flags
 */
 int RDtreeVtab::init(
-  sqlite3 *db, int argc, const char *const*argv, 
+  sqlite3 *db, RDtreeRegistry *registry, int argc, const char *const*argv, 
   sqlite3_vtab **pvtab, char **err, int is_create)
 {
   /* perform arg checking */
@@ -86,9 +116,9 @@ int RDtreeVtab::init(
                              "two column definitions are required.");
     return SQLITE_ERROR;
   }
-  if (argc > 6) {
+  if (argc > 7) {
     *err = sqlite3_mprintf("wrong number of arguments. "
-                             "at most one optional argument is expected.");
+                             "at most two optional arguments are expected.");
     return SQLITE_ERROR;
   }
 
@@ -119,11 +149,18 @@ int RDtreeVtab::init(
     return SQLITE_ERROR;
   }
 
-  /* unsigned int flags = RDTREE_FLAGS_UNASSIGNED; */ // unused
-  if (argc == 6) {
-    /* no configuration flags/options are supported at this time */
-    *err = sqlite3_mprintf("unrecognized option: %s", argv[5]);
-    return SQLITE_ERROR;
+  unsigned int flags = RDTREE_FLAGS_UNASSIGNED;
+  for (int ii = 5; ii < argc; ++ii) {
+    if (!strcmp(argv[ii], "OPT_NO_PARENT_TABLE")) {
+      flags |= RDTREE_FLAGS_NO_PARENT_TABLE;
+    }
+    else if (!strcmp(argv[ii], "OPT_TOMBSTONE_DELETE")) {
+      flags |= RDTREE_FLAGS_TOMBSTONE_DELETE;
+    }
+    else {
+      *err = sqlite3_mprintf("unrecognized option: %s", argv[ii]);
+      return SQLITE_ERROR;
+    }
   }
 
   sqlite3_vtab_config(db, SQLITE_VTAB_CONSTRAINT_SUPPORT, 1);
@@ -136,7 +173,14 @@ int RDtreeVtab::init(
   rdtree->db = db;
   rdtree->bfp_bytes = bfp_bytes;
   rdtree->item_bytes = 8 /* row id */ + 4 /* min/max weight */ + 2*bfp_bytes /* bfp + max */; 
+  rdtree->flags = flags;
   rdtree->n_ref = 1;
+  rdtree->registry = nullptr;
+  rdtree->tombstones_loaded = false;
+  rdtree->deferred_writes = false;
+  rdtree->pending_changes = false;
+  rdtree->bitfreq_delta.assign(bfp_bytes*8, 0);
+  rdtree->weightfreq_delta.assign(bfp_bytes*8 + 1, 0);
 
   /* Figure out the node size to use. */
   int rc = rdtree->get_node_bytes(is_create);
@@ -179,6 +223,10 @@ int RDtreeVtab::init(
   }
 
   if (rc==SQLITE_OK) {
+    if (registry) {
+      registry->tables.push_back(rdtree);
+      rdtree->registry = registry;
+    }
     *pvtab = (sqlite3_vtab *)rdtree;
   }
   else {
@@ -188,6 +236,96 @@ int RDtreeVtab::init(
   return rc;
 }
 
+/*
+** Find the schema where an unqualified table name is resolved: the temp
+** schema is searched first, then main, then the attached databases.
+** Return SQLITE_NOTFOUND if no such table exists.
+*/
+int RDtreeVtab::find_table_schema(sqlite3 *db, const char *table_name, std::string *db_name)
+{
+  std::vector<std::string> schemas;
+  sqlite3_stmt *stmt = nullptr;
+  int rc = sqlite3_prepare_v2(
+    db, "SELECT name FROM pragma_database_list ORDER BY seq <> 1, seq", -1, &stmt, 0);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    schemas.push_back((const char *)sqlite3_column_text(stmt, 0));
+  }
+  rc = sqlite3_finalize(stmt);
+
+  for (const std::string & schema: schemas) {
+    if (rc != SQLITE_OK) {
+      break;
+    }
+    char *sql = sqlite3_mprintf(
+      "SELECT 1 FROM \"%w\".sqlite_master WHERE type = 'table' AND name = %Q COLLATE NOCASE",
+      schema.c_str(), table_name);
+    if (!sql) {
+      return SQLITE_NOMEM;
+    }
+    stmt = nullptr;
+    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+    sqlite3_free(sql);
+    if (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+      *db_name = schema;
+      return sqlite3_finalize(stmt);
+    }
+    int rc2 = sqlite3_finalize(stmt);
+    if (rc == SQLITE_OK) {
+      rc = rc2;
+    }
+  }
+
+  return (rc == SQLITE_OK) ? SQLITE_NOTFOUND : rc;
+}
+
+/*
+** Find the connected rd-tree table with the given schema and name (the
+** table is connected first if needed). If db_name is null, the table is
+** looked up in the schema where SQLite would resolve the unqualified name.
+** Return a null pointer if no such rd-tree table exists.
+*/
+RDtreeVtab * RDtreeVtab::lookup(
+  sqlite3 *db, RDtreeRegistry *registry, const char *db_name, const char *table_name)
+{
+  std::string schema;
+  if (db_name) {
+    schema = db_name;
+  }
+  else if (find_table_schema(db, table_name, &schema) != SQLITE_OK) {
+    return nullptr;
+  }
+
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    for (auto vtab: registry->tables) {
+      if (!sqlite3_stricmp(vtab->db_name.c_str(), schema.c_str()) &&
+          !sqlite3_stricmp(vtab->table_name.c_str(), table_name)) {
+        return vtab;
+      }
+    }
+    if (attempt == 0) {
+      /* Preparing a statement that references the table is sufficient to
+      ** trigger the xConnect method, if the table wasn't already in use.
+      */
+      char *sql = sqlite3_mprintf(
+        "SELECT 1 FROM \"%w\".\"%w\" LIMIT 0", schema.c_str(), table_name);
+      if (!sql) {
+        break;
+      }
+      sqlite3_stmt *stmt = nullptr;
+      int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+      sqlite3_finalize(stmt);
+      sqlite3_free(sql);
+      if (rc != SQLITE_OK) {
+        break;
+      }
+    }
+  }
+  return nullptr;
+}
+
 /* utility function used twice in get_node_bytes here below */
 static int select_int(sqlite3 * db, const char *query, int *value)
 {
@@ -264,7 +402,6 @@ int RDtreeVtab::sql_init(int is_create)
     char *create 
       = sqlite3_mprintf("CREATE TABLE \"%w\".\"%w_node\"(nodeno INTEGER PRIMARY KEY, data BLOB);"
 			"CREATE TABLE \"%w\".\"%w_rowid\"(rowid INTEGER PRIMARY KEY, nodeno INTEGER);"
-			"CREATE TABLE \"%w\".\"%w_parent\"(nodeno INTEGER PRIMARY KEY, parentnode INTEGER);"
 			"CREATE TABLE \"%w\".\"%w_bitfreq\"(bitno INTEGER PRIMARY KEY, freq INTEGER);"
 			"CREATE TABLE \"%w\".\"%w_weightfreq\"(weight INTEGER PRIMARY KEY, freq INTEGER);"
 			"INSERT INTO \"%w\".\"%w_node\" VALUES(1, zeroblob(%d))",
@@ -272,7 +409,6 @@ int RDtreeVtab::sql_init(int is_create)
 			db_name.c_str(), table_name.c_str(), 
 			db_name.c_str(), table_name.c_str(), 
 			db_name.c_str(), table_name.c_str(), 
-			db_name.c_str(), table_name.c_str(), 
 			db_name.c_str(), table_name.c_str(), node_bytes
 			);
     if (!create) {
@@ -283,6 +419,36 @@ int RDtreeVtab::sql_init(int is_create)
     if (rc != SQLITE_OK) {
       return rc;
     }
+
+    if (has_tombstone_table()) {
+      char *create_tombstone
+        = sqlite3_mprintf("CREATE TABLE \"%w\".\"%w_tombstone\"(rowid INTEGER PRIMARY KEY);",
+			  db_name.c_str(), table_name.c_str()
+			  );
+      if (!create_tombstone) {
+        return SQLITE_NOMEM;
+      }
+      rc = sqlite3_exec(db, create_tombstone, 0, 0, 0);
+      sqlite3_free(create_tombstone);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+    }
+
+    if (has_parent_table()) {
+      char *create_parent
+        = sqlite3_mprintf("CREATE TABLE \"%w\".\"%w_parent\"(nodeno INTEGER PRIMARY KEY, parentnode INTEGER);",
+			  db_name.c_str(), table_name.c_str()
+			  );
+      if (!create_parent) {
+        return SQLITE_NOMEM;
+      }
+      rc = sqlite3_exec(db, create_parent, 0, 0, 0);
+      sqlite3_free(create_parent);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+    }
     
     char *init_bitfreq
       = sqlite3_mprintf("INSERT INTO \"%w\".\"%w_bitfreq\" VALUES(?, 0)",
@@ -355,7 +521,7 @@ int RDtreeVtab::sql_init(int is_create)
   }
   
   // TODO make the block below "prettier"
-  static constexpr const int N_STATEMENT = 13;
+  static constexpr const int N_STATEMENT = 15;
 
   static const char *asql[N_STATEMENT] = {
     /* Read and write the xxx_node table */
@@ -373,13 +539,17 @@ int RDtreeVtab::sql_init(int is_create)
     "INSERT OR REPLACE INTO '%q'.'%q_parent' VALUES(:1, :2)",
     "DELETE FROM '%q'.'%q_parent' WHERE nodeno = :1",
 
+    /* Write the xxx_tombstone table */
+    "INSERT INTO '%q'.'%q_tombstone' VALUES(:1)",
+    "DELETE FROM '%q'.'%q_tombstone' WHERE rowid = :1",
+
     /* Update the xxx_bitfreq table */
-    "UPDATE '%q'.'%q_bitfreq' SET freq = freq + 1 WHERE bitno = :1",
-    "UPDATE '%q'.'%q_bitfreq' SET freq = freq - 1 WHERE bitno = :1",
+    "UPDATE '%q'.'%q_bitfreq' SET freq = freq + ?2 WHERE bitno = ?1",
+    "UPDATE '%q'.'%q_bitfreq' SET freq = freq - ?2 WHERE bitno = ?1",
 
     /* Update the xxx_weightfreq table */
-    "UPDATE '%q'.'%q_weightfreq' SET freq = freq + 1 WHERE weight = :1",
-    "UPDATE '%q'.'%q_weightfreq' SET freq = freq - 1 WHERE weight = :1"
+    "UPDATE '%q'.'%q_weightfreq' SET freq = freq + ?2 WHERE weight = ?1",
+    "UPDATE '%q'.'%q_weightfreq' SET freq = freq - ?2 WHERE weight = ?1"
   };
 
   sqlite3_stmt **apstmt[N_STATEMENT] = {
@@ -392,6 +562,8 @@ int RDtreeVtab::sql_init(int is_create)
     &pReadParent,
     &pWriteParent,
     &pDeleteParent,
+    &pWriteTombstone,
+    &pDeleteTombstone,
     &pIncrementBitfreq,
     &pDecrementBitfreq,
     &pIncrementWeightfreq,
@@ -399,6 +571,16 @@ int RDtreeVtab::sql_init(int is_create)
   };
 
   for (int i=0; i<N_STATEMENT && rc==SQLITE_OK; i++) {
+    if (!has_parent_table() && 
+        (apstmt[i] == &pReadParent || apstmt[i] == &pWriteParent || apstmt[i] == &pDeleteParent)) {
+      *apstmt[i] = nullptr;
+      continue;
+    }
+    if (!has_tombstone_table() && 
+        (apstmt[i] == &pWriteTombstone || apstmt[i] == &pDeleteTombstone)) {
+      *apstmt[i] = nullptr;
+      continue;
+    }
     char *sql = sqlite3_mprintf(asql[i], db_name.c_str(), table_name.c_str());
     if (sql) {
       rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, apstmt[i], 0);
@@ -496,23 +678,19 @@ int RDtreeVtab::destroy()
 {
   int rc = SQLITE_OK;
  
-  char *sql = sqlite3_mprintf("DROP TABLE '%q'.'%q_node';"
-	"DROP TABLE '%q'.'%q_rowid';"
-	"DROP TABLE '%q'.'%q_parent';"
-	"DROP TABLE '%q'.'%q_bitfreq';"
-	"DROP TABLE '%q'.'%q_weightfreq';",
-	db_name.c_str(), table_name.c_str(), 
-	db_name.c_str(), table_name.c_str(),
-	db_name.c_str(), table_name.c_str(),
-	db_name.c_str(), table_name.c_str(),
-	db_name.c_str(), table_name.c_str());
-
-  if (!sql) {
-    rc = SQLITE_NOMEM;
-  }
-  else{
-    rc = sqlite3_exec(db, sql, 0, 0, 0);
-    sqlite3_free(sql);
+  for (auto & shadow_name: shadow_table_names()) {
+    char *sql = sqlite3_mprintf("DROP TABLE '%q'.'%q_%q';",
+      db_name.c_str(), table_name.c_str(), shadow_name.c_str());
+    if (!sql) {
+      rc = SQLITE_NOMEM;
+    }
+    else {
+      rc = sqlite3_exec(db, sql, 0, 0, 0);
+      sqlite3_free(sql);
+    }
+    if (rc != SQLITE_OK) {
+      break;
+    }
   }
 
   if (rc == SQLITE_OK) {
@@ -522,6 +700,21 @@ int RDtreeVtab::destroy()
   return rc;
 }
 
+/*
+** The suffixes of the shadow tables that store the rd-tree data.
+*/
+std::vector<std::string> RDtreeVtab::shadow_table_names() const
+{
+  std::vector<std::string> names = {"node", "rowid", "bitfreq", "weightfreq"};
+  if (has_parent_table()) {
+    names.push_back("parent");
+  }
+  if (has_tombstone_table()) {
+    names.push_back("tombstone");
+  }
+  return names;
+}
+
 /* 
 ** This function is the implementation of the xDisconnect
 ** method of the rd-tree virtual table.
@@ -546,7 +739,12 @@ int RDtreeVtab::increment_bitfreq(const uint8_t *bfp)
     uint8_t byte = *bfp++;
     for (i = 0; i < 8; ++i, ++bitno, byte>>=1) {
       if (byte & 0x01) {
+        if (deferred_writes) {
+          ++bitfreq_delta[bitno];
+          continue;
+        }
         sqlite3_bind_int(pIncrementBitfreq, 1, bitno);
+        sqlite3_bind_int(pIncrementBitfreq, 2, 1);
         sqlite3_step(pIncrementBitfreq);
         rc = sqlite3_reset(pIncrementBitfreq);
       }
@@ -570,7 +768,12 @@ int RDtreeVtab::decrement_bitfreq(const uint8_t *bfp)
     uint8_t byte = *bfp++;
     for (i = 0; i < 8; ++i, ++bitno, byte>>=1) {
       if (byte & 0x01) {
+        if (deferred_writes) {
+          --bitfreq_delta[bitno];
+          continue;
+        }
         sqlite3_bind_int(pDecrementBitfreq, 1, bitno);
+        sqlite3_bind_int(pDecrementBitfreq, 2, 1);
 	    sqlite3_step(pDecrementBitfreq);
 	    rc = sqlite3_reset(pDecrementBitfreq);
       }
@@ -586,7 +789,12 @@ int RDtreeVtab::decrement_bitfreq(const uint8_t *bfp)
 int RDtreeVtab::increment_weightfreq(int weight)
 {
   int rc = SQLITE_OK;
+  if (deferred_writes) {
+    ++weightfreq_delta[weight];
+    return rc;
+  }
   sqlite3_bind_int(pIncrementWeightfreq, 1, weight);
+  sqlite3_bind_int(pIncrementWeightfreq, 2, 1);
   sqlite3_step(pIncrementWeightfreq);
   rc = sqlite3_reset(pIncrementWeightfreq);
   return rc;
@@ -599,7 +807,12 @@ int RDtreeVtab::increment_weightfreq(int weight)
 int RDtreeVtab::decrement_weightfreq(int weight)
 {
   int rc = SQLITE_OK;
+  if (deferred_writes) {
+    --weightfreq_delta[weight];
+    return rc;
+  }
   sqlite3_bind_int(pDecrementWeightfreq, 1, weight);
+  sqlite3_bind_int(pDecrementWeightfreq, 2, 1);
   sqlite3_step(pDecrementWeightfreq);
   rc = sqlite3_reset(pDecrementWeightfreq);
   return rc;
@@ -607,26 +820,182 @@ int RDtreeVtab::decrement_weightfreq(int weight)
 
 /*
 ** Write mapping (iRowid->iNode) to the <rdtree>_rowid table.
+**
+** Within a write transaction the mapping is only recorded in memory, and
+** written to the database by flush_pending().
 */
 int RDtreeVtab::rowid_write(sqlite3_int64 rowid, sqlite3_int64 nodeid)
 {
+  if (deferred_writes) {
+    mapping_save(false, rowid);
+    pending_rowids[rowid] = nodeid;
+    return SQLITE_OK;
+  }
   sqlite3_bind_int64(pWriteRowid, 1, rowid);
   sqlite3_bind_int64(pWriteRowid, 2, nodeid);
   sqlite3_step(pWriteRowid);
   return sqlite3_reset(pWriteRowid);
 }
 
+/*
+** Read the node id associated to rowid, taking into account the mappings
+** that were not yet written to the <rdtree>_rowid table. If no mapping is
+** found, *found is set to false.
+*/
+int RDtreeVtab::rowid_read(sqlite3_int64 rowid, sqlite3_int64 *nodeid, bool *found)
+{
+  auto pit = pending_rowids.find(rowid);
+  if (pit != pending_rowids.end()) {
+    *nodeid = pit->second;
+    *found = true;
+    return SQLITE_OK;
+  }
+
+  *found = false;
+  sqlite3_bind_int64(pReadRowid, 1, rowid);
+  if (sqlite3_step(pReadRowid) == SQLITE_ROW) {
+    *nodeid = sqlite3_column_int64(pReadRowid, 0);
+    *found = true;
+  }
+  return sqlite3_reset(pReadRowid);
+}
+
+/*
+** Remove the mapping for rowid from the <rdtree>_rowid table.
+*/
+int RDtreeVtab::rowid_delete(sqlite3_int64 rowid)
+{
+  mapping_save(false, rowid);
+  pending_rowids.erase(rowid);
+  sqlite3_bind_int64(pDeleteRowid, 1, rowid);
+  sqlite3_step(pDeleteRowid);
+  return sqlite3_reset(pDeleteRowid);
+}
+
 /*
 ** Write mapping (iNode->iPar) to the <rdtree>_parent table.
+**
+** Within a write transaction the mapping is only recorded in memory, and
+** written to the database by flush_pending().
 */
 int RDtreeVtab::parent_write(sqlite3_int64 nodeid, sqlite3_int64 parentid)
 {
+  if (!has_parent_table()) {
+    return SQLITE_OK;
+  }
+  if (deferred_writes) {
+    mapping_save(true, nodeid);
+    pending_parents[nodeid] = parentid;
+    return SQLITE_OK;
+  }
   sqlite3_bind_int64(pWriteParent, 1, nodeid);
   sqlite3_bind_int64(pWriteParent, 2, parentid);
   sqlite3_step(pWriteParent);
   return sqlite3_reset(pWriteParent);
 }
 
+/*
+** Read the id of the parent of node nodeid, taking into account the
+** mappings that were not yet written to the <rdtree>_parent table. If no
+** mapping is found, *found is set to false.
+*/
+int RDtreeVtab::parent_read(sqlite3_int64 nodeid, sqlite3_int64 *parentid, bool *found)
+{
+  auto pit = pending_parents.find(nodeid);
+  if (pit != pending_parents.end()) {
+    *parentid = pit->second;
+    *found = true;
+    return SQLITE_OK;
+  }
+
+  *found = false;
+  sqlite3_bind_int64(pReadParent, 1, nodeid);
+  if (sqlite3_step(pReadParent) == SQLITE_ROW) {
+    *parentid = sqlite3_column_int64(pReadParent, 0);
+    *found = true;
+  }
+  return sqlite3_reset(pReadParent);
+}
+
+/*
+** Remove the mapping for nodeid from the <rdtree>_parent table.
+*/
+int RDtreeVtab::parent_delete(sqlite3_int64 nodeid)
+{
+  if (!has_parent_table()) {
+    return SQLITE_OK;
+  }
+  mapping_save(true, nodeid);
+  pending_parents.erase(nodeid);
+  sqlite3_bind_int64(pDeleteParent, 1, nodeid);
+  sqlite3_step(pDeleteParent);
+  return sqlite3_reset(pDeleteParent);
+}
+
+/*
+** Load the rowids of the tombstoned records from the <rdtree>_tombstone
+** table.
+*/
+int RDtreeVtab::tombstones_load()
+{
+  tombstones.clear();
+
+  char *sql = sqlite3_mprintf("SELECT rowid FROM '%q'.'%q_tombstone'",
+			      db_name.c_str(), table_name.c_str());
+  if (!sql) {
+    return SQLITE_NOMEM;
+  }
+
+  sqlite3_stmt *stmt = 0;
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    tombstones.insert(sqlite3_column_int64(stmt, 0));
+  }
+  sqlite3_finalize(stmt);
+
+  if (rc != SQLITE_DONE) {
+    tombstones.clear();
+    return rc;
+  }
+
+  tombstones_loaded = true;
+  return SQLITE_OK;
+}
+
+/*
+** Record rowid as tombstoned. The <rdtree>_tombstone table is updated
+** immediately, so that it's kept consistent by a transaction rollback.
+*/
+int RDtreeVtab::tombstone_write(sqlite3_int64 rowid)
+{
+  sqlite3_bind_int64(pWriteTombstone, 1, rowid);
+  sqlite3_step(pWriteTombstone);
+  int rc = sqlite3_reset(pWriteTombstone);
+  if (rc == SQLITE_OK) {
+    tombstones.insert(rowid);
+  }
+  return rc;
+}
+
+/*
+** Remove rowid from the set of tombstoned records.
+*/
+int RDtreeVtab::tombstone_delete(sqlite3_int64 rowid)
+{
+  sqlite3_bind_int64(pDeleteTombstone, 1, rowid);
+  sqlite3_step(pDeleteTombstone);
+  int rc = sqlite3_reset(pDeleteTombstone);
+  if (rc == SQLITE_OK) {
+    tombstones.erase(rowid);
+  }
+  return rc;
+}
+
 /*
 ** Allocate and return new rd-tree node. Initially, (RDtreeNode.nodeid==0),
 ** indicating that node has not yet been assigned a node number. It is
@@ -765,6 +1134,7 @@ int RDtreeVtab::node_write(RDtreeNode *node)
 {
   int rc = SQLITE_OK;
   if (node->dirty) {
+    node_save(node, false);
     if (node->nodeid) {
       sqlite3_bind_int64(pWriteNode, 1, node->nodeid);
     }
@@ -778,6 +1148,7 @@ int RDtreeVtab::node_write(RDtreeNode *node)
     if (node->nodeid == 0 && rc == SQLITE_OK) {
       node->nodeid = sqlite3_last_insert_rowid(db);
       node_hash_insert(node);
+      node_save(node, true);
     }
   }
   return rc;
@@ -796,12 +1167,21 @@ void RDtreeVtab::node_incref(RDtreeNode *node)
 /*
 ** Decrease the reference count for a node. If the ref count drops to zero,
 ** release it.
+**
+** Within a write transaction, a dirty node is not released. The reference
+** is instead transferred to the list of pinned nodes, and the node is kept
+** in memory until the pending changes are flushed.
 */
 int RDtreeVtab::node_decref(RDtreeNode *node)
 {
   int rc = SQLITE_OK;
   if (node) {
     assert(node->n_ref > 0);
+    if (node->n_ref == 1 && node->dirty && deferred_writes && 
+        node->nodeid != 0 && !node->pinned) {
+      node_pin(node);
+      return rc;
+    }
     --node->n_ref;
     if (node->n_ref == 0) {
       rc = node_release(node);
@@ -810,6 +1190,77 @@ int RDtreeVtab::node_decref(RDtreeNode *node)
   return rc;
 }
 
+/*
+** Register the node in the list of pinned nodes. The reference held by the
+** caller is transferred to the list.
+*/
+void RDtreeVtab::node_pin(RDtreeNode *node)
+{
+  assert(!node->pinned);
+  node->pinned = true;
+  pinned_nodes.push_back(node);
+}
+
+/*
+** Remove the node from the list of pinned nodes, and drop the reference
+** that the list was holding. The node is not released, and the caller is
+** expected to own an additional reference.
+*/
+void RDtreeVtab::node_unpin(RDtreeNode *node)
+{
+  assert(node->pinned && node->n_ref > 1);
+  auto pit = std::find(pinned_nodes.begin(), pinned_nodes.end(), node);
+  assert(pit != pinned_nodes.end());
+  pinned_nodes.erase(pit);
+  node->pinned = false;
+  --node->n_ref;
+}
+
+/*
+** Save the current state of the node in the open savepoints, before it's
+** modified, written or removed for the first time since the savepoint was
+** opened. The nodes created after the savepoint are also recorded, with
+** no content.
+*/
+void RDtreeVtab::node_save(RDtreeNode *node, bool created)
+{
+  if (savepoints.empty() || node->nodeid == 0 ||
+      savepoints.back().nodes.count(node->nodeid) > 0 ||
+      node_hash_lookup(node->nodeid) != node) {
+    return;
+  }
+  for (auto & sp: savepoints) {
+    if (sp.nodes.count(node->nodeid) == 0) {
+      RDtreeSavedNode & saved = sp.nodes[node->nodeid];
+      saved.dirty = node->dirty;
+      if (!created) {
+        saved.data = node->data;
+      }
+    }
+  }
+}
+
+/*
+** Save the pending value of a node mapping in the open savepoints, before
+** it's modified for the first time since the savepoint was opened.
+*/
+void RDtreeVtab::mapping_save(bool parents, sqlite3_int64 key)
+{
+  if (savepoints.empty()) {
+    return;
+  }
+  const auto & pending = parents ? pending_parents : pending_rowids;
+  auto pit = pending.find(key);
+  for (auto & sp: savepoints) {
+    auto & saved = parents ? sp.parents : sp.rowids;
+    if (saved.count(key) == 0) {
+      RDtreeSavedMapping & mapping = saved[key];
+      mapping.pending = (pit != pending.end());
+      mapping.value = mapping.pending ? pit->second : 0;
+    }
+  }
+}
+
 /*
 ** Release a reference to a node. If the node is dirty and the reference
 ** count drops to zero, the node data is written to the database.
@@ -840,17 +1291,13 @@ int RDtreeVtab::node_release(RDtreeNode *node)
 */
 int RDtreeVtab::find_leaf_node(sqlite3_int64 rowid, RDtreeNode **leaf)
 {
-  int rc = SQLITE_OK;
+  sqlite3_int64 nodeid;
+  bool found;
   *leaf = nullptr;
-  sqlite3_bind_int64(pReadRowid, 1, rowid);
-  if (sqlite3_step(pReadRowid) == SQLITE_ROW) {
-    sqlite3_int64 nodeid = sqlite3_column_int64(pReadRowid, 0);
+  int rc = rowid_read(rowid, &nodeid, &found);
+  if (rc == SQLITE_OK && found) {
     rc = node_acquire(nodeid, 0, leaf);
   }
-  int rc2 = sqlite3_reset(pReadRowid);
-  if (rc == SQLITE_OK) {
-    rc = rc2;
-  }
   return rc;
 }
 
@@ -1086,18 +1533,45 @@ int RDtreeVtab::split_node(RDtreeNode *node, RDtreeItem *item, int height)
 ** rowid of the row to delete, which can be used to find the leaf node on which
 ** the entry resides. Once the leaf is located, this function is called to
 ** determine its ancestry.
+**
+** If the %_parent table is not available, the ancestry is determined by
+** a search from the root node (see find_parent_node() below).
 */
-int RDtreeVtab::load_parent_chain(RDtreeNode *node)
+int RDtreeVtab::load_parent_chain(RDtreeNode *node, int height)
 {
   int rc = SQLITE_OK;
+
+  if (!has_parent_table()) {
+    if (node->nodeid == 1 || node->parent) {
+      return SQLITE_OK;
+    }
+    RDtreeNode *root = nullptr;
+    if ((rc = node_acquire(1, 0, &root)) != SQLITE_OK) {
+      return rc;
+    }
+    bool found = false;
+    if (node->get_size() > 0) {
+      RDtreeItem bounds(bfp_bytes);
+      node->get_bounds(&bounds);
+      rc = find_parent_node(root, depth, node, height, &bounds, &found);
+    }
+    else {
+      rc = find_parent_node(root, depth, node, height, nullptr, &found);
+    }
+    int rc2 = node_decref(root);
+    if (rc == SQLITE_OK) rc = rc2;
+    if (rc == SQLITE_OK && !found) rc = SQLITE_CORRUPT_VTAB;
+    return rc;
+  }
+
   RDtreeNode *child = node;
   // as long as node has a null parent, and it's not the root
   while (rc == SQLITE_OK && child->nodeid != 1 && child->parent == 0) {
-    int rc2 = SQLITE_OK;          /* sqlite3_reset() return code */
-    sqlite3_bind_int64(pReadParent, 1, child->nodeid);
-    rc = sqlite3_step(pReadParent);
-    if (rc == SQLITE_ROW) {
-      sqlite3_int64 parent_nodeid = sqlite3_column_int64(pReadParent, 0);
+    int rc2 = SQLITE_OK;          /* node_acquire() return code */
+    sqlite3_int64 parent_nodeid;
+    bool found;
+    rc = parent_read(child->nodeid, &parent_nodeid, &found);
+    if (rc == SQLITE_OK && found) {
 
       /* Before setting pChild->parent, test that we are not creating a
       ** loop of references (as we would if, say, pChild==parent). We don't
@@ -1114,7 +1588,6 @@ int RDtreeVtab::load_parent_chain(RDtreeNode *node)
         rc2 = node_acquire(parent_nodeid, 0, &child->parent);
       }
     }
-    rc = sqlite3_reset(pReadParent);
     if (rc == SQLITE_OK) rc = rc2;
     if (rc == SQLITE_OK && !child->parent) rc = SQLITE_CORRUPT_VTAB;
     child = child->parent;
@@ -1122,6 +1595,48 @@ int RDtreeVtab::load_parent_chain(RDtreeNode *node)
   return rc;
 }
 
+/*
+** Search the subtree rooted at node (located at the given height) for the
+** parent of child, and link child to it. Only the branches whose bounds
+** contain the bounds of the child content are visited (all of them, if
+** bounds is null). On a successful search, found is set to true and the
+** nodes along the path from the root are all linked to their parents.
+*/
+int RDtreeVtab::find_parent_node(RDtreeNode *node, int height, 
+				 RDtreeNode *child, int child_height,
+				 const RDtreeItem *bounds, bool *found)
+{
+  int rc = SQLITE_OK;
+  int node_size = node->get_size();
+
+  for (int ii = 0; rc == SQLITE_OK && !*found && ii < node_size; ii++) {
+    if (height == child_height + 1) {
+      if (node->get_rowid(ii) == child->nodeid) {
+        node_incref(node);
+        child->parent = node;
+        *found = true;
+      }
+      continue;
+    }
+
+    RDtreeItem item(bfp_bytes);
+    node->get_item(ii, &item);
+    if (bounds && !item.contains(*bounds)) {
+      continue;
+    }
+
+    RDtreeNode *next = nullptr;
+    rc = node_acquire(item.rowid, node, &next);
+    if (rc == SQLITE_OK) {
+      rc = find_parent_node(next, height - 1, child, child_height, bounds, found);
+      int rc2 = node_decref(next);
+      if (rc == SQLITE_OK) rc = rc2;
+    }
+  }
+
+  return rc;
+}
+
 /*
 ** deleting an Item may result in the removal of an underfull node,
 ** that in turn requires the deletion of the corresponding Item from the
@@ -1137,7 +1652,20 @@ int RDtreeVtab::remove_node(RDtreeNode *node, int height)
   RDtreeNode *parent = 0;
   int item;
 
-  assert( node->n_ref == 1 );
+  node_save(node, false);
+
+  /* A pinned node is about to be dropped from the tree, and there's no
+  ** point in keeping it in the list of nodes pending to be written.
+  */
+  if (node->pinned) {
+    node_unpin(node);
+  }
+
+  /* Other than the caller, the node may be still referenced by its
+  ** children, if they are in memory. These references are released when
+  ** the children are re-parented, while reinserting the node content.
+  */
+  assert( node->n_ref >= 1 );
 
   /* Remove the entry in the parent item. */
   rc = node->get_index_in_parent(&item);
@@ -1164,9 +1692,7 @@ int RDtreeVtab::remove_node(RDtreeNode *node, int height)
   }
 
   /* Remove the xxx_parent entry. */
-  sqlite3_bind_int64(pDeleteParent, 1, node->nodeid);
-  sqlite3_step(pDeleteParent);
-  if (SQLITE_OK != (rc = sqlite3_reset(pDeleteParent))) {
+  if (SQLITE_OK != (rc = parent_delete(node->nodeid))) {
     return rc;
   }
   
@@ -1191,16 +1717,9 @@ int RDtreeVtab::update_node_bounds(RDtreeNode *node)
   int rc = SQLITE_OK; 
   RDtreeNode *parent = node->parent;
   if (parent) {
-    int node_size = node->get_size();
     // compute the bounding box for this node
     RDtreeItem bounds(bfp_bytes); 
-    node->get_item(0, &bounds);
-    for (int ii = 1; ii < node_size; ii++) {
-      RDtreeItem item(bfp_bytes);
-      node->get_item(ii, &item);
-      bounds.extend_bounds(item);
-    }
-    bounds.rowid = node->nodeid;
+    node->get_bounds(&bounds);
     // update the bounding box info in the
     // parent's item that points to this node
     // and then recur up the tree
@@ -1226,7 +1745,7 @@ int RDtreeVtab::delete_item(RDtreeNode *node, int idx, int height)
   ** If node is not the root and its parent is null, load all the ancestor
   ** nodes into memory
   */
-  if ((rc = load_parent_chain(node)) != SQLITE_OK) {
+  if ((rc = load_parent_chain(node, height)) != SQLITE_OK) {
     return rc;
   }
 
@@ -1235,13 +1754,21 @@ int RDtreeVtab::delete_item(RDtreeNode *node, int idx, int height)
   */
   node->delete_item(idx);
 
-  /* If the node is not the tree root and now has less than the minimum
-  ** number of cells, remove it from the tree. Otherwise, update the
-  ** cell in the parent node so that it tightly contains the updated
-  ** node.
-  */
-  RDtreeNode *parent = node->parent;
-  assert(parent || node->nodeid == 1);
+  return condense_node(node, height);
+}
+
+/*
+** Adjust the rd-tree data structure after some items were removed from
+** node. If the node is not the tree root and now has less than the minimum
+** number of cells, remove it from the tree. Otherwise, update the
+** cell in the parent node so that it tightly contains the updated
+** node.
+*/
+int RDtreeVtab::condense_node(RDtreeNode *node, int height)
+{
+  int rc = SQLITE_OK;
+  RDtreeNode *parent = node->parent;
+  assert(parent || node->nodeid == 1);
   if (parent) {
     if (node->get_size() < node_minsize()) {
       rc = remove_node(node, height);
@@ -1342,17 +1869,23 @@ int RDtreeVtab::delete_rowid(sqlite3_int64 rowid)
     rc = find_leaf_node(rowid, &leaf);
   }
 
-  /* Delete the cell in question from the leaf node. */
+  /* Delete the cell in question from the leaf node. The frequency counts
+  ** of a tombstoned record were already updated when it was deleted.
+  */
   if (rc == SQLITE_OK) {
+    bool tombstone = is_tombstone(rowid);
     rc = leaf->get_rowid_index(rowid, &item);
-    if (rc == SQLITE_OK) {
+    if (rc == SQLITE_OK && !tombstone) {
       const uint8_t *bfp = leaf->get_bfp(item);
       rc = decrement_bitfreq(bfp);
     }
-    if (rc == SQLITE_OK) {
+    if (rc == SQLITE_OK && !tombstone) {
       int weight = leaf->get_max_weight(item);
       rc = decrement_weightfreq(weight);
     }
+    if (rc == SQLITE_OK && tombstone) {
+      rc = tombstone_delete(rowid);
+    }
     if (rc == SQLITE_OK) {
       rc = delete_item(leaf, item, 0);
     }
@@ -1364,11 +1897,35 @@ int RDtreeVtab::delete_rowid(sqlite3_int64 rowid)
 
   /* Delete the corresponding entry in the <rdtree>_rowid table. */
   if (rc == SQLITE_OK) {
-    sqlite3_bind_int64(pDeleteRowid, 1, rowid);
-    sqlite3_step(pDeleteRowid);
-    rc = sqlite3_reset(pDeleteRowid);
+    rc = rowid_delete(rowid);
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = condense_tree(root);
+  }
+  else {
+    clear_removed_nodes();
   }
 
+  /* Release the reference to the root node. */
+  rc2 = node_decref(root);
+  if (rc == SQLITE_OK) {
+    rc = rc2;
+  }
+
+  return rc;
+}
+
+/*
+** Complete the removal of records from the tree, by reducing the tree
+** height if possible, and reinserting the content of the underfull nodes
+** that were removed.
+*/
+int RDtreeVtab::condense_tree(RDtreeNode *root)
+{
+  int rc = SQLITE_OK;
+  int rc2;
+
   /* Check if the root node now has exactly one child. If so, remove
   ** it, schedule the contents of the child for reinsertion and 
   ** reduce the tree height by one.
@@ -1390,6 +1947,7 @@ int RDtreeVtab::delete_rowid(sqlite3_int64 rowid)
     }
     if (rc == SQLITE_OK) {
       --depth;
+      node_save(root, false);
       write_uint16(root->data.data(), depth);
       root->dirty = true;
     }
@@ -1407,15 +1965,175 @@ int RDtreeVtab::delete_rowid(sqlite3_int64 rowid)
     removed_nodes.pop();
   }
 
-  /* Release the reference to the root node. */
-  rc2 = node_decref(root);
+  return rc;
+}
+
+/*
+** Drop the underfull nodes that were removed from the tree, without
+** reinserting their content (on error).
+*/
+void RDtreeVtab::clear_removed_nodes()
+{
+  while (!removed_nodes.empty()) {
+    delete removed_nodes.top();
+    removed_nodes.pop();
+  }
+}
+
+/*
+** Mark the entry with rowid=rowid as deleted, without removing it from
+** the rd-tree structure (see rdtree_compact).
+*/
+int RDtreeVtab::tombstone_rowid(sqlite3_int64 rowid)
+{
+  int rc, rc2;
+  RDtreeNode *leaf = 0;
+  int item;
+
+  rc = find_leaf_node(rowid, &leaf);
+
+  if (rc == SQLITE_OK && !leaf) {
+    rc = SQLITE_CORRUPT_VTAB;
+  }
+
   if (rc == SQLITE_OK) {
-    rc = rc2;
+    rc = leaf->get_rowid_index(rowid, &item);
+    if (rc == SQLITE_OK) {
+      const uint8_t *bfp = leaf->get_bfp(item);
+      rc = decrement_bitfreq(bfp);
+    }
+    if (rc == SQLITE_OK) {
+      int weight = leaf->get_max_weight(item);
+      rc = decrement_weightfreq(weight);
+    }
+    rc2 = node_decref(leaf);
+    if (rc == SQLITE_OK) {
+      rc = rc2;
+    }
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = tombstone_write(rowid);
   }
 
   return rc;
 }
 
+/*
+** Remove all the tombstoned records from the rd-tree structure. The
+** leaf nodes containing tombstoned records are processed one at a time,
+** and all their tombstoned items are removed before the tree is
+** condensed.
+**
+** The operation runs within a savepoint, so that a failure doesn't leave
+** the tree partially compacted.
+*/
+int RDtreeVtab::compact(int *compacted)
+{
+  int rc = SQLITE_OK;
+  *compacted = 0;
+
+  if (!has_tombstone_table()) {
+    return SQLITE_OK;
+  }
+
+  incref();
+
+  rc = sqlite3_exec(db, "SAVEPOINT rdtree_compact", 0, 0, 0);
+  if (rc != SQLITE_OK) {
+    decref();
+    return rc;
+  }
+
+  pending_changes = pending_changes || deferred_writes;
+
+  while (rc == SQLITE_OK) {
+    // the set is also reloaded if a statement rollback invalidated it
+    // (e.g. when a statement on the shadow tables is prepared again)
+    if (!tombstones_loaded) {
+      rc = tombstones_load();
+    }
+    if (rc != SQLITE_OK || tombstones.empty()) {
+      break;
+    }
+
+    int rc2;
+    sqlite3_int64 rowid = *tombstones.begin();
+
+    RDtreeNode *root = 0;
+    rc = node_acquire(1, 0, &root);
+    if (rc != SQLITE_OK) {
+      break;
+    }
+
+    RDtreeNode *leaf = 0;
+    rc = find_leaf_node(rowid, &leaf);
+    if (rc == SQLITE_OK && !leaf) {
+      rc = SQLITE_CORRUPT_VTAB;
+    }
+
+    if (rc == SQLITE_OK) {
+      rc = load_parent_chain(leaf, 0);
+      for (int ii = leaf->get_size() - 1; rc == SQLITE_OK && ii >= 0; --ii) {
+        sqlite3_int64 item_rowid = leaf->get_rowid(ii);
+        if (is_tombstone(item_rowid)) {
+          leaf->delete_item(ii);
+          rc = rowid_delete(item_rowid);
+          if (rc == SQLITE_OK) {
+            rc = tombstone_delete(item_rowid);
+          }
+          if (rc == SQLITE_OK) {
+            ++*compacted;
+          }
+        }
+      }
+      if (rc == SQLITE_OK) {
+        rc = condense_node(leaf, 0);
+      }
+      rc2 = node_decref(leaf);
+      if (rc == SQLITE_OK) {
+        rc = rc2;
+      }
+    }
+
+    if (rc == SQLITE_OK) {
+      rc = condense_tree(root);
+    }
+    else {
+      clear_removed_nodes();
+    }
+
+    rc2 = node_decref(root);
+    if (rc == SQLITE_OK) {
+      rc = rc2;
+    }
+
+    if (rc == SQLITE_OK && pending_over_limit()) {
+      rc = flush_pending();
+    }
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(db, "RELEASE rdtree_compact", 0, 0, 0);
+  }
+  else {
+    // undo the changes, and keep the error code. Within a write transaction
+    // the in-memory state is restored by rollback_to(), otherwise the cached
+    // state is discarded, and the tombstones are reloaded when needed.
+    sqlite3_exec(db, "ROLLBACK TO rdtree_compact", 0, 0, 0);
+    sqlite3_exec(db, "RELEASE rdtree_compact", 0, 0, 0);
+    if (!deferred_writes) {
+      discard_pending();
+    }
+    tombstones.clear();
+    tombstones_loaded = false;
+    *compacted = 0;
+  }
+
+  decref();
+  return rc;
+}
+
 /*
 ** The xUpdate method for rdtree module virtual tables.
 */
@@ -1435,6 +2153,15 @@ int RDtreeVtab::update(int argc, sqlite3_value **argv, sqlite_int64 *updated_row
   */
   assert(argc == 1 || argc == 4);
 
+  pending_changes = pending_changes || deferred_writes;
+
+  if (has_tombstone_table() && !tombstones_loaded) {
+    rc = tombstones_load();
+    if (rc != SQLITE_OK) {
+      goto update_end;
+    }
+  }
+
   /*
   ** argc = 1
   ** argv[0] != NULL
@@ -1483,12 +2210,16 @@ int RDtreeVtab::update(int argc, sqlite3_value **argv, sqlite_int64 *updated_row
 
       // if it's an insert || an update with rowid change
       if ((sqlite3_value_type(argv[0]) == SQLITE_NULL) || (sqlite3_value_int64(argv[0]) != rowid)) {
-        sqlite3_bind_int64(pReadRowid, 1, rowid);
-        int steprc = sqlite3_step(pReadRowid);
-        rc = sqlite3_reset(pReadRowid);
-        if (SQLITE_ROW == steprc) {
+        sqlite3_int64 nodeid;
+        bool found;
+        rc = rowid_read(rowid, &nodeid, &found);
+        if (rc == SQLITE_OK && found) {
           // rowid already exists
-          if (sqlite3_vtab_on_conflict(db) == SQLITE_REPLACE) {
+          if (is_tombstone(rowid)) {
+            // but it was deleted, complete its removal
+            rc = delete_rowid(rowid);
+          }
+          else if (sqlite3_vtab_on_conflict(db) == SQLITE_REPLACE) {
             rc = delete_rowid(rowid);
           }
 	        else {
@@ -1501,7 +2232,7 @@ int RDtreeVtab::update(int argc, sqlite3_value **argv, sqlite_int64 *updated_row
       have_rowid = true;
     }
 
-    std::string bfp = arg_to_bfp(argv[3], &rc);
+    std::string_view bfp = arg_to_bfp_view(argv[3], &rc);
     int input_bfp_bytes = bfp.size();
     if (rc == SQLITE_OK && input_bfp_bytes != bfp_bytes) {
       // TODO: log an informative error message
@@ -1527,7 +2258,12 @@ int RDtreeVtab::update(int argc, sqlite3_value **argv, sqlite_int64 *updated_row
   ** (note: updates too are performed as a delete+re-insert)
   */
   if (sqlite3_value_type(argv[0]) != SQLITE_NULL) {
-    rc = delete_rowid(sqlite3_value_int64(argv[0]));
+    if (argc == 1 && has_tombstone_table()) {
+      rc = tombstone_rowid(sqlite3_value_int64(argv[0]));
+    }
+    else {
+      rc = delete_rowid(sqlite3_value_int64(argv[0]));
+    }
   }
 
   /* If the argv[] array contains more than one element, elements
@@ -1565,6 +2301,11 @@ int RDtreeVtab::update(int argc, sqlite3_value **argv, sqlite_int64 *updated_row
     }
   }
 
+  /* Keep the amount of pending changes bounded */
+  if (rc == SQLITE_OK && pending_over_limit()) {
+    rc = flush_pending();
+  }
+
 update_end:
   decref();
   return rc;
@@ -1578,6 +2319,8 @@ int RDtreeVtab::open(sqlite3_vtab_cursor **cursor)
   int rc = SQLITE_OK;
   RDtreeCursor *csr = new RDtreeCursor; // FIXME: try/catch set rc = SQLITE_NOMEM
   csr->pVtab = this;
+  csr->node = nullptr;
+  csr->strategy = 1;
   *cursor = csr;
   return rc;
 }
@@ -1589,15 +2332,55 @@ int RDtreeVtab::close(sqlite3_vtab_cursor *cursor)
 {
   RDtreeCursor *csr = (RDtreeCursor *)cursor;
   int rc = node_decref(csr->node);
+  if (csr->strategy != 1) {
+    report_query_stats(csr->stats);
+  }
   delete csr;
   return rc;
 }
 
+/*
+** Make the counters collected by a cursor available to the
+** rdtree_last_query_stats() SQL function, and optionally log them.
+*/
+void RDtreeVtab::report_query_stats(const RDtreeQueryStats & stats)
+{
+  if (registry) {
+    registry->last_query_stats = stats;
+  }
+
+  int log_stats = 0;
+  if (chemicalite_get(RDTREE_QUERY_STATS, &log_stats) == SQLITE_OK && log_stats) {
+    chemicalite_log(
+      SQLITE_NOTICE, 
+      "rdtree %s: nodes acquired %lld (cache hits %lld), "
+      "internal items tested %lld (pruned %lld), "
+      "leaf items tested %lld (accepted %lld), initialize %.3f ms",
+      table_name.c_str(),
+      stats.nodes_acquired, stats.cache_hits,
+      stats.internal_tested, stats.internal_pruned,
+      stats.leaf_tested, stats.leaf_accepted,
+      stats.initialize_ms);
+  }
+}
+
 int RDtreeVtab::test_item(RDtreeCursor *csr, int height, bool *is_eof)
 {
   RDtreeItem item(bfp_bytes);
   int rc = SQLITE_OK;
 
+  if (height == 0) {
+    ++csr->stats.leaf_tested;
+  }
+  else {
+    ++csr->stats.internal_tested;
+  }
+
+  if (height == 0 && is_tombstone(csr->node->get_rowid(csr->item))) {
+    *is_eof = true;
+    return rc;
+  }
+
   csr->node->get_item(csr->item, &item);
 
   bool item_eof = false;
@@ -1614,6 +2397,15 @@ int RDtreeVtab::test_item(RDtreeCursor *csr, int height, bool *is_eof)
   }
   *is_eof = item_eof;
 
+  if (rc == SQLITE_OK) {
+    if (height == 0 && !item_eof) {
+      ++csr->stats.leaf_accepted;
+    }
+    else if (height > 0 && item_eof) {
+      ++csr->stats.internal_pruned;
+    }
+  }
+
   return rc;
 }
 
@@ -1641,6 +2433,10 @@ int RDtreeVtab::descend_to_item(RDtreeCursor *csr, int height, bool *is_eof)
   // at the current cursor position
   RDtreeNode *child;
   sqlite3_int64 rowid = csr->node->get_rowid(csr->item);
+  ++csr->stats.nodes_acquired;
+  if (node_hash_lookup(rowid)) {
+    ++csr->stats.cache_hits;
+  }
   rc = node_acquire(rowid, csr->node, &child);
   if (rc != SQLITE_OK) {
     return rc;
@@ -1743,11 +2539,28 @@ int RDtreeVtab::filter(
   csr->constraints.clear(); // needed? or not needed?
   csr->strategy = idxnum;
 
+  /* The counters are reported for the last search performed by the cursor
+  ** (xFilter is called again e.g. for each row of the outer loop in a join).
+  */
+  csr->stats = RDtreeQueryStats();
+
+  if (has_tombstone_table() && !tombstones_loaded) {
+    rc = tombstones_load();
+    if (rc != SQLITE_OK) {
+      decref();
+      return rc;
+    }
+  }
+
   if (csr->strategy == 1) {
     /* Special case - lookup by rowid. */
     RDtreeNode *leaf;        /* Leaf on which the required item resides */
     sqlite3_int64 rowid = sqlite3_value_int64(argv[0]);
     rc = find_leaf_node(rowid, &leaf);
+    if (leaf && is_tombstone(rowid)) {
+      node_decref(leaf);
+      leaf = nullptr;
+    }
     csr->node = leaf; 
     if (leaf) {
       assert(rc == SQLITE_OK);
@@ -1777,7 +2590,11 @@ int RDtreeVtab::filter(
         std::shared_ptr<RDtreeConstraint> p = RDtreeConstraint::deserialize(data, size, *this, &rc);
 
         if (rc == SQLITE_OK) {
-            rc = p->initialize(*this);
+          auto start = std::chrono::steady_clock::now();
+          rc = p->initialize(*this);
+          std::chrono::duration<double, std::milli> elapsed 
+            = std::chrono::steady_clock::now() - start;
+          csr->stats.initialize_ms += elapsed.count();
         }
         if (rc == SQLITE_OK) {
           csr->constraints.push_back(p);
@@ -1789,6 +2606,10 @@ int RDtreeVtab::filter(
 
     if (rc == SQLITE_OK) {
       csr->node = nullptr;
+      ++csr->stats.nodes_acquired;
+      if (node_hash_lookup(1)) {
+        ++csr->stats.cache_hits;
+      }
       rc = node_acquire(1, 0, &root);
     }
 
@@ -1871,32 +2692,41 @@ int RDtreeVtab::column(sqlite3_vtab_cursor *vtab_cursor, sqlite3_context *ctx, i
 */
 int RDtreeVtab::rename(const char *newname)
 {
-  int rc = SQLITE_NOMEM;
-  char *sql = sqlite3_mprintf(
-    "ALTER TABLE %Q.'%q_node'   RENAME TO \"%w_node\";"
-    "ALTER TABLE %Q.'%q_parent' RENAME TO \"%w_parent\";"
-    "ALTER TABLE %Q.'%q_rowid'  RENAME TO \"%w_rowid\";"
-    "ALTER TABLE %Q.'%q_bitfreq'  RENAME TO \"%w_bitfreq\";"
-    "ALTER TABLE %Q.'%q_weightfreq'  RENAME TO \"%w_weightfreq\";"
-    , db_name.c_str(), table_name.c_str(), newname 
-    , db_name.c_str(), table_name.c_str(), newname 
-    , db_name.c_str(), table_name.c_str(), newname 
-    , db_name.c_str(), table_name.c_str(), newname 
-    , db_name.c_str(), table_name.c_str(), newname 
-  );
-  if (sql) {
-    rc = sqlite3_exec(db, sql, 0, 0, 0);
-    sqlite3_free(sql);
+  int rc = SQLITE_OK;
+  for (auto & shadow_name: shadow_table_names()) {
+    char *sql = sqlite3_mprintf(
+      "ALTER TABLE %Q.'%q_%q' RENAME TO \"%w_%w\";"
+      , db_name.c_str(), table_name.c_str(), shadow_name.c_str()
+      , newname, shadow_name.c_str()
+    );
+    if (!sql) {
+      rc = SQLITE_NOMEM;
+    }
+    else {
+      rc = sqlite3_exec(db, sql, 0, 0, 0);
+      sqlite3_free(sql);
+    }
+    if (rc != SQLITE_OK) {
+      break;
+    }
   }
   return rc;
 }
 
 /*
 ** Select a currently unused rowid for a new rd-tree record.
+**
+** The rowid is assigned by inserting a placeholder record into the
+** xxx_rowid table. Any pending mappings are written first, so that the
+** assigned value can't collide with a rowid that is only known in memory.
 */
 int RDtreeVtab::new_rowid(sqlite3_int64 *rowid)
 {
-  int rc;
+  int rc = flush_pending_rowids();
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
   sqlite3_bind_null(pWriteRowid, 1);
   sqlite3_bind_null(pWriteRowid, 2);
   sqlite3_step(pWriteRowid);
@@ -1905,6 +2735,331 @@ int RDtreeVtab::new_rowid(sqlite3_int64 *rowid)
   return rc;
 }
 
+/*
+** Write the rowid to node mappings that were collected in memory during
+** the current write transaction.
+*/
+int RDtreeVtab::flush_pending_rowids()
+{
+  int rc = SQLITE_OK;
+  for (auto & mapping: pending_rowids) {
+    mapping_save(false, mapping.first);
+    sqlite3_bind_int64(pWriteRowid, 1, mapping.first);
+    sqlite3_bind_int64(pWriteRowid, 2, mapping.second);
+    sqlite3_step(pWriteRowid);
+    if ((rc = sqlite3_reset(pWriteRowid)) != SQLITE_OK) {
+      return rc;
+    }
+  }
+  pending_rowids.clear();
+  return rc;
+}
+
+/*
+** Write all the changes that were collected in memory during the current
+** write transaction: the node mappings, the updated frequency counts and
+** the content of the pinned nodes.
+*/
+int RDtreeVtab::flush_pending()
+{
+  int rc = flush_pending_rowids();
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  for (auto & mapping: pending_parents) {
+    mapping_save(true, mapping.first);
+    sqlite3_bind_int64(pWriteParent, 1, mapping.first);
+    sqlite3_bind_int64(pWriteParent, 2, mapping.second);
+    sqlite3_step(pWriteParent);
+    if ((rc = sqlite3_reset(pWriteParent)) != SQLITE_OK) {
+      return rc;
+    }
+  }
+  pending_parents.clear();
+
+  int num_bits = bitfreq_delta.size();
+  for (int bitno = 0; bitno < num_bits; ++bitno) {
+    int delta = bitfreq_delta[bitno];
+    if (delta) {
+      sqlite3_stmt *stmt = (delta > 0) ? pIncrementBitfreq : pDecrementBitfreq;
+      sqlite3_bind_int(stmt, 1, bitno);
+      sqlite3_bind_int(stmt, 2, abs(delta));
+      sqlite3_step(stmt);
+      if ((rc = sqlite3_reset(stmt)) != SQLITE_OK) {
+        return rc;
+      }
+      bitfreq_delta[bitno] = 0;
+    }
+  }
+
+  int num_weights = weightfreq_delta.size();
+  for (int weight = 0; weight < num_weights; ++weight) {
+    int delta = weightfreq_delta[weight];
+    if (delta) {
+      sqlite3_stmt *stmt = (delta > 0) ? pIncrementWeightfreq : pDecrementWeightfreq;
+      sqlite3_bind_int(stmt, 1, weight);
+      sqlite3_bind_int(stmt, 2, abs(delta));
+      sqlite3_step(stmt);
+      if ((rc = sqlite3_reset(stmt)) != SQLITE_OK) {
+        return rc;
+      }
+      weightfreq_delta[weight] = 0;
+    }
+  }
+
+  /* Release the references held by the list of pinned nodes. This triggers
+  ** the nodes write, and writing is therefore temporarily restored to be
+  ** immediate, so that the released nodes aren't pinned again.
+  */
+  bool saved_deferred_writes = deferred_writes;
+  deferred_writes = false;
+  std::vector<RDtreeNode *> nodes;
+  nodes.swap(pinned_nodes);
+  for (RDtreeNode *node: nodes) {
+    node->pinned = false;
+  }
+  for (RDtreeNode *node: nodes) {
+    int rc2 = node_decref(node);
+    if (rc == SQLITE_OK) {
+      rc = rc2;
+    }
+  }
+  deferred_writes = saved_deferred_writes;
+
+  if (rc == SQLITE_OK) {
+    pending_changes = false;
+  }
+  return rc;
+}
+
+/*
+** Drop all the changes that were collected in memory and not yet written
+** to the database. This is used when the transaction is rolled back, and
+** the content of the in-memory nodes is therefore no longer valid.
+*/
+void RDtreeVtab::discard_pending()
+{
+  tombstones.clear();
+  tombstones_loaded = false;
+  pending_rowids.clear();
+  pending_parents.clear();
+  std::fill(bitfreq_delta.begin(), bitfreq_delta.end(), 0);
+  std::fill(weightfreq_delta.begin(), weightfreq_delta.end(), 0);
+  pending_changes = false;
+
+  for (auto & entry: node_hash) {
+    entry.second->dirty = false;
+  }
+
+  std::vector<RDtreeNode *> nodes;
+  nodes.swap(pinned_nodes);
+  for (RDtreeNode *node: nodes) {
+    node->pinned = false;
+  }
+  for (RDtreeNode *node: nodes) {
+    node->dirty = false;
+    node_decref(node);
+  }
+}
+
+/*
+** Return true if the amount of pending changes exceeds the configured limits.
+*/
+bool RDtreeVtab::pending_over_limit() const
+{
+  return (
+    (int)pinned_nodes.size() > RDTREE_MAX_PINNED_NODES ||
+    (int)(pending_rowids.size() + pending_parents.size()) > RDTREE_MAX_PENDING_MAPPINGS
+    );
+}
+
+/*
+** rdtree virtual table module xBegin method.
+**
+** Within a write transaction the changes to the tree are retained in memory
+** and written to the database once, when the transaction is synced. This
+** saves repeatedly writing the same records (the root node and the upper
+** levels of the tree in particular) when many items are inserted or deleted.
+*/
+int RDtreeVtab::begin()
+{
+  assert(pinned_nodes.empty());
+  deferred_writes = true;
+  pending_changes = false;
+  savepoints.clear();
+  return SQLITE_OK;
+}
+
+/*
+** rdtree virtual table module xSync method.
+*/
+int RDtreeVtab::sync()
+{
+  incref();
+  int rc = flush_pending();
+  decref();
+  return rc;
+}
+
+/*
+** rdtree virtual table module xCommit method.
+*/
+int RDtreeVtab::commit()
+{
+  assert(pinned_nodes.empty());
+  deferred_writes = false;
+  savepoints.clear();
+  return SQLITE_OK;
+}
+
+/*
+** rdtree virtual table module xRollback method.
+*/
+int RDtreeVtab::rollback()
+{
+  discard_pending();
+  deferred_writes = false;
+  savepoints.clear();
+  return SQLITE_OK;
+}
+
+/*
+** rdtree virtual table module xSavepoint method.
+**
+** SQLite opens a statement level savepoint for most of the statements
+** executed within a transaction, and the pending changes are therefore not
+** written when a savepoint is opened. If there are any, the state of the
+** nodes and mappings is instead saved when they are first modified within
+** the savepoint (see node_save() and mapping_save()), so that it can be
+** restored if the savepoint is rolled back.
+*/
+int RDtreeVtab::savepoint(int savepoint_id)
+{
+  while (!savepoints.empty() && savepoints.back().savepoint_id >= savepoint_id) {
+    savepoints.pop_back();
+  }
+  if (pending_changes) {
+    savepoints.emplace_back();
+    RDtreeSavepoint & sp = savepoints.back();
+    sp.savepoint_id = savepoint_id;
+    sp.bitfreq_delta = bitfreq_delta;
+    sp.weightfreq_delta = weightfreq_delta;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** rdtree virtual table module xRelease method.
+**
+** The changes made within the released savepoints become part of the
+** enclosing savepoint (or of the transaction), and they are written when
+** the transaction is synced.
+*/
+int RDtreeVtab::release(int savepoint_id)
+{
+  while (!savepoints.empty() && savepoints.back().savepoint_id >= savepoint_id) {
+    savepoints.pop_back();
+  }
+  return SQLITE_OK;
+}
+
+/*
+** rdtree virtual table module xRollbackTo method.
+**
+** If no changes were pending when the savepoint was opened, the database
+** content matches the state of the tree at the savepoint, and the changes
+** collected in memory can be dropped. Otherwise, the nodes and mappings
+** that were pending at the savepoint are restored from the saved state.
+*/
+int RDtreeVtab::rollback_to(int savepoint_id)
+{
+  while (!savepoints.empty() && savepoints.back().savepoint_id > savepoint_id) {
+    savepoints.pop_back();
+  }
+  if (savepoints.empty() || savepoints.back().savepoint_id != savepoint_id) {
+    discard_pending();
+    return SQLITE_OK;
+  }
+
+  RDtreeSavepoint & sp = savepoints.back();
+
+  /* The content of the nodes that were pending at the savepoint: the dirty
+  ** nodes that were not modified since, and the saved dirty nodes.
+  */
+  std::unordered_map<sqlite3_int64, Blob> dirty_nodes;
+  for (auto & entry: node_hash) {
+    if (entry.second->dirty && sp.nodes.count(entry.first) == 0) {
+      dirty_nodes[entry.first] = entry.second->data;
+    }
+  }
+  for (auto & entry: sp.nodes) {
+    if (entry.second.dirty) {
+      dirty_nodes[entry.first] = entry.second.data;
+    }
+  }
+
+  std::unordered_map<sqlite3_int64, sqlite3_int64> rowids(pending_rowids);
+  for (auto & entry: sp.rowids) {
+    if (entry.second.pending) {
+      rowids[entry.first] = entry.second.value;
+    }
+    else {
+      rowids.erase(entry.first);
+    }
+  }
+
+  std::unordered_map<sqlite3_int64, sqlite3_int64> parents(pending_parents);
+  for (auto & entry: sp.parents) {
+    if (entry.second.pending) {
+      parents[entry.first] = entry.second.value;
+    }
+    else {
+      parents.erase(entry.first);
+    }
+  }
+
+  discard_pending();
+
+  pending_rowids.swap(rowids);
+  pending_parents.swap(parents);
+  bitfreq_delta = sp.bitfreq_delta;
+  weightfreq_delta = sp.weightfreq_delta;
+
+  /* The nodes that are still referenced are restored to their content at
+  ** the savepoint, and the pending ones are pinned again.
+  */
+  for (auto & entry: sp.nodes) {
+    RDtreeNode *node = node_hash_lookup(entry.first);
+    if (node && !entry.second.data.empty()) {
+      node->data = entry.second.data;
+    }
+  }
+  for (auto & entry: dirty_nodes) {
+    RDtreeNode *node = node_hash_lookup(entry.first);
+    if (node) {
+      node_incref(node);
+    }
+    else {
+      node = new RDtreeNode(this, nullptr);
+      node->nodeid = entry.first;
+      node_hash_insert(node);
+    }
+    node->data = entry.second;
+    node->dirty = true;
+    node_pin(node);
+  }
+
+  RDtreeNode *root = node_hash_lookup(1);
+  depth = root ? root->get_depth() : -1;
+
+  pending_changes = true;
+  sp.nodes.clear();
+  sp.rowids.clear();
+  sp.parents.clear();
+  return SQLITE_OK;
+}
+
 void RDtreeVtab::incref()
 {
   ++n_ref;
@@ -1914,6 +3069,11 @@ void RDtreeVtab::decref()
 {
   --n_ref;
   if (n_ref == 0) {
+    if (registry) {
+      auto & tables = registry->tables;
+      tables.erase(std::find(tables.begin(), tables.end(), this));
+    }
+    discard_pending();
     sqlite3_finalize(pReadNode);
     sqlite3_finalize(pWriteNode);
     sqlite3_finalize(pDeleteNode);
@@ -1923,6 +3083,8 @@ void RDtreeVtab::decref()
     sqlite3_finalize(pReadParent);
     sqlite3_finalize(pWriteParent);
     sqlite3_finalize(pDeleteParent);
+    sqlite3_finalize(pWriteTombstone);
+    sqlite3_finalize(pDeleteTombstone);
     sqlite3_finalize(pIncrementBitfreq);
     sqlite3_finalize(pDecrementBitfreq);
     sqlite3_finalize(pIncrementWeightfreq);
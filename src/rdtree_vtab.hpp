@@ -4,19 +4,62 @@
 #include <stack>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
 #include <sqlite3ext.h>
 extern const sqlite3_api_routines *sqlite3_api;
 
+#include "utils.hpp"
+#include "rdtree_cursor.hpp"
+
 class RDtreeNode;
 class RDtreeItem;
-class RDtreeCursor;
+class RDtreeVtab;
+
+/*
+** Per-connection state of the rdtree module. The registry holds the rd-tree
+** virtual tables currently connected, so that the SQL functions that operate
+** on a whole rd-tree (e.g. rdtree_compact) can access the vtab instance.
+** It also retains the traversal counters of the last completed query.
+*/
+struct RDtreeRegistry {
+  std::vector<RDtreeVtab *> tables;
+  RDtreeQueryStats last_query_stats;
+};
+
+/*
+** The state required to roll back to a savepoint that was opened while
+** changes to the tree were pending in memory: the content of the nodes,
+** the node mappings that were modified after the savepoint was opened
+** (as they were before the first change), and the frequency deltas.
+*/
+struct RDtreeSavedNode {
+  bool dirty;
+  Blob data;                   /* Empty if the node didn't exist */
+};
+
+struct RDtreeSavedMapping {
+  bool pending;
+  sqlite3_int64 value;
+};
+
+struct RDtreeSavepoint {
+  int savepoint_id;
+  std::unordered_map<sqlite3_int64, RDtreeSavedNode> nodes;
+  std::unordered_map<sqlite3_int64, RDtreeSavedMapping> rowids;
+  std::unordered_map<sqlite3_int64, RDtreeSavedMapping> parents;
+  std::vector<int> bitfreq_delta;
+  std::vector<int> weightfreq_delta;
+};
 
 class RDtreeVtab : public sqlite3_vtab {
 public:
   static const int RDTREE_MAX_BITSTRING_SIZE;
   static const int RDTREE_MAX_DEPTH;
+  static const int RDTREE_MAX_PINNED_NODES;
+  static const int RDTREE_MAX_PENDING_MAPPINGS;
 
   virtual ~RDtreeVtab() {}
 
@@ -40,18 +83,41 @@ public:
   int rowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid);
   int update(int argc, sqlite3_value **argv, sqlite_int64 *pRowid);
   int rename(const char *newname);
+  int begin();
+  int sync();
+  int commit();
+  int rollback();
+  int savepoint(int savepoint_id);
+  int release(int savepoint_id);
+  int rollback_to(int savepoint_id);
 
   void incref();
   void decref();
 
+  static const unsigned int RDTREE_FLAGS_UNASSIGNED;
+  static const unsigned int RDTREE_FLAGS_NO_PARENT_TABLE;
+  static const unsigned int RDTREE_FLAGS_TOMBSTONE_DELETE;
+
   static int init(
-    sqlite3 *db, int argc, const char *const*argv, 
+    sqlite3 *db, RDtreeRegistry *registry, int argc, const char *const*argv, 
 	  sqlite3_vtab **pvtab, char **err, int is_create);
 
+  static RDtreeVtab * lookup(
+    sqlite3 *db, RDtreeRegistry *registry, const char *db_name, const char *table_name);
+  static int find_table_schema(
+    sqlite3 *db, const char *table_name, std::string *db_name);
+
+  int compact(int *compacted);
+  void report_query_stats(const RDtreeQueryStats & stats);
+
   int get_node_bytes(int is_create);
   int sql_init(int is_create);
   int delete_rowid(sqlite3_int64 rowid);
+  int tombstone_rowid(sqlite3_int64 rowid);
   int delete_item(RDtreeNode *node, int item, int height);
+  int condense_node(RDtreeNode *node, int height);
+  int condense_tree(RDtreeNode *root);
+  void clear_removed_nodes();
   int insert_item(RDtreeNode *node, RDtreeItem *item, int height);
   int remove_node(RDtreeNode *node, int height);
   int reinsert_node_content(RDtreeNode *node);
@@ -59,7 +125,10 @@ public:
   int update_mapping(sqlite3_int64 rowid, RDtreeNode *node, int height);
   int adjust_tree(RDtreeNode *node, RDtreeItem *item);
   int update_node_bounds(RDtreeNode *node);
-  int load_parent_chain(RDtreeNode *leaf);
+  int load_parent_chain(RDtreeNode *node, int height);
+  int find_parent_node(RDtreeNode *node, int height, 
+		       RDtreeNode *child, int child_height,
+		       const RDtreeItem *bounds, bool *found);
   int new_rowid(sqlite3_int64 *rowid);
   int test_item(RDtreeCursor *csr, int height, bool *is_eof);
   int descend_to_item(RDtreeCursor *csr, int height, bool *is_eof);
@@ -86,6 +155,14 @@ public:
   int node_release(RDtreeNode *node);
   int node_minsize() {return node_capacity/3;}
 
+  bool has_parent_table() const {
+    return (flags & RDTREE_FLAGS_NO_PARENT_TABLE) == 0;
+  }
+  bool has_tombstone_table() const {
+    return (flags & RDTREE_FLAGS_TOMBSTONE_DELETE) != 0;
+  }
+  std::vector<std::string> shadow_table_names() const;
+
   void node_hash_insert(RDtreeNode * node);
   RDtreeNode * node_hash_lookup(sqlite3_int64 nodeid);
   void node_hash_remove(RDtreeNode * node);
@@ -96,7 +173,27 @@ public:
   int decrement_weightfreq(int weight);
 
   int rowid_write(sqlite3_int64 rowid, sqlite3_int64 nodeid);
+  int rowid_read(sqlite3_int64 rowid, sqlite3_int64 *nodeid, bool *found);
+  int rowid_delete(sqlite3_int64 rowid);
   int parent_write(sqlite3_int64 nodeid, sqlite3_int64 parentid);
+  int parent_read(sqlite3_int64 nodeid, sqlite3_int64 *parentid, bool *found);
+  int parent_delete(sqlite3_int64 nodeid);
+
+  int tombstones_load();
+  int tombstone_write(sqlite3_int64 rowid);
+  int tombstone_delete(sqlite3_int64 rowid);
+  bool is_tombstone(sqlite3_int64 rowid) const {
+    return !tombstones.empty() && tombstones.count(rowid) > 0;
+  }
+
+  void node_pin(RDtreeNode *node);
+  void node_unpin(RDtreeNode *node);
+  void node_save(RDtreeNode *node, bool created);
+  void mapping_save(bool parents, sqlite3_int64 key);
+  int flush_pending_rowids();
+  int flush_pending();
+  void discard_pending();
+  bool pending_over_limit() const;
 
   sqlite3 *db;                 /* Host database connection */
   int bfp_bytes;               /* Size (bytes) of the binary fingerprint */
@@ -104,9 +201,11 @@ public:
   int node_bytes;              /* Size (bytes) of each node in the node table */
   int node_capacity;           /* Size (items) of each node */
   int depth;                   /* Current depth of the rd-tree structure */
+  unsigned int flags;          /* Configuration flags (RDTREE_FLAGS_*) */
   std::string db_name;         /* Name of database containing rd-tree table */
   std::string table_name;      /* Name of rd-tree table */ 
   int n_ref;                   /* Current number of users of this structure */
+  RDtreeRegistry *registry;    /* Connected vtabs (the owner of this vtab) */
 
   /* Hash table of in-memory nodes. */
   std::unordered_map<sqlite3_int64, RDtreeNode *> node_hash; 
@@ -117,6 +216,37 @@ public:
   */
   std::stack<RDtreeNode *> removed_nodes;
 
+  /* Write-back state for the current transaction (see begin() and sync()).
+  **
+  ** While a write transaction is open, dirty nodes are not written to the
+  ** xxx_node table when their reference count drops to zero. An additional
+  ** reference is instead held in pinned_nodes, and the node is written
+  ** when the pending changes are flushed. Updates to the xxx_rowid and
+  ** xxx_parent mappings and to the frequency tables are similarly collected
+  ** in memory, so that each record is written at most once per flush.
+  */
+  bool deferred_writes;
+  bool pending_changes;
+  std::vector<RDtreeNode *> pinned_nodes;
+  std::unordered_map<sqlite3_int64, sqlite3_int64> pending_rowids;
+  std::unordered_map<sqlite3_int64, sqlite3_int64> pending_parents;
+  std::vector<int> bitfreq_delta;
+  std::vector<int> weightfreq_delta;
+
+  /* Savepoints opened while changes were pending (see savepoint()). The
+  ** pending changes are not written when a savepoint is opened, and the
+  ** state they had is instead saved here when it's first modified.
+  */
+  std::vector<RDtreeSavepoint> savepoints;
+
+  /* Rowids of the records that were deleted in tombstone mode. These
+  ** records are still stored in the tree, but they are skipped by the
+  ** cursors until the table is compacted. The set mirrors the xxx_tombstone
+  ** table, and it's reloaded when a transaction is rolled back.
+  */
+  std::unordered_set<sqlite3_int64> tombstones;
+  bool tombstones_loaded;
+
   /* Statements to read/write/delete a record from xxx_node */
   sqlite3_stmt *pReadNode;
   sqlite3_stmt *pWriteNode;
@@ -132,6 +262,10 @@ public:
   sqlite3_stmt *pWriteParent;
   sqlite3_stmt *pDeleteParent;
 
+  /* Statements to write/delete a record from xxx_tombstone */
+  sqlite3_stmt *pWriteTombstone;
+  sqlite3_stmt *pDeleteTombstone;
+
   /* Statements to update the bit frequencies in xxx_bitfreq */
   sqlite3_stmt *pIncrementBitfreq;
   sqlite3_stmt *pDecrementBitfreq;
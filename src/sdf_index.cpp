@@ -0,0 +1,196 @@
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+#include <sqlite3ext.h>
+extern const sqlite3_api_routines *sqlite3_api;
+
+#include "utils.hpp"
+#include "file_compression.hpp"
+#include "sdf_index.hpp"
+#include "logging.hpp"
+
+static const uint32_t SDF_INDEX_MAGIC = 0x53444658; // "SDFX"
+static const uint32_t SDF_INDEX_VERSION = 1;
+
+// magic, version, file size, file mtime, number of records
+static const std::size_t SDF_INDEX_HEADER_SIZE = 2*sizeof(uint32_t) + 3*sizeof(uint64_t);
+
+static bool file_status(const std::string & filename, uint64_t & size, int64_t & mtime)
+{
+  std::error_code ec;
+  size = std::filesystem::file_size(filename, ec);
+  if (ec) {
+    return false;
+  }
+  auto time = std::filesystem::last_write_time(filename, ec);
+  if (ec) {
+    return false;
+  }
+  mtime = time.time_since_epoch().count();
+  return true;
+}
+
+std::shared_ptr<SdfRecordIndex> SdfRecordIndex::open(
+  const std::string & filename, bool persistent, int * rc)
+{
+  std::shared_ptr<SdfRecordIndex> index(new SdfRecordIndex);
+  index->filename = filename;
+
+  if (!file_status(filename, index->file_size, index->file_mtime)) {
+    std::string message = "could not open file '" + filename + "'";
+    *rc = SQLITE_ERROR;
+    chemicalite_log(*rc, message.c_str());
+    return nullptr;
+  }
+
+  // an empty file can't be mapped, but it's a valid input with no records
+  if (index->file_size > 0) {
+    try {
+      index->file.open(filename);
+    }
+    catch (...) {
+      std::string message = "could not map file '" + filename + "'";
+      *rc = SQLITE_IOERR;
+      chemicalite_log(*rc, message.c_str());
+      return nullptr;
+    }
+    // the file was modified while it was opened
+    index->file_size = index->file.size();
+
+    if (detect_compression(index->file.data(), index->file.size()) != FileCompression::NONE) {
+      std::string message = "indexed access is not supported for compressed file '" + filename + "'";
+      *rc = SQLITE_ERROR;
+      chemicalite_log(*rc, message.c_str());
+      return nullptr;
+    }
+  }
+
+  std::string index_filename = filename + ".idx";
+  if (!persistent || !index->load(index_filename)) {
+    index->build();
+    if (persistent) {
+      index->save(index_filename);
+    }
+  }
+
+  return index;
+}
+
+bool SdfRecordIndex::is_current() const
+{
+  uint64_t size = 0;
+  int64_t mtime = 0;
+  return file_status(filename, size, mtime) && size == file_size && mtime == file_mtime;
+}
+
+std::string_view SdfRecordIndex::records(std::size_t first, std::size_t last) const
+{
+  if (first >= last) {
+    return std::string_view();
+  }
+  return std::string_view(file.data() + offsets[first], offsets[last] - offsets[first]);
+}
+
+void SdfRecordIndex::build()
+{
+  offsets.assign(1, 0);
+
+  const char * data = file.is_open() ? file.data() : nullptr;
+  std::size_t size = file.is_open() ? file.size() : 0;
+
+  // the content that follows the last delimiter is an additional record, if
+  // it's not only whitespace
+  bool open_record = false;
+  std::size_t pos = 0;
+  while (pos < size) {
+    const char * eol = (const char *) memchr(data + pos, '\n', size - pos);
+    std::size_t end = eol ? (eol - data) + 1 : size;
+    if (end - pos >= 4 && memcmp(data + pos, "$$$$", 4) == 0) {
+      offsets.push_back(end);
+      open_record = false;
+    }
+    else {
+      for (std::size_t ii = pos; !open_record && ii < end; ++ii) {
+        open_record = !isspace((unsigned char) data[ii]);
+      }
+    }
+    pos = end;
+  }
+
+  if (open_record) {
+    offsets.push_back(size);
+  }
+}
+
+bool SdfRecordIndex::load(const std::string & index_filename)
+{
+  std::ifstream ins(index_filename, std::ios::binary);
+  if (!ins.is_open()) {
+    return false;
+  }
+
+  Blob blob((std::istreambuf_iterator<char>(ins)), std::istreambuf_iterator<char>());
+  if (blob.size() < SDF_INDEX_HEADER_SIZE) {
+    return false;
+  }
+
+  const uint8_t * p = blob.data();
+  uint32_t magic = read_uint32(p); p += sizeof(uint32_t);
+  uint32_t version = read_uint32(p); p += sizeof(uint32_t);
+  uint64_t size = read_uint64(p); p += sizeof(uint64_t);
+  int64_t mtime = (int64_t) read_uint64(p); p += sizeof(uint64_t);
+  uint64_t count = read_uint64(p); p += sizeof(uint64_t);
+
+  if (magic != SDF_INDEX_MAGIC || version != SDF_INDEX_VERSION ||
+      size != file_size || mtime != file_mtime ||
+      blob.size() != SDF_INDEX_HEADER_SIZE + (count + 1)*sizeof(uint64_t)) {
+    // not an index, or an outdated one
+    return false;
+  }
+
+  std::vector<uint64_t> values(count + 1);
+  for (auto & value: values) {
+    value = read_uint64(p);
+    p += sizeof(uint64_t);
+  }
+
+  // the offsets are expected to be increasing and within the file boundaries
+  if (values[0] != 0 || values[count] > file_size) {
+    return false;
+  }
+  for (uint64_t ii = 0; ii < count; ++ii) {
+    if (values[ii] >= values[ii+1]) {
+      return false;
+    }
+  }
+
+  offsets = std::move(values);
+  return true;
+}
+
+void SdfRecordIndex::save(const std::string & index_filename) const
+{
+  Blob blob(SDF_INDEX_HEADER_SIZE + offsets.size()*sizeof(uint64_t));
+  uint8_t * p = blob.data();
+  p += write_uint32(p, SDF_INDEX_MAGIC);
+  p += write_uint32(p, SDF_INDEX_VERSION);
+  p += write_uint64(p, file_size);
+  p += write_uint64(p, (uint64_t) file_mtime);
+  p += write_uint64(p, num_records());
+  for (uint64_t offset: offsets) {
+    p += write_uint64(p, offset);
+  }
+
+  std::ofstream outs(index_filename, std::ios::binary | std::ios::trunc);
+  outs.write((const char *) blob.data(), blob.size());
+  outs.close();
+
+  if (!outs) {
+    // not fatal, the index will be rebuilt on the next access
+    std::string message = "could not write the SDF index file '" + index_filename + "'";
+    chemicalite_log(SQLITE_WARNING, message.c_str());
+  }
+}
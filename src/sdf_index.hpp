@@ -0,0 +1,45 @@
+#ifndef CHEMICALITE_SDF_INDEX_INCLUDED
+#define CHEMICALITE_SDF_INDEX_INCLUDED
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+
+/*
+** A memory-mapped SDF file, and the offsets of its records.
+**
+** The offsets are computed scanning the file for the "$$$$" delimiters, and
+** they can be optionally saved to (and loaded from) an index file, named
+** after the SDF file with an additional ".idx" extension. The saved index is
+** only used if the size and modification time of the SDF file match.
+*/
+class SdfRecordIndex {
+public:
+  static std::shared_ptr<SdfRecordIndex> open(
+    const std::string & filename, bool persistent, int * rc);
+
+  // true if the SDF file was not modified since the index was built
+  bool is_current() const;
+
+  std::size_t num_records() const { return offsets.size() - 1; }
+
+  // the text of the records in the [first, last) range (0-based)
+  std::string_view records(std::size_t first, std::size_t last) const;
+
+private:
+  SdfRecordIndex() = default;
+  void build();
+  bool load(const std::string & index_filename);
+  void save(const std::string & index_filename) const;
+
+  std::string filename;
+  std::uint64_t file_size = 0;
+  std::int64_t file_mtime = 0;
+  boost::iostreams::mapped_file_source file;
+  std::vector<std::uint64_t> offsets;
+};
+
+#endif
@@ -1,7 +1,10 @@
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstring>
 #include <fstream>
 #include <iomanip>
+#include <stdexcept>
 #include <string>
 #include <sstream>
 
@@ -16,7 +19,11 @@ extern const sqlite3_api_routines *sqlite3_api;
 #include "utils.hpp"
 #include "sdf_io.hpp"
 #include "file_io.hpp"
+#include "file_compression.hpp"
+#include "file_pipeline.hpp"
+#include "sdf_index.hpp"
 #include "mol.hpp"
+#include "map_function.hpp"
 #include "logging.hpp"
 
 
@@ -24,9 +31,14 @@ class SdfReaderVtab : public sqlite3_vtab {
 public:
   std::string filename;
   PropColumnPtrs columns;
+  int threads;
+  bool use_index;
+  bool persistent_index;
+  std::shared_ptr<SdfRecordIndex> record_index;
   bool is_function;
 
   SdfReaderVtab()
+    : filename(), threads(1), use_index(false), persistent_index(false)
   {
     nRef = 0;
     pModule = 0;
@@ -39,7 +51,7 @@ public:
     if ((argc == 3) && (std::string(argv[0]) == std::string(argv[2]))) {
       is_function = true;
 
-      int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(molecule MOL, filename TEXT HIDDEN)");
+      int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(molecule MOL, filename TEXT HIDDEN, threads INTEGER HIDDEN)");
 
       if (rc != SQLITE_OK) {
         *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
@@ -59,9 +71,9 @@ public:
     std::istringstream filename_ss(argv[3]);
     filename_ss >> std::quoted(filename, '\'');
 
-    if (argc > 5) {
+    if (argc > 7) {
       chemicalite_log(
-        SQLITE_ERROR, "the sdf_reader virtual table expects at most one optional schema argument");
+        SQLITE_ERROR, "the sdf_reader virtual table expects at most three optional arguments (schema, threads, index)");
       return SQLITE_ERROR;
     }
   
@@ -98,6 +110,40 @@ public:
         if (rc != SQLITE_OK) {
           return rc;
         }
+      }
+      else if (arg_name == "threads") {
+        try {
+          threads = std::stoi(std::string(arg, eq_pos+1, std::string::npos));
+        }
+        catch (...) {
+          threads = 0;
+        }
+        if (threads < 1) {
+          std::string error = "could not parse \"" + arg + "\": invalid number of threads";
+          chemicalite_log(SQLITE_ERROR, error.c_str());
+          return SQLITE_ERROR;
+        }
+      }
+      else if (arg_name == "index") {
+        // the records are accessed through a memory-mapped file and an index
+        // of their offsets, that is only kept in memory, or also saved to file
+        std::string arg_value;
+        std::istringstream arg_value_ss(std::string(arg, eq_pos+1, std::string::npos));
+        arg_value_ss >> std::quoted(arg_value, '\'');
+        boost::trim(arg_value);
+        if (arg_value == "memory") {
+          use_index = true;
+          persistent_index = false;
+        }
+        else if (arg_value == "file") {
+          use_index = true;
+          persistent_index = true;
+        }
+        else if (arg_value != "none") {
+          std::string error = "could not parse \"" + arg + "\": index should be one of none, memory, file";
+          chemicalite_log(SQLITE_ERROR, error.c_str());
+          return SQLITE_ERROR;
+        }
       } else {
         std::string error = "could not parse \"" + arg + "\": unexpected arg name: " + arg_name;
         chemicalite_log(SQLITE_ERROR, error.c_str());
@@ -122,6 +168,24 @@ public:
 
 };
 
+/*
+** Reported in idxNum when the molecule column is not used. The records are
+** then not parsed, and the values of the property columns are extracted from
+** the text of the records.
+*/
+static const int SDF_SCAN_PROPS_ONLY = 1 << 5;
+
+/*
+** The rowid constraints supported by the indexed access, as reported in idxNum
+*/
+enum SdfRowidConstraint : int {
+  ROWID_EQ = 1,
+  ROWID_GT = 2,
+  ROWID_GE = 4,
+  ROWID_LT = 8,
+  ROWID_LE = 16
+};
+
 static int sdfReaderInit(sqlite3 *db, void */*pAux*/,
                       int argc, const char * const *argv,
                       sqlite3_vtab **ppVTab,
@@ -152,28 +216,98 @@ int sdfReaderBestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIndexInfo)
   if (vtab->is_function) {
     // We expect the filename to be provided as an argument to the table-valued function
     // and made available to this code as an equality constraint on the hidden filename
-    // column (the 2nd column in the declared vtab schema)
-    bool found = false;
+    // column (the 2nd column in the declared vtab schema). The number of threads
+    // (the 3rd column) is optional.
+    int col_pos[3] = {-1, -1, -1};
     for (int ii=0; ii<pIndexInfo->nConstraint; ++ii) {
-      if (pIndexInfo->aConstraint[ii].iColumn == 1 &&
+      int col = pIndexInfo->aConstraint[ii].iColumn;
+      if ((col == 1 || col == 2) &&
           pIndexInfo->aConstraint[ii].op == SQLITE_INDEX_CONSTRAINT_EQ) {
         if (!pIndexInfo->aConstraint[ii].usable) {
           return SQLITE_CONSTRAINT;
         }
-        pIndexInfo->aConstraintUsage[ii].argvIndex = 1;
-        found = true;
-        break;
+        col_pos[col] = ii;
       }
     }
-    if (!found) {
+    if (col_pos[1] < 0) {
       chemicalite_log(
         SQLITE_ERROR, "the sdf_reader function requires a filename argument");
       return SQLITE_ERROR;
     }
+    pIndexInfo->aConstraintUsage[col_pos[1]].argvIndex = 1;
+    if (col_pos[2] >= 0) {
+      pIndexInfo->aConstraintUsage[col_pos[2]].argvIndex = 2;
+    }
+  }
+
+  /* The records are always returned in file (rowid) order */
+  if (pIndexInfo->nOrderBy == 1 &&
+      pIndexInfo->aOrderBy[0].iColumn < 0 && !pIndexInfo->aOrderBy[0].desc) {
+    pIndexInfo->orderByConsumed = 1;
   }
 
-  /* A forward scan is the only supported mode, this method is therefore very minimal */
   pIndexInfo->estimatedCost = 100000; 
+
+  int idx_num = (pIndexInfo->colUsed & 1) ? 0 : SDF_SCAN_PROPS_ONLY;
+  pIndexInfo->idxNum = idx_num;
+
+  if (vtab->is_function || !vtab->use_index) {
+    /* A forward scan is the only supported mode */
+    return SQLITE_OK;
+  }
+
+  /* With an index of the records, constraints on the rowid are used to seek
+  ** the first record and to stop the scan. The constraints are not omitted, so
+  ** that SQLite will still check the values that are not exact integers.
+  */
+  int eq_pos = -1;
+  int lower_pos = -1;
+  int upper_pos = -1;
+  for (int ii=0; ii<pIndexInfo->nConstraint; ++ii) {
+    if (pIndexInfo->aConstraint[ii].iColumn >= 0 || !pIndexInfo->aConstraint[ii].usable) {
+      continue;
+    }
+    switch (pIndexInfo->aConstraint[ii].op) {
+      case SQLITE_INDEX_CONSTRAINT_EQ:
+        eq_pos = ii;
+        break;
+      case SQLITE_INDEX_CONSTRAINT_GT:
+      case SQLITE_INDEX_CONSTRAINT_GE:
+        lower_pos = ii;
+        break;
+      case SQLITE_INDEX_CONSTRAINT_LT:
+      case SQLITE_INDEX_CONSTRAINT_LE:
+        upper_pos = ii;
+        break;
+      default:
+        break;
+    }
+  }
+
+  int argc = 0;
+  if (eq_pos >= 0) {
+    idx_num |= SdfRowidConstraint::ROWID_EQ;
+    pIndexInfo->aConstraintUsage[eq_pos].argvIndex = ++argc;
+    pIndexInfo->estimatedCost = 1;
+    pIndexInfo->estimatedRows = 1;
+    pIndexInfo->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+  }
+  else {
+    if (lower_pos >= 0) {
+      idx_num |= (pIndexInfo->aConstraint[lower_pos].op == SQLITE_INDEX_CONSTRAINT_GT) ?
+        SdfRowidConstraint::ROWID_GT : SdfRowidConstraint::ROWID_GE;
+      pIndexInfo->aConstraintUsage[lower_pos].argvIndex = ++argc;
+      pIndexInfo->estimatedCost /= 4;
+    }
+    if (upper_pos >= 0) {
+      idx_num |= (pIndexInfo->aConstraint[upper_pos].op == SQLITE_INDEX_CONSTRAINT_LT) ?
+        SdfRowidConstraint::ROWID_LT : SdfRowidConstraint::ROWID_LE;
+      pIndexInfo->aConstraintUsage[upper_pos].argvIndex = ++argc;
+      pIndexInfo->estimatedCost /= 4;
+    }
+  }
+  pIndexInfo->idxNum = idx_num;
+
   return SQLITE_OK;
 }
 
@@ -184,13 +318,294 @@ static int sdfReaderDisconnectDestroy(sqlite3_vtab *pVTab)
   return SQLITE_OK;
 }
 
+/*
+** A record parsed by the worker threads of the pipelined reader, the binary
+** molecule is serialized in advance, while the ROMol is retained to provide
+** the values of the property columns. If the record can't be parsed, the
+** values are instead extracted from its text.
+*/
+struct SdfRecord {
+  std::unique_ptr<RDKit::ROMol> mol;
+  Blob blob;
+  PropValues values;
+};
+
+/*
+** The pipeline chunks contain the text of up to SDF_CHUNK_RECORDS records,
+** and a maximum of SDF_CHUNKS_PER_THREAD chunks per worker thread are read
+** in advance.
+*/
+static const std::size_t SDF_CHUNK_RECORDS = 64;
+static const std::size_t SDF_CHUNKS_PER_THREAD = 4;
+
+/*
+** Append the text of the next record to the argument, splitting the input
+** stream on the "$$$$" record delimiters. Return false if no more records
+** are available.
+*/
+static bool read_sdf_record(std::istream & ins, std::string & text)
+{
+  std::string line;
+  bool open_record = false;
+  while (std::getline(ins, line)) {
+    text += line;
+    text += '\n';
+    if (line.compare(0, 4, "$$$$") == 0) {
+      return true;
+    }
+    if (!open_record && !boost::trim_copy(line).empty()) {
+      open_record = true;
+    }
+  }
+  if (ins.bad()) {
+    throw std::runtime_error("error reading the SDF input");
+  }
+  // a last record not terminated by the delimiter
+  return open_record;
+}
+
+bool read_sdf_chunk(std::istream & ins, FileChunk & chunk)
+{
+  while (chunk.num_records < SDF_CHUNK_RECORDS) {
+    if (!read_sdf_record(ins, chunk.text)) {
+      return false;
+    }
+    ++chunk.num_records;
+  }
+  return true;
+}
+
+/*
+** Extract the header lines and the data items of an SD record, without
+** parsing the molecule. The values are assigned to the same property names
+** used by the RDKit SD parser.
+*/
+static void parse_sdf_fields(std::string_view text, PropValues & values)
+{
+  static const char * HEADER_PROPS[] = {"_Name", "_MolFileInfo", "_MolFileComments"};
+
+  std::size_t pos = 0;
+  std::size_t line_num = 0;
+  bool in_data = false;
+  bool in_value = false;
+  std::string label;
+  std::string value;
+  while (pos < text.size()) {
+    std::size_t eol = text.find('\n', pos);
+    std::size_t end = (eol == std::string_view::npos) ? text.size() : eol;
+    std::string_view line = text.substr(pos, end - pos);
+    pos = end + 1;
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
+
+    if (line.compare(0, 4, "$$$$") == 0) {
+      break;
+    }
+    else if (line_num < 3) {
+      values[HEADER_PROPS[line_num++]] = std::string(line);
+    }
+    else if (!in_data) {
+      // the data items follow the connection table
+      in_data = (line.compare(0, 6, "M  END") == 0);
+    }
+    else if (in_value) {
+      // a value may span multiple lines, and it's terminated by a blank line
+      if (line.empty()) {
+        values[label] = value;
+        in_value = false;
+      }
+      else {
+        if (!value.empty()) {
+          value += '\n';
+        }
+        value += line;
+      }
+    }
+    else if (!line.empty() && line[0] == '>') {
+      // the data header line includes the label enclosed in angle brackets
+      std::size_t label_start = line.find('<');
+      std::size_t label_end = line.find('>', label_start);
+      label.clear();
+      if (label_start != std::string_view::npos && label_end != std::string_view::npos) {
+        label = line.substr(label_start + 1, label_end - label_start - 1);
+      }
+      value.clear();
+      in_value = true;
+    }
+  }
+
+  if (in_value) {
+    values[label] = value;
+  }
+}
+
+/*
+** Split the text of consecutive records on the "$$$$" delimiter lines, in
+** the same way read_sdf_record does
+*/
+static std::vector<std::string_view> split_sdf_records(std::string_view text)
+{
+  std::vector<std::string_view> records;
+  std::size_t start = 0;
+  std::size_t pos = 0;
+  while (pos < text.size()) {
+    std::size_t eol = text.find('\n', pos);
+    std::size_t end = (eol == std::string_view::npos) ? text.size() : eol + 1;
+    if (text.compare(pos, 4, "$$$$") == 0) {
+      records.push_back(text.substr(start, end - start));
+      start = end;
+    }
+    pos = end;
+  }
+  if (start < text.size()) {
+    records.push_back(text.substr(start));
+  }
+  return records;
+}
+
+void parse_sdf_chunk_mols(const FileChunk & chunk, std::vector<std::unique_ptr<RDKit::ROMol>> & mols)
+{
+  // the records are parsed from the chunk text, without copying it
+  MemoryStreamBuf buf(chunk.text.data(), chunk.text.size());
+  std::istream ins(&buf);
+  RDKit::ForwardSDMolSupplier supplier(&ins, false);
+
+  mols.resize(chunk.num_records);
+  for (auto & mol: mols) {
+    try {
+      mol.reset(supplier.next());
+    }
+    catch (...) {
+      // the position of the next record in the chunk is not known anymore,
+      // the remaining records are returned as NULL
+      chemicalite_log(SQLITE_ERROR, "error parsing SDF record");
+      break;
+    }
+  }
+}
+
+static void parse_sdf_chunk(const FileChunk & chunk, std::vector<SdfRecord> & records)
+{
+  std::vector<std::unique_ptr<RDKit::ROMol>> mols;
+  parse_sdf_chunk_mols(chunk, mols);
+
+  std::vector<std::string_view> texts;
+  records.resize(mols.size());
+  for (std::size_t ii = 0; ii < mols.size(); ++ii) {
+    auto & record = records[ii];
+    record.mol = std::move(mols[ii]);
+    if (record.mol) {
+      int rc = SQLITE_OK;
+      record.blob = mol_to_blob(*record.mol, &rc);
+    }
+    else {
+      if (texts.empty()) {
+        texts = split_sdf_records(chunk.text);
+      }
+      if (ii < texts.size()) {
+        parse_sdf_fields(texts[ii], record.values);
+      }
+    }
+  }
+}
+
+static RDKit::ROMol * parse_sdf_record(std::string_view text)
+{
+  MemoryStreamBuf buf(text.data(), text.size());
+  std::istream ins(&buf);
+  RDKit::ForwardSDMolSupplier supplier(&ins, false);
+  try {
+    return supplier.next();
+  }
+  catch (...) {
+    chemicalite_log(SQLITE_ERROR, "error parsing SDF record");
+  }
+  return nullptr;
+}
+
+using SdfPipeline = FilePipeline<SdfRecord>;
+
 struct SdfReaderCursor : public sqlite3_vtab_cursor {
   std::string filename;
-  std::unique_ptr<RDKit::ForwardSDMolSupplier> supplier;
+  int threads;
+  bool parse_molecule;
+  std::unique_ptr<std::istream> input;
+  PropValues values;
+  std::unique_ptr<SdfPipeline> pipeline;
+  std::shared_ptr<SdfRecordIndex> record_index;
+  sqlite3_int64 last_rowid;
+  bool eof;
   sqlite3_int64 rowid;
   std::unique_ptr<RDKit::ROMol> mol;
+  Blob blob;
+  // the text of the current record, for the single-threaded scan (retained
+  // across the records, to reuse its allocation)
+  std::string record_text;
+
+  int next();
 };
 
+int SdfReaderCursor::next()
+{
+  if (pipeline) {
+    SdfRecord record;
+    if (pipeline->next(record)) {
+      rowid += 1;
+      mol = std::move(record.mol);
+      blob = std::move(record.blob);
+      values = std::move(record.values);
+    }
+    else if (pipeline->failed()) {
+      std::string message = "error reading file '" + filename + "'";
+      chemicalite_log(SQLITE_IOERR, message.c_str());
+      return SQLITE_IOERR;
+    }
+    else {
+      eof = true;
+    }
+    return SQLITE_OK;
+  }
+
+  std::string_view text;
+  if (record_index) {
+    if (rowid >= last_rowid) {
+      eof = true;
+      return SQLITE_OK;
+    }
+    text = record_index->records(rowid, rowid + 1);
+  }
+  else {
+    bool found = false;
+    record_text.clear();
+    try {
+      found = read_sdf_record(*input, record_text);
+    }
+    catch (...) {
+      std::string message = "error reading file '" + filename + "'";
+      chemicalite_log(SQLITE_IOERR, message.c_str());
+      return SQLITE_IOERR;
+    }
+    if (!found) {
+      eof = true;
+      return SQLITE_OK;
+    }
+    text = record_text;
+  }
+
+  rowid += 1;
+  values.clear();
+  if (parse_molecule) {
+    mol.reset(parse_sdf_record(text));
+  }
+  // the property values are only extracted from the text of the record if
+  // the molecule is not parsed, or if it can't be parsed
+  if (!mol) {
+    parse_sdf_fields(text, values);
+  }
+  return SQLITE_OK;
+}
+
 static int sdfReaderOpen(sqlite3_vtab */*pVTab*/, sqlite3_vtab_cursor **ppCursor)
 {
   int rc = SQLITE_OK;
@@ -206,17 +621,62 @@ static int sdfReaderClose(sqlite3_vtab_cursor *pCursor)
   return SQLITE_OK;
 }
 
-static int sdfReaderFilter(sqlite3_vtab_cursor *pCursor, int /*idxNum*/, const char */*idxStr*/,
+/*
+** Compute the range of rowids that satisfy the constraints passed to xFilter.
+** Values that are not numeric leave the range unbounded.
+*/
+static void sdf_rowid_range(
+  int idxNum, int argc, sqlite3_value **argv, sqlite3_int64 & first, sqlite3_int64 & last)
+{
+  int argn = 0;
+  for (int flag: {SdfRowidConstraint::ROWID_EQ,
+                  SdfRowidConstraint::ROWID_GT, SdfRowidConstraint::ROWID_GE,
+                  SdfRowidConstraint::ROWID_LT, SdfRowidConstraint::ROWID_LE}) {
+    if (!(idxNum & flag) || argn >= argc) {
+      continue;
+    }
+    sqlite3_value *arg = argv[argn++];
+    int value_type = sqlite3_value_numeric_type(arg);
+    if (value_type != SQLITE_INTEGER && value_type != SQLITE_FLOAT) {
+      continue;
+    }
+    double value = sqlite3_value_double(arg);
+    // avoid overflows when converting the bounds to integer
+    value = std::max(-1., std::min(value, (double) last + 1));
+    switch (flag) {
+      case SdfRowidConstraint::ROWID_EQ:
+        first = std::max(first, (sqlite3_int64) std::ceil(value));
+        last = std::min(last, (sqlite3_int64) std::floor(value));
+        break;
+      case SdfRowidConstraint::ROWID_GT:
+        first = std::max(first, (sqlite3_int64) std::floor(value) + 1);
+        break;
+      case SdfRowidConstraint::ROWID_GE:
+        first = std::max(first, (sqlite3_int64) std::ceil(value));
+        break;
+      case SdfRowidConstraint::ROWID_LT:
+        last = std::min(last, (sqlite3_int64) std::ceil(value) - 1);
+        break;
+      case SdfRowidConstraint::ROWID_LE:
+        last = std::min(last, (sqlite3_int64) std::floor(value));
+        break;
+    }
+  }
+  // make sure that [first-1, last) is a valid range of record positions
+  last = std::max(last, first - 1);
+}
+
+static int sdfReaderFilter(sqlite3_vtab_cursor *pCursor, int idxNum, const char */*idxStr*/,
                      int argc, sqlite3_value **argv)
 {
   SdfReaderCursor *p = (SdfReaderCursor *)pCursor;
   SdfReaderVtab *vtab = (SdfReaderVtab *)p->pVtab;
 
   if (vtab->is_function) {
-    // a single arg is expected
-    if (argc != 1) {
+    // the filename and optionally the number of threads are expected
+    if (argc < 1 || argc > 2) {
       chemicalite_log(
-        SQLITE_ERROR, "the sdf_reader function expects one single argument");
+        SQLITE_ERROR, "the sdf_reader function expects one or two arguments");
       return SQLITE_ERROR;
     }
 
@@ -230,81 +690,157 @@ static int sdfReaderFilter(sqlite3_vtab_cursor *pCursor, int /*idxNum*/, const c
     }
 
     p->filename = (const char *)sqlite3_value_text(arg);
+
+    p->threads = 1;
+    if (argc > 1) {
+      arg = argv[1];
+      if (sqlite3_value_type(arg) != SQLITE_INTEGER) {
+        chemicalite_log(
+          SQLITE_ERROR, "the sdf_reader function expects the threads argument to be of type INTEGER");
+        return SQLITE_MISMATCH;
+      }
+      p->threads = sqlite3_value_int(arg);
+      if (p->threads < 1) {
+        chemicalite_log(
+          SQLITE_ERROR, "the sdf_reader function requires a positive number of threads");
+        return SQLITE_ERROR;
+      }
+    }
   }
   else {
     p->filename = vtab->filename;
+    p->threads = vtab->threads;
   }
 
-  std::unique_ptr<std::ifstream> pins(new std::ifstream(p->filename));
+  // a cursor may be rewound, release the state of any previous scan
+  p->pipeline.reset();
+  p->input.reset();
+  p->record_index.reset();
+  p->values.clear();
+  p->mol.reset();
+  p->blob.clear();
+  p->eof = false;
+  p->rowid = 0;
+  p->parse_molecule = !(idxNum & SDF_SCAN_PROPS_ONLY);
+
+  if (!vtab->is_function && vtab->use_index) {
+    // (re)build the index of the records if the file was modified
+    if (!vtab->record_index || !vtab->record_index->is_current()) {
+      int rc = SQLITE_OK;
+      vtab->record_index = SdfRecordIndex::open(vtab->filename, vtab->persistent_index, &rc);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+    }
+    p->record_index = vtab->record_index;
+
+    sqlite3_int64 first = 1;
+    sqlite3_int64 last = p->record_index->num_records();
+    sdf_rowid_range(idxNum, argc, argv, first, last);
+    p->rowid = first - 1;
+    p->last_rowid = last;
+
+    if (p->threads > 1 && p->parse_molecule) {
+      // the chunks of records are read from the mapped file
+      std::shared_ptr<SdfRecordIndex> index = p->record_index;
+      std::size_t pos = first - 1;
+      std::size_t end = last;
+      p->pipeline.reset(new SdfPipeline(
+        [index, pos, end](FileChunk & chunk) mutable {
+          std::size_t chunk_end = std::min(pos + SDF_CHUNK_RECORDS, end);
+          chunk.text = index->records(pos, chunk_end);
+          chunk.num_records = chunk_end - pos;
+          pos = chunk_end;
+          return pos < end;
+        },
+        parse_sdf_chunk, p->threads, SDF_CHUNKS_PER_THREAD*p->threads));
+    }
 
-  if (!pins->is_open()) {
-    // Maybe log something
-    std::string message = "could not open file '" + p->filename + "'";
-    chemicalite_log(SQLITE_ERROR, message.c_str());
-    return SQLITE_ERROR;
+    return p->next();
   }
 
-  p->supplier.reset(new RDKit::ForwardSDMolSupplier(pins.release(), true));
-  if (!p->supplier->atEnd()) {
-    p->rowid = 1;
-    p->mol.reset(p->supplier->next());
+  // compressed files are decompressed by a background thread
+  int rc = SQLITE_OK;
+  FileCompression compression = FileCompression::NONE;
+  std::unique_ptr<std::istream> pins = open_input_file(p->filename, &compression, &rc);
+
+  if (!pins) {
+    return rc;
   }
 
-  return SQLITE_OK;
+  if (p->threads > 1 && p->parse_molecule) {
+    // a reader thread splits the input in chunks of records, that are parsed
+    // and serialized by the worker threads
+    std::shared_ptr<std::istream> ins(pins.release());
+    p->pipeline.reset(new SdfPipeline(
+      [ins](FileChunk & chunk) { return read_sdf_chunk(*ins, chunk); },
+      parse_sdf_chunk, p->threads, SDF_CHUNKS_PER_THREAD*p->threads));
+  }
+  else {
+    // the text of each record is read, so that the property values are
+    // available also if the molecule can't be parsed
+    p->input = std::move(pins);
+  }
+
+  return p->next();
 }
 
 static int sdfReaderNext(sqlite3_vtab_cursor *pCursor)
 {
   SdfReaderCursor * p = (SdfReaderCursor *)pCursor;
-  if (!p->supplier->atEnd()) {
-    p->rowid += 1;
-    p->mol.reset(p->supplier->next());
-  }
-  return SQLITE_OK;
+  return p->next();
 }
 
 static int sdfReaderEof(sqlite3_vtab_cursor *pCursor)
 {
   SdfReaderCursor * p = (SdfReaderCursor *)pCursor;
-  return p->supplier->atEnd() ? 1 : 0;
+  return p->eof ? 1 : 0;
 }
 
 static int sdfReaderColumn(sqlite3_vtab_cursor *pCursor, sqlite3_context *ctx, int N)
 {
   SdfReaderCursor * p = (SdfReaderCursor *)pCursor;
+  SdfReaderVtab * vtab = (SdfReaderVtab *) p->pVtab;
 
-  if (!p->mol) {
-      sqlite3_result_null(ctx);
+  if (N > 0 && vtab->is_function) {
+    // the hidden args of the table-valued function
+    if (N == 1) {
+      sqlite3_result_text(ctx, p->filename.c_str(), -1, SQLITE_TRANSIENT);
+    }
+    else {
+      sqlite3_result_int(ctx, p->threads);
+    }
   }
-  else if (N == 0) {
-    // the molecule
+  else if (N > 0) {
+    // The requested index must map to one of the additional columns
+    // that provide access to the mol properties. If the molecule was not
+    // parsed, or it could not be parsed, the values are taken from the
+    // text of the record.
+    assert(N <= int(vtab->columns.size()));
     if (p->mol) {
-      int rc = SQLITE_OK;
-      Blob blob = mol_to_blob(*p->mol, &rc);
-      if (rc == SQLITE_OK) {
-        sqlite3_result_blob(ctx, blob.data(), blob.size(), SQLITE_TRANSIENT);
-      }
-      else {
-        sqlite3_result_error_code(ctx, rc);
-      }
+      vtab->columns[N-1]->sqlite3_result(*p->mol, ctx);
     }
     else {
-      sqlite3_result_null(ctx);
+      vtab->columns[N-1]->sqlite3_result(p->values, ctx);
     }
   }
-  else {
-    SdfReaderVtab * vtab = (SdfReaderVtab *) p->pVtab;
-    
-    if (vtab->is_function) {
-      sqlite3_result_text(ctx, p->filename.c_str(), -1, SQLITE_TRANSIENT);
+  else if (!p->blob.empty()) {
+    // the molecule, already serialized by the pipeline
+    sqlite3_result_blob(ctx, p->blob.data(), p->blob.size(), SQLITE_TRANSIENT);
+  }
+  else if (p->mol) {
+    int rc = SQLITE_OK;
+    Blob blob = mol_to_blob(*p->mol, &rc);
+    if (rc == SQLITE_OK) {
+      sqlite3_result_blob(ctx, blob.data(), blob.size(), SQLITE_TRANSIENT);
     }
     else {
-      // The requested index must map to one of the additional columns
-      // that provide access to the mol properties
-      assert(N <= int(vtab->columns.size()));
-      vtab->columns[N-1]->sqlite3_result(*p->mol, ctx);
+      sqlite3_result_error_code(ctx, rc);
     }
   }
+  else {
+    sqlite3_result_null(ctx);
+  }
 
   return SQLITE_OK;
 }
@@ -355,25 +891,56 @@ static sqlite3_module sdfReaderModule = {
 };
 
 
+/*
+** The output file is written through a buffer of SDF_WRITER_BUFFER_SIZE bytes
+** (unless a different size is requested). In the multi-threaded mode, the
+** molecules are decoded and formatted by the workers in batches of
+** SDF_WRITER_BATCH_RECORDS records, and at most SDF_WRITER_BATCHES_PER_THREAD
+** batches per worker thread are waiting to be written.
+*/
+static const int SDF_WRITER_BUFFER_SIZE = 1 << 20;
+static const std::size_t SDF_WRITER_BATCH_RECORDS = 64;
+static const std::size_t SDF_WRITER_BATCHES_PER_THREAD = 4;
+
+using SdfOutputPipeline = OutputPipeline<MapValue>;
+
 struct SdfWriterAggregateContext {
-  std::shared_ptr<RDKit::SDWriter> writer;
+  std::unique_ptr<OutputFileStream> outs;
+  std::unique_ptr<RDKit::SDWriter> writer;
+  std::unique_ptr<SdfOutputPipeline> pipeline;
+  int num_mols = 0;
 };
 
-void sdf_writer_step(sqlite3_context* ctx, int, sqlite3_value** argv)
+/*
+** Format a serialized molecule as an SD record (called by the workers)
+*/
+static bool format_sdf_record(const MapValue & value, std::string & text)
+{
+  int rc = SQLITE_OK;
+  std::unique_ptr<RDKit::ROMol> mol(map_arg_to_romol(value, &rc));
+  if (rc != SQLITE_OK) {
+    return false;
+  }
+
+  // a dedicated SDWriter produces the same output as the sequential writer
+  std::ostringstream outs;
+  try {
+    RDKit::SDWriter writer(&outs, false);
+    writer.write(*mol);
+    writer.close();
+  }
+  catch (...) {
+    return false;
+  }
+  text += outs.str();
+  return true;
+}
+
+void sdf_writer_step(sqlite3_context* ctx, int argc, sqlite3_value** argv)
 {
   // get the input args
   sqlite3_value *mol_arg = argv[0];
-
-  std::unique_ptr<RDKit::ROMol> mol;
-  if (sqlite3_value_type(mol_arg) != SQLITE_NULL) {
-    int rc = SQLITE_OK;
-    mol.reset(arg_to_romol(mol_arg, &rc));
-    if (rc != SQLITE_OK) {
-      chemicalite_log(SQLITE_MISMATCH, "invalid molecule input");
-      sqlite3_result_error_code(ctx, rc);
-      return;
-    }
-  } 
+  int mol_type = sqlite3_value_type(mol_arg);
 
   sqlite3_value *filename_arg = argv[1];
 
@@ -391,6 +958,58 @@ void sdf_writer_step(sqlite3_context* ctx, int, sqlite3_value** argv)
 
   std::string filename((const char *)sqlite3_value_text(filename_arg));
 
+  // assign the default values to the optional args
+  int threads = 1;
+  int buffer_size = SDF_WRITER_BUFFER_SIZE;
+
+  if (argc > 2) {
+    sqlite3_value *arg = argv[2];
+    int type = sqlite3_value_type(arg);
+    if (type == SQLITE_NULL) {
+      ; // ok, keep the default value
+    }
+    else if (type != SQLITE_INTEGER || sqlite3_value_int(arg) < 1) {
+      chemicalite_log(SQLITE_MISMATCH, "threads argument must be a positive integer");
+      sqlite3_result_error_code(ctx, SQLITE_MISMATCH);
+      return;
+    }
+    else {
+      threads = sqlite3_value_int(arg);
+    }
+  }
+
+  if (argc > 3) {
+    sqlite3_value *arg = argv[3];
+    int type = sqlite3_value_type(arg);
+    if (type == SQLITE_NULL) {
+      ; // ok, keep the default value
+    }
+    else if (type != SQLITE_INTEGER || sqlite3_value_int(arg) < 1) {
+      chemicalite_log(SQLITE_MISMATCH, "buffer_size argument must be a positive integer");
+      sqlite3_result_error_code(ctx, SQLITE_MISMATCH);
+      return;
+    }
+    else {
+      buffer_size = sqlite3_value_int(arg);
+    }
+  }
+
+  FileCompression compression = compression_from_extension(filename);
+
+  if (argc > 4) {
+    sqlite3_value *arg = argv[4];
+    int type = sqlite3_value_type(arg);
+    if (type == SQLITE_NULL) {
+      ; // ok, keep the compression format from the filename extension
+    }
+    else if (type != SQLITE_TEXT ||
+             !compression_from_name((const char *)sqlite3_value_text(arg), &compression)) {
+      chemicalite_log(SQLITE_MISMATCH, "compression argument must be one of 'none', 'gzip' or 'zstd'");
+      sqlite3_result_error_code(ctx, SQLITE_MISMATCH);
+      return;
+    }
+  }
+
   // get the aggregate context
   void **agg = (void **) sqlite3_aggregate_context(ctx, sizeof(void *));
 
@@ -402,31 +1021,67 @@ void sdf_writer_step(sqlite3_context* ctx, int, sqlite3_value** argv)
   }  
 
   if (!*agg) {
-    // open the output file stream, allocate an aggregate context, and initialize the writer
-    std::unique_ptr<std::ofstream> pouts(new std::ofstream(filename));
+    // allocate an aggregate context, and open the output file stream (if
+    // compressed, the output is compressed by a background thread)
+    std::unique_ptr<SdfWriterAggregateContext> context(new SdfWriterAggregateContext);
 
-    if (!pouts->is_open()) {
+    int rc = SQLITE_OK;
+    context->outs = open_output_file(filename, compression, buffer_size, &rc);
+
+    if (!context->outs) {
       std::string message = "could not open file '" + filename + "'";
-      chemicalite_log(SQLITE_ERROR, message.c_str());
       sqlite3_result_error(ctx, message.c_str(), -1);
       return;
     }
 
-    // create the SD writer, instructing it to take ownership of the ofstream pointer
-    std::shared_ptr<RDKit::SDWriter> writer(new RDKit::SDWriter(pouts.release(), true));
-    // create the aggregate context, and assign the writer to it
-    std::unique_ptr<SdfWriterAggregateContext> context(new SdfWriterAggregateContext);
-    context->writer = writer;
+    if (threads > 1) {
+      // the molecules are decoded and formatted by the workers, and a writer
+      // thread appends the records to the output file in the input order
+      OutputFileStream * outs = context->outs.get();
+      context->pipeline.reset(new SdfOutputPipeline(
+        format_sdf_record,
+        [outs](const std::string & text) { outs->write(text.data(), text.size()); },
+        threads, SDF_WRITER_BATCH_RECORDS, SDF_WRITER_BATCHES_PER_THREAD*threads));
+    }
+    else {
+      // create the SD writer, the aggregate context retains the ownership of the output stream
+      context->writer.reset(new RDKit::SDWriter(context->outs.get(), false));
+    }
 
     *agg = (void *) context.release();
   }
 
   SdfWriterAggregateContext * context = (SdfWriterAggregateContext *) *agg;
 
-  if (mol) {
+  if (mol_type == SQLITE_NULL) {
+    return;
+  }
+
+  if (context->pipeline) {
+    if (mol_type != SQLITE_BLOB) {
+      chemicalite_log(SQLITE_MISMATCH, "invalid molecule input");
+      sqlite3_result_error_code(ctx, SQLITE_MISMATCH);
+      return;
+    }
+    MapValue value;
+    value.type = SQLITE_BLOB;
+    const uint8_t * data = (const uint8_t *) sqlite3_value_blob(mol_arg);
+    value.bytes.assign(data, data + sqlite3_value_bytes(mol_arg));
+    context->pipeline->push(std::move(value));
+  }
+  else {
+    int rc = SQLITE_OK;
+    std::shared_ptr<const RDKit::ROMol> mol = arg_to_cached_romol(
+      sqlite3_context_db_handle(ctx), mol_arg, &rc);
+    if (rc != SQLITE_OK) {
+      chemicalite_log(SQLITE_MISMATCH, "invalid molecule input");
+      sqlite3_result_error_code(ctx, rc);
+      return;
+    }
     context->writer->write(*mol); // can this throw?
-    context->writer->flush();
   }
+
+  context->num_mols += 1;
 }
 
 void sdf_writer_final(sqlite3_context * ctx)
@@ -440,11 +1095,31 @@ void sdf_writer_final(sqlite3_context * ctx)
   }
 
   if (*agg) {
-    SdfWriterAggregateContext * context = (SdfWriterAggregateContext *) *agg;
+    std::unique_ptr<SdfWriterAggregateContext> context((SdfWriterAggregateContext *) *agg);
+    *agg = nullptr;
+
+    std::size_t num_failed = 0;
+    if (context->pipeline) {
+      num_failed = context->pipeline->finish();
+    }
+    else {
+      context->writer->close();
+    }
+    bool written = context->outs->close();
+
+    if (num_failed > 0) {
+      chemicalite_log(SQLITE_MISMATCH, "invalid molecule input");
+      sqlite3_result_error_code(ctx, SQLITE_MISMATCH);
+      return;
+    }
 
-    context->writer->close();
+    if (!written) {
+      chemicalite_log(SQLITE_IOERR, "error writing the SDF output file");
+      sqlite3_result_error_code(ctx, SQLITE_IOERR);
+      return;
+    }
 
-    int num_mols = context->writer->numMols();
+    int num_mols = context->num_mols;
     if (num_mols > 0) {
       sqlite3_result_int(ctx, num_mols);
     }
@@ -463,11 +1138,14 @@ int chemicalite_init_sdf_io(sqlite3 *db)
     0   /* Module destructor function */
   );
 
-  if (rc == SQLITE_OK) {
+  for (int nargs=2; nargs<6; ++nargs) {
+    if (rc != SQLITE_OK) {
+      break;
+    }
     rc = sqlite3_create_window_function(
       db,
       "sdf_writer",
-      2, // int nArg,
+      nargs,
       SQLITE_UTF8, // int eTextRep,
       0, // void *pApp,
       sdf_writer_step, // void (*xStep)(sqlite3_context*,int,sqlite3_value**),
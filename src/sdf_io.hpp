@@ -1,6 +1,24 @@
 #ifndef CHEMICALITE_SDF_IO_INCLUDED
 #define CHEMICALITE_SDF_IO_INCLUDED
+#include <istream>
+#include <memory>
+#include <vector>
+
+#include "file_pipeline.hpp"
+
+namespace RDKit
+{
+  class ROMol;
+} // namespace RDKit
 
 int chemicalite_init_sdf_io(sqlite3 *db);
 
+/*
+** Split an SDF input in chunks of records, and parse the molecules of a chunk
+** (the records that can't be parsed are returned as nullptr). Also used by
+** chemicalite_import.
+*/
+bool read_sdf_chunk(std::istream & ins, FileChunk & chunk);
+void parse_sdf_chunk_mols(const FileChunk & chunk, std::vector<std::unique_ptr<RDKit::ROMol>> & mols);
+
 #endif
@@ -35,7 +35,9 @@ struct Setting {
 };
 
 static Setting settings[] = {
-  { "logging", LOGGING_DISABLED }
+  { "logging", LOGGING_DISABLED },
+  { "rdtree_query_stats", 0 },
+  { "mol_cache_size", 8 }
 #ifdef ENABLE_TEST_SETTINGS
   ,
   { "answer", 42 },
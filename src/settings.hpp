@@ -5,6 +5,8 @@ int chemicalite_init_settings(sqlite3 *db);
 
 enum ChemicaLiteSetting {
   LOGGING,
+  RDTREE_QUERY_STATS,
+  MOL_CACHE_SIZE,
 #ifdef ENABLE_TEST_SETTINGS
   ANSWER,
   PI,
@@ -1,18 +1,30 @@
+#include <stdexcept>
+
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/tokenizer.hpp>
 
 #include <GraphMol/FileParsers/MolSupplier.h>
 #include <GraphMol/FileParsers/MolWriters.h>
+#include <GraphMol/SmilesParse/SmilesParse.h>
 
 #include <sqlite3ext.h>
 extern const sqlite3_api_routines *sqlite3_api;
 
 #include "utils.hpp"
 #include "file_io.hpp"
+#include "file_compression.hpp"
+#include "file_pipeline.hpp"
 #include "smi_io.hpp"
 #include "mol.hpp"
+#include "map_function.hpp"
 #include "logging.hpp"
 
+/*
+** When the molecules are parsed: while scanning the file (full), only when
+** the molecule column is read (lazy), or never (none)
+*/
+enum class SmiParseMode { FULL, LAZY, NONE };
 
 class SmiReaderVtab : public sqlite3_vtab {
 public:
@@ -21,11 +33,14 @@ public:
   int smiles_column;
   int name_column;
   bool title_line;
+  int threads;
+  SmiParseMode parse_mode;
   std::vector<std::unique_ptr<PropColumn>> columns;
   bool is_function;
 
   SmiReaderVtab()
-    : filename(), delimiter(" \t"), smiles_column(0), name_column(1), title_line(true)
+    : filename(), delimiter(" \t"), smiles_column(0), name_column(1), title_line(true), threads(1),
+      parse_mode(SmiParseMode::FULL)
   {
     nRef = 0;
     pModule = 0;
@@ -45,7 +60,8 @@ public:
         " delimiter TEXT HIDDEN,"
         " smiles_column INTEGER HIDDEN,"
         " name_column INTEGER HIDDEN,"
-        " title_line BOOL HIDDEN"
+        " title_line BOOL HIDDEN,"
+        " threads INTEGER HIDDEN"
         ")");
 
       if (rc != SQLITE_OK) {
@@ -66,9 +82,9 @@ public:
     std::istringstream filename_ss(argv[3]);
     filename_ss >> std::quoted(filename, '\'');
 
-    if (argc > 9) {
+    if (argc > 11) {
       chemicalite_log(
-        SQLITE_ERROR, "the sdf_reader virtual table expects at most five optional arguments (delimiter, smiles_column, name_column, title_line, schema)");
+        SQLITE_ERROR, "the smi_reader virtual table expects at most seven optional arguments (delimiter, smiles_column, name_column, title_line, schema, threads, parse)");
       return SQLITE_ERROR;
     }
   
@@ -138,6 +154,36 @@ public:
           return SQLITE_ERROR;
         }
       }
+      else if (arg_name == "threads") {
+        try {
+          size_t pos;
+          threads = std::stoi(arg_value, &pos);
+        }
+        catch (...) {
+          threads = 0;
+        }
+        if (threads < 1) {
+          std::string error = "could not parse \"" + arg + "\": invalid number of threads";
+          chemicalite_log(SQLITE_ERROR, error.c_str());
+          return SQLITE_ERROR;
+        }
+      }
+      else if (arg_name == "parse") {
+        if (arg_value == "full") {
+          parse_mode = SmiParseMode::FULL;
+        }
+        else if (arg_value == "lazy") {
+          parse_mode = SmiParseMode::LAZY;
+        }
+        else if (arg_value == "none") {
+          parse_mode = SmiParseMode::NONE;
+        }
+        else {
+          std::string error = "could not parse \"" + arg + "\": expected full, lazy or none";
+          chemicalite_log(SQLITE_ERROR, error.c_str());
+          return SQLITE_ERROR;
+        }
+      }
       else if (arg_name == "schema") {
         // we expect the schema spec string to be in quotes, and consist in a comma-separated
         // list of mol properties, that need to be exposed as table columns
@@ -160,6 +206,10 @@ public:
     for (const auto & column: columns) {
       sql_declaration += ", " + column->declare_column();
     }
+    if (parse_mode != SmiParseMode::FULL) {
+      // the SMILES text, as read from the input file
+      sql_declaration += ", smiles TEXT";
+    }
     sql_declaration += ")";
 
     int rc = sqlite3_declare_vtab(db, sql_declaration.c_str());
@@ -198,9 +248,17 @@ enum SmiReaderColumn : int {
   DELIMITER = 2,
   SMILES_COLUMN = 3,
   NAME_COLUMN = 4,
-  TITLE_LINE = 5
+  TITLE_LINE = 5,
+  THREADS = 6
 };
 
+/*
+** Reported in idxNum when the molecule column is not used. The records are
+** then not parsed, and the values of the property columns are extracted from
+** the text of the records.
+*/
+static const int SMI_SCAN_PROPS_ONLY = 1 << 8;
+
 int smiReaderBestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIndexInfo)
 {
   SmiReaderVtab *vtab = (SmiReaderVtab *)pVTab;
@@ -216,8 +274,8 @@ int smiReaderBestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIndexInfo)
     // The additional arguments (delimiter, smiles and name columns, title line availability)
     // are optional.
     int queryplan_mask = 0;
-    int col_pos[6];
-    col_pos[0] = col_pos[1] = col_pos[2] = col_pos[3] = col_pos[4] = col_pos[5] = -1;
+    int col_pos[7];
+    col_pos[0] = col_pos[1] = col_pos[2] = col_pos[3] = col_pos[4] = col_pos[5] = col_pos[6] = -1;
 
     for (int ii=0; ii<pIndexInfo->nConstraint; ++ii) {
       if (pIndexInfo->aConstraint[ii].iColumn < SmiReaderColumn::FILENAME) {
@@ -242,7 +300,7 @@ int smiReaderBestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIndexInfo)
 
     // pass the available args to xFilter in their column order
     int argc = 0;
-    for (int col=SmiReaderColumn::FILENAME; col <= SmiReaderColumn::TITLE_LINE; ++col) {
+    for (int col=SmiReaderColumn::FILENAME; col <= SmiReaderColumn::THREADS; ++col) {
       int pos = col_pos[col];
       if (pos >= 0) {
         pIndexInfo->aConstraintUsage[pos].argvIndex = ++argc;
@@ -254,6 +312,21 @@ int smiReaderBestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIndexInfo)
     pIndexInfo->idxNum = queryplan_mask;
   }
 
+  // the records are not parsed if the molecule column is not used, but only
+  // if the name of the molecules (when requested) is read from the input
+  // (otherwise it's the line number assigned by the SMILES parser)
+  bool props_only = !(pIndexInfo->colUsed & 1);
+  if (vtab->name_column < 0) {
+    for (const auto & column: vtab->columns) {
+      if (column->property == "_Name") {
+        props_only = false;
+      }
+    }
+  }
+  if (props_only) {
+    pIndexInfo->idxNum |= SMI_SCAN_PROPS_ONLY;
+  }
+
   pIndexInfo->estimatedCost = 100000; 
   return SQLITE_OK;
 }
@@ -265,25 +338,305 @@ static int smiReaderDisconnectDestroy(sqlite3_vtab *pVTab)
   return SQLITE_OK;
 }
 
+/*
+** A record parsed by the worker threads of the pipelined reader
+*/
+struct SmiRecord {
+  std::unique_ptr<RDKit::ROMol> mol;
+  Blob blob;
+};
+
+/*
+** The pipeline chunks contain up to SMI_CHUNK_RECORDS lines, and a maximum
+** of SMI_CHUNKS_PER_THREAD chunks per worker thread are read in advance.
+*/
+static const std::size_t SMI_CHUNK_RECORDS = 256;
+static const std::size_t SMI_CHUNKS_PER_THREAD = 4;
+
+/*
+** Comments and blank lines are skipped by the SMILES supplier, and they
+** don't count as records
+*/
+bool is_smi_record(const std::string & line)
+{
+  return !line.empty() && line[0] != '#' && line.find_first_not_of(" \t\r\n") != std::string::npos;
+}
+
+std::string read_smi_title(std::istream & ins, std::size_t * line_count)
+{
+  std::string line;
+  while (std::getline(ins, line)) {
+    ++*line_count;
+    if (is_smi_record(line)) {
+      return line + '\n';
+    }
+  }
+  return std::string();
+}
+
+/*
+** Each chunk starts with a copy of the title line (if any), so that the
+** columns of all the chunks are assigned the same property names. The
+** comments and blank lines are also copied, so that the lines of the chunk
+** are numbered as in the input, with an offset.
+*/
+bool read_smi_chunk(
+  std::istream & ins, const std::string & title, std::size_t * line_count, FileChunk & chunk)
+{
+  chunk.text = title;
+  chunk.first_line = *line_count;
+  std::string line;
+  while (chunk.num_records < SMI_CHUNK_RECORDS) {
+    if (!std::getline(ins, line)) {
+      if (ins.bad()) {
+        throw std::runtime_error("error reading the SMILES input");
+      }
+      return false;
+    }
+    ++*line_count;
+    chunk.text += line;
+    chunk.text += '\n';
+    if (is_smi_record(line)) {
+      ++chunk.num_records;
+    }
+  }
+  return true;
+}
+
+/*
+** Split a line on the delimiter chars, like the SMILES supplier does
+*/
+static std::vector<std::string> split_smi_line(const std::string & line, const std::string & delimiter)
+{
+  using Tokenizer = boost::tokenizer<boost::char_separator<char>>;
+  boost::char_separator<char> sep(delimiter.c_str(), "", boost::keep_empty_tokens);
+  Tokenizer tokens(line, sep);
+
+  std::vector<std::string> result;
+  for (const auto & token: tokens) {
+    result.push_back(boost::trim_copy(token));
+  }
+  return result;
+}
+
+using SmiPipeline = FilePipeline<SmiRecord>;
+
 struct SmiReaderCursor : public sqlite3_vtab_cursor {
   std::string filename;
   std::string delimiter;
   int smiles_column;
   int name_column;
   bool title_line;
+  int threads;
+  bool parse_molecule;
+  std::unique_ptr<std::istream> input;
+  std::vector<std::string> title;
+  std::string smiles;
+  PropValues values;
+  bool mol_parsed;
   std::unique_ptr<RDKit::SmilesMolSupplier> supplier;
+  std::unique_ptr<SmiPipeline> pipeline;
   bool eof;
   sqlite3_int64 rowid;
   std::unique_ptr<RDKit::ROMol> mol;
+  Blob blob;
 
   SmiReaderCursor()
-    : filename(), delimiter(" \t"), smiles_column(0), name_column(1), title_line(true) {};
+    : filename(), delimiter(" \t"), smiles_column(0), name_column(1), title_line(true), threads(1) {};
 
+  void parse_chunk(const FileChunk & chunk, std::vector<SmiRecord> & records) const;
+  void parse_fields(const std::string & line);
+  void parse_smiles();
   int next();
 };
 
+/*
+** True if the line has a value in the name column (the SMILES supplier
+** otherwise names the molecule after the line number)
+*/
+static bool has_smi_name(const std::string & line, const std::string & delimiter, int name_column)
+{
+  if (name_column < 0) {
+    return false;
+  }
+  // the empty tokens are retained, as in split_smi_line
+  std::string trimmed = boost::trim_copy(line);
+  int num_tokens = 1;
+  for (std::size_t pos = 0;
+       num_tokens <= name_column && (pos = trimmed.find_first_of(delimiter, pos)) != std::string::npos;
+       ++pos) {
+    ++num_tokens;
+  }
+  return num_tokens > name_column;
+}
+
+void parse_smi_chunk_mols(const FileChunk & chunk, const std::string & delimiter,
+                          int smiles_column, int name_column, bool title_line,
+                          std::vector<std::unique_ptr<RDKit::ROMol>> & mols)
+{
+  std::istringstream ins(chunk.text);
+  RDKit::SmilesMolSupplier chunk_supplier(
+    &ins, false, delimiter, smiles_column, name_column, title_line);
+
+  mols.resize(chunk.num_records);
+  for (auto & mol: mols) {
+    try {
+      mol.reset(chunk_supplier.next());
+    }
+    catch (...) {
+      chemicalite_log(SQLITE_ERROR, "error parsing SMILES record");
+      break;
+    }
+  }
+
+  // the names generated by the supplier from the line numbers refer to the
+  // lines of the chunk, and they are shifted to the lines of the input (the
+  // copy of the title line replaces the lines that precede the chunk)
+  long long line_offset = (long long) chunk.first_line - (title_line ? 1 : 0);
+  std::istringstream lines(chunk.text);
+  std::string line;
+  bool skip_title = title_line;
+  std::size_t index = 0;
+  while (index < mols.size() && std::getline(lines, line)) {
+    if (!is_smi_record(line)) {
+      continue;
+    }
+    if (skip_title) {
+      skip_title = false;
+      continue;
+    }
+    const auto & mol = mols[index++];
+    if (!mol || has_smi_name(line, delimiter, name_column) || !mol->hasProp("_Name")) {
+      continue;
+    }
+    try {
+      long long line_num = std::stoll(mol->getProp<std::string>("_Name"));
+      mol->setProp("_Name", std::to_string(line_num + line_offset));
+    }
+    catch (...) {
+      // not a generated name
+    }
+  }
+}
+
+void SmiReaderCursor::parse_chunk(const FileChunk & chunk, std::vector<SmiRecord> & records) const
+{
+  std::vector<std::unique_ptr<RDKit::ROMol>> mols;
+  parse_smi_chunk_mols(chunk, delimiter, smiles_column, name_column, title_line, mols);
+
+  records.resize(mols.size());
+  for (std::size_t ii = 0; ii < mols.size(); ++ii) {
+    auto & record = records[ii];
+    record.mol = std::move(mols[ii]);
+    if (record.mol) {
+      int rc = SQLITE_OK;
+      record.blob = mol_to_blob(*record.mol, &rc);
+    }
+  }
+}
+
+/*
+** Assign the values of the name and property columns of a record. If the
+** line has too few columns, the SMILES parser would fail and no values are
+** assigned.
+*/
+void SmiReaderCursor::parse_fields(const std::string & line)
+{
+  smiles.clear();
+  values.clear();
+  mol.reset();
+  blob.clear();
+  mol_parsed = false;
+
+  std::vector<std::string> recs = split_smi_line(line, delimiter);
+  if (int(recs.size()) <= smiles_column || int(recs.size()) <= name_column) {
+    return;
+  }
+
+  for (int col = 0; col < int(recs.size()); ++col) {
+    if (col == smiles_column) {
+      smiles = recs[col];
+    }
+    else if (col == name_column) {
+      values["_Name"] = recs[col];
+    }
+    else if (col < int(title.size())) {
+      values[title[col]] = recs[col];
+    }
+    else {
+      values["Column_" + std::to_string(col)] = recs[col];
+    }
+  }
+}
+
+/*
+** Parse the SMILES of the current record on demand, and assign the property
+** values extracted from the input line
+*/
+void SmiReaderCursor::parse_smiles()
+{
+  if (mol_parsed) {
+    return;
+  }
+  mol_parsed = true;
+
+  if (smiles.empty()) {
+    return;
+  }
+
+  try {
+    mol.reset(RDKit::SmilesToMol(smiles));
+  }
+  catch (...) {
+    mol.reset();
+  }
+
+  if (mol) {
+    for (const auto & item: values) {
+      mol->setProp(item.first, item.second);
+    }
+  }
+}
+
 int SmiReaderCursor::next()
 {
+  if (!parse_molecule) {
+    // only the text of the records is needed, to extract the property values
+    std::string line;
+    while (std::getline(*input, line)) {
+      if (is_smi_record(line)) {
+        rowid += 1;
+        parse_fields(line);
+        return SQLITE_OK;
+      }
+    }
+    if (input->bad()) {
+      std::string message = "error reading file '" + filename + "'";
+      chemicalite_log(SQLITE_IOERR, message.c_str());
+      return SQLITE_IOERR;
+    }
+    eof = true;
+    return SQLITE_OK;
+  }
+
+  if (pipeline) {
+    SmiRecord record;
+    if (pipeline->next(record)) {
+      rowid += 1;
+      mol = std::move(record.mol);
+      blob = std::move(record.blob);
+    }
+    else if (pipeline->failed()) {
+      std::string message = "error reading file '" + filename + "'";
+      chemicalite_log(SQLITE_IOERR, message.c_str());
+      return SQLITE_IOERR;
+    }
+    else {
+      eof = true;
+    }
+    return SQLITE_OK;
+  }
+
   try {
     rowid += 1;
     mol.reset(supplier->next());
@@ -322,6 +675,17 @@ static int smiReaderFilter(sqlite3_vtab_cursor *pCursor, int idxNum, const char
   SmiReaderCursor *p = (SmiReaderCursor *)pCursor;
   SmiReaderVtab *vtab = (SmiReaderVtab *)p->pVtab;
 
+  // a cursor may be rewound, release the state of any previous scan (this
+  // also stops the workers of a pipeline, before the parsing args change)
+  p->pipeline.reset();
+  p->supplier.reset();
+  p->input.reset();
+  p->title.clear();
+  p->values.clear();
+  p->mol.reset();
+  p->blob.clear();
+  p->threads = 1;
+
   if (vtab->is_function) {
     // when this virtual table is used as a function, the mol supplier args are to be found in
     // the available query constraints.
@@ -391,6 +755,22 @@ static int smiReaderFilter(sqlite3_vtab_cursor *pCursor, int idxNum, const char
       p->title_line = sqlite3_value_int(arg);
     }
 
+    if ((argn < argc) && (query_mask & (1 << SmiReaderColumn::THREADS))) {
+      arg = argv[argn++];
+      value_type = sqlite3_value_type(arg);
+      if (value_type != SQLITE_INTEGER) {
+        chemicalite_log(
+          SQLITE_ERROR, "the smi_reader function expects the threads argument to be of type INTEGER");
+        return SQLITE_MISMATCH;
+      }
+      p->threads = sqlite3_value_int(arg);
+      if (p->threads < 1) {
+        chemicalite_log(
+          SQLITE_ERROR, "the smi_reader function requires a positive number of threads");
+        return SQLITE_ERROR;
+      }
+    }
+
   }
   else {
     // get the mol supplier args from the virtual table instance
@@ -399,22 +779,62 @@ static int smiReaderFilter(sqlite3_vtab_cursor *pCursor, int idxNum, const char
     p->smiles_column = vtab->smiles_column;
     p->name_column = vtab->name_column;
     p->title_line = vtab->title_line;
+    p->threads = vtab->threads;
   }
 
-  std::unique_ptr<std::ifstream> pins(new std::ifstream(p->filename));
+  // compressed files are decompressed by a background thread
+  int rc = SQLITE_OK;
+  FileCompression compression = FileCompression::NONE;
+  std::unique_ptr<std::istream> pins = open_input_file(p->filename, &compression, &rc);
+
+  if (!pins) {
+    return rc;
+  }
+
+  p->rowid = 0;
+  p->eof = false;
+  p->parse_molecule = !(idxNum & SMI_SCAN_PROPS_ONLY) && (
+    vtab->is_function || vtab->parse_mode == SmiParseMode::FULL);
+
+  if (!p->parse_molecule) {
+    // the property names are read from the title line, if available
+    if (p->title_line) {
+      std::string line;
+      while (std::getline(*pins, line)) {
+        if (is_smi_record(line)) {
+          p->title = split_smi_line(line, p->delimiter);
+          break;
+        }
+      }
+    }
+    p->input = std::move(pins);
+    return p->next();
+  }
 
-  if (!pins->is_open()) {
-    // Maybe log something
-    std::string message = "could not open file '" + p->filename + "'";
-    chemicalite_log(SQLITE_ERROR, message.c_str());
-    return SQLITE_ERROR;
+  if (p->threads > 1 || compression != FileCompression::NONE) {
+    // the title line is read in advance, and it's passed to the workers
+    // together with each chunk of records. The pipeline is also used for
+    // compressed files, because SmilesMolSupplier requires a seekable stream.
+    std::shared_ptr<std::istream> ins(pins.release());
+    std::string title;
+    std::size_t line_count = 0;
+    if (p->title_line) {
+      title = read_smi_title(*ins, &line_count);
+    }
+    p->pipeline.reset(new SmiPipeline(
+      [ins, title, line_count](FileChunk & chunk) mutable {
+        return read_smi_chunk(*ins, title, &line_count, chunk);
+      },
+      [p](const FileChunk & chunk, std::vector<SmiRecord> & records) {
+        p->parse_chunk(chunk, records);
+      },
+      p->threads, SMI_CHUNKS_PER_THREAD*p->threads));
+    return p->next();
   }
 
   p->supplier.reset(new RDKit::SmilesMolSupplier(
     pins.release(), true, p->delimiter,
     p->smiles_column, p->name_column, p->title_line));
-  p->rowid = 0;
-  p->eof = false;
 
   return p->next();
 }
@@ -434,10 +854,40 @@ static int smiReaderEof(sqlite3_vtab_cursor *pCursor)
 static int smiReaderColumn(sqlite3_vtab_cursor *pCursor, sqlite3_context *ctx, int N)
 {
   SmiReaderCursor * p = (SmiReaderCursor *)pCursor;
+  SmiReaderVtab * vtab = (SmiReaderVtab *) p->pVtab;
+
+  if (!p->parse_molecule && N == 0) {
+    // the molecule is only parsed when requested
+    if (vtab->parse_mode != SmiParseMode::NONE) {
+      p->parse_smiles();
+    }
+  }
 
-  if (!p->mol) {
+  if (!p->parse_molecule && N > 0) {
+    if (vtab->is_function) {
+      sqlite3_result_text(ctx, p->filename.c_str(), -1, SQLITE_TRANSIENT);
+    }
+    else if (N > int(vtab->columns.size())) {
+      // the smiles column (NULL if the line has too few columns)
+      if (p->smiles.empty()) {
+        sqlite3_result_null(ctx);
+      }
+      else {
+        sqlite3_result_text(ctx, p->smiles.c_str(), p->smiles.size(), SQLITE_TRANSIENT);
+      }
+    }
+    else {
+      // the properties are extracted from the input line
+      vtab->columns[N-1]->sqlite3_result(p->values, ctx);
+    }
+  }
+  else if (!p->mol) {
       sqlite3_result_null(ctx);
   }
+  else if (N == 0 && !p->blob.empty()) {
+    // the molecule, already serialized by the pipeline
+    sqlite3_result_blob(ctx, p->blob.data(), p->blob.size(), SQLITE_TRANSIENT);
+  }
   else if (N == 0) {
     // the molecule
     int rc = SQLITE_OK;
@@ -450,8 +900,6 @@ static int smiReaderColumn(sqlite3_vtab_cursor *pCursor, sqlite3_context *ctx, i
     }
   }
   else {
-    SmiReaderVtab * vtab = (SmiReaderVtab *) p->pVtab;
-    
     if (vtab->is_function) {
       sqlite3_result_text(ctx, p->filename.c_str(), -1, SQLITE_TRANSIENT);
     }
@@ -513,25 +961,76 @@ static sqlite3_module smiReaderModule = {
 };
 
 
+/*
+** The output file is written through a buffer of SMI_WRITER_BUFFER_SIZE
+** bytes. In the multi-threaded mode, the molecules are decoded and converted
+** to SMILES by the workers in batches of SMI_WRITER_BATCH_RECORDS records,
+** and at most SMI_WRITER_BATCHES_PER_THREAD batches per worker thread are
+** waiting to be written.
+*/
+static const int SMI_WRITER_BUFFER_SIZE = 1 << 20;
+static const std::size_t SMI_WRITER_BATCH_RECORDS = 256;
+static const std::size_t SMI_WRITER_BATCHES_PER_THREAD = 4;
+
+/*
+** A molecule submitted to the multi-threaded writer, with the position it
+** would have in the output of the sequential writer
+*/
+struct SmiOutputRecord {
+  MapValue mol;
+  int molid;
+};
+
+using SmiOutputPipeline = OutputPipeline<SmiOutputRecord>;
+
 struct SmiWriterAggregateContext {
-  std::shared_ptr<RDKit::SmilesWriter> writer;
+  std::unique_ptr<OutputFileStream> outs;
+  std::unique_ptr<RDKit::SmilesWriter> writer;
+  std::unique_ptr<SmiOutputPipeline> pipeline;
+  int num_mols = 0;
 };
 
+/*
+** Format a serialized molecule as a line of the SMILES output (called by the
+** workers). The line is generated by a dedicated SmilesWriter, configured to
+** reproduce the output of the sequential writer: the header line is included
+** with the first molecule, and the unnamed molecules are named after their
+** position in the output.
+*/
+static bool format_smi_record(
+  const SmiOutputRecord & record, const std::string & delimiter,
+  const std::string & name_header, bool include_header, bool isomeric_smiles,
+  std::string & text)
+{
+  int rc = SQLITE_OK;
+  std::unique_ptr<RDKit::ROMol> mol(map_arg_to_romol(record.mol, &rc));
+  if (rc != SQLITE_OK) {
+    return false;
+  }
+
+  if (!mol->hasProp("_Name")) {
+    mol->setProp("_Name", std::to_string(record.molid));
+  }
+
+  std::ostringstream outs;
+  try {
+    RDKit::SmilesWriter writer(
+      &outs, delimiter, name_header, include_header && record.molid == 0, false, isomeric_smiles);
+    writer.write(*mol);
+    writer.close();
+  }
+  catch (...) {
+    return false;
+  }
+  text += outs.str();
+  return true;
+}
+
 void smi_writer_step(sqlite3_context* ctx, int argc, sqlite3_value**argv)
 {
   // get the input args
   sqlite3_value *mol_arg = argv[0];
-
-  std::unique_ptr<RDKit::ROMol> mol;
-  if (sqlite3_value_type(mol_arg) != SQLITE_NULL) {
-    int rc = SQLITE_OK;
-    mol.reset(arg_to_romol(mol_arg, &rc));
-    if (rc != SQLITE_OK) {
-      chemicalite_log(SQLITE_MISMATCH, "invalid molecule input");
-      sqlite3_result_error_code(ctx, rc);
-      return;
-    }
-  } 
+  int mol_type = sqlite3_value_type(mol_arg);
 
   sqlite3_value *filename_arg = argv[1];
 
@@ -554,6 +1053,7 @@ void smi_writer_step(sqlite3_context* ctx, int argc, sqlite3_value**argv)
   std::string name_header = "Name";
   bool include_header = true;
   bool isomeric_smiles = true;
+  int threads = 1;
 
   if (argc > 2) {
     sqlite3_value *arg = argv[2];
@@ -618,7 +1118,39 @@ void smi_writer_step(sqlite3_context* ctx, int argc, sqlite3_value**argv)
       isomeric_smiles = (bool)sqlite3_value_int(arg);
     }
   }
+
+  if (argc > 6) {
+    sqlite3_value *arg = argv[6];
+    int type = sqlite3_value_type(arg);
+    if (type == SQLITE_NULL) {
+      ; // ok, keep the default value
+    }
+    else if (type != SQLITE_INTEGER || sqlite3_value_int(arg) < 1) {
+      chemicalite_log(SQLITE_MISMATCH, "threads argument must be a positive integer");
+      sqlite3_result_error_code(ctx, SQLITE_MISMATCH);
+      return;
+    }
+    else {
+      threads = sqlite3_value_int(arg);
+    }
+  }
   
+  FileCompression compression = compression_from_extension(filename);
+
+  if (argc > 7) {
+    sqlite3_value *arg = argv[7];
+    int type = sqlite3_value_type(arg);
+    if (type == SQLITE_NULL) {
+      ; // ok, keep the compression format from the filename extension
+    }
+    else if (type != SQLITE_TEXT ||
+             !compression_from_name((const char *)sqlite3_value_text(arg), &compression)) {
+      chemicalite_log(SQLITE_MISMATCH, "compression argument must be one of 'none', 'gzip' or 'zstd'");
+      sqlite3_result_error_code(ctx, SQLITE_MISMATCH);
+      return;
+    }
+  }
+
   // get the aggregate context
   void **agg = (void **) sqlite3_aggregate_context(ctx, sizeof(void *));
 
@@ -630,34 +1162,74 @@ void smi_writer_step(sqlite3_context* ctx, int argc, sqlite3_value**argv)
   }  
 
   if (!*agg) {
-    // open the output file stream, allocate an aggregate context, and initialize the writer
-    std::unique_ptr<std::ofstream> pouts(new std::ofstream(filename));
+    // allocate an aggregate context, and open the output file stream (if
+    // compressed, the output is compressed by a background thread)
+    std::unique_ptr<SmiWriterAggregateContext> context(new SmiWriterAggregateContext);
 
-    if (!pouts->is_open()) {
+    int rc = SQLITE_OK;
+    context->outs = open_output_file(filename, compression, SMI_WRITER_BUFFER_SIZE, &rc);
+
+    if (!context->outs) {
       std::string message = "could not open file '" + filename + "'";
-      chemicalite_log(SQLITE_ERROR, message.c_str());
       sqlite3_result_error(ctx, message.c_str(), -1);
       return;
     }
 
-    // create the smiles writer, instructing it to take ownership of the ofstream pointer
-    bool take_ownership = true;
-    std::shared_ptr<RDKit::SmilesWriter> writer(new RDKit::SmilesWriter(
-        pouts.release(), delimiter, name_header, include_header, take_ownership, isomeric_smiles));
-
-    // create the aggregate context, and assign the writer to it
-    std::unique_ptr<SmiWriterAggregateContext> context(new SmiWriterAggregateContext);
-    context->writer = writer;
+    if (threads > 1) {
+      // the SMILES are generated by the workers, and a writer thread appends
+      // the lines to the output file in the input order
+      OutputFileStream * outs = context->outs.get();
+      context->pipeline.reset(new SmiOutputPipeline(
+        [delimiter, name_header, include_header, isomeric_smiles](
+          const SmiOutputRecord & record, std::string & text) {
+          return format_smi_record(
+            record, delimiter, name_header, include_header, isomeric_smiles, text);
+        },
+        [outs](const std::string & text) { outs->write(text.data(), text.size()); },
+        threads, SMI_WRITER_BATCH_RECORDS, SMI_WRITER_BATCHES_PER_THREAD*threads));
+    }
+    else {
+      // create the smiles writer, the aggregate context retains the ownership of the output stream
+      bool take_ownership = false;
+      context->writer.reset(new RDKit::SmilesWriter(
+          context->outs.get(), delimiter, name_header, include_header, take_ownership, isomeric_smiles));
+    }
 
     *agg = (void *) context.release();
   }
 
   SmiWriterAggregateContext * context = (SmiWriterAggregateContext *) *agg;
 
-  if (mol) {
+  if (mol_type == SQLITE_NULL) {
+    return;
+  }
+
+  if (context->pipeline) {
+    if (mol_type != SQLITE_BLOB) {
+      chemicalite_log(SQLITE_MISMATCH, "invalid molecule input");
+      sqlite3_result_error_code(ctx, SQLITE_MISMATCH);
+      return;
+    }
+    SmiOutputRecord record;
+    record.mol.type = SQLITE_BLOB;
+    const uint8_t * data = (const uint8_t *) sqlite3_value_blob(mol_arg);
+    record.mol.bytes.assign(data, data + sqlite3_value_bytes(mol_arg));
+    record.molid = context->num_mols;
+    context->pipeline->push(std::move(record));
+  }
+  else {
+    int rc = SQLITE_OK;
+    std::shared_ptr<const RDKit::ROMol> mol = arg_to_cached_romol(
+      sqlite3_context_db_handle(ctx), mol_arg, &rc);
+    if (rc != SQLITE_OK) {
+      chemicalite_log(SQLITE_MISMATCH, "invalid molecule input");
+      sqlite3_result_error_code(ctx, rc);
+      return;
+    }
     context->writer->write(*mol); // can this throw?
-    context->writer->flush();
   }
+
+  context->num_mols += 1;
 }
 
 void smi_writer_final(sqlite3_context * ctx)
@@ -671,11 +1243,31 @@ void smi_writer_final(sqlite3_context * ctx)
   }
 
   if (*agg) {
-    SmiWriterAggregateContext * context = (SmiWriterAggregateContext *) *agg;
+    std::unique_ptr<SmiWriterAggregateContext> context((SmiWriterAggregateContext *) *agg);
+    *agg = nullptr;
+
+    std::size_t num_failed = 0;
+    if (context->pipeline) {
+      num_failed = context->pipeline->finish();
+    }
+    else {
+      context->writer->close();
+    }
+    bool written = context->outs->close();
+
+    if (num_failed > 0) {
+      chemicalite_log(SQLITE_MISMATCH, "invalid molecule input");
+      sqlite3_result_error_code(ctx, SQLITE_MISMATCH);
+      return;
+    }
 
-    context->writer->close();
+    if (!written) {
+      chemicalite_log(SQLITE_IOERR, "error writing the SMILES output file");
+      sqlite3_result_error_code(ctx, SQLITE_IOERR);
+      return;
+    }
 
-    int num_mols = context->writer->numMols();
+    int num_mols = context->num_mols;
     if (num_mols > 0) {
       sqlite3_result_int(ctx, num_mols);
     }
@@ -694,7 +1286,7 @@ int chemicalite_init_smi_io(sqlite3 *db)
     0   /* Module destructor function */
   );
 
-  for (int nargs=2; nargs<7; ++nargs) {
+  for (int nargs=2; nargs<9; ++nargs) {
     if (rc != SQLITE_OK) {
       break;
     }
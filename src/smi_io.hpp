@@ -1,6 +1,33 @@
 #ifndef CHEMICALITE_SMI_IO_INCLUDED
 #define CHEMICALITE_SMI_IO_INCLUDED
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "file_pipeline.hpp"
+
+namespace RDKit
+{
+  class ROMol;
+} // namespace RDKit
 
 int chemicalite_init_smi_io(sqlite3 *db);
 
+/*
+** Split a SMILES input in chunks of lines, and parse the molecules of a chunk
+** (the records that can't be parsed are returned as nullptr). The title line,
+** if any, is read first, and it's prepended to each chunk. The lines read so
+** far are counted in line_count, so that the names generated from the line
+** numbers are the same as for a sequential read of the input. Also used by
+** chemicalite_import.
+*/
+bool is_smi_record(const std::string & line);
+std::string read_smi_title(std::istream & ins, std::size_t * line_count);
+bool read_smi_chunk(
+  std::istream & ins, const std::string & title, std::size_t * line_count, FileChunk & chunk);
+void parse_smi_chunk_mols(const FileChunk & chunk, const std::string & delimiter,
+                          int smiles_column, int name_column, bool title_line,
+                          std::vector<std::unique_ptr<RDKit::ROMol>> & mols);
+
 #endif
@@ -133,6 +133,28 @@ TEST_CASE("bfp constructors + ops + descriptors", "[bfp]")
         ")", 0.2105263158);
   }
 
+  SECTION("test cached bfp")
+  {
+    test_select_value(
+        db,
+        "SELECT "
+        "mol_pattern_bfp(m.cached, 2048) = mol_pattern_bfp(m.mol, 2048) AND "
+        "mol_morgan_bfp(m.cached, 2, 2048) = mol_morgan_bfp(m.mol, 2, 2048) AND "
+        "mol_morgan_bfp(m.cached, 2, 512) = mol_morgan_bfp(m.mol, 2, 512) AND "
+        "mol_pattern_bfp(m.cached, 1024) = mol_pattern_bfp(m.mol, 1024) AND "
+        "mol_num_hvyatms(m.cached) = 14 AND "
+        "mol_to_smiles(m.cached) = mol_to_smiles(m.mol) "
+        "FROM (SELECT mol AS mol, mol_with_cached_fps(mol) AS cached "
+        "FROM (SELECT mol_from_smiles('Cn1cnc2n(C)c(=O)n(C)c(=O)c12') AS mol)) m", 1);
+    test_select_value(
+        db,
+        "SELECT "
+        "mol_morgan_bfp(m.cached, 3, 1024) = mol_morgan_bfp(m.mol, 3, 1024) AND "
+        "bfp_length(mol_pattern_bfp(m.cached, 512)) = 512 "
+        "FROM (SELECT mol AS mol, mol_with_cached_fps(mol, 512, 3, 1024) AS cached "
+        "FROM (SELECT mol_from_smiles('Nc1ccccc1COC') AS mol)) m", 1);
+  }
+
   SECTION("test bfp weight")
   {
     test_select_value(
@@ -0,0 +1,177 @@
+#include "test_common.hpp"
+
+TEST_CASE("chemicalite import", "[chemicalite_import]")
+{
+  sqlite3 * db = nullptr;
+  test_db_open(&db);
+
+  int rc = sqlite3_exec(
+      db,
+      "CREATE TABLE cdk2(id INTEGER PRIMARY KEY, name TEXT, molecule MOL, mw REAL, hba INTEGER);"
+      "CREATE TABLE ref(id INTEGER PRIMARY KEY, molecule MOL);"
+      "INSERT INTO ref(id, molecule) SELECT rowid, molecule FROM sdf_reader('cdk2.sdf');",
+      NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_OK);
+
+  SECTION("SDF import")
+  {
+    test_select_value(
+        db,
+        "SELECT chemicalite_import('cdk2.sdf', 'cdk2', '{"
+        "\"properties\": {\"name\": \"_Name\"}, "
+        "\"descriptors\": {\"mw\": \"mol_amw\", \"hba\": \"mol_hba\"}, "
+        "\"threads\": 3}')", 47);
+
+    // the rows are inserted in file order
+    test_select_value(db, "SELECT COUNT(*) FROM cdk2", 47);
+    test_select_value(db, "SELECT name FROM cdk2 WHERE id = 1", "ZINC03814457");
+    test_select_value(db, "SELECT name FROM cdk2 WHERE id = 47", "ZINC03831630");
+    test_select_value(db, "SELECT MAX(mw) FROM cdk2", 449.517);
+    test_select_value(
+        db,
+        "SELECT COUNT(*) FROM cdk2 JOIN ref ON ref.id = cdk2.id "
+        "WHERE mol_to_smiles(cdk2.molecule) = mol_to_smiles(ref.molecule) "
+        "AND cdk2.hba = mol_hba(ref.molecule)", 47);
+  }
+
+  SECTION("cached fingerprints and linked rdtree indexes")
+  {
+    rc = sqlite3_exec(
+        db,
+        "CREATE VIRTUAL TABLE pfp USING rdtree(id, fp bits(2048));"
+        "SELECT rdtree_link_index('cdk2', 'molecule', 'pfp', 'mol_pattern_bfp', 2048);"
+        "CREATE VIRTUAL TABLE mfp USING rdtree(id, fp bits(1024));"
+        "SELECT rdtree_link_index('cdk2', 'molecule', 'mfp', 'mol_morgan_bfp', 2, 1024);"
+        "CREATE TABLE plain(id INTEGER PRIMARY KEY, molecule MOL);",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    test_select_value(
+        db,
+        "SELECT chemicalite_import('cdk2.sdf', 'cdk2', '{"
+        "\"cached_fps\": {\"morgan_length\": 1024}, \"threads\": 2}')", 47);
+    test_select_value(
+        db,
+        "SELECT chemicalite_import('cdk2.sdf', 'plain', '{\"cached_fps\": false}')", 47);
+
+    // the cached fingerprints are stored with the molecules
+    test_select_value(
+        db,
+        "SELECT COUNT(*) FROM cdk2 JOIN plain ON plain.id = cdk2.id "
+        "WHERE length(cdk2.molecule) > length(plain.molecule)", 47);
+
+    // and they match the ones computed from the parsed molecules
+    test_select_value(
+        db,
+        "SELECT COUNT(*) FROM pfp JOIN ref ON ref.id = pfp.id "
+        "WHERE pfp.fp = mol_pattern_bfp(ref.molecule, 2048)", 47);
+    test_select_value(
+        db,
+        "SELECT COUNT(*) FROM mfp JOIN ref ON ref.id = mfp.id "
+        "WHERE mfp.fp = mol_morgan_bfp(ref.molecule, 2, 1024)", 47);
+  }
+
+  SECTION("SMILES import")
+  {
+    rc = sqlite3_exec(
+        db, "CREATE TABLE chembl(chembl_id TEXT, molecule MOL)", NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    const char * options =
+      "'{\"format\": \"smi\", \"delimiter\": \"\\t\", \"smiles_column\": 1, \"name_column\": 0, "
+      "\"properties\": {\"chembl_id\": \"_Name\"}}'";
+
+    test_select_value(
+        db,
+        std::string("SELECT chemicalite_import('chembl_29_sample.txt', 'chembl', ") + options + ")",
+        10);
+    test_select_value(
+        db,
+        std::string("SELECT chemicalite_import('chembl_29_sample.txt.gz', 'chembl', ") + options + ")",
+        10);
+
+    test_select_value(db, "SELECT COUNT(DISTINCT chembl_id) FROM chembl", 10);
+    test_select_value(db, "SELECT MAX(mol_amw(molecule)) FROM chembl", 3548.213);
+    test_select_value(
+        db,
+        "SELECT chembl_id FROM chembl WHERE rowid = 1", "CHEMBL153534");
+  }
+
+  SECTION("SMILES import across chunks")
+  {
+    // the names generated from the line numbers match the sequential reader
+    rc = sqlite3_exec(
+        db,
+        "CREATE TABLE lines(name TEXT, molecule MOL);"
+        "CREATE VIRTUAL TABLE ref USING smi_reader("
+        "'chunks.smi', name_column=-1, schema='_Name TEXT AS name');"
+        "CREATE TABLE ref_names AS SELECT rowid AS id, name FROM ref;",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    test_select_value(
+        db,
+        "SELECT chemicalite_import('chunks.smi.gz', 'lines', "
+        "'{\"format\": \"smi\", \"name_column\": -1, \"threads\": 3, "
+        "\"properties\": {\"name\": \"_Name\"}}')",
+        600);
+
+    test_select_value(db, "SELECT COUNT(DISTINCT name) FROM lines", 600);
+    test_select_value(
+        db,
+        "SELECT COUNT(*) FROM lines JOIN ref_names ON ref_names.id = lines.rowid "
+        "WHERE lines.name = ref_names.name", 600);
+  }
+
+  SECTION("errors")
+  {
+    // the format can't be detected from the file extension
+    rc = sqlite3_exec(
+        db, "SELECT chemicalite_import('chembl_29_sample.txt', 'cdk2')", NULL, NULL, NULL);
+    REQUIRE(rc != SQLITE_OK);
+
+    // invalid options
+    rc = sqlite3_exec(
+        db, "SELECT chemicalite_import('cdk2.sdf', 'cdk2', 'threads=2')", NULL, NULL, NULL);
+    REQUIRE(rc != SQLITE_OK);
+    rc = sqlite3_exec(
+        db, "SELECT chemicalite_import('cdk2.sdf', 'cdk2', '{\"thread\": 2}')", NULL, NULL, NULL);
+    REQUIRE(rc != SQLITE_OK);
+    rc = sqlite3_exec(
+        db, "SELECT chemicalite_import('cdk2.sdf', 'cdk2', '{\"descriptors\": {\"mw\": \"mol_mw\"}}')",
+        NULL, NULL, NULL);
+    REQUIRE(rc != SQLITE_OK);
+
+    // missing table or column
+    rc = sqlite3_exec(
+        db, "SELECT chemicalite_import('cdk2.sdf', 'compounds')", NULL, NULL, NULL);
+    REQUIRE(rc != SQLITE_OK);
+    rc = sqlite3_exec(
+        db, "SELECT chemicalite_import('cdk2.sdf', 'cdk2', '{\"column\": \"mol\"}')", NULL, NULL, NULL);
+    REQUIRE(rc != SQLITE_OK);
+
+    // a failed insert leaves the table unchanged
+    rc = sqlite3_exec(
+        db,
+        "CREATE TABLE small(id INTEGER PRIMARY KEY CHECK (id <= 40), molecule MOL)",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+    rc = sqlite3_exec(
+        db, "SELECT chemicalite_import('cdk2.sdf', 'small')", NULL, NULL, NULL);
+    REQUIRE(rc != SQLITE_OK);
+    test_select_value(db, "SELECT COUNT(*) FROM small", 0);
+
+    // as does a file that can't be read to the end
+    rc = sqlite3_exec(
+        db, "SELECT chemicalite_import('cdk2_truncated.sdf.gz', 'cdk2', '{\"format\": \"sdf\"}')",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_IOERR);
+    rc = sqlite3_exec(
+        db, "SELECT chemicalite_import('cdk2_truncated.sdf.gz', 'cdk2', '{\"threads\": 3}')",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_IOERR);
+    test_select_value(db, "SELECT COUNT(*) FROM cdk2", 0);
+  }
+
+  test_db_close(db);
+}
@@ -0,0 +1,121 @@
+#include "test_common.hpp"
+
+TEST_CASE("chemicalite map", "[mol]")
+{
+  sqlite3 * db = nullptr;
+  test_db_open(&db);
+
+  int rc = sqlite3_exec(
+      db,
+      "CREATE TABLE mols(id INTEGER PRIMARY KEY, smiles TEXT, mol MOL);"
+      "INSERT INTO mols(smiles) VALUES "
+      "('C'), ('CO'), ('CCO'), ('c1ccccn1'), ('OC(=O)c1ccccc1[O-].[Na+]'), (NULL), "
+      "('Cn1cnc2n(C)c(=O)n(C)c(=O)c12'), ('CC(=O)Oc1ccccc1C(=O)O');"
+      "UPDATE mols SET mol = mol_from_smiles(smiles);",
+      NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_OK);
+
+  SECTION("multiple blocks")
+  {
+    // 512 input rows, read in blocks while the previous ones are evaluated
+    const char * query =
+      "'SELECT a.id*10000 + b.id*100 + c.id, c.mol FROM mols a, mols b, mols c "
+      "ORDER BY a.id, b.id, c.id'";
+    test_select_value(
+        db,
+        "SELECT COUNT(*) FROM mols JOIN "
+        "chemicalite_map('mol_num_hvyatms', " + std::string(query) + ", 2) AS m "
+        "ON m.id % 100 = mols.id WHERE m.result IS mol_num_hvyatms(mols.mol)", 512);
+    // the results are returned in the order of the input rows
+    test_select_value(
+        db,
+        "SELECT COUNT(*) FROM (SELECT id, LAG(id) OVER (ORDER BY rowid) AS prev "
+        "FROM chemicalite_map('mol_num_hvyatms', " + std::string(query) + ", 3)) "
+        "WHERE prev IS NULL OR prev < id", 512);
+    // the scan can be interrupted before the input rows are exhausted
+    test_select_value(
+        db,
+        "SELECT SUM(result) FROM (SELECT result FROM "
+        "chemicalite_map('mol_num_hvyatms', " + std::string(query) + ", 4) LIMIT 8)",
+        50);
+  }
+
+  SECTION("descriptors")
+  {
+    test_select_value(
+        db,
+        "SELECT COUNT(*) FROM mols JOIN "
+        "chemicalite_map('mol_num_hvyatms', 'SELECT id, mol FROM mols', 4) AS m "
+        "ON m.id = mols.id WHERE m.result IS mol_num_hvyatms(mols.mol)", 8);
+    test_select_value(
+        db,
+        "SELECT COUNT(*) FROM mols JOIN "
+        "chemicalite_map('mol_tpsa', 'SELECT id, mol FROM mols', 3) AS m "
+        "ON m.id = mols.id WHERE m.result IS mol_tpsa(mols.mol)", 8);
+    test_select_value(
+        db,
+        "SELECT group_concat(result, ' ') FROM "
+        "chemicalite_map('mol_formula', 'SELECT id, mol FROM mols WHERE id < 4 ORDER BY id DESC', 2)",
+        "C2H6O CH4O CH4");
+  }
+
+  SECTION("fingerprints")
+  {
+    test_select_value(
+        db,
+        "SELECT COUNT(*) FROM mols JOIN "
+        "chemicalite_map('mol_morgan_bfp', 'SELECT id, mol, 2, 1024 FROM mols', 4) AS m "
+        "ON m.id = mols.id WHERE m.result IS mol_morgan_bfp(mols.mol, 2, 1024)", 8);
+    test_select_value(
+        db,
+        "SELECT COUNT(*) FROM mols JOIN "
+        "chemicalite_map('mol_pattern_bfp', 'SELECT id, mol, 2048 FROM mols', 2) AS m "
+        "ON m.id = mols.id WHERE m.result IS mol_pattern_bfp(mols.mol, 2048)", 8);
+  }
+
+  SECTION("standardization")
+  {
+    test_select_value(
+        db,
+        "SELECT COUNT(*) FROM mols JOIN "
+        "chemicalite_map('mol_fragment_parent', 'SELECT id, mol FROM mols') AS m "
+        "ON m.id = mols.id "
+        "WHERE mol_to_smiles(m.result) IS mol_to_smiles(mol_fragment_parent(mols.mol))", 8);
+    test_select_value(
+        db,
+        "SELECT COUNT(*) FROM mols JOIN "
+        "chemicalite_map('mol_cleanup', 'SELECT id, mol, ''{}'' FROM mols', 2) AS m "
+        "ON m.id = mols.id "
+        "WHERE mol_to_smiles(m.result) IS mol_to_smiles(mol_cleanup(mols.mol))", 8);
+  }
+
+  SECTION("errors")
+  {
+    sqlite3_stmt *pStmt = nullptr;
+    rc = sqlite3_prepare_v2(
+      db, "SELECT * FROM chemicalite_map('mol_unknown', 'SELECT id, mol FROM mols', 2)",
+      -1, &pStmt, 0);
+    REQUIRE(rc == SQLITE_OK);
+    rc = sqlite3_step(pStmt);
+    REQUIRE(rc == SQLITE_ERROR);
+    sqlite3_finalize(pStmt);
+
+    rc = sqlite3_prepare_v2(
+      db, "SELECT * FROM chemicalite_map('mol_tpsa', 'SELECT id FROM mols', 2)",
+      -1, &pStmt, 0);
+    REQUIRE(rc == SQLITE_OK);
+    rc = sqlite3_step(pStmt);
+    REQUIRE(rc == SQLITE_ERROR);
+    sqlite3_finalize(pStmt);
+
+    rc = sqlite3_prepare_v2(
+      db, "SELECT * FROM chemicalite_map('mol_tpsa', 'SELECT id, smiles FROM mols', 2)",
+      -1, &pStmt, 0);
+    REQUIRE(rc == SQLITE_OK);
+    rc = sqlite3_step(pStmt);
+    REQUIRE(rc == SQLITE_MISMATCH);
+    sqlite3_finalize(pStmt);
+  }
+
+  test_db_close(db);
+}
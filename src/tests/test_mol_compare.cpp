@@ -33,6 +33,45 @@ TEST_CASE("mol compare", "[mol]")
         ")", 0);
   }
 
+  SECTION("test mol_cmp_key")
+  {
+    test_select_value(
+        db,
+        "SELECT mol_cmp_key(mol_from_smiles('c1ccccc1')) = "
+        "mol_cmp_key(mol_from_smiles('C1=CC=CC=C1'))", 1);
+    test_select_value(
+        db,
+        "SELECT mol_cmp_key(mol_from_smiles('c1ccccc1C')) > "
+        "mol_cmp_key(mol_from_smiles('c1ccccc1'))", 1);
+    test_select_value(
+        db,
+        "SELECT mol_cmp_key(mol_from_smiles('CCO')) = "
+        "mol_cmp_key(mol_from_smiles('COC'))", 0);
+
+    int rc = sqlite3_exec(
+      db,
+      "CREATE TABLE mols(smiles TEXT, mol MOL);"
+      "INSERT INTO mols(smiles) VALUES "
+      "('CCO'), ('c1ccccc1'), ('OCC'), ('COC'), ('C1=CC=CC=C1'), ('C'), ('c1ccccc1C'), ('CCO');"
+      "UPDATE mols SET mol = mol_from_smiles(smiles);",
+      NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    // the key equality is consistent with mol_cmp
+    test_select_value(
+        db,
+        "SELECT COUNT(*) FROM mols AS a, mols AS b "
+        "WHERE (mol_cmp_key(a.mol) = mol_cmp_key(b.mol)) != (mol_cmp(a.mol, b.mol) = 0)", 0);
+    test_select_value(
+        db,
+        "SELECT COUNT(*) FROM (SELECT 1 FROM mols GROUP BY mol_cmp_key(mol))", 5);
+    test_select_value(
+        db,
+        "SELECT group_concat(smiles, ' ') FROM ("
+        "SELECT smiles FROM mols WHERE smiles IN ('c1ccccc1C', 'C', 'COC') "
+        "ORDER BY mol_cmp_key(mol))", "C COC c1ccccc1C");
+  }
+
   SECTION("test mol_is_substruct")
   {
     test_select_value(
@@ -93,5 +132,57 @@ TEST_CASE("mol compare", "[mol]")
         ")", 1);
   }
 
+  SECTION("test mol_substruct_screened")
+  {
+    int rc = sqlite3_exec(
+      db,
+      "CREATE TABLE mols(smiles TEXT, mol MOL, cached MOL);"
+      "INSERT INTO mols(smiles) VALUES "
+      "('c1ccccc1C'), ('c1ccccn1'), ('CCO'), ('C'), ('c1ccccc1CC(=O)O'), ('C[C@H](N)C(=O)O');"
+      "UPDATE mols SET mol = mol_from_smiles(smiles);"
+      "UPDATE mols SET cached = mol_with_cached_fps(mol);",
+      NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    const char * queries[] = {"c1ccccc1", "C", "CO", "c1cc[c,n]cc1", "C(=O)O", "N[C@H](C)C(=O)O"};
+    for (const char * query : queries) {
+      std::string sql =
+        "SELECT COUNT(*) FROM mols WHERE "
+        "mol_is_substruct(mol, mol_from_smarts('" + std::string(query) + "')) != "
+        "mol_substruct_screened(mol, mol_from_smarts('" + std::string(query) + "')) OR "
+        "mol_is_substruct(mol, mol_from_smarts('" + std::string(query) + "')) != "
+        "mol_substruct_screened(cached, mol_from_smarts('" + std::string(query) + "'))";
+      test_select_value(db, sql, 0);
+    }
+
+    test_select_value(
+        db,
+        "SELECT group_concat(smiles, ' ') FROM mols "
+        "WHERE mol_substruct_screened(cached, mol_from_smiles('c1ccccc1'))",
+        "c1ccccc1C c1ccccc1CC(=O)O");
+
+    // chirality is only used when requested
+    test_select_value(
+        db,
+        "SELECT mol_substruct_screened("
+        "mol_from_smiles('C[C@H](N)C(=O)O'), mol_from_smiles('C[C@@H](N)C(=O)O'))", 1);
+    test_select_value(
+        db,
+        "SELECT mol_substruct_screened("
+        "mol_from_smiles('C[C@H](N)C(=O)O'), mol_from_smiles('C[C@@H](N)C(=O)O'), 1)", 0);
+    test_select_value(
+        db,
+        "SELECT mol_substruct_screened("
+        "mol_from_smiles('C[C@H](N)C(=O)O'), mol_from_smiles('C[C@H](N)C(=O)O'), 1)", 1);
+
+    // the chirality flag is evaluated for each row, while the query is compiled once
+    test_select_value(
+        db,
+        "SELECT group_concat(mol_substruct_screened("
+        "mol_from_smiles('C[C@H](N)C(=O)O'), mol_from_smiles('C[C@@H](N)C(=O)O'), flag), '') "
+        "FROM (SELECT column1 AS flag FROM (VALUES (0), (1), (1), (0), (1)))",
+        "10010");
+  }
+
   test_db_close(db);
 }
@@ -95,5 +95,62 @@ TEST_CASE("mol descriptors", "[mol]")
     test_select_value(db, "SELECT mol_formula(mol_from_smiles('OC1CCCCN1'))", "C5H11NO");
   }
 
+  SECTION("multiple descriptors of the same mol")
+  {
+    int rc = sqlite3_exec(
+      db,
+      "CREATE TABLE mols(smiles TEXT, mol MOL);"
+      "INSERT INTO mols(smiles) VALUES ('C'), ('CO'), ('CCO'), ('c1ccccn1'), ('CO');"
+      "UPDATE mols SET mol = mol_from_smiles(smiles);",
+      NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    const std::string query =
+      "SELECT group_concat(mol_to_smiles(mol) || ':' || mol_num_hvyatms(mol) || ':' || mol_hba(mol), ' ') "
+      "FROM mols";
+
+    test_select_value(db, "SELECT value FROM chemicalite_settings WHERE key = 'mol_cache_size'", 8);
+    test_select_value(
+      db, query,
+      "C:1:0 CO:2:1 CCO:3:1 c1ccncc1:6:1 CO:2:1");
+
+    // the results don't change when the cache is disabled
+    rc = sqlite3_exec(
+      db, "UPDATE chemicalite_settings SET value = 0 WHERE key = 'mol_cache_size'", NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    test_select_value(
+      db, query,
+      "C:1:0 CO:2:1 CCO:3:1 c1ccncc1:6:1 CO:2:1");
+
+    rc = sqlite3_exec(
+      db, "UPDATE chemicalite_settings SET value = 8 WHERE key = 'mol_cache_size'", NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+  }
+
+  SECTION("mol_descriptor_table")
+  {
+    test_select_value(
+      db,
+      "SELECT amw FROM mol_descriptor_table(mol_from_smiles('CO'))", 32.042);
+    test_select_value(
+      db,
+      "SELECT formula FROM mol_descriptor_table(mol_from_smiles('NC1CC=CCN1'))", "C5H10N2");
+    test_select_value(
+      db,
+      "SELECT d.hba = mol_hba(m.mol) AND d.hbd = mol_hbd(m.mol) "
+      "AND d.num_rings = mol_num_rings(m.mol) AND d.logp = mol_logp(m.mol) "
+      "AND d.tpsa = mol_tpsa(m.mol) AND d.kappa2 = mol_kappa2(m.mol) "
+      "FROM (SELECT mol_from_smiles('Oc1ccccc1C=O') AS mol) m, "
+      "mol_descriptor_table(m.mol) d", 1);
+    test_select_value(
+      db,
+      "SELECT COUNT(*) FROM mol_descriptor_table(NULL)", 0);
+    // the hidden column returns the input molecule
+    test_select_value(
+      db,
+      "SELECT mol_to_smiles(molecule) FROM mol_descriptor_table(mol_from_smiles('OCC'))", "CCO");
+  }
+
   test_db_close(db);
 }
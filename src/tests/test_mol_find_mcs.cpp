@@ -25,5 +25,43 @@ TEST_CASE("mol find MCS", "[mol]")
 
   }
 
+  SECTION("test mol find MCS with params")
+  {
+    int rc = SQLITE_OK;
+
+    rc = sqlite3_exec(
+        db, 
+        "CREATE TABLE mols(id INTEGER PRIMARY KEY, series INTEGER, mol MOL);"
+        "INSERT INTO mols(series, mol) VALUES (1, mol_from_smiles('CCO'));"
+        "INSERT INTO mols(series, mol) VALUES (1, mol_from_smiles('CCN'));"
+        "INSERT INTO mols(series, mol) VALUES (2, mol_from_smiles('c1ccccc1O'));"
+        "INSERT INTO mols(series, mol) VALUES (2, mol_from_smiles('c1ccccc1CO'));",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    test_select_value(
+      db,
+      "SELECT mol_num_atms(mol_find_mcs(mol)) FROM mols WHERE series = 1", 2);
+    test_select_value(
+      db,
+      "SELECT mol_num_atms(mol_find_mcs(mol, '{\"AtomCompare\": \"Any\"}')) FROM mols WHERE series = 1", 3);
+    test_select_value(
+      db,
+      "SELECT mol_num_atms(mol_find_mcs(mol, '{\"Timeout\": 10}')) FROM mols WHERE series = 1", 2);
+    test_select_value(
+      db,
+      "SELECT group_concat(n, ' ') FROM ("
+      "SELECT series, mol_num_atms(mol_find_mcs(mol, '{\"AtomCompare\": \"Any\"}')) AS n "
+      "FROM mols GROUP BY series ORDER BY series)", "3 7");
+
+    sqlite3_stmt *pStmt = nullptr;
+    rc = sqlite3_prepare_v2(
+      db, "SELECT mol_find_mcs(mol, 'not json') FROM mols", -1, &pStmt, 0);
+    REQUIRE(rc == SQLITE_OK);
+    rc = sqlite3_step(pStmt);
+    REQUIRE(rc == SQLITE_ERROR);
+    sqlite3_finalize(pStmt);
+  }
+
   test_db_close(db);
 }
@@ -267,5 +267,59 @@ TEST_CASE("mol formats interconversion", "[mol]")
     sqlite3_finalize(pStmt);
   }
 
+  SECTION("mol properties")
+  {
+    rc = sqlite3_exec(
+      db,
+      "CREATE TABLE mols(mol MOL);"
+      "INSERT INTO mols(mol) "
+      "VALUES (mol_set_prop(mol_set_prop(mol_from_smiles('CCO'), 'name', 'ethanol'), 'mw', 46.07));",
+      NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    // the properties are available to the functions that need them
+    test_select_value(db, "SELECT mol_get_text_prop(mol, 'name') FROM mols", "ethanol");
+    test_select_value(db, "SELECT mol_get_float_prop(mol, 'mw') FROM mols", 46.07);
+    test_select_value(db, "SELECT mol_has_prop(mol, 'formula') FROM mols", 0);
+    test_select_value(
+      db, "SELECT COUNT(*) FROM mols, mol_prop_list(mols.mol) WHERE property = 'name'", 1);
+    test_select_value(
+      db, "SELECT mol_get_text_prop(mol_set_prop(mol, 'id', 'x'), 'name') FROM mols", "ethanol");
+
+    // and not needed by those that only use the molecular graph
+    test_select_value(db, "SELECT mol_to_smiles(mol) FROM mols", "CCO");
+    test_select_value(db, "SELECT mol_num_hvyatms(mol) FROM mols", 3);
+
+    // the binary mol still includes the properties
+    sqlite3_stmt *pStmt;
+    rc = sqlite3_prepare_v2(db, "SELECT mol_to_binary_mol(mol) FROM mols", -1, &pStmt, 0);
+    REQUIRE(rc == SQLITE_OK);
+
+    rc = sqlite3_step(pStmt);
+    REQUIRE(rc == SQLITE_ROW);
+
+    int sz = sqlite3_column_bytes(pStmt, 0);
+    std::string pkl((const char *)sqlite3_column_blob(pStmt, 0), sz);
+    std::unique_ptr<RDKit::ROMol> output_mol(new RDKit::ROMol(pkl));
+    REQUIRE(output_mol->getProp<std::string>("name") == "ethanol");
+
+    sqlite3_finalize(pStmt);
+
+    // molecules stored from a binary pickle are still supported
+    test_select_value(
+      db, 
+      "SELECT mol_get_text_prop(mol_from_binary_mol(mol_to_binary_mol(mol)), 'name') FROM mols",
+      "ethanol");
+
+    // the private properties (e.g. the name from a SD file) are stored too
+    rc = sqlite3_exec(
+      db,
+      "CREATE TABLE cdk2(mol MOL);"
+      "INSERT INTO cdk2(mol) SELECT molecule FROM sdf_reader('cdk2.sdf') WHERE rowid = 1;",
+      NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+    test_select_value(db, "SELECT mol_get_text_prop(mol, '_Name') FROM cdk2", "ZINC03814457");
+  }
+
   test_db_close(db);
 }
@@ -33,5 +33,43 @@ TEST_CASE("mol hash", "[mol]")
     }
   }
 
+  SECTION("test mol hash index")
+  {
+    int rc = sqlite3_exec(
+      db,
+      "CREATE TABLE mols(id INTEGER PRIMARY KEY, mol MOL);"
+      "INSERT INTO mols(mol) VALUES "
+      "(mol_from_smiles('CCO')), (mol_from_smiles('c1ccccc1')), (NULL), (mol_from_smiles('CC(=O)O'));"
+      "SELECT mol_hash_link_index('mols', 'mol', 'mols_smiles', 'mol_hash_canonicalsmiles');"
+      "INSERT INTO mols(mol) VALUES (mol_from_smiles('OCC')), (mol_from_smiles('c1ccncc1'));"
+      "UPDATE mols SET mol = mol_from_smiles('CN') WHERE id = 3;"
+      "DELETE FROM mols WHERE id = 4;",
+      NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    test_select_value(db, "SELECT COUNT(*) FROM mols_smiles", 5);
+    test_select_value(
+      db,
+      "SELECT group_concat(id, ' ') FROM (SELECT id FROM mols_smiles "
+      "WHERE hash = mol_hash_canonicalsmiles(mol_from_smiles('C(O)C')) ORDER BY id)",
+      "1 5");
+    test_select_value(
+      db,
+      "SELECT id FROM mols_smiles WHERE hash = mol_hash_canonicalsmiles(mol_from_smiles('CN'))", 3);
+    test_select_value(
+      db,
+      "SELECT COUNT(*) FROM mols_smiles WHERE hash = mol_hash_canonicalsmiles(mol_from_smiles('CC(=O)O'))", 0);
+
+    rc = sqlite3_exec(
+      db,
+      "SELECT mol_hash_unlink_index('mols', 'mol', 'mols_smiles');"
+      "INSERT INTO mols(mol) VALUES (mol_from_smiles('CCCC'));",
+      NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    test_select_value(db, "SELECT COUNT(*) FROM sqlite_master WHERE type = 'trigger'", 0);
+    test_select_value(db, "SELECT COUNT(*) FROM mols_smiles", 5);
+  }
+
   test_db_close(db);
 }
@@ -39,6 +39,34 @@ TEST_CASE("rdtree create/drop", "[rdtree]")
     REQUIRE(rc == SQLITE_ERROR);
   }
 
+  SECTION("create and drop rdtree vtab w/o parent table")
+  {
+    int rc = sqlite3_exec(
+        db, 
+        "CREATE VIRTUAL TABLE xyz USING rdtree(id integer primary key, s bits(256), OPT_NO_PARENT_TABLE)",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    test_select_value(db, "SELECT COUNT(*) FROM xyz_rowid", 0);
+    test_select_value(db, "SELECT COUNT(*) FROM xyz_node", 1);
+
+    sqlite3_stmt *pStmt;
+
+    rc = sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM xyz_parent", -1, &pStmt, 0);
+    REQUIRE(rc == SQLITE_ERROR);
+
+    rc = sqlite3_exec(db, "ALTER TABLE xyz RENAME TO abc", NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    test_select_value(db, "SELECT COUNT(*) FROM abc_node", 1);
+
+    rc = sqlite3_exec(db, "DROP TABLE abc", NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    rc = sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM abc_node", -1, &pStmt, 0);
+    REQUIRE(rc == SQLITE_ERROR);
+  }
+
   SECTION ("create and drop rdtree vtab w/ unrecognized option")
   {
     int rc = sqlite3_exec(
@@ -127,6 +127,144 @@ TEST_CASE("rdtree insert", "[rdtree]")
     sqlite3_finalize(pStmt);
   }
 
+  SECTION("insert multiple bfp values within a transaction")
+  {
+    const int NUM_BFPS = 256;
+
+    rc = sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    sqlite3_stmt *pStmt = 0;
+    rc = sqlite3_prepare(db, "INSERT INTO xyz(id, s) VALUES(?1, bfp_dummy(1024, ?2))", -1, &pStmt, 0);
+    REQUIRE(rc == SQLITE_OK);
+
+    for (int i=0; i < NUM_BFPS; ++i) {
+      rc = sqlite3_bind_int(pStmt, 1, i+1);
+      REQUIRE(rc == SQLITE_OK);
+
+      rc = sqlite3_bind_int(pStmt, 2, i);
+      REQUIRE(rc == SQLITE_OK);
+
+      rc = sqlite3_step(pStmt);
+      REQUIRE(rc == SQLITE_DONE);
+
+      rc = sqlite3_reset(pStmt);
+      REQUIRE(rc == SQLITE_OK);
+    }
+
+    sqlite3_finalize(pStmt);
+
+    // the pending changes are visible before the transaction is committed
+    test_select_value(db, "SELECT COUNT(*) FROM xyz", NUM_BFPS);
+    test_select_value(
+      db, 
+      "SELECT COUNT(*) FROM xyz WHERE id MATCH rdtree_subset(bfp_dummy(1024, 1))", 128);
+
+    // inserting a duplicate rowid still fails
+    rc = sqlite3_exec(
+        db, 
+        "INSERT INTO xyz(id, s) VALUES(16, bfp_dummy(1024, 42))",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_CONSTRAINT);
+
+    rc = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    // and after the commit the shadow tables are up to date
+    test_select_value(db, "SELECT COUNT(*) FROM xyz_rowid", NUM_BFPS);
+    test_select_value(db, "SELECT SUM(freq) FROM xyz_weightfreq", NUM_BFPS);
+    test_select_value(db, "SELECT SUM(freq) FROM xyz_bitfreq", 1024*NUM_BFPS/2);
+    test_select_value(
+      db, 
+      "SELECT COUNT(*) FROM xyz WHERE id MATCH rdtree_subset(bfp_dummy(1024, 1))", 128);
+  }
+
+  SECTION("rollback a transaction")
+  {
+    rc = sqlite3_exec(
+        db, 
+        "INSERT INTO xyz(id, s) VALUES(1, bfp_dummy(1024, 1))",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    rc = sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    sqlite3_stmt *pStmt = 0;
+    rc = sqlite3_prepare(db, "INSERT INTO xyz(id, s) VALUES(?1, bfp_dummy(1024, ?2))", -1, &pStmt, 0);
+    REQUIRE(rc == SQLITE_OK);
+
+    for (int i=1; i < 100; ++i) {
+      rc = sqlite3_bind_int(pStmt, 1, i+1);
+      REQUIRE(rc == SQLITE_OK);
+
+      rc = sqlite3_bind_int(pStmt, 2, i);
+      REQUIRE(rc == SQLITE_OK);
+
+      rc = sqlite3_step(pStmt);
+      REQUIRE(rc == SQLITE_DONE);
+
+      rc = sqlite3_reset(pStmt);
+      REQUIRE(rc == SQLITE_OK);
+    }
+
+    sqlite3_finalize(pStmt);
+
+    test_select_value(db, "SELECT COUNT(*) FROM xyz", 100);
+
+    rc = sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    test_select_value(db, "SELECT COUNT(*) FROM xyz", 1);
+    test_select_value(db, "SELECT COUNT(*) FROM xyz_rowid", 1);
+    test_select_value(db, "SELECT COUNT(*) FROM xyz_node", 1);
+    test_select_value(db, "SELECT SUM(freq) FROM xyz_weightfreq", 1);
+    test_select_value(
+      db, 
+      "SELECT COUNT(*) FROM xyz WHERE id MATCH rdtree_subset(bfp_dummy(1024, 1))", 1);
+  }
+
+  SECTION("rollback to a savepoint")
+  {
+    rc = sqlite3_exec(
+        db, 
+        "BEGIN;"
+        "WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i < 100) "
+        "INSERT INTO xyz(id, s) SELECT i, bfp_dummy(1024, i) FROM c;"
+        "SAVEPOINT sp;"
+        "WITH RECURSIVE c(i) AS (SELECT 101 UNION ALL SELECT i+1 FROM c WHERE i < 200) "
+        "INSERT INTO xyz(id, s) SELECT i, bfp_dummy(1024, i) FROM c;"
+        "DELETE FROM xyz WHERE id % 3 = 0;",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    test_select_value(db, "SELECT COUNT(*) FROM xyz", 134);
+
+    // the changes made before the savepoint are retained
+    rc = sqlite3_exec(db, "ROLLBACK TO sp", NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+    test_select_value(db, "SELECT COUNT(*) FROM xyz", 100);
+
+    // as well as those made before a failed statement
+    rc = sqlite3_exec(
+        db, 
+        "WITH RECURSIVE c(i) AS (SELECT 101 UNION ALL SELECT i+1 FROM c WHERE i < 150) "
+        "INSERT INTO xyz(id, s) SELECT i, bfp_dummy(1024, i) FROM c UNION ALL SELECT 50, bfp_dummy(1024, 50)",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_CONSTRAINT);
+    test_select_value(db, "SELECT COUNT(*) FROM xyz", 100);
+
+    rc = sqlite3_exec(db, "RELEASE sp; COMMIT", NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    test_select_value(db, "SELECT COUNT(*) FROM xyz", 100);
+    test_select_value(db, "SELECT COUNT(*) FROM xyz_rowid", 100);
+    test_select_value(db, "SELECT SUM(freq) FROM xyz_weightfreq", 100);
+    test_select_value(
+      db, 
+      "SELECT COUNT(*) FROM xyz WHERE id MATCH rdtree_subset(bfp_dummy(1024, 1))", 50);
+  }
+
   rc = sqlite3_exec(db, "DROP TABLE xyz", NULL, NULL, NULL);
   REQUIRE(rc == SQLITE_OK);
 
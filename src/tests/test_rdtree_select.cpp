@@ -62,6 +62,41 @@ TEST_CASE("rdtree select", "[rdtree]")
       "SELECT COUNT(*) FROM xyz WHERE id MATCH rdtree_tanimoto(bfp_dummy(1024, 1), .5)", 8);
   }
 
+  SECTION("traversal counters of the last query") {
+
+    test_select_value(
+      db, 
+      "SELECT COUNT(*) FROM xyz WHERE id MATCH rdtree_subset(bfp_dummy(1024, 0x0f))", 16);
+
+    test_select_value(
+      db, 
+      "SELECT json_extract(rdtree_last_query_stats(), '$.leaf_accepted')", 16);
+
+    // some of the leaf nodes are expected to be pruned
+    test_select_value(
+      db, 
+      "SELECT json_extract(rdtree_last_query_stats(), '$.leaf_tested') BETWEEN 16 AND 255", 1);
+    test_select_value(
+      db, 
+      "SELECT json_extract(rdtree_last_query_stats(), '$.internal_pruned') > 0", 1);
+    test_select_value(
+      db, 
+      "SELECT json_extract(rdtree_last_query_stats(), '$.nodes_acquired') "
+      "<= json_extract(rdtree_last_query_stats(), '$.internal_tested') "
+      "- json_extract(rdtree_last_query_stats(), '$.internal_pruned') + 1", 1);
+
+    // the counters are reset when the cursor is filtered again, e.g. in the
+    // inner loop of a join
+    test_select_value(
+      db, 
+      "SELECT COUNT(*) FROM (SELECT 1 UNION ALL SELECT 2 UNION ALL SELECT 3) AS t "
+      "CROSS JOIN xyz WHERE xyz.id MATCH rdtree_subset(bfp_dummy(1024, 0x0f))", 48);
+
+    test_select_value(
+      db, 
+      "SELECT json_extract(rdtree_last_query_stats(), '$.leaf_accepted')", 16);
+  }
+
   sqlite3_finalize(pStmt);
 
   rc = sqlite3_exec(db, "DROP TABLE xyz", NULL, NULL, NULL);
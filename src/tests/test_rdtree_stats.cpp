@@ -0,0 +1,149 @@
+#include "test_common.hpp"
+
+TEST_CASE("rdtree stats", "[rdtree]")
+{
+  sqlite3 * db = nullptr;
+  test_db_open(&db);
+
+  int rc = sqlite3_exec(
+      db, 
+      "CREATE VIRTUAL TABLE xyz USING rdtree(id integer primary key, s bits(1024))",
+      NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_OK);
+
+  SECTION("empty rdtree")
+  {
+    test_select_value(db, "SELECT COUNT(*) FROM rdtree_stats('xyz')", 1);
+    test_select_value(db, "SELECT height FROM rdtree_stats('xyz')", 0);
+    test_select_value(db, "SELECT nodes FROM rdtree_stats('xyz')", 1);
+    test_select_value(db, "SELECT items FROM rdtree_stats('xyz')", 0);
+    test_select_value(db, "SELECT avg_union_weight FROM rdtree_stats('xyz')", 0.);
+  }
+
+  SECTION("multiple levels")
+  {
+    const int NUM_BFPS = 256;
+
+    sqlite3_stmt *pStmt = 0;
+    rc = sqlite3_prepare(db, "INSERT INTO xyz(id, s) VALUES(?1, bfp_dummy(1024, ?2))", -1, &pStmt, 0);
+    REQUIRE(rc == SQLITE_OK);
+
+    for (int i=0; i < NUM_BFPS; ++i) {
+      rc = sqlite3_bind_int(pStmt, 1, i+1);
+      REQUIRE(rc == SQLITE_OK);
+
+      rc = sqlite3_bind_int(pStmt, 2, i);
+      REQUIRE(rc == SQLITE_OK);
+
+      rc = sqlite3_step(pStmt);
+      REQUIRE(rc == SQLITE_DONE);
+
+      rc = sqlite3_reset(pStmt);
+      REQUIRE(rc == SQLITE_OK);
+    }
+
+    sqlite3_finalize(pStmt);
+
+    test_select_value(db, "SELECT COUNT(*) > 1 FROM rdtree_stats('xyz')", 1);
+    test_select_value(
+      db, "SELECT MAX(height) + 1 = COUNT(*) FROM rdtree_stats('xyz')", 1);
+
+    // the root is the only node at the top level, and it stores the union
+    // of all the fingerprints
+    test_select_value(
+      db, "SELECT nodes FROM rdtree_stats('xyz') ORDER BY height DESC LIMIT 1", 1);
+    test_select_value(
+      db, "SELECT avg_union_weight FROM rdtree_stats('xyz') ORDER BY height DESC LIMIT 1", 1024.);
+
+    // each item at an intermediate level references a node at the level below
+    test_select_value(
+      db, 
+      "SELECT (SELECT COUNT(*) FROM rdtree_stats('xyz') AS a JOIN rdtree_stats('xyz') AS b "
+      "ON a.height = b.height + 1 WHERE a.items = b.nodes) = "
+      "(SELECT COUNT(*) - 1 FROM rdtree_stats('xyz'))", 1);
+    test_select_value(db, "SELECT items FROM rdtree_stats('xyz') WHERE height = 0", NUM_BFPS);
+    test_select_value(
+      db, 
+      "SELECT MIN(avg_fill > 0 AND avg_fill <= 1 AND pruning_power >= 0 AND pruning_power <= 1) "
+      "FROM rdtree_stats('xyz')", 1);
+  }
+
+  SECTION("not an rdtree")
+  {
+    sqlite3_stmt *pStmt = 0;
+    rc = sqlite3_prepare_v2(db, "SELECT * FROM rdtree_stats('abc')", -1, &pStmt, 0);
+    REQUIRE(rc == SQLITE_OK);
+    rc = sqlite3_step(pStmt);
+    REQUIRE(rc == SQLITE_ERROR);
+    REQUIRE(std::string(sqlite3_errmsg(db)) == "no such rdtree table: abc");
+    sqlite3_finalize(pStmt);
+
+    rc = sqlite3_prepare_v2(db, "SELECT * FROM rdtree_stats('aux', 'xyz')", -1, &pStmt, 0);
+    REQUIRE(rc == SQLITE_OK);
+    rc = sqlite3_step(pStmt);
+    REQUIRE(rc == SQLITE_ERROR);
+    REQUIRE(std::string(sqlite3_errmsg(db)).find("no such table") != std::string::npos);
+    sqlite3_finalize(pStmt);
+  }
+
+  SECTION("attached database")
+  {
+    rc = sqlite3_exec(
+        db, 
+        "ATTACH DATABASE ':memory:' AS aux;"
+        "CREATE VIRTUAL TABLE aux.abc USING rdtree(id integer primary key, s bits(1024));"
+        "INSERT INTO aux.abc(id, s) VALUES(1, bfp_dummy(1024, 1)), (2, bfp_dummy(1024, 2));",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    test_select_value(db, "SELECT items FROM rdtree_stats('abc') WHERE height = 0", 2);
+    test_select_value(db, "SELECT items FROM rdtree_stats('aux', 'abc') WHERE height = 0", 2);
+    test_select_value(db, "SELECT items FROM rdtree_stats('main', 'xyz') WHERE height = 0", 0);
+
+    sqlite3_stmt *pStmt = 0;
+    rc = sqlite3_prepare(db, "SELECT * FROM rdtree_stats('main', 'abc')", -1, &pStmt, 0);
+    REQUIRE(rc == SQLITE_OK);
+    rc = sqlite3_step(pStmt);
+    REQUIRE(rc == SQLITE_ERROR);
+    sqlite3_finalize(pStmt);
+
+    rc = sqlite3_exec(db, "DROP TABLE aux.abc; DETACH DATABASE aux", NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+  }
+
+  SECTION("tombstoned records")
+  {
+    const int NUM_BFPS = 256;
+
+    rc = sqlite3_exec(
+        db, 
+        "CREATE VIRTUAL TABLE abc USING rdtree(id integer primary key, s bits(1024), OPT_TOMBSTONE_DELETE);"
+        "WITH RECURSIVE ids(id) AS (SELECT 1 UNION ALL SELECT id + 1 FROM ids WHERE id < 256) "
+        "INSERT INTO abc(id, s) SELECT id, bfp_dummy(1024, id) FROM ids;"
+        "DELETE FROM abc WHERE id % 4 = 0;",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    test_select_value(
+      db, "SELECT items FROM rdtree_stats('abc') WHERE height = 0", NUM_BFPS - NUM_BFPS/4);
+    test_select_value(
+      db, "SELECT tombstones FROM rdtree_stats('abc') WHERE height = 0", NUM_BFPS/4);
+    test_select_value(
+      db, "SELECT SUM(tombstones) FROM rdtree_stats('abc') WHERE height > 0", 0);
+
+    test_select_value(db, "SELECT rdtree_compact('abc')", NUM_BFPS/4);
+
+    test_select_value(
+      db, "SELECT items FROM rdtree_stats('abc') WHERE height = 0", NUM_BFPS - NUM_BFPS/4);
+    test_select_value(
+      db, "SELECT tombstones FROM rdtree_stats('abc') WHERE height = 0", 0);
+
+    rc = sqlite3_exec(db, "DROP TABLE abc", NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+  }
+
+  rc = sqlite3_exec(db, "DROP TABLE xyz", NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_OK);
+
+  test_db_close(db);
+}
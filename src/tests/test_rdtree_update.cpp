@@ -111,3 +111,214 @@ TEST_CASE("rdtree update", "[rdtree]")
 
   test_db_close(db);
 }
+
+TEST_CASE("rdtree delete w/o parent table", "[rdtree]")
+{
+  sqlite3 * db = nullptr;
+  test_db_open(&db);
+
+  int rc = sqlite3_exec(
+      db, 
+      "CREATE VIRTUAL TABLE xyz USING rdtree(id integer primary key, s bits(1024), OPT_NO_PARENT_TABLE)",
+      NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_OK);
+
+  const int NUM_BFPS = 512;
+
+  sqlite3_stmt *pStmt = 0;
+  rc = sqlite3_prepare(db, "INSERT INTO xyz(id, s) VALUES(?1, bfp_dummy(1024, ?2))", -1, &pStmt, 0);
+  REQUIRE(rc == SQLITE_OK);
+
+  for (int i=0; i < NUM_BFPS; ++i) {
+    rc = sqlite3_bind_int(pStmt, 1, i+1);
+    REQUIRE(rc == SQLITE_OK);
+
+    rc = sqlite3_bind_int(pStmt, 2, i % 256);
+    REQUIRE(rc == SQLITE_OK);
+
+    rc = sqlite3_step(pStmt);
+    REQUIRE(rc == SQLITE_DONE);
+
+    rc = sqlite3_reset(pStmt);
+    REQUIRE(rc == SQLITE_OK);
+  }
+
+  sqlite3_finalize(pStmt);
+
+  // the deletion of records from leaf nodes requires the ancestry of
+  // the nodes to be rebuilt by a search from the root
+  rc = sqlite3_exec(db, "DELETE FROM xyz WHERE id % 3 = 0", NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_OK);
+
+  rc = sqlite3_exec(db, "UPDATE xyz SET s=bfp_dummy(1024, 255) WHERE id % 5 = 0", NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_OK);
+
+  test_select_value(db, "SELECT COUNT(*) FROM xyz", NUM_BFPS - NUM_BFPS/3);
+  test_select_value(db, "SELECT COUNT(*) FROM xyz_rowid", NUM_BFPS - NUM_BFPS/3);
+  test_select_value(db, "SELECT SUM(freq) FROM xyz_weightfreq", NUM_BFPS - NUM_BFPS/3);
+  test_select_value(
+    db, 
+    "SELECT SUM(freq) = (SELECT SUM(bfp_weight(s)) FROM xyz) FROM xyz_bitfreq", 1);
+  test_select_value(
+    db, 
+    "SELECT COUNT(*) = (SELECT COUNT(*) FROM xyz WHERE bfp_weight(s) = 1024) "
+    "FROM xyz WHERE id MATCH rdtree_subset(bfp_dummy(1024, 255))", 1);
+
+  rc = sqlite3_exec(db, "DELETE FROM xyz", NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_OK);
+
+  test_select_value(db, "SELECT COUNT(*) FROM xyz", 0);
+  test_select_value(db, "SELECT COUNT(*) FROM xyz_node", 1);
+
+  rc = sqlite3_exec(db, "DROP TABLE xyz", NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_OK);
+
+  test_db_close(db);
+}
+
+TEST_CASE("rdtree tombstone delete", "[rdtree]")
+{
+  sqlite3 * db = nullptr;
+  test_db_open(&db);
+
+  int rc = sqlite3_exec(
+      db, 
+      "CREATE VIRTUAL TABLE xyz USING rdtree(id integer primary key, s bits(1024), OPT_TOMBSTONE_DELETE)",
+      NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_OK);
+
+  const int NUM_BFPS = 512;
+
+  sqlite3_stmt *pStmt = 0;
+  rc = sqlite3_prepare(db, "INSERT INTO xyz(id, s) VALUES(?1, bfp_dummy(1024, ?2))", -1, &pStmt, 0);
+  REQUIRE(rc == SQLITE_OK);
+
+  for (int i=0; i < NUM_BFPS; ++i) {
+    rc = sqlite3_bind_int(pStmt, 1, i+1);
+    REQUIRE(rc == SQLITE_OK);
+
+    rc = sqlite3_bind_int(pStmt, 2, i % 256);
+    REQUIRE(rc == SQLITE_OK);
+
+    rc = sqlite3_step(pStmt);
+    REQUIRE(rc == SQLITE_DONE);
+
+    rc = sqlite3_reset(pStmt);
+    REQUIRE(rc == SQLITE_OK);
+  }
+
+  sqlite3_finalize(pStmt);
+
+  rc = sqlite3_exec(db, "DELETE FROM xyz WHERE id % 2 = 0", NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_OK);
+
+  // the deleted records are still stored in the tree, but they are skipped
+  test_select_value(db, "SELECT COUNT(*) FROM xyz_tombstone", NUM_BFPS/2);
+  test_select_value(db, "SELECT COUNT(*) FROM xyz_rowid", NUM_BFPS);
+  test_select_value(db, "SELECT COUNT(*) FROM xyz", NUM_BFPS/2);
+  test_select_value(db, "SELECT COUNT(*) FROM xyz WHERE id = 2", 0);
+  test_select_value(db, "SELECT COUNT(*) FROM xyz WHERE id = 3", 1);
+  test_select_value(db, "SELECT SUM(freq) FROM xyz_weightfreq", NUM_BFPS/2);
+  test_select_value(
+    db, 
+    "SELECT COUNT(*) FROM xyz WHERE id MATCH rdtree_subset(bfp_dummy(1024, 255))", 0);
+
+  // a tombstoned rowid can be reused
+  rc = sqlite3_exec(db, "INSERT INTO xyz(id, s) VALUES(2, bfp_dummy(1024, 255))", NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_OK);
+
+  test_select_value(db, "SELECT COUNT(*) FROM xyz_tombstone", NUM_BFPS/2 - 1);
+  test_select_value(db, "SELECT bfp_weight(s) FROM xyz WHERE id = 2", 1024);
+  test_select_value(
+    db, 
+    "SELECT COUNT(*) FROM xyz WHERE id MATCH rdtree_subset(bfp_dummy(1024, 255))", 1);
+
+  // a failed compaction leaves the table unchanged
+  rc = sqlite3_exec(
+      db, 
+      "CREATE TABLE counter(n INTEGER);"
+      "INSERT INTO counter VALUES(0);"
+      "CREATE TRIGGER fail_compact BEFORE DELETE ON xyz_tombstone BEGIN "
+      "UPDATE counter SET n = n + 1; "
+      "SELECT RAISE(ABORT, 'compaction failed') WHERE (SELECT n FROM counter) > 100; "
+      "END;",
+      NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_OK);
+  rc = sqlite3_exec(db, "SELECT rdtree_compact('xyz')", NULL, NULL, NULL);
+  REQUIRE(rc != SQLITE_OK);
+
+  test_select_value(db, "SELECT n FROM counter", 0);
+  test_select_value(db, "SELECT COUNT(*) FROM xyz_tombstone", NUM_BFPS/2 - 1);
+  test_select_value(db, "SELECT COUNT(*) FROM xyz_rowid", NUM_BFPS);
+  test_select_value(db, "SELECT COUNT(*) FROM xyz", NUM_BFPS/2 + 1);
+  test_select_value(db, "SELECT COUNT(*) FROM xyz WHERE id = 4", 0);
+  test_select_value(
+    db, 
+    "SELECT COUNT(*) FROM xyz WHERE id MATCH rdtree_subset(bfp_dummy(1024, 255))", 1);
+
+  // also within a transaction, where the changes are pending in memory
+  rc = sqlite3_exec(
+      db, 
+      "BEGIN;"
+      "DELETE FROM xyz WHERE id = 3;"
+      "INSERT INTO xyz(id, s) VALUES(3, bfp_dummy(1024, 3));",
+      NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_OK);
+  rc = sqlite3_exec(db, "SELECT rdtree_compact('xyz')", NULL, NULL, NULL);
+  REQUIRE(rc != SQLITE_OK);
+  rc = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_OK);
+
+  test_select_value(db, "SELECT COUNT(*) FROM xyz_tombstone", NUM_BFPS/2 - 1);
+  test_select_value(db, "SELECT COUNT(*) FROM xyz_rowid", NUM_BFPS);
+  test_select_value(db, "SELECT COUNT(*) FROM xyz", NUM_BFPS/2 + 1);
+
+  rc = sqlite3_exec(db, "DROP TRIGGER fail_compact; DROP TABLE counter", NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_OK);
+
+  // compaction removes the tombstoned records from the tree
+  rc = sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_OK);
+  test_select_value(db, "SELECT rdtree_compact('xyz')", NUM_BFPS/2 - 1);
+  rc = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_OK);
+
+  test_select_value(db, "SELECT COUNT(*) FROM xyz_tombstone", 0);
+  test_select_value(db, "SELECT COUNT(*) FROM xyz_rowid", NUM_BFPS/2 + 1);
+  test_select_value(db, "SELECT COUNT(*) FROM xyz", NUM_BFPS/2 + 1);
+  test_select_value(db, "SELECT SUM(freq) FROM xyz_weightfreq", NUM_BFPS/2 + 1);
+  test_select_value(
+    db, 
+    "SELECT SUM(freq) = (SELECT SUM(bfp_weight(s)) FROM xyz) FROM xyz_bitfreq", 1);
+
+  test_select_value(db, "SELECT rdtree_compact('xyz')", 0);
+
+  rc = sqlite3_exec(db, "SELECT rdtree_compact('abc')", NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_ERROR);
+
+  // a table with the same name in an attached database is a distinct table
+  rc = sqlite3_exec(
+      db, 
+      "ATTACH DATABASE ':memory:' AS aux;"
+      "CREATE VIRTUAL TABLE aux.xyz USING rdtree(id integer primary key, s bits(1024), OPT_TOMBSTONE_DELETE);"
+      "INSERT INTO aux.xyz(id, s) SELECT id, s FROM main.xyz;"
+      "DELETE FROM aux.xyz WHERE id % 3 = 0;",
+      NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_OK);
+
+  test_select_value(db, "SELECT rdtree_compact('xyz')", 0);
+  test_select_value(db, "SELECT rdtree_compact('main', 'xyz')", 0);
+  test_select_value(db, "SELECT rdtree_compact('aux', 'xyz')", 85);
+  test_select_value(db, "SELECT COUNT(*) FROM aux.xyz_rowid", NUM_BFPS/2 + 1 - 85);
+
+  rc = sqlite3_exec(db, "SELECT rdtree_compact('temp', 'xyz')", NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_ERROR);
+
+  rc = sqlite3_exec(db, "DROP TABLE aux.xyz; DETACH DATABASE aux", NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_OK);
+
+  rc = sqlite3_exec(db, "DROP TABLE xyz", NULL, NULL, NULL);
+  REQUIRE(rc == SQLITE_OK);
+
+  test_db_close(db);
+}
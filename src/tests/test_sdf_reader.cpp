@@ -44,5 +44,193 @@ TEST_CASE("SDF reader", "[sdf_reader]")
       "Cc1nc(C)c(-c2[nH]nc3c2C(=O)c2c(NC(=O)NN4CC[NH+](C)CC4)cccc2-3)s1");
   }
 
+  SECTION("multi-threaded")
+  {
+    int rc = sqlite3_exec(
+        db, 
+        "CREATE VIRTUAL TABLE cdk2 USING sdf_reader("
+        "'cdk2.sdf', "
+        "schema='_Name TEXT AS name', "
+        "threads=4"
+        ")",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    rc = sqlite3_exec(
+        db, 
+        "CREATE VIRTUAL TABLE ref USING sdf_reader('cdk2.sdf', schema='_Name TEXT AS name')",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    test_select_value(db, "SELECT COUNT(*) FROM cdk2", 47);
+
+    // the records are returned in file order
+    test_select_value(
+      db,
+      "SELECT COUNT(*) FROM cdk2 JOIN ref ON ref.rowid = cdk2.rowid "
+      "WHERE mol_to_smiles(ref.molecule) = mol_to_smiles(cdk2.molecule) AND "
+      "ref.name = cdk2.name", 47);
+
+    test_select_value(db, "SELECT COUNT(*) FROM sdf_reader('cdk2.sdf', 3)", 47);
+
+    test_select_value(db, "SELECT MAX(mol_amw(molecule)) FROM sdf_reader('cdk2.sdf', 3)", 449.517);
+
+    rc = sqlite3_exec(
+        db, 
+        "CREATE VIRTUAL TABLE invalid USING sdf_reader('cdk2.sdf', threads=0)",
+        NULL, NULL, NULL);
+    REQUIRE(rc != SQLITE_OK);
+  }
+
+  SECTION("indexed access")
+  {
+    int rc = sqlite3_exec(
+        db, 
+        "CREATE VIRTUAL TABLE cdk2 USING sdf_reader("
+        "'cdk2.sdf', schema='_Name TEXT AS name', index=memory);"
+        "CREATE VIRTUAL TABLE ref USING sdf_reader("
+        "'cdk2.sdf', schema='_Name TEXT AS name');"
+        "CREATE VIRTUAL TABLE cdk2_mt USING sdf_reader("
+        "'cdk2.sdf', schema='_Name TEXT AS name', index=memory, threads=3);",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    test_select_value(db, "SELECT COUNT(*) FROM cdk2", 47);
+    test_select_value(db, "SELECT name FROM cdk2 WHERE rowid = 1", "ZINC03814457");
+    test_select_value(db, "SELECT name FROM cdk2 WHERE rowid = 47", "ZINC03831630");
+    test_select_value(db, "SELECT COUNT(*) FROM cdk2 WHERE rowid = 48", 0);
+    test_select_value(db, "SELECT COUNT(*) FROM cdk2 WHERE rowid = 2.5", 0);
+    test_select_value(db, "SELECT COUNT(*) FROM cdk2 WHERE rowid BETWEEN 10 AND 20", 11);
+    test_select_value(db, "SELECT COUNT(*) FROM cdk2 WHERE rowid > 40", 7);
+    test_select_value(db, "SELECT COUNT(*) FROM cdk2 WHERE rowid < 5.5", 5);
+    test_select_value(db, "SELECT COUNT(*) FROM cdk2_mt WHERE rowid > 10 AND rowid <= 30", 20);
+
+    test_select_value(
+      db,
+      "SELECT COUNT(*) FROM ref JOIN cdk2 ON cdk2.rowid = ref.rowid "
+      "WHERE mol_to_smiles(ref.molecule) = mol_to_smiles(cdk2.molecule) AND "
+      "ref.name = cdk2.name", 47);
+    test_select_value(
+      db,
+      "SELECT COUNT(*) FROM ref JOIN cdk2_mt ON cdk2_mt.rowid = ref.rowid "
+      "WHERE mol_to_smiles(ref.molecule) = mol_to_smiles(cdk2_mt.molecule) AND "
+      "ref.name = cdk2_mt.name", 47);
+
+    rc = sqlite3_exec(
+        db, 
+        "CREATE VIRTUAL TABLE invalid USING sdf_reader('cdk2.sdf', index=disk)",
+        NULL, NULL, NULL);
+    REQUIRE(rc != SQLITE_OK);
+  }
+
+  SECTION("compressed input")
+  {
+    test_select_value(db, "SELECT COUNT(*) FROM sdf_reader('cdk2.sdf.gz')", 47);
+    test_select_value(db, "SELECT MAX(mol_amw(molecule)) FROM sdf_reader('cdk2.sdf.gz')", 449.517);
+    test_select_value(db, "SELECT COUNT(*) FROM sdf_reader('cdk2.sdf.zst')", 47);
+    test_select_value(db, "SELECT MAX(mol_amw(molecule)) FROM sdf_reader('cdk2.sdf.zst', 2)", 449.517);
+
+    int rc = sqlite3_exec(
+        db, 
+        "CREATE VIRTUAL TABLE cdk2 USING sdf_reader("
+        "'cdk2.sdf.gz', schema='_Name TEXT AS name', threads=2)",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+    test_select_value(db, "SELECT name FROM cdk2 WHERE rowid = 47", "ZINC03831630");
+
+    // the indexed access requires an uncompressed file
+    rc = sqlite3_exec(
+        db, 
+        "CREATE VIRTUAL TABLE indexed USING sdf_reader('cdk2.sdf.gz', index=memory);"
+        "SELECT COUNT(*) FROM indexed",
+        NULL, NULL, NULL);
+    REQUIRE(rc != SQLITE_OK);
+
+    // corrupt compressed data fails the scan, with or without the molecules
+    rc = sqlite3_exec(
+        db, "SELECT COUNT(*) FROM sdf_reader('cdk2_truncated.sdf.gz')", NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_IOERR);
+    rc = sqlite3_exec(
+        db, "SELECT COUNT(molecule) FROM sdf_reader('cdk2_truncated.sdf.gz')", NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_IOERR);
+    rc = sqlite3_exec(
+        db, "SELECT COUNT(molecule) FROM sdf_reader('cdk2_truncated.sdf.gz', 2)", NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_IOERR);
+  }
+
+  SECTION("property-only scans")
+  {
+    int rc = sqlite3_exec(
+        db, 
+        "CREATE VIRTUAL TABLE cdk2 USING sdf_reader("
+        "'cdk2.sdf', "
+        "schema='_Name TEXT AS name, Cluster INTEGER AS cluster, "
+        "\"r_mmffld_Potential_Energy-OPLS_2005\" REAL AS energy');"
+        "CREATE VIRTUAL TABLE indexed USING sdf_reader("
+        "'cdk2.sdf', schema='_Name TEXT AS name', index=memory)",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    // the molecule column is not used, and the records are not parsed
+    test_select_value(db, "SELECT name FROM cdk2 WHERE rowid = 47", "ZINC03831630");
+    test_select_value(db, "SELECT MAX(cluster) FROM cdk2", 32);
+    test_select_value(
+      db, "SELECT name FROM cdk2 WHERE energy = (SELECT MIN(energy) FROM cdk2)", "ZINC03814453");
+    test_select_value(db, "SELECT name FROM indexed WHERE rowid = 1", "ZINC03814457");
+    test_select_value(db, "SELECT COUNT(*) FROM indexed WHERE rowid BETWEEN 10 AND 20", 11);
+
+    // the indexed lookup of a record is also a property-only scan, the plan
+    // reports the rowid constraint (1) and the property-only flag (32)
+    const char * plans[][2] = {
+      {"EXPLAIN QUERY PLAN SELECT name FROM indexed WHERE rowid = 2", "INDEX 33:"},
+      {"EXPLAIN QUERY PLAN SELECT name FROM indexed WHERE rowid >= 2", "INDEX 36:"},
+      {"EXPLAIN QUERY PLAN SELECT molecule FROM indexed WHERE rowid = 2", "INDEX 1:"},
+    };
+    for (const auto & plan : plans) {
+      sqlite3_stmt *pStmt = 0;
+      rc = sqlite3_prepare_v2(db, plan[0], -1, &pStmt, 0);
+      REQUIRE(rc == SQLITE_OK);
+      rc = sqlite3_step(pStmt);
+      REQUIRE(rc == SQLITE_ROW);
+      std::string detail = (const char *) sqlite3_column_text(pStmt, 3);
+      REQUIRE(detail.find(plan[1]) != std::string::npos);
+      sqlite3_finalize(pStmt);
+    }
+
+    // the same values are returned when the molecules are parsed
+    test_select_value(
+      db, "SELECT name FROM cdk2 WHERE molecule IS NOT NULL AND rowid = 47", "ZINC03831630");
+    test_select_value(
+      db, "SELECT MAX(cluster) FROM cdk2 WHERE molecule IS NOT NULL", 32);
+  }
+
+  SECTION("invalid records")
+  {
+    int rc = sqlite3_exec(
+        db, 
+        "CREATE VIRTUAL TABLE plain USING sdf_reader("
+        "'cdk2_invalid.sdf', schema='_Name TEXT AS name, Cluster INTEGER AS cluster');"
+        "CREATE VIRTUAL TABLE threaded USING sdf_reader("
+        "'cdk2_invalid.sdf', schema='_Name TEXT AS name, Cluster INTEGER AS cluster', threads=2);"
+        "CREATE VIRTUAL TABLE indexed USING sdf_reader("
+        "'cdk2_invalid.sdf', schema='_Name TEXT AS name, Cluster INTEGER AS cluster', index=memory)",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    // the second record can't be parsed, but its properties are still returned,
+    // whether the molecule column is used or not
+    for (std::string table: {"plain", "threaded", "indexed"}) {
+      test_select_value(db, "SELECT COUNT(*) FROM " + table, 3);
+      test_select_value(db, "SELECT COUNT(*) FROM " + table + " WHERE molecule IS NULL", 1);
+      test_select_value(
+        db, "SELECT name FROM " + table + " WHERE molecule IS NULL", "ZINC03814459");
+      test_select_value(
+        db, "SELECT cluster FROM " + table + " WHERE molecule IS NULL", 2);
+      test_select_value(db, "SELECT name FROM " + table + " WHERE rowid = 2", "ZINC03814459");
+      test_select_value(
+        db, "SELECT group_concat(cluster) FROM " + table + " WHERE molecule IS NOT NULL", "1,2");
+    }
+  }
+
   test_db_close(db);
 }
@@ -1,5 +1,13 @@
+#include <fstream>
+#include <iterator>
+
 #include "test_common.hpp"
 
+static std::string read_file(const std::string & filename)
+{
+  std::ifstream ins(filename, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(ins), std::istreambuf_iterator<char>());
+}
 
 TEST_CASE("SDF writer", "[sdf_writer]")
 {
@@ -25,5 +33,55 @@ TEST_CASE("SDF writer", "[sdf_writer]")
     test_select_value(db, "SELECT COUNT(*) FROM sdf_reader('/tmp/copy.sdf')", 23);
   }
 
+  SECTION("multi-threaded copy")
+  {
+    test_select_value(
+      db, 
+      "SELECT sdf_writer(molecule, '/tmp/copy.sdf') FROM sdf_reader('cdk2.sdf')", 47);
+    test_select_value(
+      db, 
+      "SELECT sdf_writer(molecule, '/tmp/copy_mt.sdf', 3, 4096) FROM sdf_reader('cdk2.sdf')", 47);
+
+    // the records are written in the input order
+    std::string expected = read_file("/tmp/copy.sdf");
+    REQUIRE(!expected.empty());
+    REQUIRE(read_file("/tmp/copy_mt.sdf") == expected);
+
+    test_select_value(
+      db, 
+      "SELECT sdf_writer(molecule, '/tmp/copy_mt.sdf', 2) FROM sdf_reader('cdk2.sdf')"
+      " WHERE mol_amw(molecule) < 350.0", 23);
+    test_select_value(db, "SELECT COUNT(*) FROM sdf_reader('/tmp/copy_mt.sdf')", 23);
+
+    int rc = sqlite3_exec(
+      db, "SELECT sdf_writer(molecule, '/tmp/copy_mt.sdf', 0) FROM sdf_reader('cdk2.sdf')",
+      NULL, NULL, NULL);
+    REQUIRE(rc != SQLITE_OK);
+  }
+
+  SECTION("compressed copy")
+  {
+    test_select_value(
+      db, 
+      "SELECT sdf_writer(molecule, '/tmp/copy.sdf.gz') FROM sdf_reader('cdk2.sdf')", 47);
+    test_select_value(db, "SELECT COUNT(*) FROM sdf_reader('/tmp/copy.sdf.gz')", 47);
+    test_select_value(
+      db, "SELECT MAX(mol_amw(molecule)) FROM sdf_reader('/tmp/copy.sdf.gz')", 449.517);
+
+    // the compression format may be also explicitly requested
+    test_select_value(
+      db, 
+      "SELECT sdf_writer(molecule, '/tmp/copy.sdf.z', 2, NULL, 'zstd') FROM sdf_reader('cdk2.sdf')",
+      47);
+    test_select_value(
+      db, "SELECT MAX(mol_amw(molecule)) FROM sdf_reader('/tmp/copy.sdf.z')", 449.517);
+
+    int rc = sqlite3_exec(
+      db,
+      "SELECT sdf_writer(molecule, '/tmp/copy.sdf', NULL, NULL, 'bzip2') FROM sdf_reader('cdk2.sdf')",
+      NULL, NULL, NULL);
+    REQUIRE(rc != SQLITE_OK);
+  }
+
   test_db_close(db);
 }
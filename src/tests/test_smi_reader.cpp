@@ -145,5 +145,180 @@ TEST_CASE("SMILES reader", "[smi reader]")
     test_select_value(db, "SELECT MAX(TPSA) FROM tpsa", 106.51);
   }
 
+  SECTION("multi-threaded")
+  {
+    int rc;
+  
+    rc = sqlite3_exec(
+        db,
+        "CREATE VIRTUAL TABLE chembl USING smi_reader("
+        "'chembl_29_sample.txt', smiles_column=1, name_column=0, threads=3);"
+        "CREATE VIRTUAL TABLE ref USING smi_reader("
+        "'chembl_29_sample.txt', smiles_column=1, name_column=0);"
+        "CREATE VIRTUAL TABLE tpsa USING smi_reader("
+        "'fewSmi.2.csv', delimiter=',', "
+        "smiles_column=1, name_column=0, schema='TPSA REAL', threads=2)",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    test_select_value(db, "SELECT COUNT(*) FROM chembl", 10);
+    test_select_value(db, "SELECT MAX(mol_amw(molecule)) FROM chembl", 3548.213);
+
+    // the rows are returned in file order, with the same rowids
+    test_select_value(
+        db,
+        "SELECT COUNT(*) FROM chembl JOIN ref ON ref.rowid = chembl.rowid "
+        "WHERE mol_to_smiles(ref.molecule) = mol_to_smiles(chembl.molecule)",
+        10);
+
+    // the title line is used for the property names
+    test_select_value(db, "SELECT MAX(TPSA) FROM tpsa", 106.51);
+
+    test_select_value(
+        db,
+        "SELECT COUNT(*) FROM smi_reader('fewSmi.csv') "
+        "WHERE delimiter=',' AND "
+        "smiles_column=1 AND name_column=0 AND title_line=0 AND threads=2",
+        10);
+
+    rc = sqlite3_exec(
+        db,
+        "CREATE VIRTUAL TABLE invalid USING smi_reader("
+        "'chembl_29_sample.txt', threads=0)",
+        NULL, NULL, NULL);
+    REQUIRE(rc != SQLITE_OK);
+  }
+
+  SECTION("compressed input")
+  {
+    int rc;
+  
+    rc = sqlite3_exec(
+        db,
+        "CREATE VIRTUAL TABLE chembl USING smi_reader("
+        "'chembl_29_sample.txt.gz', smiles_column=1, name_column=0)",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    test_select_value(db, "SELECT COUNT(*) FROM chembl", 10);
+    test_select_value(db, "SELECT MAX(mol_amw(molecule)) FROM chembl", 3548.213);
+
+    test_select_value(
+        db,
+        "SELECT MAX(mol_amw(molecule)) FROM smi_reader("
+        "'chembl_29_sample.txt.gz') WHERE smiles_column=1 AND name_column=0 AND threads=2",
+        3548.213);
+  }
+
+  SECTION("property-only scans")
+  {
+    int rc;
+  
+    rc = sqlite3_exec(
+        db,
+        "CREATE VIRTUAL TABLE tpsa USING smi_reader("
+        "'fewSmi.2.csv', delimiter=',', "
+        "smiles_column=1, name_column=0, schema='_Name TEXT AS name, TPSA REAL')",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    // the molecule column is not used, and the records are not parsed
+    test_select_value(db, "SELECT COUNT(*) FROM tpsa", 10);
+    test_select_value(db, "SELECT name FROM tpsa WHERE TPSA = (SELECT MAX(TPSA) FROM tpsa)", "3");
+
+    // the same values are returned when the molecules are parsed
+    test_select_value(
+        db, "SELECT name FROM tpsa WHERE molecule IS NOT NULL AND TPSA > 100", "3");
+  }
+
+  SECTION("deferred parsing")
+  {
+    int rc;
+  
+    rc = sqlite3_exec(
+        db,
+        "CREATE VIRTUAL TABLE raw USING smi_reader("
+        "'chembl_29_sample.txt', smiles_column=1, name_column=0, "
+        "schema='_Name TEXT AS name', parse=none);"
+        "CREATE VIRTUAL TABLE lazy USING smi_reader("
+        "'chembl_29_sample.txt.gz', smiles_column=1, name_column=0, "
+        "schema='_Name TEXT AS name', parse=lazy)",
+        NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    // the smiles are returned as text, and the molecules are never parsed
+    test_select_value(db, "SELECT COUNT(*) FROM raw WHERE molecule IS NULL", 10);
+    test_select_value(
+        db, "SELECT smiles FROM raw WHERE name = 'CHEMBL153534'", "Cc1cc(-c2csc(N=C(N)N)n2)cn1C");
+
+    // the molecules are parsed on demand
+    test_select_value(db, "SELECT MAX(mol_amw(molecule)) FROM lazy", 3548.213);
+    test_select_value(
+        db, "SELECT COUNT(*) FROM lazy JOIN smi_reader('chembl_29_sample.txt') AS ref "
+        "ON lazy.rowid = ref.rowid "
+        "WHERE ref.smiles_column=1 AND ref.name_column=0 AND "
+        "mol_to_smiles(lazy.molecule) = mol_to_smiles(ref.molecule)", 10);
+    test_select_value(
+        db, "SELECT COUNT(*) FROM lazy JOIN raw ON lazy.rowid = raw.rowid "
+        "WHERE lazy.smiles = raw.smiles", 10);
+
+    rc = sqlite3_exec(
+        db,
+        "CREATE VIRTUAL TABLE invalid USING smi_reader("
+        "'chembl_29_sample.txt', parse=never)",
+        NULL, NULL, NULL);
+    REQUIRE(rc != SQLITE_OK);
+  }
+
+  SECTION("names across chunks")
+  {
+    // chunks.smi has 600 records, that are split in multiple chunks by the
+    // pipelined readers (used for compressed files or multiple threads).
+    // Some records have no name, and with name_column=-1 none of them has:
+    // the names generated from the line numbers must be the same as for
+    // the sequential reader.
+    const char * options[] = {"name_column=1", "name_column=-1"};
+    for (const char * option : options) {
+      const char * readers[][2] = {
+        {"seq", "'chunks.smi'"},
+        {"par", "'chunks.smi', threads=3"},
+        {"gz", "'chunks.smi.gz'"},
+        {"gzpar", "'chunks.smi.gz', threads=2"},
+      };
+      for (const auto & reader : readers) {
+        std::string sql =
+          std::string("CREATE VIRTUAL TABLE ") + reader[0] + " USING smi_reader(" +
+          reader[1] + ", " + option + ", schema='_Name TEXT AS name');"
+          "CREATE TABLE " + reader[0] + "_names AS "
+          "SELECT rowid AS id, name, molecule IS NULL AS failed FROM " + reader[0] + ";";
+        int rc = sqlite3_exec(db, sql.c_str(), NULL, NULL, NULL);
+        REQUIRE(rc == SQLITE_OK);
+      }
+
+      test_select_value(db, "SELECT COUNT(*) FROM seq_names", 600);
+      for (const auto & reader : readers) {
+        std::string table = std::string(reader[0]) + "_names";
+        test_select_value(
+          db,
+          "SELECT COUNT(*) FROM seq_names JOIN " + table + " AS t USING(id) "
+          "WHERE seq_names.name IS t.name AND seq_names.failed = t.failed", 600);
+      }
+
+      if (std::string(option) == "name_column=-1") {
+        test_select_value(db, "SELECT COUNT(DISTINCT name) FROM seq_names", 600);
+      }
+      else {
+        test_select_value(db, "SELECT name FROM seq_names WHERE id = 600", "mol600");
+      }
+
+      for (const auto & reader : readers) {
+        std::string sql =
+          std::string("DROP TABLE ") + reader[0] + "; DROP TABLE " + reader[0] + "_names;";
+        int rc = sqlite3_exec(db, sql.c_str(), NULL, NULL, NULL);
+        REQUIRE(rc == SQLITE_OK);
+      }
+    }
+  }
+
   test_db_close(db);
 }
\ No newline at end of file
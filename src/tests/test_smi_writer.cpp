@@ -1,5 +1,14 @@
+#include <fstream>
+#include <iterator>
+
 #include "test_common.hpp"
 
+static std::string read_file(const std::string & filename)
+{
+  std::ifstream ins(filename, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(ins), std::istreambuf_iterator<char>());
+}
+
 TEST_CASE("SMILES writer", "[smi_writer]")
 {
   sqlite3 * db = nullptr;
@@ -69,5 +78,57 @@ TEST_CASE("SMILES writer", "[smi_writer]")
     test_select_value(db, "SELECT COUNT(*) FROM smi_reader('/tmp/copy.smi')", 4);
   }
 
+  SECTION("multi-threaded copy")
+  {
+    test_select_value(
+      db, 
+      "SELECT smi_writer(molecule, '/tmp/copy.smi', ';') "
+      "FROM smi_reader('chembl_29_sample.txt') WHERE smiles_column=1 AND name_column=0", 10);
+    test_select_value(
+      db, 
+      "SELECT smi_writer(molecule, '/tmp/copy_mt.smi', ';', NULL, NULL, NULL, 3) "
+      "FROM smi_reader('chembl_29_sample.txt') WHERE smiles_column=1 AND name_column=0", 10);
+
+    // the output is the same of the sequential writer
+    std::string expected = read_file("/tmp/copy.smi");
+    REQUIRE(!expected.empty());
+    REQUIRE(read_file("/tmp/copy_mt.smi") == expected);
+
+    // including the names assigned to the unnamed molecules
+    int rc = sqlite3_exec(
+      db,
+      "CREATE VIRTUAL TABLE raw USING smi_reader("
+      "'fewSmi.2.csv', delimiter=',', smiles_column=1, name_column=0, parse=none)",
+      NULL, NULL, NULL);
+    REQUIRE(rc == SQLITE_OK);
+
+    test_select_value(
+      db, "SELECT smi_writer(mol_from_smiles(smiles), '/tmp/copy.smi') FROM raw", 10);
+    test_select_value(
+      db,
+      "SELECT smi_writer(mol_from_smiles(smiles), '/tmp/copy_mt.smi', NULL, NULL, NULL, NULL, 2) "
+      "FROM raw", 10);
+
+    expected = read_file("/tmp/copy.smi");
+    REQUIRE(!expected.empty());
+    REQUIRE(read_file("/tmp/copy_mt.smi") == expected);
+  }
+
+  SECTION("compressed copy")
+  {
+    test_select_value(
+      db, 
+      "SELECT smi_writer(molecule, '/tmp/copy.smi.zst') "
+      "FROM smi_reader('chembl_29_sample.txt') WHERE smiles_column=1 AND name_column=0", 10);
+    test_select_value(
+      db, "SELECT MAX(mol_amw(molecule)) FROM smi_reader('/tmp/copy.smi.zst')", 3548.213);
+
+    test_select_value(
+      db, 
+      "SELECT smi_writer(molecule, '/tmp/copy.smi.z', NULL, NULL, NULL, NULL, 2, 'gzip') "
+      "FROM smi_reader('chembl_29_sample.txt') WHERE smiles_column=1 AND name_column=0", 10);
+    test_select_value(db, "SELECT COUNT(*) FROM smi_reader('/tmp/copy.smi.z')", 10);
+  }
+
   test_db_close(db);
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #ifndef CHEMICALITE_UTILITIES_INCLUDED
 #define CHEMICALITE_UTILITIES_INCLUDED
 #include <cstdint>
+#include <streambuf>
 #include <vector>
 #include <string>
 
@@ -25,6 +26,20 @@ static void strict(sqlite3_context* ctx, int argc, sqlite3_value** argv)
 
 std::string trim(const std::string &);
 
+/*
+** A read-only stream buffer over a memory region, used to read the data
+** from a blob or a string (e.g. when unpickling a molecule, or parsing the
+** text of a record) without copying it.
+*/
+class MemoryStreamBuf : public std::streambuf {
+public:
+  MemoryStreamBuf(const char * data, size_t size)
+  {
+    char * p = const_cast<char *>(data);
+    setg(p, p, p + size);
+  }
+};
+
 inline uint16_t read_uint16(const uint8_t *p)
 {
   return (p[0]<<8) + p[1];